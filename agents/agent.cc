@@ -40,13 +40,33 @@
  ****************************************************************************/
 
 #include "../common/common.h"
+#include "position.h"
+#include "analysiscache.h"
+#include "sharedengine.h"
+#include "registry.h"
+#include "metrics.h"
+
+#if !defined(_WIN32)
+	#include "analysisstore.h"
+	#include "router.h"
+	#include <sys/epoll.h>
+	#include <sys/eventfd.h>
+	#include <sys/resource.h>
+	#include <sys/signalfd.h>
+	#include <sys/wait.h>
+	#include <netinet/tcp.h>
+	#include <deque>
+	#include <sys/random.h>
+	#include <vector>
+#endif
 
 using namespace std;
 
-static struct EngineEntry gEngineTables[MAX_NUM_ENGINE];
+static struct EngineRegistry gRegistry;
 static pthread_mutex_t gJetsonTableLock;
-static int gbIsTableLockOn = 0;
+static pthread_mutex_t gJetsonScanLock;	//scan/load and reload rewrite the engine list one at a time
 static int gbAgentExiting = 0;
+static int gnExitSignal = 0;	//SIGINT/SIGTERM that ended the reactor loop, exit code
 
 static char gsMyOsArch[MAX_NAME_LEN] = "";
 static char gsJreHeader[MAX_NAME_LEN] = "";
@@ -56,11 +76,144 @@ static int gOsArchId = OS_ARCH_UNKNOWN;
 static char *gsAgentConfFile = (char *)"jetson_agent.conf";
 static char *gsMgmtPortFile = (char *)"mgmt.port";
 static string gsMgmtPortStr = STR_MGMT_PORT;
+static int gnNodeMaxInstances = 0;	//max=N on a line of its own in jetson_agent.conf
+static string gsMetricsPortStr;		//metrics=PORT, Prometheus listener, empty if off
+static vector<string> gRouterConfBackends;	//backend=HOST[:MGMTPORT] settings, router mode if any
+static int gnRouteMode = 0;			//route=load (ROUTE_MODE_LOAD) or route=hash
+static int gnRoutePortOffset = 0;	//portoffset=N: routed engines listen on the backend's port + N
 
 char gsMyHostName[MAX_NAME_LEN] = "UNKNOWN_SERVER";
-pthread_mutex_t gLogFileLock;
+struct JetsonLogger gLogger;
 char gsLogFile[MAX_NAME_LEN] = "JetsonAgentErr.log";
 
+#if !defined(_WIN32)
+#define MAX_REACTOR_EVENTS 256
+#define ENGINE_EXIT_GRACE_MSEC 5000	//engine is killed if it outlives its closed stdin this long
+#define RESUME_REPLAY_BYTES 65536	//stream tail kept per resumable session
+#define RESUME_MAX_PENDING 262144	//engine output queued for a detached session, beyond it lines are dropped
+#define MGMT_WORKERS 4				//threads rendering scan/query/stats and metrics replies
+#define MGMT_SEND_TIMEOUT_SEC 10	//a management client not reading its reply is dropped after this long
+
+struct LingeringEngine {
+	struct ClientEntry *client;
+	long long deadline;
+};
+
+static int gEpollFd = -1;
+static struct ReactorHandle gMgmtListenEvt;
+static struct ReactorHandle gDiscoveryEvt = { 0, -1, 0, NULL };
+static struct ReactorHandle gMgmtDoneEvt = { 0, -1, 0, NULL };
+static struct ReactorHandle gMetricsListenEvt = { 0, -1, 0, NULL };
+static string gsMetricsListenPort;		//port gMetricsListenEvt is bound to
+static struct ReactorHandle gSignalEvt;
+static vector<struct LingeringEngine> gLingeringEngines;
+static vector<struct ClientEntry *> gReleasedClients;	//freed once current epoll batch is done
+static vector<struct ReactorHandle *> gReleasedHandles;
+static vector<struct ClientEntry *> gInfoFlushClients;	//sessions holding back info lines
+static vector<struct PendingLogin *> gLoginQueue;		//logins waiting for an engine instance
+static int gbAdmitCheck = 0;	//an engine exited or a pool instance got ready, waiting logins may fit now
+static int gnDrainingEngines = 0;
+static int gbReloadPending = 0;		//SIGHUP seen, reload once the batch is done
+static unordered_map<int, string> gMuxServIp;	//session end of a mux channel -> address the client reached
+static unordered_map<unsigned long long, struct ClientEntry *> gResumeTokens;	//sessions that may be resumed
+static int gnDetachedSessions = 0;
+static vector<shared_ptr<struct RouterBackend> > gRouterBackends;	//router mode, conf order
+static atomic<int> gbRouterChecked(0);	//a check thread has a result for the reactor
+
+static void JetsonSearchLeave(struct ClientEntry *client);
+static void JetsonSharedEnqueue(struct ClientEntry *session, int bStopNow);
+static void JetsonSharedLeave(struct ClientEntry *session);
+static void JetsonSharedWorkerGone(struct ClientEntry *worker);
+static void JetsonReloadEngines(SOCKET sockClient);
+static void JetsonReapDrainedEngines();
+static int JetsonMuxMgmtReply(SOCKET sock, const char *data, int len);
+static int JetsonMgmtQueueReply(SOCKET sock, const char *data, int len);
+static void JetsonResumeIssueToken(struct ClientEntry *client);
+static int JetsonResumeDetach(struct ClientEntry *client);
+static void JetsonResumeEnd(struct ClientEntry *client, const char *sReason);
+static void JetsonLoadReply(SOCKET sock, const char *sEngName);
+static void JetsonRouteAccept(struct EngineEntry *engEntry, int fd, const char *sIpAddr);
+static void JetsonRouterApplyConf();
+static void JetsonDrainEngine(struct EngineEntry *engEntry);
+static int JetsonHasRoom(struct EngineEntry *engEntry);
+static int JetsonListen(int sockType, const char *sEngDir, const char *sEngExeName, const char *sEngPort, const char *sEngName, const char *arguments, const struct EngineOptions *pOpts);
+#endif
+
+static void JetsonScanAndLoadEngines();
+static string JetsonRenderScan(const char *sServIp);
+static void JetsonQueryEngines(SOCKET sockClient);
+static void JetsonPublishSnapshot();
+static string JetsonRenderStats();
+
+//----- engine's "id name" line gets the JRE header so the GUI shows where the engine runs
+static int JetsonRewriteIdName(struct ClientEntry *client, const char *sLine, string &sRewritten)
+{
+	if (strncmp(sLine, "id name ", 8) != 0)
+		return 0;
+
+	ostringstream ossSockWriteBuf;
+	ossSockWriteBuf << "id name " << gsJreHeader << client->sServIpAddr << "_"
+		<< client->engine->sEngineName << "##" << (sLine + 8);
+	sRewritten = ossSockWriteBuf.str();
+	return 1;
+}
+
+//----- bytes just received from the client were committed to reqFramer.
+//Older jetson_scan sends one command per send() without '\n', that is
+//told apart by the first bytes of the session: a whole UCI command with
+//no line end. A '\n' that starts a send or sits inside one later shows the
+//first command just came alone, the session goes back to lines then.
+//Returns 0 if there is no room left in the framer.
+static int JetsonFrameClientBytes(struct ClientEntry *client, const char *data, int len)
+{
+	static const char *sUciCmds[] = { "uci", "debug", "isready", "setoption", "register",
+		"ucinewgame", "position", "go", "stop", "ponderhit", "quit", NULL };
+
+	if (client->nReqFraming == REQ_FRAMING_UNKNOWN) {
+		client->nReqFraming = REQ_FRAMING_LINES;
+		if (memchr(data, '\n', len) == NULL) {
+			int wordLen = 0;
+			while (wordLen < len && data[wordLen] != ' ' && data[wordLen] != '\r')
+				wordLen++;
+
+			for (int i=0; sUciCmds[i] != NULL; i++) {
+				if ((int)strlen(sUciCmds[i]) == wordLen && strncmp(data, sUciCmds[i], wordLen) == 0)
+					client->nReqFraming = REQ_FRAMING_PER_SEND;
+			}
+		}
+		if (client->nReqFraming == REQ_FRAMING_PER_SEND)
+			JetsonWriteLogs("Client (%s, %d) sends commands without line ends, one per send\n",
+				client->sIpAddr, client->sock);
+	}
+	else if (client->nReqFraming == REQ_FRAMING_PER_SEND && (data[0] == '\n' || memchr(data, '\n', len - 1) != NULL)) {
+		client->nReqFraming = REQ_FRAMING_LINES;
+		JetsonWriteLogs("Client (%s, %d) ends its commands with '\\n' after all\n", client->sIpAddr, client->sock);
+	}
+
+	if (client->nReqFraming == REQ_FRAMING_PER_SEND && data[len-1] != '\n')
+		return (JetsonFramerPush(&client->reqFramer, "\n", 1) == 1 ||
+			(JetsonFramerGrow(&client->reqFramer, FRAMER_MAX_CMD_BUFSIZE) && JetsonFramerPush(&client->reqFramer, "\n", 1) == 1));
+
+	return 1;
+}
+
+//next whole command from the client into cmdBuf. One that doesn't fit grows the
+//framer, a long game's position command included, up to FRAMER_MAX_CMD_BUFSIZE
+static int JetsonNextClientCmd(struct ClientEntry *client, vector<char> &cmdBuf)
+{
+	while (1) {
+		if (cmdBuf.size() < client->reqFramer.cap + 1)
+			cmdBuf.resize(client->reqFramer.cap + 1);
+
+		int len = JetsonFramerNextLine(&client->reqFramer, cmdBuf.data(), client->reqFramer.cap);
+		if (len != FRAMER_LINE_TOO_LONG)
+			return len;
+		if (!JetsonFramerGrow(&client->reqFramer, FRAMER_MAX_CMD_BUFSIZE))
+			return FRAMER_LINE_TOO_LONG;
+	}
+}
+
+#if defined(_WIN32)
 static void *EngineInstanceRequestThread(void *data)
 {
 	struct ClientEntry *client = (struct ClientEntry *)data;
@@ -87,14 +240,33 @@ static void *EngineInstanceRequestThread(void *data)
 #endif
 		if (!bIsConnected)
 			throw runtime_error("Unable to connect request pipe\n");
+
+		client->nReqFraming = REQ_FRAMING_UNKNOWN;
+		if (!JetsonFramerInit(&client->reqFramer, FRAMER_BUFSIZE))
+			throw runtime_error("Unable to allocate request framer\n");
       
 		//----- receive data from client socket, incoming uci command
+		vector<char> cmdBuf;
 		while (1) {
-			char sockReadBuf[REQ_BUFSIZE];
-			memset(sockReadBuf, 0, REQ_BUFSIZE);
+			int space = 0;
+			char *sRecvPtr = JetsonFramerWritePtr(&client->reqFramer, &space);
                     
-			int bytesReceived = recv(client->sock, sockReadBuf, REQ_BUFSIZE, 0);
-			if (bytesReceived < 1 || bytesReceived >= REQ_BUFSIZE) {
+			int bytesReceived = recv(client->sock, sRecvPtr, space, 0);
+			if (bytesReceived > 0) {
+				JetsonFramerCommit(&client->reqFramer, bytesReceived);
+				JetsonMetricsOnClientBytes(client, bytesReceived, 0);
+				if (!JetsonFrameClientBytes(client, sRecvPtr, bytesReceived))
+					bytesReceived = 0;
+			}
+
+			int cbReplyBytes = 0;//number of bytes to write
+			if (bytesReceived > 0) {
+				cbReplyBytes = JetsonNextClientCmd(client, cmdBuf);
+				if (cbReplyBytes == FRAMER_NEED_MORE)
+					continue;
+			}
+
+			if (bytesReceived < 1 || cbReplyBytes == FRAMER_LINE_TOO_LONG) {
 				JetsonWriteLogs("Closing (%d) from client(%s) for engine(%s)\n", sock, sIpAddr, sEngineName);
                     	
 				//----- TODO: lookup client sock in table, find the client, kill engine, clear client entry
@@ -104,20 +276,26 @@ static void *EngineInstanceRequestThread(void *data)
 				
 				break;
 			}
-                    
-			//ATTN: here have to add \n to force cmd to execute and then flush out pipe
-			//bytesReceived is up to REQ_BUFSIZE-1 so no worry of buffer overrun.
-			sockReadBuf[bytesReceived] = '\n';
 
-			JetsonWriteLogs("Client (%s, %d, %s, %s) received UCI cmd >> %s",
-				sIpAddr, sock, sEngineName, sServIp, sockReadBuf); //'\n' already in sockReadBuf
+			//forward every complete command buffered so far in one write
+			string sPipeWriteBuf;
+			int cbLineBytes = cbReplyBytes;
+			while (cbLineBytes > 0) {
+				char *sockReadBuf = cmdBuf.data();
+				sockReadBuf[cbLineBytes] = '\0';
+				JetsonTraceLogs("Client (%s, %d, %s, %s) received UCI cmd >> %s",
+					sIpAddr, sock, sEngineName, sServIp, sockReadBuf); //'\n' already in sockReadBuf
+				JetsonMetricsOnCommand(client, sockReadBuf);
+				sPipeWriteBuf.append(sockReadBuf, cbLineBytes);
+
+				cbLineBytes = JetsonNextClientCmd(client, cmdBuf);
+			}
+			cbReplyBytes = (int)sPipeWriteBuf.length();
 
-			int cbReplyBytes = bytesReceived+1;//number of bytes to write
 			int cbWritten = 0;//number of bytes written 
 			char sWriteErr[128];
-			//Note: no need use separate pipeWriteBuf, just use sockReadBuf
 #if defined(_WIN32)
-			BOOL fSuccess = WriteFile(client->hReqPipe, sockReadBuf, (DWORD)cbReplyBytes, (LPDWORD)&cbWritten, NULL); 
+			BOOL fSuccess = WriteFile(client->hReqPipe, sPipeWriteBuf.c_str(), (DWORD)cbReplyBytes, (LPDWORD)&cbWritten, NULL); 
          	
          	if (!fSuccess || cbReplyBytes != cbWritten) {
 				sprintf(sWriteErr, "WriteFile failed, rval(%d), rbytes(%d), wbytes(%d), GLE=%d.\n",
@@ -125,7 +303,7 @@ static void *EngineInstanceRequestThread(void *data)
           		throw runtime_error(sWriteErr);
 			}  
 #else
-            cbWritten = write(client->hReqPipe, sockReadBuf, cbReplyBytes);
+            cbWritten = write(client->hReqPipe, sPipeWriteBuf.c_str(), cbReplyBytes);
 			  
          	if (cbReplyBytes != cbWritten) {				
 				sprintf(sWriteErr, "WriteFile failed, rbytes(%d), wbytes(%d)\n",
@@ -138,19 +316,21 @@ static void *EngineInstanceRequestThread(void *data)
 		if (bIsConnected)
 			CloseHandle(client->hReqPipe);
 		
-		JetsonWriteLogs("<<< ERROR on eng_i_req for Client (%s, %d) (%s, %s): %s",
+		JetsonErrorLogs("<<< ERROR on eng_i_req for Client (%s, %d) (%s, %s): %s",
 				sIpAddr, sock, sEngineName, sServIp, e.what());
 	}
 
 	if (bIsConnected)
 		CloseHandle(client->hReqPipe);
 	
+	JetsonFramerFree(&client->reqFramer);
 	JetsonWriteLogs("<<< Exited eng_i_req from client(%s, %d) via (%s, %s)\n",
 			sIpAddr, sock, sEngineName, sServIp);
 
 	if (bDisconnectClientNeeded) {	
 		pthread_mutex_lock(&gJetsonTableLock);
 		client->bIsConnected = 0;
+		JetsonRegistryRemoveSession(&gRegistry, client);
 		pthread_mutex_unlock(&gJetsonTableLock);
 	}
 	return NULL;
@@ -183,17 +363,18 @@ static void *EngineInstanceResponseThread(void *data)
 		if (!bIsConnected)
 			throw runtime_error("Unable to connect response pipe\n");
 
-		while (1) {
-			char pipeReadBuf[RSP_BUFSIZE];
-			memset(pipeReadBuf, 0, RSP_BUFSIZE);
+		if (!JetsonFramerInit(&client->rspFramer, FRAMER_BUFSIZE))
+			throw runtime_error("Unable to allocate response framer\n");
 
-			// Read client requests from the pipe. This simplistic code only allows messages
-			// up to RSP_BUFSIZE characters in length.
+		while (1) {
+			// Engine output goes into the framer as it comes, only whole lines are relayed.
       		//SleepMsec(300);
+			int space = 0;
+			char *pipeReadBuf = JetsonFramerWritePtr(&client->rspFramer, &space);
 			int cbBytesRead = 0; // number of bytes read
 			char sReadErr[128];
 #if defined(_WIN32)			
-			BOOL fSuccess = ReadFile(client->hRspPipe, pipeReadBuf, RSP_BUFSIZE*sizeof(TCHAR), (LPDWORD)&cbBytesRead, NULL); 
+			BOOL fSuccess = ReadFile(client->hRspPipe, pipeReadBuf, (DWORD)space, (LPDWORD)&cbBytesRead, NULL); 
 
 			if (!fSuccess || cbBytesRead == 0) {
 				if (GetLastError() == ERROR_BROKEN_PIPE) {
@@ -208,63 +389,69 @@ static void *EngineInstanceResponseThread(void *data)
 				throw runtime_error(sReadErr);
 			}
 #else
-			cbBytesRead = read(client->hRspPipe, pipeReadBuf, RSP_BUFSIZE);
+			cbBytesRead = read(client->hRspPipe, pipeReadBuf, space);
 			
 			if (cbBytesRead <= 0) {
 				sprintf(sReadErr, "ReadFile failed, rbytes(%d)\n", cbBytesRead); 
 				throw runtime_error(sReadErr);
 			}			
 #endif
+			JetsonFramerCommit(&client->rspFramer, cbBytesRead);
     		
-			//-----hijack id name and save actual response string to oss
-			//Note: pipeReadBuf is converted to ossSockWriteBuf
+			//-----hijack id name and send all complete lines in one go
 			ostringstream ossSockWriteBuf;
-		
-			if (strstr(pipeReadBuf, "id name")) {
-				string sRspStr = pipeReadBuf;
-				char *sIdStr = (char *)"id name ";
-				size_t idPos = sRspStr.find(sIdStr);
-				size_t insertPos = idPos + strlen(sIdStr);			
-				string sOrigIdStr = sRspStr.substr(insertPos);
-			
-				ossSockWriteBuf << "id name " << gsJreHeader << client->sServIpAddr << "_" 
-					<< client->engine->sEngineName << "##" << sOrigIdStr;
-				cbBytesRead = ossSockWriteBuf.str().length();
-			}
-			else {
-				ossSockWriteBuf << pipeReadBuf;
+			char sLine[FRAMER_BUFSIZE+1];
+			int cbLineBytes;
+
+			while ((cbLineBytes = JetsonFramerNextLine(&client->rspFramer, sLine, FRAMER_BUFSIZE)) != FRAMER_NEED_MORE) {
+				if (cbLineBytes == FRAMER_LINE_TOO_LONG)
+					cbLineBytes = JetsonFramerDrain(&client->rspFramer, sLine, FRAMER_BUFSIZE);
+				sLine[cbLineBytes] = '\0';
+				JetsonMetricsOnEngineLine(client, sLine);
+
+				string sRewritten;
+				if (JetsonRewriteIdName(client, sLine, sRewritten))
+					ossSockWriteBuf << sRewritten;
+				else
+					ossSockWriteBuf.write(sLine, cbLineBytes);
 			}
 		
 			if (client->bIsDataLogOn) {
 				//TODO: change a bit behavior (0d 0a) for neat output to log file but keep return message intact
 			}
 		
-			send(client->sock, ossSockWriteBuf.str().c_str(), cbBytesRead, 0);
+			string sSockWriteBuf = ossSockWriteBuf.str();
+			if (!sSockWriteBuf.empty())
+				send(client->sock, sSockWriteBuf.c_str(), (int)sSockWriteBuf.length(), 0);
 		}
 	} catch (exception& e) {
 		if (bIsConnected)
 			CloseHandle(client->hRspPipe);
 		
-		JetsonWriteLogs("<<< ERROR on eng_i_rsp for Client (%s, %d) (%s, %s): %s",
+		JetsonErrorLogs("<<< ERROR on eng_i_rsp for Client (%s, %d) (%s, %s): %s",
 				sIpAddr, sock, sEngineName, sServIp, e.what());	
 	}
 	
 	if (bIsConnected)
 		CloseHandle(client->hRspPipe);
 	
+	JetsonFramerFree(&client->rspFramer);
 	JetsonWriteLogs("<<< Exited eng_i_rsp from client(%s, %d) via (%s, %s)\n",
 			sIpAddr, sock, sEngineName, sServIp);	
 	return NULL;
 }
+#endif
 
 void JetsonSignalHandler( int signal_num )
 { 	
 	gbAgentExiting = 1;
-	JetsonWriteLogs("<<<<<<<<<< Server terminated with sig(%d).\n", signal_num);
-	JetsonWriteLogs("<<<<<<<<<<\n");
+	JetsonErrorLogs("<<<<<<<<<< Server terminated with sig(%d).\n", signal_num);
+	JetsonErrorLogs("<<<<<<<<<<\n");
+	JetsonLogStop();
 	exit(signal_num);
 }
 
+#if defined(_WIN32)
 static void *EngineInstanceThread(void *data)
 {
 	struct ClientEntry *newClient = (struct ClientEntry *)data;
@@ -316,7 +503,7 @@ static void *EngineInstanceThread(void *data)
 	
 		JetsonWriteLogs("<<< (%s) is ended, rval=%d\n", ossCmdline.str().c_str(), rval);
 	} catch (exception& e) {
-		JetsonWriteLogs("<<< ERROR on eng_i for Client (%s, %d) (%s, %s): %s",
+		JetsonErrorLogs("<<< ERROR on eng_i for Client (%s, %d) (%s, %s): %s",
 				sIpAddr, sock, sEngineName, sServIp, e.what());	
 	}
 	
@@ -324,288 +511,4277 @@ static void *EngineInstanceThread(void *data)
 			sIpAddr, sock, sEngineName, sServIp);
 	return NULL;
 }	
+#endif
 
 static char *GetServIp(SOCKET sock)
 {
 	struct sockaddr_in localSin;
 	socklen_t localSinLen = sizeof(localSin);
 	getsockname(sock, (struct sockaddr*)&localSin, &localSinLen);
+#if !defined(_WIN32)
+	//session of a mux channel: the client reached the agent through its connection
+	if (localSin.sin_family == AF_UNIX) {
+		auto it = gMuxServIp.find(sock);
+		if (it != gMuxServIp.end())
+			return (char *)it->second.c_str();
+	}
+#endif
 	return (inet_ntoa(localSin.sin_addr));
 }
 
-static int JetsonClientLogin(struct EngineEntry *engEntry, SOCKET sock, const char *sIpAddr, fd_set *pMaster)
+//----- replies to management commands, a mux connection gets them on the channel
+//the command came on
+static void JetsonMgmtSend(SOCKET sock, const char *data, int len)
 {
-	ostringstream ossReqPipe;
-	ostringstream ossRspPipe;
-	ostringstream ossParam;
-	ostringstream ossNewEngExeName;
+#if !defined(_WIN32)
+	if (JetsonMuxMgmtReply(sock, data, len) || JetsonMgmtQueueReply(sock, data, len))
+		return;
+#endif
+	send(sock, data, len, 0);
+}
 
-	try {
-#if defined(_WIN32)
-		HANDLE hReqPipe = INVALID_HANDLE_VALUE;
-		HANDLE hRspPipe = INVALID_HANDLE_VALUE;
-	
-		ossReqPipe << "\\\\.\\pipe\\" << engEntry->sEngineName << "_req_" << sIpAddr;
-		ossRspPipe << "\\\\.\\pipe\\" << engEntry->sEngineName << "_rsp_" << sIpAddr;
-						
-		JetsonWriteLogs("Creating request pipe (%s)\n", ossReqPipe.str().c_str());	
-		hReqPipe = CreateNamedPipe( 
-				ossReqPipe.str().c_str(),	// pipe name 
-				PIPE_ACCESS_DUPLEX,			// read/write access 
-				PIPE_TYPE_MESSAGE |			// message type pipe 
-				PIPE_READMODE_MESSAGE |		// message-read mode 
-				PIPE_WAIT,					// blocking mode 
-				PIPE_UNLIMITED_INSTANCES,	// max. instances  
-				PIPE_BUFSIZE,				// output buffer size 
-				PIPE_BUFSIZE,				// input buffer size 
-				0,							// client time-out 
-				NULL);						// default security attribute 
+#if !defined(_WIN32)
+static long long JetsonNowMsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (long long)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
 
-		if (hReqPipe == INVALID_HANDLE_VALUE) {
-			JetsonWriteLogs("CreateReqPipe (%s) failed, GLE=%d.\n", ossReqPipe.str().c_str(), GetLastError()); 
-			throw runtime_error("CreateReqPipe failed\n");
+//EngineArguments are colon separated in jetson_agent.conf, one argv entry each
+static void JetsonSplitArguments(const char *arguments, vector<string> &argv)
+{
+	string args = arguments;
+	size_t pos = 0;
+	while (args.length() > 0) {
+		pos = args.find(':');
+		if (pos == string::npos) {
+			argv.push_back(args);
+			break;
 		}
+		if (pos > 0)
+			argv.push_back(args.substr(0, pos));
+		args.erase(0, pos + 1);
+	}
+}
 
-		JetsonWriteLogs("Creating response pipe, pipe_name=(%s)\n", ossRspPipe.str().c_str());	
-		hRspPipe = CreateNamedPipe( 
-			ossRspPipe.str().c_str(),					// pipe name 
-			PIPE_ACCESS_DUPLEX,			// read/write access 
-			PIPE_TYPE_MESSAGE |			// message type pipe 
-			PIPE_READMODE_MESSAGE |		// message-read mode 
-			PIPE_WAIT,					// blocking mode 
-			PIPE_UNLIMITED_INSTANCES,	// max. instances  
-			PIPE_BUFSIZE,				// output buffer size 
-			PIPE_BUFSIZE,				// input buffer size 
-			0,							// client time-out 
-			NULL);						// default security attribute 
+//----- start engine instance with stdin/stdout on anonymous pipes, no shell or FIFO involved
+static int JetsonSpawnEngineInstance(struct ClientEntry *client)
+{
+	struct EngineEntry *engEntry = client->engine;
 
-		if (hRspPipe == INVALID_HANDLE_VALUE) {
-			JetsonWriteLogs("CreateRspPipe (%s) failed, GLE=%d.\n", ossRspPipe.str().c_str(), GetLastError()); 
-			throw runtime_error("CreateRspPipe failed\n");
-		}
-						
-		ossNewEngExeName << "jei_" << sIpAddr << "_" << engEntry->sEngineName << ".exe";
-		ossParam << "cd " << engEntry->sEngineDir << " && "
-			<< "copy " << engEntry->sEngineExeName << " ";	    				
-#else
-		int hReqPipe;
-		int hRspPipe;
-	
-		ossReqPipe << engEntry->sEngineDir << engEntry->sEngineName << "_req_" << sIpAddr;
-		ossRspPipe << engEntry->sEngineDir << engEntry->sEngineName << "_rsp_" << sIpAddr;
+	client->nReqFraming = REQ_FRAMING_UNKNOWN;
+	if (!JetsonFramerInit(&client->reqFramer, FRAMER_BUFSIZE) ||
+		!JetsonFramerInit(&client->rspFramer, FRAMER_BUFSIZE)) {
+		JetsonWriteLogs("Unable to allocate line framers for (%s)\n", client->sEngInstName);
+		return 0;
+	}
 
-		JetsonWriteLogs("Creating request pipe, pipe_name=(%s)\n", ossReqPipe.str().c_str());	
-		mkfifo(ossReqPipe.str().c_str(), 0666);
+	//argv[0] keeps the "./<instance>" form the shell used to pass, engines
+	//like lc0 derive their binary directory from it
+	vector<string> args;
+	args.push_back(string("./") + client->sEngInstName);
+	JetsonSplitArguments(engEntry->arguments, args);
 
-		JetsonWriteLogs("Creating response pipe, pipe_name=(%s)\n", ossRspPipe.str().c_str());	
-		mkfifo(ossRspPipe.str().c_str(), 0666);
+	vector<char *> argv;
+	for (size_t i=0; i<args.size(); i++)
+		argv.push_back((char *)args[i].c_str());
+	argv.push_back(NULL);
 
-		ossNewEngExeName << "jei_" << sIpAddr << "_" << engEntry->sEngineName;
-		ossParam << "cd " << engEntry->sEngineDir << "; "
-			<< "cp " << engEntry->sEngineExeName << " ";
-#endif
+	string sExePath = string("./") + engEntry->sEngineExeName;
 
-		JetsonWriteLogs("new engine instance name=(%s)\n", ossNewEngExeName.str().c_str());
-	    				
-		ossParam << ossNewEngExeName.str();
-	
-		//change permission to executable
-#if !defined(_WIN32)
-		ossParam << "; " << "chmod a+x " << ossNewEngExeName.str();
-#endif
-	    				
-		JetsonWriteLogs("copy instance (%s)\n", ossParam.str().c_str());
-	    				
-		int rval = system(ossParam.str().c_str());
-		if (rval != 0) {
-			JetsonWriteLogs("ERROR: cmd exec rval=%d\n", rval);
-			throw runtime_error("cmd exec failed\n");
-		}
+	int reqPipe[2];
+	int rspPipe[2];
+	if (pipe2(reqPipe, O_CLOEXEC) < 0) {
+		JetsonErrorLogs("pipe2() failed. (%d)\n", errno);
+		return 0;
+	}
+	if (pipe2(rspPipe, O_CLOEXEC) < 0) {
+		JetsonErrorLogs("pipe2() failed. (%d)\n", errno);
+		close(reqPipe[0]);
+		close(reqPipe[1]);
+		return 0;
+	}
 
-		//----- add new client login and engine instance
-		//TODO: need to check duplicate client???
-		struct ClientEntry *newClient = NULL;
-		pthread_mutex_lock(&gJetsonTableLock);
-		for (int i=0; i<MAX_NUM_LOGI_PER_ENGINE; i++) {
-			struct ClientEntry *thisClient = &engEntry->clients[i];
-		
-			if (thisClient->bIsConnected)
-				continue;
-		
-			//get a free entry
-			thisClient->bIsConnected = 1;
-			thisClient->sock = sock;
-			strncpy(thisClient->sIpAddr, sIpAddr, MAX_NAME_LEN);
-			strncpy(thisClient->sEngInstName, ossNewEngExeName.str().c_str(), MAX_NAME_LEN);
-			thisClient->engine = engEntry;
-			thisClient->hReqPipe = hReqPipe;
-			thisClient->hRspPipe = hRspPipe;
-			strncpy(thisClient->sReqPipe, ossReqPipe.str().c_str(), MAX_NAME_LEN);
-			strncpy(thisClient->sRspPipe, ossRspPipe.str().c_str(), MAX_NAME_LEN);
-			thisClient->pMaster = pMaster;
-		
-			char *sSrvIp = GetServIp(sock);
-			strncpy(thisClient->sServIpAddr, sSrvIp, MAX_NAME_LEN);
+	pid_t pid = fork();
+	if (pid < 0) {
+		JetsonErrorLogs("fork() failed. (%d)\n", errno);
+		close(reqPipe[0]);
+		close(reqPipe[1]);
+		close(rspPipe[0]);
+		close(rspPipe[1]);
+		return 0;
+	}
 
-			newClient = thisClient;
-			break;
-		}
-		pthread_mutex_unlock(&gJetsonTableLock);
+	if (pid == 0) {
+		//child: async-signal-safe calls only until exec
+		sigset_t emptySet;
+		sigemptyset(&emptySet);
+		sigprocmask(SIG_SETMASK, &emptySet, NULL);
+		signal(SIGPIPE, SIG_DFL);
 
-		if (newClient != NULL) {
-			int rc;
-			
-			JetsonWriteLogs("connected socket = %d, from %s\n", sock, sIpAddr);
+		if (chdir(engEntry->sEngineDir) < 0)
+			_exit(127);
+		if (dup2(reqPipe[0], 0) < 0 || dup2(rspPipe[1], 1) < 0)
+			_exit(127);
 
-			pthread_t engineInstanceReqThreadId;
-			rc = pthread_create(&engineInstanceReqThreadId, NULL, EngineInstanceRequestThread, (void *)newClient);
-			if (rc != 0)
-				throw runtime_error("Unable to create engine instance request thread\n");
+		execv(sExePath.c_str(), &argv[0]);
+		_exit(127);
+	}
 
-			pthread_t engineInstanceRspThreadId;
-			rc = pthread_create(&engineInstanceRspThreadId, NULL, EngineInstanceResponseThread, (void *)newClient);
-			if (rc != 0)
-				throw runtime_error("Unable to create engine instance response thread\n");
-	    
-			pthread_t engineInstanceThreadId;
-			rc = pthread_create(&engineInstanceThreadId, NULL, EngineInstanceThread, (void *)newClient);
-			if (rc != 0)
-				throw runtime_error("Unable to create engine instance thread\n");
-		}
-	} catch (exception& e) {
-  		//TODO: better to clean up resources here!!!
-		JetsonWriteLogs("<<< ERROR on login for Client (%s, %d) (%s): %s",
-				sIpAddr, sock, engEntry->sEngineName, e.what());	
+	close(reqPipe[0]);
+	close(rspPipe[1]);
+	fcntl(reqPipe[1], F_SETFL, O_NONBLOCK);
+	fcntl(rspPipe[0], F_SETFL, O_NONBLOCK);
+
+	client->hReqPipe = reqPipe[1];
+	client->hRspPipe = rspPipe[0];
+	client->nEnginePid = pid;
+	gRegistry.byPid[pid] = client;
+	client->nConfigGen = engEntry->nConfigGen;
+	client->nEngineExitStatus = 0;
+
+	JetsonWriteLogs(">>> (%s%s) is launched as (%s), pid=%d, argc=%d\n",
+		engEntry->sEngineDir, engEntry->sEngineExeName, client->sEngInstName, pid, (int)args.size());
+	return 1;
+}
+
+//----- reactor: one epoll loop owns listening sockets, client sockets and engine pipes
+static int JetsonIoBufAppend(struct IoBuffer *buf, const char *data, int len)
+{
+	if (buf->len + len > buf->cap) {
+		int newCap = (buf->cap > 0 ? buf->cap : RSP_BUFSIZE);
+		while (newCap < buf->len + len)
+			newCap *= 2;
+
+		char *p = (char *)realloc(buf->data, newCap);
+		if (p == NULL)
+			return 0;
+		buf->data = p;
+		buf->cap = newCap;
 	}
-	
-	return 0;
+	memcpy(buf->data + buf->len, data, len);
+	buf->len += len;
+	return 1;
 }
 
-static int JetsonFindEngine(const char *sEngName)
+static void JetsonIoBufConsume(struct IoBuffer *buf, int len)
 {
-	int bIsEngineExist = 0;
-	
-	pthread_mutex_lock(&gJetsonTableLock);
-	for (int i=0; i<MAX_NUM_ENGINE; i++) {
-		struct EngineEntry *thisEng = &gEngineTables[i];
-		
-		if (!thisEng->bIsAllocated)
-			continue;
-		
-		if (strcmp(thisEng->sEngineName, sEngName) == 0)
-		{
-			bIsEngineExist = 1;
-			break;
-		}
+	if (len >= buf->len) {
+		buf->len = 0;
+		return;
 	}
-	pthread_mutex_unlock(&gJetsonTableLock);
+	memmove(buf->data, buf->data + len, buf->len - len);
+	buf->len -= len;
+}
 
-	return bIsEngineExist;	
+static void JetsonIoBufFree(struct IoBuffer *buf)
+{
+	free(buf->data);
+	memset(buf, 0, sizeof(struct IoBuffer));
 }
 
-static struct EngineEntry* JetsonAddNewEngine(const char *sEngDir, const char *sEngExeName, 
-		const char *sEngPort, const char *sEngName, const char *arguments)
+//per-multipv buffers of a session, allocated only when it coalesces or tracks searches
+static struct IoBuffer *JetsonIoBufArrayNew()
 {
-	struct EngineEntry *pAddedEng = NULL;
-	
-	//FIXME: add new engine should be one time thing, need to check duplicate?
-	pthread_mutex_lock(&gJetsonTableLock);
-	for (int i=0; i<MAX_NUM_ENGINE; i++) {
-		struct EngineEntry *thisEng = &gEngineTables[i];
-		
-		if (thisEng->bIsAllocated)
-			continue;
-		
-		//get a free entry
-		thisEng->bIsAllocated = 1;
-		strncpy(thisEng->sEngineDir, sEngDir, MAX_NAME_LEN);
-		strncpy(thisEng->sEngineName, sEngName, MAX_NAME_LEN);
-		strncpy(thisEng->sEngineExeName, sEngExeName, MAX_NAME_LEN);
-		strncpy(thisEng->sEngienPort, sEngPort, MAX_NAME_LEN);
-		strncpy(thisEng->arguments, arguments, MAX_NAME_LEN);
-		pAddedEng = thisEng;
-		break;
-	}
-	pthread_mutex_unlock(&gJetsonTableLock);
-	
-	return pAddedEng;
+	return (struct IoBuffer *)calloc(MAX_TRACKED_MULTIPV+1, sizeof(struct IoBuffer));
 }
 
-static void JetsonScanAndLoadEngines(SOCKET sockClient, int bIsScan);
-static void JetsonQueryEngines(SOCKET sockClient);
-static int JetsonSocket(int sockType, const char *sEngDir, const char *sEngExeName, const char *sEngPort, const char *sEngName, const char *arguments)
+static void JetsonIoBufArrayFree(struct IoBuffer **bufs)
 {
-	if (sockType != SOCK_TYPE_ENGINE &&
-		sockType != SOCK_TYPE_MGMT) {
-		JetsonWriteLogs("ERROR: invalid sockType(%d)\n", sockType);
+	if (*bufs == NULL)
+		return;
+	for (int i=0; i<=MAX_TRACKED_MULTIPV; i++)
+		free((*bufs)[i].data);
+	free(*bufs);
+	*bufs = NULL;
+}
+
+static int JetsonReactorAdd(struct ReactorHandle *h, int type, int fd, void *owner, unsigned int events)
+{
+	h->type = type;
+	h->fd = fd;
+	h->owner = owner;
+	h->events = events;
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = h;
+	if (epoll_ctl(gEpollFd, EPOLL_CTL_ADD, fd, &ev) < 0) {
+		JetsonErrorLogs("epoll_ctl(ADD, %d) failed. (%d)\n", fd, errno);
+		h->fd = -1;
 		return 0;
 	}
-	
-	if (sockType == SOCK_TYPE_MGMT)
-		JetsonWriteLogs(">>> MGMT creating listening socket...\n");
-	else
-		JetsonWriteLogs(">>> Engine (%s) creating listening socket...\n", sEngName);
-	
-	int bIsSockListenValid = 0;
-    SOCKET sockListen;
-		
-	try {
-		struct addrinfo localAddr;
-		memset(&localAddr, 0, sizeof(localAddr));
-		localAddr.ai_family = AF_INET;
-		localAddr.ai_socktype = SOCK_STREAM;
-		localAddr.ai_flags = AI_PASSIVE;
+	return 1;
+}
 
-		struct addrinfo *bindAddr;
-		getaddrinfo(0, sEngPort, &localAddr, &bindAddr);
+static void JetsonReactorMod(struct ReactorHandle *h, unsigned int events)
+{
+	if (h->fd < 0 || h->events == events)
+		return;
 
-		sockListen = socket(bindAddr->ai_family,
-				    bindAddr->ai_socktype, bindAddr->ai_protocol);
-		if (!IsSockValid(sockListen)) {
-			JetsonWriteLogs("socket() failed. (%d)\n", GetSockErrno());
-			throw runtime_error("socket() failed\n");
-		}
-		bIsSockListenValid = 1;
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = events;
+	ev.data.ptr = h;
+	if (epoll_ctl(gEpollFd, EPOLL_CTL_MOD, h->fd, &ev) < 0)
+		JetsonErrorLogs("epoll_ctl(MOD, %d) failed. (%d)\n", h->fd, errno);
+	h->events = events;
+}
 
-		if (bind(sockListen, bindAddr->ai_addr, bindAddr->ai_addrlen)) {
-			JetsonWriteLogs("bind() failed. (%d)\n", GetSockErrno());
-			throw runtime_error("bind() failed\n");
-		}
-		freeaddrinfo(bindAddr);
+//unregister and close; events already fetched for this handle are skipped (fd < 0)
+static void JetsonReactorClose(struct ReactorHandle *h)
+{
+	if (h->fd < 0)
+		return;
 
-		if (listen(sockListen, 10) < 0) {
-			JetsonWriteLogs("listen() failed. (%d)\n", GetSockErrno());
-			throw runtime_error("listen() failed\n");
-		}
+	epoll_ctl(gEpollFd, EPOLL_CTL_DEL, h->fd, NULL);
+	close(h->fd);
+	h->fd = -1;
+}
 
-		fd_set master;
-		FD_ZERO(&master);
-		FD_SET(sockListen, &master);
-		SOCKET maxSock = sockListen;
+static void JetsonClientUpdateEvents(struct ClientEntry *client)
+{
+	unsigned int sockEvents = 0;
+	if (client->pipeOut.len < IO_HIGH_WATERMARK && !client->bCloseAfterFlush)
+		sockEvents |= EPOLLIN;
+	if (client->sockOut.len > 0)
+		sockEvents |= EPOLLOUT;
+	JetsonReactorMod(&client->hSockEvt, sockEvents);
 
-		struct EngineEntry *pNewEng = NULL;
+	JetsonReactorMod(&client->hRspPipeEvt,
+		(client->sockOut.len < IO_HIGH_WATERMARK ? (unsigned int)EPOLLIN : 0));
+	JetsonReactorMod(&client->hReqPipeEvt,
+		(client->pipeOut.len > 0 ? (unsigned int)EPOLLOUT : 0));
+}
 
-		if (sockType == SOCK_TYPE_MGMT)
-			printf("MGMT waiting for connections...\n");
-		else {
-			printf("Engine (%s) waiting for connections...\n", sEngName);
-		
-			pNewEng = JetsonAddNewEngine(sEngDir, sEngExeName, sEngPort, sEngName, arguments);
-			if (pNewEng == NULL) {
-				JetsonWriteLogs("Unable to add new engine for %s\n", sEngName);
-				throw runtime_error("add engine failed\n");
-			}
-		}
+//record is freed only after the current epoll batch, see JetsonReactorLoop(); a
+//close path may get here more than once, the record is queued the first time only
+static void JetsonClientRelease(struct ClientEntry *client)
+{
+	if (client->bReleased)
+		return;
 
-		while(1) {
-			struct timeval timeout;
-			timeout.tv_sec = 1;
-			timeout.tv_usec = 0;
+	client->bReleased = 1;
+	gReleasedClients.push_back(client);
+}
+
+static void JetsonClientMaybeRelease(struct ClientEntry *client)
+{
+	if (client->hSockEvt.fd >= 0 || client->hRspPipeEvt.fd >= 0 || client->nEnginePid > 0)
+		return;
+
+	JetsonClientRelease(client);
+}
+
+static void JetsonCloseRequestPipe(struct ClientEntry *client)
+{
+	//best effort: push out what is still queued (e.g. "quit") before EOF
+	while (client->pipeOut.len > 0 && client->hReqPipeEvt.fd >= 0) {
+		int cbWritten = write(client->hReqPipeEvt.fd, client->pipeOut.data, client->pipeOut.len);
+		if (cbWritten <= 0)
+			break;
+		JetsonIoBufConsume(&client->pipeOut, cbWritten);
+	}
+
+	if (client->hReqPipeEvt.fd >= 0 && client->nEnginePid > 0) {
+		//stdin EOF asks the engine to quit, make sure it really does
+		struct LingeringEngine lingering;
+		lingering.client = client;
+		lingering.deadline = JetsonNowMsec() + ENGINE_EXIT_GRACE_MSEC;
+		gLingeringEngines.push_back(lingering);
+	}
+	JetsonReactorClose(&client->hReqPipeEvt);
+}
+
+//----- info line coalescing: between two flushes only the latest info line
+//per multipv index is kept; any other engine output flushes them first
+static void JetsonSessionStart(struct ClientEntry *client)
+{
+	client->nInfoRateMsec = client->engine->opts.nCoalesceMsec;
+	client->bSpliceReady = 0;
+	client->bSpliceOff = 0;
+	client->bPositionDelta = 0;
+	client->nLastPositionMoves = 0;
+	client->lastPosition.len = 0;
+	client->nInfoLastFlush = 0;
+	client->nInfoFlushDeadline = 0;
+	client->nInfoLinesIn = 0;
+	client->nInfoLinesOut = 0;
+	client->nPositionKey = 0;
+	client->nOptionsHash = 0;
+	client->nReadyPending = 0;
+	client->bUciokPending = 0;
+	client->search.nState = SEARCH_STATE_NONE;
+	client->search.pLeader = NULL;
+	client->search.heldReply.len = 0;
+	client->search.nHeldReadyAhead = 0;
+
+	//in shared mode the session has no engine process, its state is replayed per go
+	memset(&client->shared, 0, sizeof(client->shared));
+	client->shared.nState = (client->engine->pShared != NULL ? SHARED_STATE_IDLE : SHARED_STATE_NONE);
+
+	client->resume.nToken = 0;
+	client->resume.bDetached = 0;
+	client->resume.nBytesSent = 0;
+	client->resume.nBytesReceived = 0;
+	client->resume.sent.len = 0;
+	client->resume.lastInfo.len = 0;
+
+	JetsonMetricsReset(&client->metrics);
+	JetsonMetricAdd(client->engine->metrics.nLogins, 1);
+}
+
+static void JetsonFlushInfoLines(struct ClientEntry *client)
+{
+	for (int i=0; client->infoPending != NULL && i<=MAX_TRACKED_MULTIPV; i++) {
+		struct IoBuffer *pending = &client->infoPending[i];
+		if (pending->len == 0)
+			continue;
+
+		JetsonIoBufAppend(&client->sockOut, pending->data, pending->len);
+		pending->len = 0;
+		client->nInfoLinesOut++;
+	}
+	client->nInfoLastFlush = JetsonNowMsec();
+	client->nInfoFlushDeadline = 0;
+}
+
+static void JetsonDropInfoLines(struct ClientEntry *client)
+{
+	for (int i=0; client->infoPending != NULL && i<=MAX_TRACKED_MULTIPV; i++)
+		client->infoPending[i].len = 0;
+	client->nInfoFlushDeadline = 0;
+}
+
+//returns 1 if the line is held back for the next flush
+static int JetsonCoalesceInfoLine(struct ClientEntry *client, const char *sLine, int len)
+{
+	if (client->nInfoRateMsec <= 0 && client->nInfoFlushDeadline == 0)
+		return 0;
+
+	//bestmove, readyok, uciok etc. must not overtake what is held back,
+	//info string is passed on at once
+	if (strncmp(sLine, "info ", 5) != 0 || strncmp(sLine, "info string", 11) == 0 ||
+		client->nInfoRateMsec <= 0) {
+		if (client->nInfoFlushDeadline != 0 && strncmp(sLine, "info string", 11) != 0)
+			JetsonFlushInfoLines(client);
+		return 0;
+	}
+
+	client->nInfoLinesIn++;
+
+	int key = 0;
+	if (strstr(sLine, " pv ") != NULL) {
+		const char *sMultiPv = strstr(sLine, " multipv ");
+		key = (sMultiPv != NULL ? atoi(sMultiPv + 9) : 1);
+	}
+
+	long long now = JetsonNowMsec();
+	if (key < 0 || key > MAX_TRACKED_MULTIPV ||
+		(client->nInfoFlushDeadline == 0 && now - client->nInfoLastFlush >= client->nInfoRateMsec)) {
+		if (client->nInfoFlushDeadline != 0)
+			JetsonFlushInfoLines(client);
+		client->nInfoLastFlush = now;
+		client->nInfoLinesOut++;
+		return 0;
+	}
+
+	if (client->infoPending == NULL && (client->infoPending = JetsonIoBufArrayNew()) == NULL) {
+		client->nInfoLinesOut++;
+		return 0;
+	}
+	client->infoPending[key].len = 0;
+	JetsonIoBufAppend(&client->infoPending[key], sLine, len);
+
+	if (client->nInfoFlushDeadline == 0)
+		client->nInfoFlushDeadline = client->nInfoLastFlush + client->nInfoRateMsec;
+
+	if (!client->bInfoTimerArmed) {
+		client->bInfoTimerArmed = 1;
+		gInfoFlushClients.push_back(client);
+	}
+	return 1;
+}
+
+//setoption for settings the agent handles itself, these never reach the engine
+static int JetsonOnAgentOption(struct ClientEntry *client, const char *sLine)
+{
+	if (strncasecmp(sLine, RESUME_REQUEST, strlen(RESUME_REQUEST) - 1) == 0) {
+		JetsonResumeIssueToken(client);
+		return 1;
+	}
+
+	if (strncasecmp(sLine, POSITION_DELTA_REQUEST, strlen(POSITION_DELTA_REQUEST) - 1) == 0) {
+		client->bPositionDelta = 1;
+		client->lastPosition.len = 0;
+		JetsonIoBufAppend(&client->sockOut, POSITION_DELTA_OK, strlen(POSITION_DELTA_OK));
+		return 1;
+	}
+
+	if (strncasecmp(sLine, "setoption name JetsonInfoRate ", 30) != 0)
+		return 0;
+
+	const char *sValue = strstr(sLine, " value ");
+	int nRateMsec = (sValue != NULL ? atoi(sValue + 7) : 0);
+	if (nRateMsec < 0)
+		nRateMsec = 0;
+	if (nRateMsec > MAX_INFO_RATE_MSEC)
+		nRateMsec = MAX_INFO_RATE_MSEC;
+
+	client->nInfoRateMsec = nRateMsec;
+	JetsonWriteLogs("Client (%s, %d) info rate set to %d ms\n", client->sIpAddr, client->sock, nRateMsec);
+	return 1;
+}
+
+//----- warm pool: instances that already answered uci/isready, handed to logins as they come
+#define POOL_MAX_FAILURES 3		//stop refilling after this many instances die before readyok
+
+static void JetsonPoolCount(struct EngineEntry *engEntry, int *pnWarming, int *pnIdle, int *pnRecycling)
+{
+	*pnWarming = *pnIdle = *pnRecycling = 0;
+
+	for (int i=0; i<engEntry->nInsts; i++) {
+		struct ClientEntry *thisClient = engEntry->insts[i];
+		if (!thisClient->bIsEngineRunning)
+			continue;
+
+		if (thisClient->nPoolState == POOL_STATE_WARMING)
+			(*pnWarming)++;
+		else if (thisClient->nPoolState == POOL_STATE_IDLE)
+			(*pnIdle)++;
+		else if (thisClient->nPoolState == POOL_STATE_RECYCLING)
+			(*pnRecycling)++;
+	}
+}
+
+static void JetsonPoolRetire(struct ClientEntry *inst)
+{
+	JetsonWriteLogs("Pool instance (%s) pid=%d retired\n", inst->sEngInstName, inst->nEnginePid);
+
+	//out of the pool first so its exit isn't taken for a failed warm-up
+	inst->nPoolState = POOL_STATE_NONE;
+	inst->bIsPooled = 0;
+	JetsonRegistryRemoveInst(inst->engine, inst);
+	JetsonCloseRequestPipe(inst);
+}
+
+//instance the agent itself owns (pool or shared worker), uci/isready already queued
+static struct ClientEntry *JetsonSpawnAgentInstance(struct EngineEntry *engEntry, const char *sKind)
+{
+	pthread_mutex_lock(&gJetsonTableLock);
+	struct ClientEntry *inst = JetsonRegistryAddClient(&gRegistry, engEntry);
+	if (inst != NULL) {
+		inst->bIsEngineRunning = 1;
+		if (!JetsonRegistryAddInst(engEntry, inst)) {
+			JetsonRegistryRemoveClient(&gRegistry, inst);
+			inst = NULL;
+		}
+	}
+	pthread_mutex_unlock(&gJetsonTableLock);
+
+	if (inst == NULL) {
+		JetsonWriteLogs("No memory for %s instance on engine (%s)\n", sKind, engEntry->sEngineName);
+		return NULL;
+	}
+
+	inst->sock = -1;
+	inst->sIpAddr[0] = '\0';
+	inst->sServIpAddr[0] = '\0';
+	inst->hSockEvt.fd = -1;
+	inst->hReqPipeEvt.fd = -1;
+	inst->hRspPipeEvt.fd = -1;
+	ostringstream ossInstName;
+	ossInstName << "jei_" << sKind << ++engEntry->nPoolSeq << "_" << engEntry->sEngineName;
+	snprintf(inst->sEngInstName, sizeof(inst->sEngInstName), "%s", ossInstName.str().c_str());
+
+	if (!JetsonSpawnEngineInstance(inst)) {
+		JetsonClientRelease(inst);
+		return NULL;
+	}
+
+	JetsonReactorAdd(&inst->hRspPipeEvt, RH_TYPE_ENGINE_RSP, inst->hRspPipe, inst, EPOLLIN);
+	JetsonReactorAdd(&inst->hReqPipeEvt, RH_TYPE_ENGINE_REQ, inst->hReqPipe, inst, 0);
+
+	const char *sWarmUp = "uci\nisready\n";
+	JetsonIoBufAppend(&inst->pipeOut, sWarmUp, strlen(sWarmUp));
+	JetsonClientUpdateEvents(inst);
+	return inst;
+}
+
+static void JetsonPoolSpawn(struct EngineEntry *engEntry)
+{
+	struct ClientEntry *inst = JetsonSpawnAgentInstance(engEntry, "pool");
+	if (inst == NULL)
+		return;
+
+	inst->nPoolState = POOL_STATE_WARMING;
+	inst->bIsPooled = 1;
+}
+
+static void JetsonPoolRefill(struct EngineEntry *engEntry)
+{
+	if (engEntry->opts.nPoolSize <= 0 || engEntry->bDraining)
+		return;
+
+	if (engEntry->nPoolFailures >= POOL_MAX_FAILURES) {
+		JetsonWriteLogs("Pool for engine (%s) disabled after %d failed warm-ups\n",
+			engEntry->sEngineName, engEntry->nPoolFailures);
+		return;
+	}
+
+	//pool instances are engine processes like any other, max=N counts them too
+	int nWarming, nIdle, nRecycling;
+	JetsonPoolCount(engEntry, &nWarming, &nIdle, &nRecycling);
+	for (int n = nWarming + nIdle; n < engEntry->opts.nPoolSize && JetsonHasRoom(engEntry); n++)
+		JetsonPoolSpawn(engEntry);
+}
+
+static struct ClientEntry *JetsonPoolTake(struct EngineEntry *engEntry)
+{
+	if (engEntry->opts.nPoolSize <= 0)
+		return NULL;
+
+	for (int i=0; i<engEntry->nInsts; i++) {
+		struct ClientEntry *thisClient = engEntry->insts[i];
+		if (thisClient->bIsEngineRunning && thisClient->nPoolState == POOL_STATE_IDLE)
+			return thisClient;
+	}
+	return NULL;
+}
+
+//client left a pooled instance: reset it and keep it instead of starting a new one
+static int JetsonPoolRecycle(struct ClientEntry *client)
+{
+	struct EngineEntry *engEntry = client->engine;
+
+	//spliced output isn't read, readyok lines it carried can't be counted
+	if (!client->bIsPooled || client->bOptionsChanged || client->bQuitSent ||
+		client->hReqPipeEvt.fd < 0 || client->hRspPipeEvt.fd < 0 || engEntry->opts.bSplice ||
+		engEntry->bDraining || client->nConfigGen != engEntry->nConfigGen)
+		return 0;
+
+	int nWarming, nIdle, nRecycling;
+	JetsonPoolCount(engEntry, &nWarming, &nIdle, &nRecycling);
+	if (nWarming + nIdle + nRecycling >= engEntry->opts.nPoolSize) {
+		if (nWarming == 0)
+			return 0;
+
+		//an initialized instance beats one that is still loading
+		for (int i=0; i<engEntry->nInsts; i++) {
+			struct ClientEntry *thisClient = engEntry->insts[i];
+			if (thisClient->bIsEngineRunning && thisClient->nPoolState == POOL_STATE_WARMING) {
+				JetsonPoolRetire(thisClient);
+				break;
+			}
+		}
+	}
+	if (!JetsonRegistryAddInst(engEntry, client))
+		return 0;
+
+	JetsonWriteLogs("Recycling pool instance (%s) pid=%d from client(%s, %d)\n",
+		client->sEngInstName, client->nEnginePid, client->sIpAddr, client->sock);
+
+	JetsonReactorClose(&client->hSockEvt);
+
+	pthread_mutex_lock(&gJetsonTableLock);
+	client->bIsConnected = 0;
+	JetsonRegistryRemoveSession(&gRegistry, client);
+	pthread_mutex_unlock(&gJetsonTableLock);
+
+	client->sockOut.len = 0;
+	client->bCloseAfterFlush = 0;
+	client->nPoolState = POOL_STATE_RECYCLING;
+	JetsonFramerReset(&client->reqFramer);
+
+	const char *sReset = "stop\nucinewgame\nisready\n";
+	JetsonIoBufAppend(&client->pipeOut, sReset, strlen(sReset));
+	client->nReadyPending++;
+	JetsonClientUpdateEvents(client);
+	return 1;
+}
+
+//engine output while no client owns the instance is dropped; it is ready again at
+//the readyok of the reset, those of isready the client sent before come first
+static void JetsonOnPoolLine(struct ClientEntry *inst, const char *sLine)
+{
+	if (inst->nPoolState == POOL_STATE_IDLE || strncmp(sLine, "readyok", 7) != 0)
+		return;
+	if (inst->nReadyPending > 1) {
+		inst->nReadyPending--;
+		return;
+	}
+	inst->nReadyPending = 0;
+
+	struct EngineEntry *engEntry = inst->engine;
+	engEntry->nPoolFailures = 0;
+
+	if (inst->nPoolState == POOL_STATE_RECYCLING) {
+		int nWarming, nIdle, nRecycling;
+		JetsonPoolCount(engEntry, &nWarming, &nIdle, &nRecycling);
+		if (nWarming + nIdle >= engEntry->opts.nPoolSize || engEntry->bDraining ||
+			inst->nConfigGen != engEntry->nConfigGen) {
+			JetsonPoolRetire(inst);
+			return;
+		}
+	}
+
+	inst->nPoolState = POOL_STATE_IDLE;
+	inst->bOptionsChanged = 0;
+	inst->bQuitSent = 0;
+	gbAdmitCheck = 1;
+	JetsonWriteLogs("Pool instance (%s) pid=%d is ready\n", inst->sEngInstName, inst->nEnginePid);
+}
+
+static void JetsonCloseClientSock(struct ClientEntry *client)
+{
+	if (client->hSockEvt.fd < 0)
+		return;
+
+	if (JetsonResumeDetach(client))
+		return;
+	if (client->resume.nToken != 0) {
+		gResumeTokens.erase(client->resume.nToken);
+		client->resume.nToken = 0;
+	}
+
+	if (client->nInfoLinesIn > 0)
+		JetsonWriteLogs("Client (%s, %d) info lines coalesced: %lld from engine, %lld relayed\n",
+			client->sIpAddr, client->sock, client->nInfoLinesIn, client->nInfoLinesOut);
+	JetsonDropInfoLines(client);
+	JetsonSearchLeave(client);
+	JetsonSharedLeave(client);
+
+	if (JetsonPoolRecycle(client))
+		return;
+
+	JetsonWriteLogs("Closing (%d) from client(%s) for engine(%s)\n",
+		client->sock, client->sIpAddr, client->engine->sEngineName);
+
+	JetsonReactorClose(&client->hSockEvt);
+	JetsonCloseRequestPipe(client);
+
+	pthread_mutex_lock(&gJetsonTableLock);
+	client->bIsConnected = 0;
+	JetsonRegistryRemoveSession(&gRegistry, client);
+	pthread_mutex_unlock(&gJetsonTableLock);
+
+	JetsonClientMaybeRelease(client);
+}
+
+static void JetsonCloseResponsePipe(struct ClientEntry *client)
+{
+	JetsonWriteLogs("<<< Engine instance (%s) output closed for client(%s, %d)\n",
+		client->sEngInstName, client->sIpAddr, client->sock);
+
+	JetsonReactorClose(&client->hRspPipeEvt);
+	JetsonCloseRequestPipe(client);
+
+	if (client->nPoolState != POOL_STATE_NONE) {
+		if (client->nPoolState == POOL_STATE_WARMING)
+			client->engine->nPoolFailures++;
+
+		client->nPoolState = POOL_STATE_NONE;
+		JetsonPoolRefill(client->engine);
+	}
+
+	if (client->shared.bIsWorker) {
+		JetsonSharedWorkerGone(client);
+		JetsonClientMaybeRelease(client);
+		return;
+	}
+
+	if (client->resume.bDetached) {
+		JetsonResumeEnd(client, "engine exited");
+		JetsonClientMaybeRelease(client);
+		return;
+	}
+
+	//engine is gone, let the client drain what is left and then drop it
+	JetsonSearchLeave(client);
+	if (client->nInfoFlushDeadline != 0 && client->hSockEvt.fd >= 0)
+		JetsonFlushInfoLines(client);
+
+	if (client->sockOut.len == 0) {
+		JetsonCloseClientSock(client);	//releases the record itself
+		return;
+	}
+
+	client->bCloseAfterFlush = 1;
+	JetsonClientUpdateEvents(client);
+	JetsonClientMaybeRelease(client);
+}
+
+static int JetsonFlushClientSock(struct ClientEntry *client)
+{
+	while (client->sockOut.len > 0) {
+		int bytesSent = send(client->sock, client->sockOut.data, client->sockOut.len, MSG_NOSIGNAL);
+		if (bytesSent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return 0;
+		}
+		if (client->resume.nToken != 0) {
+			//sent is only trimmed once it holds twice the replay window
+			client->resume.nBytesSent += bytesSent;
+			JetsonIoBufAppend(&client->resume.sent, client->sockOut.data, bytesSent);
+			if (client->resume.sent.len > 2 * RESUME_REPLAY_BYTES)
+				JetsonIoBufConsume(&client->resume.sent, client->resume.sent.len - RESUME_REPLAY_BYTES);
+		}
+		JetsonIoBufConsume(&client->sockOut, bytesSent);
+		JetsonMetricsOnClientBytes(client, 0, bytesSent);
+	}
+	return 1;
+}
+
+static int JetsonFlushRequestPipe(struct ClientEntry *client)
+{
+	while (client->pipeOut.len > 0) {
+		int cbWritten = write(client->hReqPipeEvt.fd, client->pipeOut.data, client->pipeOut.len);
+		if (cbWritten < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return 0;
+		}
+		JetsonIoBufConsume(&client->pipeOut, cbWritten);
+	}
+	return 1;
+}
+
+static void JetsonOnClientWritable(struct ClientEntry *client)
+{
+	if (client->hSockEvt.fd < 0)
+		return;		//closed or detached, nothing to send to
+
+	if (!JetsonFlushClientSock(client)) {
+		JetsonCloseClientSock(client);
+		return;
+	}
+
+	if (client->bCloseAfterFlush && client->sockOut.len == 0) {
+		JetsonCloseClientSock(client);
+		return;
+	}
+	JetsonClientUpdateEvents(client);
+}
+
+//----- engine output line on its way to a client: info coalescing, id name
+//rewrite and the agent's own options. Caller pushes sockOut out.
+static void JetsonRelayEngineLine(struct ClientEntry *client, const char *sLine, int len)
+{
+	JetsonMetricsOnEngineLine(client, sLine);
+	if (JetsonCoalesceInfoLine(client, sLine, len))
+		return;
+
+	//-----hijack id name, advertise the agent's own options with uciok
+	string sRewritten;
+	if (JetsonRewriteIdName(client, sLine, sRewritten))
+		JetsonIoBufAppend(&client->sockOut, sRewritten.c_str(), sRewritten.length());
+	else if (strncmp(sLine, "uciok", 5) == 0) {
+		ostringstream ossOptions;
+		ossOptions << "option name JetsonInfoRate type spin default " << client->engine->opts.nCoalesceMsec
+			<< " min 0 max " << MAX_INFO_RATE_MSEC << "\n" << sLine;
+		sRewritten = ossOptions.str();
+		JetsonIoBufAppend(&client->sockOut, sRewritten.c_str(), sRewritten.length());
+		client->bSpliceReady = client->engine->opts.bSplice;
+	}
+	else
+		JetsonIoBufAppend(&client->sockOut, sLine, len);
+}
+
+//----- analysis cache and shared searches: a go is answered from the cache
+//when a finished search already covers it, or joins an identical search that
+//is running for another session on the same engine
+static void JetsonSearchReset(struct ClientEntry *client)
+{
+	client->search.nState = SEARCH_STATE_NONE;
+	client->search.pLeader = NULL;
+	client->search.nDepth = 0;
+	client->search.nNodes = 0;
+	client->search.bStopped = 0;
+	for (int i=0; client->search.pvLines != NULL && i<=MAX_TRACKED_MULTIPV; i++)
+		client->search.pvLines[i].len = 0;
+}
+
+static unsigned long long JetsonSearchKey(struct ClientEntry *client)
+{
+	if (client->nPositionKey == 0)
+		return 0;
+	return client->nPositionKey ^ (client->nOptionsHash * 0x9E3779B97F4A7C15ULL);
+}
+
+static void JetsonOnOptionsLine(struct ClientEntry *client, const char *sLine, int len)
+{
+	//FNV-1a over every setoption sent, so the same options in the same order match
+	unsigned long long hash = (client->nOptionsHash ? client->nOptionsHash : 14695981039346656037ULL);
+	for (int i=0; i<len; i++) {
+		hash ^= (unsigned char)sLine[i];
+		hash *= 1099511628211ULL;
+	}
+	client->nOptionsHash = hash;
+}
+
+static void JetsonSearchSendLine(struct ClientEntry *client, const char *sLine)
+{
+	JetsonRelayEngineLine(client, sLine, strlen(sLine));
+}
+
+//uciok or readyok the engine still owes the session, or an answer still held back
+static int JetsonSessionOwesReplies(struct ClientEntry *client)
+{
+	if (client->shared.nState != SHARED_STATE_NONE)
+		return client->shared.bUciPending || client->shared.bReadyPending;
+	return client->bUciokPending || client->nReadyPending > 0 || client->search.heldReply.len > 0;
+}
+
+//an answer from the agent can go out now, or be held behind what the own engine owes
+static int JetsonSearchCanAnswer(struct ClientEntry *client)
+{
+	if (!JetsonSessionOwesReplies(client))
+		return 1;
+	return client->shared.nState == SHARED_STATE_NONE && client->hReqPipeEvt.fd >= 0 &&
+		client->search.heldReply.len == 0;
+}
+
+//go answered from a finished search; while the engine owes replies the answer waits for
+//the readyok of an isready sent behind them, see JetsonSearchReleaseHeld
+static void JetsonSearchAnswer(struct ClientEntry *client, const struct AnalysisResult *result)
+{
+	if (!JetsonSessionOwesReplies(client)) {
+		for (size_t i=0; i<result->infoLines.size(); i++)
+			JetsonSearchSendLine(client, result->infoLines[i].c_str());
+		JetsonSearchSendLine(client, result->sBestMove.c_str());
+		return;
+	}
+
+	struct SearchEntry *search = &client->search;
+	for (size_t i=0; i<result->infoLines.size(); i++)
+		JetsonIoBufAppend(&search->heldReply, result->infoLines[i].c_str(), result->infoLines[i].length());
+	JetsonIoBufAppend(&search->heldReply, result->sBestMove.c_str(), result->sBestMove.length());
+	search->nHeldReadyAhead = client->nReadyPending;
+
+	JetsonIoBufAppend(&client->pipeOut, "isready\n", 8);
+	client->nReadyPending++;
+}
+
+//readyok from the engine, returns 1 if it answers the agent's own isready: the held
+//answer goes out in its place
+static int JetsonSearchReleaseHeld(struct ClientEntry *client)
+{
+	struct SearchEntry *search = &client->search;
+	if (search->heldReply.len == 0)
+		return 0;
+	if (search->nHeldReadyAhead > 0) {
+		search->nHeldReadyAhead--;
+		return 0;
+	}
+
+	//not through JetsonDeliverEngineLine, a later go may already run on the engine
+	if (client->resume.bDetached) {
+		JetsonIoBufAppend(&client->sockOut, client->resume.lastInfo.data, client->resume.lastInfo.len);
+		client->resume.lastInfo.len = 0;
+		JetsonIoBufAppend(&client->sockOut, search->heldReply.data, search->heldReply.len);
+	}
+	else if (client->hSockEvt.fd >= 0 && !client->bCloseAfterFlush) {
+		istringstream iss(string(search->heldReply.data, search->heldReply.len));
+		string sLine;
+		while (getline(iss, sLine)) {
+			sLine += "\n";
+			JetsonRelayEngineLine(client, sLine.c_str(), sLine.length());
+		}
+	}
+	search->heldReply.len = 0;
+	return 1;
+}
+
+//bestmove from the first move of the latest pv, for a session that stops early
+static int JetsonSearchBestMoveLine(struct ClientEntry *leader, string &sBestMove)
+{
+	struct IoBuffer *pv = &leader->search.pvLines[1];
+	if (pv->len == 0)
+		return 0;
+
+	string sPvLine(pv->data, pv->len);
+	size_t pos = sPvLine.find(" pv ");
+	if (pos == string::npos)
+		return 0;
+
+	istringstream iss(sPvLine.substr(pos + 4));
+	string sMove;
+	if (!(iss >> sMove))
+		return 0;
+
+	sBestMove = "bestmove " + sMove + "\n";
+	return 1;
+}
+
+//own engine runs the go after all, stopped right away if the client already sent stop
+static void JetsonSearchStartOwn(struct ClientEntry *client, int bStopNow)
+{
+	JetsonSearchReset(client);
+	if (client->shared.nState != SHARED_STATE_NONE) {
+		client->search.nState = SEARCH_STATE_RUNNING;
+		client->search.nStartMsec = JetsonNowMsec();
+		client->search.bStopped = bStopNow;
+		client->shared.goCmd.len = 0;
+		JetsonIoBufAppend(&client->shared.goCmd, client->search.goCmd.data, client->search.goCmd.len);
+		JetsonSharedEnqueue(client, bStopNow);
+		return;
+	}
+	if (client->hReqPipeEvt.fd < 0)
+		return;
+
+	client->search.nState = SEARCH_STATE_RUNNING;
+	client->search.nStartMsec = JetsonNowMsec();
+	client->search.bStopped = bStopNow;
+
+	JetsonIoBufAppend(&client->pipeOut, client->search.goCmd.data, client->search.goCmd.len);
+	if (bStopNow)
+		JetsonIoBufAppend(&client->pipeOut, "stop\n", 5);
+
+	if (!JetsonFlushRequestPipe(client)) {
+		JetsonErrorLogs("<<< ERROR on eng_i_req for Client (%s, %d): write failed (%d)\n",
+			client->sIpAddr, client->sock, errno);
+		JetsonCloseRequestPipe(client);
+	}
+	JetsonClientUpdateEvents(client);
+}
+
+//session goes away or its search ends, sessions attached to it run their own
+static void JetsonSearchLeave(struct ClientEntry *client)
+{
+	if (client->search.nState == SEARCH_STATE_RUNNING) {
+		struct EngineEntry *engEntry = client->engine;
+		for (int i=0; i<engEntry->nClients; i++) {
+			struct ClientEntry *follower = engEntry->clients[i];
+			if (follower->search.nState == SEARCH_STATE_ATTACHED && follower->search.pLeader == client) {
+				JetsonTraceLogs("Client (%s, %d) search detached, running it on own engine\n",
+					follower->sIpAddr, follower->sock);
+				JetsonSearchStartOwn(follower, 0);
+			}
+		}
+	}
+	JetsonSearchReset(client);
+}
+
+//returns 1 if the go was answered or shared and must not reach the engine
+static int JetsonOnGoCmd(struct ClientEntry *client, const char *sLine, int len)
+{
+	struct EngineEntry *engEntry = client->engine;
+	struct AnalysisCache *cache = engEntry->pCache;
+	struct AnalysisStore *store = engEntry->pStore;
+
+	if (client->search.nState != SEARCH_STATE_NONE)
+		JetsonSearchLeave(client);
+	if (cache == NULL && store == NULL)
+		return 0;
+	if (client->search.pvLines == NULL && (client->search.pvLines = JetsonIoBufArrayNew()) == NULL)
+		return 0;
+
+	client->search.goCmd.len = 0;
+	JetsonIoBufAppend(&client->search.goCmd, sLine, len);
+	client->search.nKey = JetsonSearchKey(client);
+	client->search.nStartMsec = JetsonNowMsec();
+	client->search.nState = SEARCH_STATE_RUNNING;
+
+	struct GoLimits limits;
+	JetsonParseGoLimits(sLine, &limits);
+	if (client->search.nKey == 0 || !limits.bShareable)
+		return 0;
+
+	if (limits.bCacheable && cache != NULL && JetsonSearchCanAnswer(client)) {
+		const struct AnalysisResult *result = JetsonCacheLookup(cache, client->search.nKey);
+		if (result != NULL && JetsonResultSatisfies(result, &limits)) {
+			cache->nHits++;
+			JetsonTraceLogs("Client (%s, %d) go answered from cache, depth %d\n",
+				client->sIpAddr, client->sock, result->nDepth);
+
+			JetsonSearchAnswer(client, result);
+			JetsonSearchReset(client);
+			return 1;
+		}
+		cache->nMisses++;
+	}
+
+	//results of earlier sessions and agent runs, or of other agents serving the engine
+	if (limits.bCacheable && store != NULL && client->nConfigGen == engEntry->nConfigGen && JetsonSearchCanAnswer(client)) {
+		struct AnalysisResult result;
+		unsigned long long nStoreKey = JetsonStoreKey(client->search.nKey, engEntry->sEngineExeName, engEntry->arguments);
+		if (JetsonStoreLookup(store, nStoreKey, &result) && JetsonResultSatisfies(&result, &limits)) {
+			store->nHits++;
+			JetsonTraceLogs("Client (%s, %d) go answered from store, depth %d\n",
+				client->sIpAddr, client->sock, result.nDepth);
+
+			JetsonSearchAnswer(client, &result);
+			if (cache != NULL)
+				JetsonCacheStore(cache, client->search.nKey, result);
+			JetsonSearchReset(client);
+			return 1;
+		}
+		store->nMisses++;
+	}
+	if (cache == NULL || JetsonSessionOwesReplies(client))
+		return 0;
+
+	//same position, same options, and the running search goes at least as far,
+	//joined only by a session the engine owes nothing that would have to come first
+	for (int i=0; i<engEntry->nClients; i++) {
+		struct ClientEntry *leader = engEntry->clients[i];
+		if (leader == client || leader->search.nState != SEARCH_STATE_RUNNING ||
+			leader->search.nKey != client->search.nKey || leader->search.bStopped ||
+			leader->nConfigGen != client->nConfigGen ||
+			leader->hSockEvt.fd < 0 || (leader->hRspPipeEvt.fd < 0 && leader->shared.nState == SHARED_STATE_NONE))
+			continue;
+
+		struct GoLimits leaderLimits;
+		string sLeaderGo(leader->search.goCmd.data, leader->search.goCmd.len);
+		JetsonParseGoLimits(sLeaderGo.c_str(), &leaderLimits);
+
+		int bCovers = (sLeaderGo == string(sLine, len)) ||
+			(limits.bCacheable && leaderLimits.bCacheable && limits.nDepth > 0 && leaderLimits.nDepth >= limits.nDepth);
+		if (!bCovers)
+			continue;
+
+		cache->nAttached++;
+		client->search.nState = SEARCH_STATE_ATTACHED;
+		client->search.pLeader = leader;
+		JetsonTraceLogs("Client (%s, %d) go joins the search of client (%s, %d)\n",
+			client->sIpAddr, client->sock, leader->sIpAddr, leader->sock);
+
+		for (int k=1; k<=MAX_TRACKED_MULTIPV; k++) {
+			struct IoBuffer *pv = &leader->search.pvLines[k];
+			if (pv->len > 0)
+				JetsonRelayEngineLine(client, pv->data, pv->len);
+		}
+		return 1;
+	}
+
+	return 0;
+}
+
+//returns 1 if the stop was handled by the agent
+static int JetsonOnStopCmd(struct ClientEntry *client)
+{
+	if (client->search.nState == SEARCH_STATE_RUNNING) {
+		client->search.bStopped = 1;
+		return 0;
+	}
+
+	if (client->search.nState != SEARCH_STATE_ATTACHED)
+		return 0;
+
+	string sBestMove;
+	if (JetsonSearchBestMoveLine(client->search.pLeader, sBestMove)) {
+		JetsonSearchSendLine(client, sBestMove.c_str());
+		JetsonSearchReset(client);
+	}
+	else
+		JetsonSearchStartOwn(client, 1);
+	return 1;
+}
+
+//a long analysis is saved at each depth it completes, so an agent that goes down
+//overnight loses the last iteration only; bestmove is the first move of the pv
+static void JetsonStoreCheckpoint(struct ClientEntry *leader)
+{
+	struct EngineEntry *engEntry = leader->engine;
+	struct SearchEntry *search = &leader->search;
+	if (engEntry->pStore == NULL || search->nKey == 0 || leader->nConfigGen != engEntry->nConfigGen)
+		return;
+
+	struct GoLimits limits;
+	string sGo(search->goCmd.data, search->goCmd.len);
+	JetsonParseGoLimits(sGo.c_str(), &limits);
+	struct AnalysisResult result;
+	if (!limits.bShareable || !JetsonSearchBestMoveLine(leader, result.sBestMove))
+		return;
+
+	result.nDepth = search->nDepth;
+	result.nNodes = search->nNodes;
+	result.nTimeMsec = JetsonNowMsec() - search->nStartMsec;
+	for (int k=1; k<=MAX_TRACKED_MULTIPV; k++)
+		if (search->pvLines[k].len > 0)
+			result.infoLines.push_back(string(search->pvLines[k].data, search->pvLines[k].len));
+	JetsonStoreSave(engEntry->pStore, JetsonStoreKey(search->nKey, engEntry->sEngineExeName, engEntry->arguments), result);
+}
+
+//output of an engine that runs a tracked search
+static void JetsonOnSearchLine(struct ClientEntry *leader, const char *sLine, int len)
+{
+	struct EngineEntry *engEntry = leader->engine;
+	struct SearchEntry *search = &leader->search;
+	int bBestMove = (strncmp(sLine, "bestmove", 8) == 0);
+
+	if (strncmp(sLine, "info ", 5) == 0 && strncmp(sLine, "info string", 11) != 0) {
+		const char *sDepth = strstr(sLine, " depth ");
+		const char *sNodes = strstr(sLine, " nodes ");
+		const char *sMultiPv = strstr(sLine, " multipv ");
+		int multiPv = (sMultiPv != NULL ? atoi(sMultiPv + 9) : 1);
+
+		if (sNodes != NULL)
+			search->nNodes = atoll(sNodes + 7);
+		if (strstr(sLine, " pv ") != NULL && multiPv >= 1 && multiPv <= MAX_TRACKED_MULTIPV) {
+			if (sDepth != NULL && multiPv == 1) {
+				int nDepth = atoi(sDepth + 7);
+				if (nDepth > search->nDepth && search->nDepth > 0)
+					JetsonStoreCheckpoint(leader);
+				search->nDepth = nDepth;
+			}
+			search->pvLines[multiPv].len = 0;
+			JetsonIoBufAppend(&search->pvLines[multiPv], sLine, len);
+		}
+	}
+	else if (!bBestMove)
+		return;
+
+	if (engEntry->pCache == NULL && engEntry->pStore == NULL)
+		return;
+
+	struct AnalysisResult result;
+	if (bBestMove) {
+		result.nDepth = search->nDepth;
+		result.nNodes = search->nNodes;
+		result.nTimeMsec = JetsonNowMsec() - search->nStartMsec;
+		for (int k=1; k<=MAX_TRACKED_MULTIPV; k++)
+			if (search->pvLines[k].len > 0)
+				result.infoLines.push_back(string(search->pvLines[k].data, search->pvLines[k].len));
+		result.sBestMove.assign(sLine, len);
+
+		struct GoLimits limits;
+		string sGo(search->goCmd.data, search->goCmd.len);
+		JetsonParseGoLimits(sGo.c_str(), &limits);
+		if (search->nKey != 0 && limits.bShareable && result.nDepth > 0) {
+			if (engEntry->pCache != NULL)
+				JetsonCacheStore(engEntry->pCache, search->nKey, result);
+			if (engEntry->pStore != NULL && leader->nConfigGen == engEntry->nConfigGen)
+				JetsonStoreSave(engEntry->pStore, JetsonStoreKey(search->nKey, engEntry->sEngineExeName, engEntry->arguments), result);
+		}
+	}
+
+	for (int i=0; i<engEntry->nClients; i++) {
+		struct ClientEntry *follower = engEntry->clients[i];
+		if (follower->search.nState != SEARCH_STATE_ATTACHED || follower->search.pLeader != leader)
+			continue;
+
+		if (!bBestMove) {
+			JetsonRelayEngineLine(follower, sLine, len);
+			JetsonOnClientWritable(follower);
+			continue;
+		}
+
+		//a leader stopped by its own client may not have gone as far as this one asked
+		struct GoLimits limits;
+		string sGo(follower->search.goCmd.data, follower->search.goCmd.len);
+		JetsonParseGoLimits(sGo.c_str(), &limits);
+		if (search->bStopped && !JetsonResultSatisfies(&result, &limits)) {
+			JetsonSearchStartOwn(follower, 0);
+			continue;
+		}
+
+		JetsonRelayEngineLine(follower, sLine, len);
+		JetsonSearchReset(follower);
+		JetsonOnClientWritable(follower);
+	}
+}
+
+//engine output for a session, from its own engine or the worker running its go
+static void JetsonDeliverEngineLine(struct ClientEntry *client, const char *sLine, int len)
+{
+	if (client->search.nState == SEARCH_STATE_RUNNING) {
+		JetsonOnSearchLine(client, sLine, len);
+		if (strncmp(sLine, "bestmove", 8) == 0)
+			JetsonSearchReset(client);
+	}
+
+	JetsonRelayEngineLine(client, sLine, len);
+}
+
+//----- management and metrics connections are non-blocking like the sessions: a
+//reply is queued and written as the peer takes it, and the next command is only
+//read once it is out; a peer that doesn't take its reply in MGMT_SEND_TIMEOUT_SEC
+//is dropped
+struct MgmtConn {
+	struct ReactorHandle h;		//first member, freed through gReleasedHandles
+	struct IoBuffer out;
+	long long nDeadlineMsec;	//0 unless a reply is waiting in out
+	int bCloseAfterFlush;		//metrics scrape, or a refused resume
+};
+
+static struct MgmtConn *gpMgmtReplyConn = NULL;	//connection whose command is running
+static vector<struct MgmtConn *> gMgmtSending;	//connections with a reply waiting
+
+static struct MgmtConn *JetsonMgmtConnNew(int type, int fd)
+{
+	struct MgmtConn *conn = (struct MgmtConn *)calloc(1, sizeof(struct MgmtConn));
+	if (conn == NULL)
+		return NULL;
+	if (!JetsonReactorAdd(&conn->h, type, fd, conn, EPOLLIN)) {
+		free(conn);
+		return NULL;
+	}
+	return conn;
+}
+
+//the record itself goes after the batch, the handle may still have events in it
+static void JetsonMgmtConnRelease(struct MgmtConn *conn)
+{
+	if (conn->nDeadlineMsec != 0) {
+		gMgmtSending.erase(find(gMgmtSending.begin(), gMgmtSending.end(), conn));
+		conn->nDeadlineMsec = 0;
+	}
+	JetsonIoBufFree(&conn->out);
+	gReleasedHandles.push_back(&conn->h);
+}
+
+static void JetsonMgmtConnClose(struct MgmtConn *conn)
+{
+	JetsonWriteLogs("MGMT closing socket (%d)\n", conn->h.fd);
+	JetsonReactorClose(&conn->h);
+	JetsonMgmtConnRelease(conn);
+}
+
+//socket taken over as a session or mux connection, returned non-blocking
+static int JetsonMgmtConnHandOver(struct MgmtConn *conn)
+{
+	int fd = conn->h.fd;
+	epoll_ctl(gEpollFd, EPOLL_CTL_DEL, fd, NULL);
+	conn->h.fd = -1;
+	JetsonMgmtConnRelease(conn);
+	return fd;
+}
+
+//called by JetsonMgmtSend, takes the reply to the command being run on a connection
+static int JetsonMgmtQueueReply(SOCKET sock, const char *data, int len)
+{
+	struct MgmtConn *conn = gpMgmtReplyConn;
+	if (conn == NULL || conn->h.fd != sock)
+		return 0;
+
+	JetsonIoBufAppend(&conn->out, data, len);
+	return 1;
+}
+
+static void JetsonMgmtFlush(struct MgmtConn *conn)
+{
+	while (conn->out.len > 0) {
+		int bytesSent = send(conn->h.fd, conn->out.data, conn->out.len, MSG_NOSIGNAL);
+		if (bytesSent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			JetsonMgmtConnClose(conn);
+			return;
+		}
+		JetsonIoBufConsume(&conn->out, bytesSent);
+	}
+
+	if (conn->out.len > 0) {
+		if (conn->nDeadlineMsec == 0) {
+			conn->nDeadlineMsec = JetsonNowMsec() + MGMT_SEND_TIMEOUT_SEC * 1000;
+			gMgmtSending.push_back(conn);
+		}
+		JetsonReactorMod(&conn->h, EPOLLOUT);
+		return;
+	}
+
+	if (conn->bCloseAfterFlush) {
+		JetsonMgmtConnClose(conn);
+		return;
+	}
+	if (conn->nDeadlineMsec != 0) {
+		gMgmtSending.erase(find(gMgmtSending.begin(), gMgmtSending.end(), conn));
+		conn->nDeadlineMsec = 0;
+	}
+	JetsonReactorMod(&conn->h, EPOLLIN);
+}
+
+//returns msec until the next waiting reply runs out of time
+static int JetsonMgmtExpire(int nMaxWaitMsec)
+{
+	long long now = JetsonNowMsec();
+	int nWaitMsec = nMaxWaitMsec;
+	vector<struct MgmtConn *> expired;
+
+	for (size_t i=0; i<gMgmtSending.size(); i++) {
+		struct MgmtConn *conn = gMgmtSending[i];
+		if (conn->nDeadlineMsec <= now)
+			expired.push_back(conn);
+		else if (conn->nDeadlineMsec - now < nWaitMsec)
+			nWaitMsec = (int)(conn->nDeadlineMsec - now);
+	}
+
+	for (size_t i=0; i<expired.size(); i++) {
+		JetsonWriteLogs("MGMT (%d) reply not read in %d s\n", expired[i]->h.fd, MGMT_SEND_TIMEOUT_SEC);
+		JetsonMgmtConnClose(expired[i]);
+	}
+	return nWaitMsec;
+}
+
+//----- session resume: a session that asked for a token outlives its connection by
+//the engine's resume=s. The engine keeps running; its output is queued (info lines
+//only the latest) and the client gets it, plus whatever it lost in flight, when it
+//comes back with the token through the management port
+
+//tokens are the only thing guarding a detached session, so they come from the
+//kernel's CSPRNG one by one; a client seeing many of them learns nothing of others
+static int JetsonResumeNewToken(unsigned long long *pToken)
+{
+	int nGot = 0;
+	while (nGot < (int)sizeof(*pToken)) {
+		ssize_t n = getrandom((char *)pToken + nGot, sizeof(*pToken) - nGot, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			break;
+		nGot += n;
+	}
+	if (nGot == (int)sizeof(*pToken))
+		return 1;
+
+	//kernel older than getrandom()
+	int fd = open("/dev/urandom", O_RDONLY | O_CLOEXEC);
+	if (fd < 0)
+		return 0;
+	nGot = read(fd, pToken, sizeof(*pToken));
+	close(fd);
+	return (nGot == (int)sizeof(*pToken));
+}
+
+static void JetsonResumeIssueToken(struct ClientEntry *client)
+{
+	int nResumeSec = client->engine->opts.nResumeSec;
+
+	if (nResumeSec <= 0 || client->shared.nState != SHARED_STATE_NONE) {
+		JetsonTraceLogs("Client (%s, %d) asked for a session token, engine(%s) doesn't keep sessions\n",
+			client->sIpAddr, client->sock, client->engine->sEngineName);
+		return;
+	}
+
+	if (client->resume.nToken == 0) {
+		unsigned long long nToken = 0;
+		do {
+			if (!JetsonResumeNewToken(&nToken)) {
+				JetsonErrorLogs("No random bytes for a session token. (%d)\n", errno);
+				return;
+			}
+		} while (nToken == 0 || gResumeTokens.count(nToken));
+		client->resume.nToken = nToken;
+		gResumeTokens[nToken] = client;
+	}
+
+	char sLine[128];
+	snprintf(sLine, sizeof(sLine), RESUME_TOKEN_LINE "%016llx %d %s\n",
+		client->resume.nToken, nResumeSec, gsMgmtPortStr.c_str());
+
+	//offsets count from the end of the token line on both sides; what is still
+	//queued ahead of it is sent before that point
+	JetsonIoBufAppend(&client->sockOut, sLine, strlen(sLine));
+	client->resume.nBytesSent = -(long long)client->sockOut.len;
+	client->resume.nBytesReceived = 0;
+	client->resume.sent.len = 0;
+
+	JetsonWriteLogs("Client (%s, %d) session %u may resume within %d s\n",
+		client->sIpAddr, client->sock, client->nSessionId, nResumeSec);
+}
+
+//connection lost: returns 1 if the session stays for a resume
+static int JetsonResumeDetach(struct ClientEntry *client)
+{
+	if (client->resume.nToken == 0 || client->resume.bDetached || client->bQuitSent ||
+		client->bCloseAfterFlush || client->hRspPipeEvt.fd < 0 || client->hReqPipeEvt.fd < 0 ||
+		client->shared.nState != SHARED_STATE_NONE || gbAgentExiting)
+		return 0;
+
+	JetsonWriteLogs("Client (%s, %d) connection lost, engine(%s) pid=%d kept %d s for a resume\n",
+		client->sIpAddr, client->sock, client->engine->sEngineName, client->nEnginePid,
+		client->engine->opts.nResumeSec);
+
+	//a search joined from another session runs on this session's engine from now on
+	if (client->search.nState == SEARCH_STATE_ATTACHED)
+		JetsonSearchStartOwn(client, client->search.bStopped);
+	else
+		JetsonSearchLeave(client);
+	if (client->nInfoFlushDeadline != 0)
+		JetsonFlushInfoLines(client);
+
+	JetsonReactorClose(&client->hSockEvt);
+
+	pthread_mutex_lock(&gJetsonTableLock);
+	JetsonRegistrySetSock(&gRegistry, client, -1);
+	pthread_mutex_unlock(&gJetsonTableLock);
+
+	client->resume.bDetached = 1;
+	client->resume.nDeadlineMsec = JetsonNowMsec() + client->engine->opts.nResumeSec * 1000LL;
+	client->resume.lastInfo.len = 0;
+	gnDetachedSessions++;
+	return 1;
+}
+
+//detached session is given up, the engine is asked to quit
+static void JetsonResumeEnd(struct ClientEntry *client, const char *sReason)
+{
+	JetsonWriteLogs("Client (%s) session %u not resumed (%s), closing engine(%s)\n",
+		client->sIpAddr, client->nSessionId, sReason, client->engine->sEngineName);
+
+	gResumeTokens.erase(client->resume.nToken);
+	client->resume.nToken = 0;
+	client->resume.bDetached = 0;
+	gnDetachedSessions--;
+
+	JetsonCloseRequestPipe(client);
+
+	pthread_mutex_lock(&gJetsonTableLock);
+	client->bIsConnected = 0;
+	JetsonRegistryRemoveSession(&gRegistry, client);
+	pthread_mutex_unlock(&gJetsonTableLock);
+}
+
+//returns msec until the next detached session runs out of time
+static int JetsonResumeExpire(int nMaxWaitMsec)
+{
+	long long now = JetsonNowMsec();
+	int nWaitMsec = nMaxWaitMsec;
+	vector<struct ClientEntry *> expired;
+
+	for (auto it = gResumeTokens.begin(); it != gResumeTokens.end(); ++it) {
+		struct ClientEntry *client = it->second;
+		if (!client->resume.bDetached)
+			continue;
+		if (client->resume.nDeadlineMsec <= now)
+			expired.push_back(client);
+		else if (client->resume.nDeadlineMsec - now < nWaitMsec)
+			nWaitMsec = (int)(client->resume.nDeadlineMsec - now);
+	}
+
+	for (size_t i=0; i<expired.size(); i++) {
+		JetsonResumeEnd(expired[i], "grace period over");
+		JetsonClientMaybeRelease(expired[i]);
+	}
+	return nWaitMsec;
+}
+
+static void JetsonResumeOnDetachedLine(struct ClientEntry *client, const char *sLine, int len)
+{
+	struct ResumeState *resume = &client->resume;
+
+	if (strncmp(sLine, "info ", 5) == 0 && strncmp(sLine, "info string", 11) != 0) {
+		resume->lastInfo.len = 0;
+		JetsonIoBufAppend(&resume->lastInfo, sLine, len);
+		return;
+	}
+
+	if (client->sockOut.len + resume->lastInfo.len + len > RESUME_MAX_PENDING) {
+		JetsonTraceLogs("Client (%s) detached session %u: output dropped, %d bytes queued\n",
+			client->sIpAddr, client->nSessionId, client->sockOut.len);
+		return;
+	}
+
+	//bestmove and the like go out behind the latest info line, as they came
+	if (resume->lastInfo.len > 0) {
+		JetsonIoBufAppend(&client->sockOut, resume->lastInfo.data, resume->lastInfo.len);
+		resume->lastInfo.len = 0;
+	}
+	JetsonDeliverEngineLine(client, sLine, len);
+}
+
+//"resume <token> <bytes received>" on a management connection, the connection
+//becomes the session's client socket
+static void JetsonResumeAttach(struct ReactorHandle *h, const char *sCmd)
+{
+	unsigned long long nToken = 0;
+	long long nBytesSeen = -1;
+	struct ClientEntry *client = NULL;
+
+	//every token is compared, all the way, so the time taken doesn't tell how
+	//close a guess came or where the match was
+	if (sscanf(sCmd + strlen(RESUME_CMD), "%llx %lld", &nToken, &nBytesSeen) == 2 && nToken != 0) {
+		for (auto &entry : gResumeTokens) {
+			unsigned long long nDiff = entry.first ^ nToken;
+			nDiff |= nDiff >> 32;
+			nDiff |= nDiff >> 16;
+			nDiff |= nDiff >> 8;
+			nDiff |= nDiff >> 4;
+			nDiff |= nDiff >> 2;
+			nDiff |= nDiff >> 1;
+			uintptr_t nMask = (uintptr_t)0 - (uintptr_t)(~nDiff & 1);
+			client = (struct ClientEntry *)(((uintptr_t)entry.second & nMask) | ((uintptr_t)client & ~nMask));
+		}
+		if (client != NULL && !client->resume.bDetached)
+			client = NULL;
+	}
+
+	if (client == NULL) {
+		JetsonWriteLogs("MGMT (%d) resume of an unknown or live session refused\n", h->fd);
+		JetsonMgmtSend(h->fd, RESUME_FAILED, strlen(RESUME_FAILED));
+		((struct MgmtConn *)h->owner)->bCloseAfterFlush = 1;
+		return;
+	}
+
+	int fd = JetsonMgmtConnHandOver((struct MgmtConn *)h->owner);
+	int nodelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	//what the client lost in flight goes first, from the replay buffer; if it
+	//reaches back further than the buffer, the replay starts at a line boundary
+	struct ResumeState *resume = &client->resume;
+	long long nReplay = resume->nBytesSent - (nBytesSeen < 0 ? 0 : nBytesSeen);
+	if (nReplay < 0)
+		nReplay = 0;
+	if (nReplay > resume->sent.len) {
+		const char *pStart = resume->sent.data;
+		const char *pEol = (const char *)memchr(pStart, '\n', resume->sent.len);
+		nReplay = (pEol != NULL ? resume->sent.len - (pEol + 1 - pStart) : 0);
+		JetsonWriteLogs("Client (%s) session %u: %lld bytes lost, replay starts at a line boundary\n",
+			client->sIpAddr, client->nSessionId, resume->nBytesSent - nBytesSeen - nReplay);
+	}
+
+	struct IoBuffer out = { NULL, 0, 0 };
+	JetsonIoBufAppend(&out, resume->sent.data + resume->sent.len - nReplay, (int)nReplay);
+	JetsonIoBufAppend(&out, client->sockOut.data, client->sockOut.len);
+	JetsonIoBufAppend(&out, resume->lastInfo.data, resume->lastInfo.len);
+	JetsonIoBufFree(&client->sockOut);
+	client->sockOut = out;
+	resume->sent.len -= (int)nReplay;
+	resume->nBytesSent -= nReplay;
+	resume->lastInfo.len = 0;
+
+	//a command cut off by the drop is sent again by the client in full
+	JetsonFramerReset(&client->reqFramer);
+
+	char sReply[64];
+	snprintf(sReply, sizeof(sReply), RESUME_OK "%lld %lld\n", resume->nBytesSent, resume->nBytesReceived);
+	send(fd, sReply, strlen(sReply), MSG_NOSIGNAL);
+
+	pthread_mutex_lock(&gJetsonTableLock);
+	JetsonRegistrySetSock(&gRegistry, client, fd);
+	strncpy(client->sServIpAddr, GetServIp(fd), sizeof(client->sServIpAddr) - 1);
+	pthread_mutex_unlock(&gJetsonTableLock);
+
+	resume->bDetached = 0;
+	gnDetachedSessions--;
+	JetsonReactorAdd(&client->hSockEvt, RH_TYPE_CLIENT_SOCK, fd, client, EPOLLIN);
+	JetsonWriteLogs("Client (%s, %d) session %u resumed, %lld bytes replayed, %d queued\n",
+		client->sIpAddr, fd, client->nSessionId, nReplay, client->sockOut.len - (int)nReplay);
+
+	JetsonOnClientWritable(client);
+	JetsonClientUpdateEvents(client);
+}
+
+//----- shared mode: the engine's sessions have no process of their own. The
+//agent keeps their options and position and replays them on a free worker
+//before each go; the worker's output goes to that session until bestmove.
+static void JetsonSharedSend(struct ClientEntry *worker, const string &sCmds)
+{
+	if (worker->hReqPipeEvt.fd < 0)
+		return;
+
+	JetsonIoBufAppend(&worker->pipeOut, sCmds.c_str(), sCmds.length());
+	if (!JetsonFlushRequestPipe(worker)) {
+		JetsonErrorLogs("<<< ERROR on shared worker (%s): write failed (%d)\n", worker->sEngInstName, errno);
+		JetsonCloseRequestPipe(worker);
+	}
+	JetsonClientUpdateEvents(worker);
+}
+
+static void JetsonSharedCount(struct EngineEntry *engEntry, int *pnWarming, int *pnIdle, int *pnBusy)
+{
+	*pnWarming = *pnIdle = *pnBusy = 0;
+
+	for (int i=0; i<engEntry->nInsts; i++) {
+		struct ClientEntry *thisClient = engEntry->insts[i];
+		if (!thisClient->bIsEngineRunning || !thisClient->shared.bIsWorker)
+			continue;
+
+		if (thisClient->shared.nState == SHARED_STATE_WARMING)
+			(*pnWarming)++;
+		else if (thisClient->shared.nState == SHARED_STATE_IDLE)
+			(*pnIdle)++;
+		else if (thisClient->shared.nState == SHARED_STATE_BUSY)
+			(*pnBusy)++;
+	}
+}
+
+static int JetsonSessionCount(struct EngineEntry *engEntry)
+{
+	int nSessions = 0;
+	for (int i=0; i<engEntry->nClients; i++)
+		nSessions += engEntry->clients[i]->bIsConnected;
+	return nSessions;
+}
+
+//no worker is left and none is started until a reload: sessions waiting for
+//uciok or a bestmove would wait forever, so they are told and closed
+static void JetsonSharedFailSessions(struct EngineEntry *engEntry)
+{
+	string sInfo = string("info string ") + engEntry->sEngineName + " is unavailable, its engine failed to start\n";
+
+	for (int i=0; i<engEntry->nClients; i++) {
+		struct ClientEntry *session = engEntry->clients[i];
+		if (!session->bIsConnected || session->hSockEvt.fd < 0 || session->bCloseAfterFlush)
+			continue;
+
+		JetsonWriteLogs("Client (%s, %d) closed, no shared worker for engine (%s)\n",
+			session->sIpAddr, session->sock, engEntry->sEngineName);
+		JetsonIoBufAppend(&session->sockOut, sInfo.c_str(), sInfo.length());
+		session->bCloseAfterFlush = 1;
+		JetsonOnClientWritable(session);
+	}
+}
+
+static void JetsonSharedRefill(struct EngineEntry *engEntry)
+{
+	if (engEntry->pShared == NULL)
+		return;
+	if (engEntry->bDraining && JetsonSessionCount(engEntry) == 0)
+		return;
+
+	int nWarming, nIdle, nBusy;
+	JetsonSharedCount(engEntry, &nWarming, &nIdle, &nBusy);
+	if (engEntry->nPoolFailures >= POOL_MAX_FAILURES) {
+		JetsonWriteLogs("Shared workers for engine (%s) not restarted after %d failed warm-ups\n",
+			engEntry->sEngineName, engEntry->nPoolFailures);
+		if (nWarming + nIdle + nBusy == 0)
+			JetsonSharedFailSessions(engEntry);
+		return;
+	}
+
+	for (int n = nWarming + nIdle + nBusy; n < engEntry->opts.nSharedWorkers; n++) {
+		struct ClientEntry *worker = JetsonSpawnAgentInstance(engEntry, "shared");
+		if (worker == NULL)
+			return;
+
+		worker->shared.bIsWorker = 1;
+		worker->shared.nState = SHARED_STATE_WARMING;
+	}
+}
+
+static void JetsonSharedRetire(struct ClientEntry *worker)
+{
+	JetsonWriteLogs("Shared worker (%s) pid=%d retired\n", worker->sEngInstName, worker->nEnginePid);
+
+	//still a worker, so its exit is handled, but neither warming nor running a go
+	worker->shared.nState = SHARED_STATE_NONE;
+	worker->shared.pPeer = NULL;
+	JetsonCloseRequestPipe(worker);
+}
+
+//replay the session's options and position on the worker, then its go
+static void JetsonSharedRun(struct ClientEntry *worker, struct ClientEntry *session)
+{
+	struct SharedEngine *shared = session->engine->pShared;
+	long long now = JetsonNowMsec();
+
+	string sWorkerOpts(worker->shared.options.data, worker->shared.options.len);
+	string sSessionOpts(session->shared.options.data, session->shared.options.len);
+	string sCmds = JetsonOptionsSwitch(shared, sWorkerOpts, sSessionOpts);
+
+	worker->shared.options.len = 0;
+	JetsonIoBufAppend(&worker->shared.options, sSessionOpts.c_str(), sSessionOpts.length());
+
+	if (session->shared.bNewGame)
+		sCmds += "ucinewgame\n";
+	sCmds.append(session->shared.position.data, session->shared.position.len);
+	sCmds.append(session->shared.goCmd.data, session->shared.goCmd.len);
+	if (session->shared.bStopNow)
+		sCmds += "stop\n";
+	else if (session->shared.bPonderHit)
+		sCmds += "ponderhit\n";
+
+	session->shared.bNewGame = 0;
+	session->shared.bStopNow = 0;
+	session->shared.bPonderHit = 0;
+	session->shared.nState = SHARED_STATE_BUSY;
+	session->shared.pPeer = worker;
+	worker->shared.nState = SHARED_STATE_BUSY;
+	worker->shared.pPeer = session;
+	worker->shared.nStartMsec = now;
+	worker->shared.bPreempting = 0;
+
+	long long nWaitMsec = now - session->shared.nQueuedMsec;
+	shared->nDispatched++;
+	shared->nWaitMsecTotal += nWaitMsec;
+	if (nWaitMsec > shared->nWaitMsecMax)
+		shared->nWaitMsecMax = nWaitMsec;
+
+	JetsonTraceLogs("Client (%s, %d) go runs on shared worker (%s) after %lld ms in queue\n",
+		session->sIpAddr, session->sock, worker->sEngInstName, nWaitMsec);
+	JetsonSharedSend(worker, sCmds);
+}
+
+static void JetsonSharedDispatch(struct EngineEntry *engEntry)
+{
+	struct SharedEngine *shared = engEntry->pShared;
+
+	while (!shared->runQueue.empty()) {
+		struct ClientEntry *session = shared->runQueue.front();
+		struct ClientEntry *worker = NULL;
+
+		//a worker already set up with the session's options saves reloading them
+		for (int i=0; i<engEntry->nInsts; i++) {
+			struct ClientEntry *thisClient = engEntry->insts[i];
+			if (!thisClient->bIsEngineRunning || !thisClient->shared.bIsWorker ||
+				thisClient->shared.nState != SHARED_STATE_IDLE || thisClient->hReqPipeEvt.fd < 0)
+				continue;
+
+			if (worker == NULL || (thisClient->shared.options.len == session->shared.options.len &&
+				memcmp(thisClient->shared.options.data, session->shared.options.data, session->shared.options.len) == 0))
+				worker = thisClient;
+		}
+		if (worker == NULL)
+			return;
+
+		shared->runQueue.pop_front();
+		JetsonSharedRun(worker, session);
+	}
+}
+
+static void JetsonSharedDequeue(struct ClientEntry *session)
+{
+	std::deque<struct ClientEntry *> &runQueue = session->engine->pShared->runQueue;
+	for (size_t i=0; i<runQueue.size(); i++) {
+		if (runQueue[i] == session) {
+			runQueue.erase(runQueue.begin() + i);
+			break;
+		}
+	}
+}
+
+static void JetsonSharedEnqueue(struct ClientEntry *session, int bStopNow)
+{
+	struct SharedEngine *shared = session->engine->pShared;
+
+	session->shared.bStopNow = bStopNow;
+	session->shared.bPonderHit = 0;
+	session->shared.sPvMove[0] = '\0';
+	session->shared.nQueuedMsec = JetsonNowMsec();
+	if (session->shared.nState != SHARED_STATE_QUEUED) {
+		session->shared.nState = SHARED_STATE_QUEUED;
+		shared->runQueue.push_back(session);
+	}
+	JetsonSharedDispatch(session->engine);
+}
+
+//session goes away: its queued go is dropped, a running one is stopped and its output discarded
+static void JetsonSharedLeave(struct ClientEntry *session)
+{
+	if (session->shared.nState == SHARED_STATE_QUEUED)
+		JetsonSharedDequeue(session);
+	else if (session->shared.nState == SHARED_STATE_BUSY) {
+		struct ClientEntry *worker = session->shared.pPeer;
+		worker->shared.pPeer = NULL;
+		if (!worker->shared.bPreempting)
+			JetsonSharedSend(worker, "stop\n");
+	}
+
+	if (session->shared.nState != SHARED_STATE_NONE)
+		session->shared.nState = SHARED_STATE_IDLE;
+	session->shared.pPeer = NULL;
+}
+
+static void JetsonSharedWorkerGone(struct ClientEntry *worker)
+{
+	struct EngineEntry *engEntry = worker->engine;
+	struct ClientEntry *session = worker->shared.pPeer;
+
+	if (worker->shared.nState == SHARED_STATE_WARMING)
+		engEntry->nPoolFailures++;
+	if (engEntry->pShared->pUciWorker == worker && !engEntry->pShared->bUciReplyDone) {
+		engEntry->pShared->sUciReply.clear();
+		engEntry->pShared->pUciWorker = NULL;
+	}
+
+	//the go starts over on another worker, ahead of everyone else
+	if (session != NULL) {
+		JetsonWriteLogs("Client (%s, %d) lost shared worker (%s), go is queued again\n",
+			session->sIpAddr, session->sock, worker->sEngInstName);
+		session->shared.pPeer = NULL;
+		session->shared.nState = SHARED_STATE_QUEUED;
+		session->shared.nQueuedMsec = JetsonNowMsec();
+		engEntry->pShared->runQueue.push_front(session);
+	}
+
+	worker->shared.nState = SHARED_STATE_NONE;
+	worker->shared.pPeer = NULL;
+	JetsonSharedRefill(engEntry);
+	JetsonSharedDispatch(engEntry);
+}
+
+static void JetsonSharedSendUci(struct ClientEntry *session)
+{
+	istringstream iss(session->engine->pShared->sUciReply);
+	string sLine;
+
+	while (getline(iss, sLine)) {
+		sLine += "\n";
+		JetsonRelayEngineLine(session, sLine.c_str(), sLine.length());
+	}
+	session->shared.bUciPending = 0;
+
+	if (session->shared.bReadyPending) {
+		JetsonRelayEngineLine(session, "readyok\n", 8);
+		session->shared.bReadyPending = 0;
+	}
+}
+
+//output of a worker: warm-up answers, then the searches it runs for sessions
+static void JetsonOnSharedWorkerLine(struct ClientEntry *worker, const char *sLine, int len)
+{
+	struct EngineEntry *engEntry = worker->engine;
+	struct SharedEngine *shared = engEntry->pShared;
+
+	if (worker->shared.nState == SHARED_STATE_WARMING) {
+		if (!shared->bUciReplyDone && shared->pUciWorker == NULL)
+			shared->pUciWorker = worker;
+		if (!shared->bUciReplyDone && shared->pUciWorker == worker && strncmp(sLine, "readyok", 7) != 0) {
+			shared->sUciReply.append(sLine, len);
+			shared->bUciReplyDone = (strncmp(sLine, "uciok", 5) == 0);
+		}
+		if (strncmp(sLine, "readyok", 7) != 0)
+			return;
+
+		engEntry->nPoolFailures = 0;
+		worker->shared.nState = SHARED_STATE_IDLE;
+		JetsonWriteLogs("Shared worker (%s) pid=%d is ready\n", worker->sEngInstName, worker->nEnginePid);
+
+		for (int i=0; i<engEntry->nClients && shared->bUciReplyDone; i++) {
+			struct ClientEntry *session = engEntry->clients[i];
+			if (session->bIsConnected && session->shared.bUciPending) {
+				JetsonSharedSendUci(session);
+				JetsonOnClientWritable(session);
+			}
+		}
+		JetsonSharedDispatch(engEntry);
+		return;
+	}
+
+	if (worker->shared.nState != SHARED_STATE_BUSY)
+		return;
+
+	struct ClientEntry *session = worker->shared.pPeer;
+	int bBestMove = (strncmp(sLine, "bestmove", 8) == 0);
+
+	if (session != NULL && !(bBestMove && worker->shared.bPreempting)) {
+		//first move of the main line answers a stop that comes while the session is queued
+		const char *sPv = strstr(sLine, " pv ");
+		const char *sMultiPv = strstr(sLine, " multipv ");
+		if (strncmp(sLine, "info ", 5) == 0 && sPv != NULL && (sMultiPv == NULL || atoi(sMultiPv + 9) == 1))
+			sscanf(sPv + 4, "%15s", session->shared.sPvMove);
+
+		if (session->hSockEvt.fd >= 0)
+			JetsonDeliverEngineLine(session, sLine, len);
+	}
+
+	if (!bBestMove)
+		return;
+
+	if (session != NULL) {
+		session->shared.pPeer = NULL;
+		if (worker->shared.bPreempting) {
+			//analysis goes on later, behind the sessions that were waiting
+			session->shared.nState = SHARED_STATE_QUEUED;
+			session->shared.nQueuedMsec = JetsonNowMsec();
+			shared->runQueue.push_back(session);
+		}
+		else
+			session->shared.nState = SHARED_STATE_IDLE;
+
+		if (session->hSockEvt.fd >= 0)
+			JetsonOnClientWritable(session);
+	}
+
+	worker->shared.nState = SHARED_STATE_IDLE;
+	worker->shared.pPeer = NULL;
+	worker->shared.bPreempting = 0;
+
+	//started with arguments a reload has since changed, or one worker too many
+	int nWarming, nIdle, nBusy;
+	JetsonSharedCount(engEntry, &nWarming, &nIdle, &nBusy);
+	if (worker->nConfigGen != engEntry->nConfigGen || nWarming + nIdle + nBusy > engEntry->opts.nSharedWorkers) {
+		JetsonSharedRetire(worker);
+		JetsonSharedRefill(engEntry);
+	}
+	JetsonSharedDispatch(engEntry);
+}
+
+//a go infinite that held its worker for a whole slice is stopped while others wait,
+//returns msec until the next one is due
+static int JetsonSharedPreempt(int nMaxWaitMsec)
+{
+	long long now = JetsonNowMsec();
+	int nWaitMsec = nMaxWaitMsec;
+
+	for (size_t i=0; i<gRegistry.engines.size(); i++) {
+		struct EngineEntry *thisEng = gRegistry.engines[i];
+		if (thisEng->pShared == NULL || thisEng->opts.nSliceMsec <= 0 ||
+			thisEng->pShared->runQueue.empty())
+			continue;
+
+		//one worker for each go that waits, counting those already being stopped
+		size_t nFreeing = 0;
+		for (int j=0; j<thisEng->nInsts; j++)
+			nFreeing += (thisEng->insts[j]->shared.bIsWorker && thisEng->insts[j]->shared.bPreempting);
+
+		for (int j=0; j<thisEng->nInsts && nFreeing < thisEng->pShared->runQueue.size(); j++) {
+			struct ClientEntry *worker = thisEng->insts[j];
+			struct ClientEntry *session = worker->shared.pPeer;
+			if (!worker->shared.bIsWorker || worker->shared.nState != SHARED_STATE_BUSY ||
+				session == NULL || worker->shared.bPreempting)
+				continue;
+
+			struct GoLimits limits;
+			string sGo(session->shared.goCmd.data, session->shared.goCmd.len);
+			JetsonParseGoLimits(sGo.c_str(), &limits);
+			if (!limits.bInfinite)
+				continue;
+
+			long long nLeftMsec = worker->shared.nStartMsec + thisEng->opts.nSliceMsec - now;
+			if (nLeftMsec > 0) {
+				if (nLeftMsec < nWaitMsec)
+					nWaitMsec = (int)nLeftMsec;
+				continue;
+			}
+
+			JetsonTraceLogs("Client (%s, %d) analysis on shared worker (%s) yields to queued sessions\n",
+				session->sIpAddr, session->sock, worker->sEngInstName);
+			thisEng->pShared->nPreempted++;
+			worker->shared.bPreempting = 1;
+			nFreeing++;
+			JetsonSharedSend(worker, "stop\n");
+		}
+	}
+	return nWaitMsec;
+}
+
+//UCI command from a session in shared mode, nothing is written to an engine here
+static void JetsonOnSharedCommand(struct ClientEntry *session, const char *sLine, int len)
+{
+	struct SharedEngine *shared = session->engine->pShared;
+	struct ClientEntry *worker = session->shared.pPeer;
+
+	if (strncmp(sLine, "uci", 3) == 0 && (sLine[3] == '\r' || sLine[3] == '\n' || sLine[3] == ' ')) {
+		if (shared->bUciReplyDone)
+			JetsonSharedSendUci(session);
+		else
+			session->shared.bUciPending = 1;
+	}
+	else if (strncmp(sLine, "isready", 7) == 0) {
+		if (session->shared.bUciPending)
+			session->shared.bReadyPending = 1;
+		else
+			JetsonRelayEngineLine(session, "readyok\n", 8);
+	}
+	else if (strncmp(sLine, "setoption", 9) == 0) {
+		string sOptions(session->shared.options.data, session->shared.options.len);
+		JetsonOptionsSet(sOptions, string(sLine, len));
+		session->shared.options.len = 0;
+		JetsonIoBufAppend(&session->shared.options, sOptions.c_str(), sOptions.length());
+	}
+	else if (strncmp(sLine, "ucinewgame", 10) == 0)
+		session->shared.bNewGame = 1;
+	else if (strncmp(sLine, "position ", 9) == 0) {
+		session->shared.position.len = 0;
+		JetsonIoBufAppend(&session->shared.position, sLine, len);
+	}
+	else if (strncmp(sLine, "go", 2) == 0) {
+		if (session->shared.nState == SHARED_STATE_BUSY) {
+			JetsonTraceLogs("Client (%s, %d) sent go while searching, ignored\n", session->sIpAddr, session->sock);
+			return;
+		}
+		session->shared.goCmd.len = 0;
+		JetsonIoBufAppend(&session->shared.goCmd, sLine, len);
+		JetsonSharedEnqueue(session, 0);
+	}
+	else if (strncmp(sLine, "stop", 4) == 0) {
+		if (session->shared.nState == SHARED_STATE_BUSY) {
+			if (worker->shared.bPreempting)
+				worker->shared.bPreempting = 0;		//its bestmove now goes to the client
+			else
+				JetsonSharedSend(worker, "stop\n");
+		}
+		else if (session->shared.nState == SHARED_STATE_QUEUED) {
+			if (session->shared.sPvMove[0] != '\0') {
+				//preempted analysis, its last main line answers at once
+				string sBestMove = string("bestmove ") + session->shared.sPvMove + "\n";
+				JetsonSharedDequeue(session);
+				session->shared.nState = SHARED_STATE_IDLE;
+				JetsonSearchLeave(session);
+				JetsonRelayEngineLine(session, sBestMove.c_str(), sBestMove.length());
+			}
+			else {
+				JetsonSharedDequeue(session);
+				shared->runQueue.push_front(session);
+				session->shared.bStopNow = 1;
+				JetsonSharedDispatch(session->engine);
+			}
+		}
+	}
+	else if (strncmp(sLine, "ponderhit", 9) == 0) {
+		if (session->shared.nState == SHARED_STATE_BUSY)
+			JetsonSharedSend(worker, "ponderhit\n");
+		else if (session->shared.nState == SHARED_STATE_QUEUED)
+			session->shared.bPonderHit = 1;
+	}
+	else if (strncmp(sLine, "quit", 4) == 0) {
+		if (session->sockOut.len == 0)
+			JetsonCloseClientSock(session);
+		else {
+			session->bCloseAfterFlush = 1;
+			JetsonClientUpdateEvents(session);
+		}
+	}
+}
+
+//----- position delta, see POSITION_DELTA_CMD: the session keeps its last position
+//command so one that only adds moves can be sent as those moves
+static void JetsonPositionRemember(struct ClientEntry *client, string &sLine)
+{
+	client->nLastPositionMoves = JetsonPositionNormalize(sLine);
+	client->lastPosition.len = 0;
+	JetsonIoBufAppend(&client->lastPosition, sLine.c_str(), sLine.length());
+}
+
+//full position command for a delta, 0 if it doesn't follow the one kept, -1 if the
+//command would grow past FRAMER_MAX_CMD_BUFSIZE, the limit on a full command sent as is
+static int JetsonPositionFromDelta(struct ClientEntry *client, const char *sLine, string &sFull)
+{
+	const char *sArgs = sLine + strlen(POSITION_DELTA_CMD);
+	char *sEnd;
+	long nMoves = strtol(sArgs, &sEnd, 10);
+	if (client->lastPosition.len == 0 || sEnd == sArgs || nMoves != client->nLastPositionMoves)
+		return 0;
+
+	//only the added moves are looked at, the kept command is just copied
+	string sAdded = sEnd;
+	size_t end = sAdded.find_last_not_of(" \t\r\n");
+	sAdded.erase(end == string::npos ? 0 : end + 1);
+	int nAdded = JetsonCountMoves(sAdded.c_str());
+	size_t nFullLen = client->lastPosition.len + (nMoves == 0 ? 6 : 0) + sAdded.length() + 1;
+	if (nAdded > 0 && nFullLen > FRAMER_MAX_CMD_BUFSIZE)
+		return -1;
+
+	sFull.assign(client->lastPosition.data, client->lastPosition.len);
+	if (nAdded > 0)
+		sFull += (nMoves == 0 ? " moves" : "") + sAdded;
+	client->nLastPositionMoves += nAdded;
+	client->lastPosition.len = 0;
+	JetsonIoBufAppend(&client->lastPosition, sFull.c_str(), sFull.length());
+	sFull += "\n";
+	return 1;
+}
+
+static void JetsonOnClientReadable(struct ClientEntry *client)
+{
+	int space = 0;
+	char *sRecvPtr = JetsonFramerWritePtr(&client->reqFramer, &space);
+
+	int bytesReceived = recv(client->sock, sRecvPtr, space, 0);
+	if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+
+	if (bytesReceived < 1) {
+		JetsonCloseClientSock(client);
+		return;
+	}
+	JetsonFramerCommit(&client->reqFramer, bytesReceived);
+	JetsonMetricsOnClientBytes(client, bytesReceived, 0);
+
+	static vector<char> cmdBuf;		//reactor thread only
+	int cbLineBytes = (JetsonFrameClientBytes(client, sRecvPtr, bytesReceived) ?
+		JetsonNextClientCmd(client, cmdBuf) : FRAMER_LINE_TOO_LONG);
+
+	for (; cbLineBytes > 0; cbLineBytes = JetsonNextClientCmd(client, cmdBuf)) {
+		char *sockReadBuf = cmdBuf.data();
+		sockReadBuf[cbLineBytes] = '\0';
+		client->resume.nBytesReceived += cbLineBytes;
+		if (cbLineBytes == 1)
+			continue;		//blank line, e.g. the '\n' of a command already ended as sent alone
+
+		//from here on a delta is the full position command it stands for
+		string sPosition;
+		if (client->bPositionDelta && strncmp(sockReadBuf, POSITION_DELTA_CMD, strlen(POSITION_DELTA_CMD)) == 0) {
+			int rc = JetsonPositionFromDelta(client, sockReadBuf, sPosition);
+			if (rc <= 0) {
+				JetsonWriteLogs("Client (%s, %d) sent a position delta that %s, closing\n",
+					client->sIpAddr, client->sock,
+					(rc < 0 ? "makes the position command too long" : "doesn't follow its last position"));
+				JetsonCloseClientSock(client);
+				return;
+			}
+			sockReadBuf = &sPosition[0];
+			cbLineBytes = (int)sPosition.length();
+		}
+		else if (client->bPositionDelta && strncmp(sockReadBuf, "position ", 9) == 0) {
+			sPosition = sockReadBuf;
+			JetsonPositionRemember(client, sPosition);
+		}
+		JetsonTraceLogs("Client (%s, %d, %s, %s) received UCI cmd >> %s",
+			client->sIpAddr, client->sock, client->engine->sEngineName, client->sServIpAddr, sockReadBuf);
+		JetsonMetricsOnCommand(client, sockReadBuf);
+
+		if (JetsonOnAgentOption(client, sockReadBuf))
+			continue;
+
+		//a pooled instance goes back to the pool only if its options are still the defaults
+		if (strncmp(sockReadBuf, "setoption", 9) == 0) {
+			client->bOptionsChanged = 1;
+			JetsonOnOptionsLine(client, sockReadBuf, cbLineBytes);
+		}
+		else if (strncmp(sockReadBuf, "quit", 4) == 0)
+			client->bQuitSent = 1;
+		else if (strncmp(sockReadBuf, "uci", 3) == 0 && (sockReadBuf[3] == '\r' || sockReadBuf[3] == '\n'))
+			client->bSpliceReady = 0;		//id name has to be rewritten again
+		else if (strncmp(sockReadBuf, "position ", 9) == 0)
+			client->nPositionKey = JetsonPositionKeyFromCmd(sockReadBuf);
+		else if (strncmp(sockReadBuf, "go", 2) == 0 && (sockReadBuf[2] == ' ' || sockReadBuf[2] == '\r' || sockReadBuf[2] == '\n')) {
+			if (JetsonOnGoCmd(client, sockReadBuf, cbLineBytes))
+				continue;
+		}
+		else if (strncmp(sockReadBuf, "stop", 4) == 0) {
+			if (JetsonOnStopCmd(client))
+				continue;
+		}
+
+		if (client->shared.nState != SHARED_STATE_NONE) {
+			JetsonOnSharedCommand(client, sockReadBuf, cbLineBytes);
+			if (client->hSockEvt.fd < 0)
+				return;
+			continue;
+		}
+
+		if (client->hReqPipeEvt.fd >= 0) {
+			JetsonIoBufAppend(&client->pipeOut, sockReadBuf, cbLineBytes);
+			client->nReadyPending += (strncmp(sockReadBuf, "isready", 7) == 0);
+			client->bUciokPending |= (strncmp(sockReadBuf, "uci", 3) == 0 && (sockReadBuf[3] == '\r' || sockReadBuf[3] == '\n'));
+		}
+	}
+
+	if (cbLineBytes == FRAMER_LINE_TOO_LONG) {
+		JetsonWriteLogs("Client (%s, %d) sent a command longer than %d bytes, closing\n",
+			client->sIpAddr, client->sock, FRAMER_MAX_CMD_BUFSIZE);
+		JetsonCloseClientSock(client);
+		return;
+	}
+
+	//answers from the analysis cache
+	if (client->sockOut.len > 0)
+		JetsonOnClientWritable(client);
+
+	if (client->hReqPipeEvt.fd < 0)
+		return;
+
+	if (!JetsonFlushRequestPipe(client)) {
+		JetsonErrorLogs("<<< ERROR on eng_i_req for Client (%s, %d): write failed (%d)\n",
+			client->sIpAddr, client->sock, errno);
+		JetsonCloseRequestPipe(client);
+	}
+	JetsonClientUpdateEvents(client);
+}
+
+static void JetsonOnRequestPipeWritable(struct ClientEntry *client)
+{
+	if (!JetsonFlushRequestPipe(client)) {
+		JetsonErrorLogs("<<< ERROR on eng_i_req for Client (%s, %d): write failed (%d)\n",
+			client->sIpAddr, client->sock, errno);
+		JetsonCloseRequestPipe(client);
+	}
+	JetsonClientUpdateEvents(client);
+}
+
+//flushes sessions whose deadline passed, returns msec until the next one is due
+static int JetsonFlushDueInfoLines(int nMaxWaitMsec)
+{
+	long long now = JetsonNowMsec();
+	int nWaitMsec = nMaxWaitMsec;
+	size_t nArmed = 0;
+
+	for (size_t i=0; i<gInfoFlushClients.size(); i++) {
+		struct ClientEntry *client = gInfoFlushClients[i];
+
+		if (client->nInfoFlushDeadline != 0 && client->nInfoFlushDeadline <= now) {
+			JetsonFlushInfoLines(client);
+			JetsonOnClientWritable(client);
+		}
+
+		if (client->nInfoFlushDeadline == 0) {
+			client->bInfoTimerArmed = 0;
+			continue;
+		}
+
+		if (client->nInfoFlushDeadline - now < nWaitMsec)
+			nWaitMsec = (int)(client->nInfoFlushDeadline - now);
+		gInfoFlushClients[nArmed++] = client;
+	}
+	gInfoFlushClients.resize(nArmed);
+
+	return nWaitMsec;
+}
+
+//----- splice=1: past uciok the line path only rewrites what a filter asks for. While
+//none is active (info coalescing, cache or store search, resume replay, unsent bytes)
+//engine output moves from its stdout pipe to the socket in the kernel.
+//Returns 0 if the copy path has to read this time, e.g. the socket is full
+#define SPLICE_CHUNK (64 * 1024)
+
+static int JetsonSpliceEngineOutput(struct ClientEntry *client)
+{
+	if (!client->bSpliceReady || client->bSpliceOff || client->nPoolState != POOL_STATE_NONE ||
+		client->shared.bIsWorker || client->resume.bDetached || client->resume.nToken != 0 ||
+		client->hSockEvt.fd < 0 || client->bCloseAfterFlush || client->sockOut.len > 0 ||
+		client->nInfoRateMsec > 0 || client->nInfoFlushDeadline != 0 ||
+		client->search.nState != SEARCH_STATE_NONE || client->search.heldReply.len > 0)
+		return 0;
+
+	//a line the copy path left half read goes out as it is, ahead of its rest
+	if (JetsonFramerUsed(&client->rspFramer) > 0) {
+		char sPartial[FRAMER_BUFSIZE+1];
+		int len = JetsonFramerDrain(&client->rspFramer, sPartial, FRAMER_BUFSIZE);
+		JetsonIoBufAppend(&client->sockOut, sPartial, len);
+		if (!JetsonFlushClientSock(client)) {
+			JetsonCloseClientSock(client);
+			return 1;
+		}
+		if (client->sockOut.len > 0)
+			return 0;
+	}
+
+	long long nBytes = 0;
+	while (1) {
+		ssize_t n = splice(client->hRspPipeEvt.fd, NULL, client->hSockEvt.fd, NULL, SPLICE_CHUNK,
+			SPLICE_F_MOVE | SPLICE_F_NONBLOCK);
+		if (n > 0) {
+			nBytes += n;
+			JetsonMetricsOnClientBytes(client, 0, n);
+			continue;
+		}
+		if (n == 0) {
+			JetsonCloseResponsePipe(client);
+			return 1;
+		}
+		if (errno == EINTR)
+			continue;
+		if (errno == EAGAIN || errno == EWOULDBLOCK)
+			return (nBytes > 0);	//pipe drained, or the socket is full and copying buffers it
+		if (errno == EINVAL || errno == ENOSYS) {
+			JetsonWriteLogs("Client (%s, %d): splice not supported, engine output is copied. (%d)\n",
+				client->sIpAddr, client->sock, errno);
+			client->bSpliceOff = 1;
+			return (nBytes > 0);
+		}
+		JetsonCloseClientSock(client);
+		return 1;
+	}
+}
+
+static void JetsonOnResponsePipeReadable(struct ClientEntry *client)
+{
+	if (JetsonSpliceEngineOutput(client))
+		return;
+
+	int space = 0;
+	char *pipeReadBuf = JetsonFramerWritePtr(&client->rspFramer, &space);
+
+	int cbBytesRead = read(client->hRspPipeEvt.fd, pipeReadBuf, space);
+	if (cbBytesRead < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+
+	if (cbBytesRead <= 0) {
+		JetsonCloseResponsePipe(client);
+		return;
+	}
+	JetsonFramerCommit(&client->rspFramer, cbBytesRead);
+
+	char sLine[FRAMER_BUFSIZE+1];
+	int cbLineBytes;
+	while ((cbLineBytes = JetsonFramerNextLine(&client->rspFramer, sLine, FRAMER_BUFSIZE)) != FRAMER_NEED_MORE) {
+		//an engine line that doesn't fit is passed on in pieces
+		if (cbLineBytes == FRAMER_LINE_TOO_LONG)
+			cbLineBytes = JetsonFramerDrain(&client->rspFramer, sLine, FRAMER_BUFSIZE);
+		sLine[cbLineBytes] = '\0';
+
+		if (client->nPoolState != POOL_STATE_NONE) {
+			JetsonOnPoolLine(client, sLine);
+			continue;
+		}
+		if (client->nReadyPending > 0 && strncmp(sLine, "readyok", 7) == 0) {
+			client->nReadyPending--;
+			if (JetsonSearchReleaseHeld(client))
+				continue;
+		}
+		if (client->bUciokPending && strncmp(sLine, "uciok", 5) == 0)
+			client->bUciokPending = 0;
+
+		if (client->shared.bIsWorker) {
+			JetsonOnSharedWorkerLine(client, sLine, cbLineBytes);
+			continue;
+		}
+
+		if (client->resume.bDetached) {
+			JetsonResumeOnDetachedLine(client, sLine, cbLineBytes);
+			continue;
+		}
+
+		if (client->hSockEvt.fd < 0 || client->bCloseAfterFlush)
+			continue;
+
+		JetsonDeliverEngineLine(client, sLine, cbLineBytes);
+	}
+
+	if (client->hSockEvt.fd >= 0 && client->sockOut.len > 0)
+		JetsonOnClientWritable(client);
+
+	//session served by a worker, bestmove already flushed its output
+	struct ClientEntry *session = (client->shared.bIsWorker ? client->shared.pPeer : NULL);
+	if (session != NULL && session->hSockEvt.fd >= 0 && session->sockOut.len > 0)
+		JetsonOnClientWritable(session);
+}
+
+static void JetsonMgmtCommand(SOCKET sock, const char *sCmd)
+{
+	if (strncmp(sCmd, "scan", 4) == 0) {
+		string sScan = JetsonRenderScan(GetServIp(sock));
+		JetsonMgmtSend(sock, sScan.c_str(), sScan.length());
+	}
+	else if (strcmp(sCmd, "query") == 0)
+		JetsonQueryEngines(sock);
+	else if (strcmp(sCmd, "stats") == 0) {
+		string sStats = JetsonRenderStats() + "# statsdone\n";
+		JetsonMgmtSend(sock, sStats.c_str(), sStats.length());
+	}
+	else if (strcmp(sCmd, "reload") == 0)
+		JetsonReloadEngines(sock);
+	else if (strncmp(sCmd, LOAD_CMD, strlen(LOAD_CMD)) == 0) {
+		char sEngName[MAX_NAME_LEN];
+		if (sscanf(sCmd + strlen(LOAD_CMD), "%63s", sEngName) == 1)
+			JetsonLoadReply(sock, sEngName);
+	}
+}
+
+static void JetsonMuxAccept(struct ReactorHandle *h);
+
+static string JetsonRenderMetricsReply()
+{
+	string sStats = JetsonRenderStats();
+	return "HTTP/1.0 200 OK\r\nContent-Type: text/plain; version=0.0.4\r\nContent-Length: "
+		+ to_string(sStats.length()) + "\r\n\r\n" + sStats;
+}
+
+//----- management workers: scan, query, stats and metrics only read the published
+//registry snapshot, so they are rendered off the reactor; the connection is out of
+//epoll until its worker hands it back. The worker sends what the socket takes at
+//once, the reactor queues the rest
+struct MgmtJob {
+	struct MgmtConn *conn;
+	string sCmd;
+	string sServIp;		//GetServIp() is answered on the reactor, it isn't reentrant
+	string sReply;
+	size_t nSent;
+	int bFailed;
+};
+
+static pthread_mutex_t gMgmtJobLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t gMgmtJobCond = PTHREAD_COND_INITIALIZER;
+static deque<struct MgmtJob *> gMgmtJobs;
+static vector<struct MgmtJob *> gMgmtJobsDone;
+
+static void *JetsonMgmtWorker(void *)
+{
+	while (1) {
+		pthread_mutex_lock(&gMgmtJobLock);
+		while (gMgmtJobs.empty())
+			pthread_cond_wait(&gMgmtJobCond, &gMgmtJobLock);
+		struct MgmtJob *job = gMgmtJobs.front();
+		gMgmtJobs.pop_front();
+		pthread_mutex_unlock(&gMgmtJobLock);
+
+		if (job->conn->h.type == RH_TYPE_METRICS_CLIENT)
+			job->sReply = JetsonRenderMetricsReply();
+		else if (strncmp(job->sCmd.c_str(), "scan", 4) == 0)
+			job->sReply = JetsonRenderScan(job->sServIp.c_str());
+		else if (job->sCmd == "query")
+			job->sReply = JetsonRegistrySnapshot(&gRegistry)->sQueryText;
+		else
+			job->sReply = JetsonRenderStats() + "# statsdone\n";
+
+		while (job->nSent < job->sReply.length()) {
+			ssize_t bytes = send(job->conn->h.fd, job->sReply.data() + job->nSent,
+				job->sReply.length() - job->nSent, MSG_NOSIGNAL | MSG_DONTWAIT);
+			if (bytes < 0 && errno == EINTR)
+				continue;
+			if (bytes <= 0) {
+				job->bFailed = (bytes < 0 && errno != EAGAIN && errno != EWOULDBLOCK);
+				break;
+			}
+			job->nSent += bytes;
+		}
+
+		pthread_mutex_lock(&gMgmtJobLock);
+		gMgmtJobsDone.push_back(job);
+		pthread_mutex_unlock(&gMgmtJobLock);
+		uint64_t one = 1;
+		if (write(gMgmtDoneEvt.fd, &one, sizeof(one)) < 0)
+			JetsonErrorLogs("management worker wakeup failed. (%d)\n", errno);
+	}
+	return NULL;
+}
+
+//without workers every command is answered on the reactor as before
+static void JetsonMgmtStartWorkers()
+{
+	int fd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+	if (fd < 0 || !JetsonReactorAdd(&gMgmtDoneEvt, RH_TYPE_MGMT_DONE, fd, NULL, EPOLLIN)) {
+		JetsonErrorLogs("management workers not started. (%d)\n", errno);
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	for (int i=0; i<MGMT_WORKERS; i++) {
+		pthread_t threadId;
+		if (pthread_create(&threadId, NULL, JetsonMgmtWorker, NULL) == 0)
+			pthread_detach(threadId);
+	}
+}
+
+static int JetsonMgmtOffload(struct MgmtConn *conn, const char *sCmd)
+{
+	if (gMgmtDoneEvt.fd < 0)
+		return 0;
+	if (conn->h.type != RH_TYPE_METRICS_CLIENT &&
+		strncmp(sCmd, "scan", 4) != 0 && strcmp(sCmd, "query") != 0 && strcmp(sCmd, "stats") != 0)
+		return 0;
+
+	//workers never publish, the first snapshot is built here if the reactor hasn't yet
+	if (JetsonRegistrySnapshot(&gRegistry) == NULL)
+		JetsonPublishSnapshot();
+
+	struct MgmtJob *job = new MgmtJob();
+	job->conn = conn;
+	job->sCmd = sCmd;
+	job->sServIp = GetServIp(conn->h.fd);
+	job->nSent = 0;
+	job->bFailed = 0;
+
+	epoll_ctl(gEpollFd, EPOLL_CTL_DEL, conn->h.fd, NULL);
+
+	pthread_mutex_lock(&gMgmtJobLock);
+	gMgmtJobs.push_back(job);
+	pthread_cond_signal(&gMgmtJobCond);
+	pthread_mutex_unlock(&gMgmtJobLock);
+	return 1;
+}
+
+//replies rendered: the connections are back in epoll and send what is left as they can
+static void JetsonOnMgmtDone(struct ReactorHandle *h)
+{
+	uint64_t count;
+	if (read(h->fd, &count, sizeof(count)) < 0 && errno != EAGAIN)
+		JetsonErrorLogs("management worker eventfd read failed. (%d)\n", errno);
+
+	vector<struct MgmtJob *> done;
+	pthread_mutex_lock(&gMgmtJobLock);
+	done.swap(gMgmtJobsDone);
+	pthread_mutex_unlock(&gMgmtJobLock);
+
+	for (size_t i=0; i<done.size(); i++) {
+		struct MgmtJob *job = done[i];
+		struct MgmtConn *conn = job->conn;
+		int fd = conn->h.fd;
+		if (job->bFailed || !JetsonReactorAdd(&conn->h, conn->h.type, fd, conn, EPOLLIN)) {
+			JetsonWriteLogs("MGMT closing socket (%d) after %s\n", fd, job->sCmd.c_str());
+			close(fd);
+			JetsonMgmtConnRelease(conn);
+		}
+		else {
+			JetsonIoBufAppend(&conn->out, job->sReply.data() + job->nSent, job->sReply.length() - job->nSent);
+			JetsonMgmtFlush(conn);
+		}
+		delete job;
+	}
+}
+
+static void JetsonOnMgmtReadable(struct MgmtConn *conn)
+{
+	char sSockReadBuf[REQ_BUFSIZE];
+	memset(sSockReadBuf, 0, REQ_BUFSIZE);
+
+	int bytesReceived = recv(conn->h.fd, sSockReadBuf, REQ_BUFSIZE - 1, 0);
+	if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (bytesReceived < 1) {
+		JetsonMgmtConnClose(conn);
+		return;
+	}
+
+	JetsonWriteLogs("MGMT received cmd=%s\n", sSockReadBuf);
+
+	if (JetsonMgmtOffload(conn, sSockReadBuf))
+		return;
+
+	gpMgmtReplyConn = conn;
+	if (strncmp(sSockReadBuf, MUX_HELLO, strlen(MUX_HELLO)) == 0)
+		JetsonMuxAccept(&conn->h);
+	else if (strncmp(sSockReadBuf, RESUME_CMD, strlen(RESUME_CMD)) == 0)
+		JetsonResumeAttach(&conn->h, sSockReadBuf);
+	else
+		JetsonMgmtCommand(conn->h.fd, sSockReadBuf);
+	gpMgmtReplyConn = NULL;
+
+	//fd is -1 once the socket became a session or mux connection
+	if (conn->h.fd >= 0)
+		JetsonMgmtFlush(conn);
+}
+
+//----- discovery probes: UDP bound to the management port number, so a broadcast
+//from jetson_scan reaches every agent of a subnet; a failed bind only costs that
+static void JetsonDiscoveryListen()
+{
+	int fd = socket(AF_INET, SOCK_DGRAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	if (fd < 0) {
+		JetsonErrorLogs("discovery socket() failed. (%d)\n", GetSockErrno());
+		return;
+	}
+
+	struct sockaddr_in addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sin_family = AF_INET;
+	addr.sin_addr.s_addr = htonl(INADDR_ANY);
+	addr.sin_port = htons(atoi(gsMgmtPortStr.c_str()));
+	if (bind(fd, (struct sockaddr *)&addr, sizeof(addr)) ||
+		!JetsonReactorAdd(&gDiscoveryEvt, RH_TYPE_DISCOVERY, fd, NULL, EPOLLIN)) {
+		JetsonErrorLogs("discovery on UDP port %s not available. (%d)\n", gsMgmtPortStr.c_str(), GetSockErrno());
+		close(fd);
+		return;
+	}
+	JetsonWriteLogs("MGMT answering discovery on UDP port %s\n", gsMgmtPortStr.c_str());
+}
+
+static void JetsonOnDiscoveryReadable(struct ReactorHandle *h)
+{
+	char buf[64];
+	struct sockaddr_storage from;
+	socklen_t fromLen = sizeof(from);
+	int bytes;
+
+	while ((bytes = recvfrom(h->fd, buf, sizeof(buf), 0, (struct sockaddr *)&from, &fromLen)) >= 0) {
+		if (bytes == (int)strlen(DISCOVER_PROBE) && memcmp(buf, DISCOVER_PROBE, bytes) == 0) {
+			string sReply = DISCOVER_REPLY + gsMgmtPortStr + "\n";
+			sendto(h->fd, sReply.c_str(), sReply.length(), 0, (struct sockaddr *)&from, fromLen);
+		}
+		fromLen = sizeof(from);
+	}
+}
+
+//----- one scrape per connection: the request is read, the metrics sent and the socket closed
+static void JetsonOnMetricsReadable(struct MgmtConn *conn)
+{
+	char sSockReadBuf[REQ_BUFSIZE];
+	int bytesReceived = recv(conn->h.fd, sSockReadBuf, REQ_BUFSIZE - 1, 0);
+	if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR))
+		return;
+	if (bytesReceived < 1) {
+		JetsonMgmtConnClose(conn);
+		return;
+	}
+
+	conn->bCloseAfterFlush = 1;
+	if (strncmp(sSockReadBuf, "GET ", 4) != 0) {
+		const char *sReply = "HTTP/1.0 405 Method Not Allowed\r\nContent-Length: 0\r\n\r\n";
+		JetsonIoBufAppend(&conn->out, sReply, strlen(sReply));
+	}
+	else if (JetsonMgmtOffload(conn, "metrics"))
+		return;
+	else {
+		string sReply = JetsonRenderMetricsReply();
+		JetsonIoBufAppend(&conn->out, sReply.data(), sReply.length());
+	}
+	JetsonMgmtFlush(conn);
+}
+
+static void JetsonOnEngineExit(pid_t pid, int status)
+{
+	struct ClientEntry *client = JetsonRegistryFindPid(&gRegistry, pid);
+
+	if (WIFEXITED(status))
+		JetsonWriteLogs("<<< Engine instance pid=%d exited, status=%d\n", pid, WEXITSTATUS(status));
+	else if (WIFSIGNALED(status))
+		JetsonWriteLogs("<<< Engine instance pid=%d killed by sig(%d)\n", pid, WTERMSIG(status));
+
+	if (client == NULL)
+		return;
+
+	gRegistry.byPid.erase(pid);
+	client->nEnginePid = 0;
+	client->nEngineExitStatus = status;
+	gbAdmitCheck = 1;
+
+	for (size_t i=0; i<gLingeringEngines.size(); i++) {
+		if (gLingeringEngines[i].client == client) {
+			gLingeringEngines.erase(gLingeringEngines.begin() + i);
+			break;
+		}
+	}
+
+	JetsonClientMaybeRelease(client);
+}
+
+static void JetsonOnSignal(struct ReactorHandle *h)
+{
+	struct signalfd_siginfo sigInfo;
+	while (read(h->fd, &sigInfo, sizeof(sigInfo)) == sizeof(sigInfo)) {
+		if (sigInfo.ssi_signo == SIGHUP)
+			gbReloadPending = 1;
+		else if (sigInfo.ssi_signo == SIGINT || sigInfo.ssi_signo == SIGTERM) {
+			JetsonErrorLogs("<<<<<<<<<< Server terminated with sig(%d).\n", sigInfo.ssi_signo);
+			gnExitSignal = sigInfo.ssi_signo;
+			gbAgentExiting = 1;
+		}
+	}
+
+	//signals coalesce, reap everything that has exited
+	int status;
+	pid_t pid;
+	while ((pid = waitpid(-1, &status, WNOHANG)) > 0)
+		JetsonOnEngineExit(pid, status);
+}
+
+static void JetsonKillLingeringEngines()
+{
+	long long now = JetsonNowMsec();
+
+	for (size_t i=0; i<gLingeringEngines.size(); i++) {
+		struct ClientEntry *client = gLingeringEngines[i].client;
+		if (gLingeringEngines[i].deadline > now || client->nEnginePid <= 0)
+			continue;
+
+		JetsonWriteLogs("Engine instance pid=%d ignored stdin EOF, killing it\n", client->nEnginePid);
+		kill(client->nEnginePid, SIGKILL);
+		gLingeringEngines[i].deadline = now + ENGINE_EXIT_GRACE_MSEC;
+	}
+}
+
+static int JetsonClientLogin(struct EngineEntry *engEntry, SOCKET sock, const char *sIpAddr, fd_set *pMaster);
+
+//----- admission control: logins beyond max=N (engine) or the node-wide max=N
+//wait here, without an engine, until a running instance goes away
+struct PendingLogin {
+	struct EngineEntry *engine;
+	SOCKET sock;
+	char sIpAddr[MAX_ADDR_LEN];
+	long long nQueuedMsec;
+	int nLastPosition;			//queue position the client was last told
+	struct IoBuffer out;		//position lines the socket hasn't taken yet
+	struct ReactorHandle *pSockEvt;	//peer hangup and pending output, commands wait in the socket
+};
+
+#define LOGIN_INFO_MAX_QUEUED 1024	//a waiting client not reading misses position updates past this
+
+//engine processes of an engine, or of all: sessions, pool instances idle, warming or
+//recycling, shared workers, and engines still exiting; with sIpAddr, sessions of that client
+static int JetsonCountInstances(struct EngineEntry *engEntry, const char *sIpAddr)
+{
+	int nInstances = 0;
+
+	for (size_t i=0; i<gRegistry.engines.size(); i++) {
+		struct EngineEntry *thisEng = gRegistry.engines[i];
+		if (engEntry != NULL && thisEng != engEntry)
+			continue;
+
+		for (int j=0; j<thisEng->nClients; j++) {
+			struct ClientEntry *thisClient = thisEng->clients[j];
+			if (sIpAddr != NULL)
+				nInstances += (thisClient->bIsConnected && thisClient->nEnginePid > 0 && strcmp(thisClient->sIpAddr, sIpAddr) == 0);
+			else
+				nInstances += (thisClient->nEnginePid > 0);
+		}
+	}
+	return nInstances;
+}
+
+//one line for a client picking the least loaded of several agents, see LOAD_CMD
+static void JetsonLoadReply(SOCKET sock, const char *sEngName)
+{
+	char sReply[MAX_NAME_LEN + 128];
+
+	pthread_mutex_lock(&gJetsonTableLock);
+	struct EngineEntry *engEntry = JetsonRegistryFindEngine(&gRegistry, sEngName);
+	if (engEntry == NULL)
+		snprintf(sReply, sizeof(sReply), LOAD_CMD "%s " LOAD_NONE "\n", sEngName);
+	else if (engEntry->bRouted) {
+		//backends that are up, added up; a limit counts only if every one of them has one
+		int nSessions = 0, nInstances = 0, nMax = 0, nWaiting = 0, nNodeInstances = 0, nNodeMax = 0;
+		int bAllMax = 1, bAllNodeMax = 1, nUp = 0;
+		for (size_t i=0; i<gRouterBackends.size(); i++) {
+			const struct RouterBackend *backend = gRouterBackends[i].get();
+			auto it = backend->live.engines.find(sEngName);
+			if (!backend->bHealthy || it == backend->live.engines.end())
+				continue;
+
+			const struct RouterEngine *eng = &it->second;
+			nUp++;
+			auto itCounts = backend->routed.find(sEngName);
+			nSessions += (eng->bLoadKnown ? eng->nSessions : (itCounts != backend->routed.end() ? itCounts->second.nRouted : 0));
+			nInstances += eng->nInstances;
+			nMax += eng->nMax;
+			nWaiting += eng->nWaiting;
+			nNodeInstances += backend->live.nNodeInstances;
+			nNodeMax += backend->live.nNodeMax;
+			bAllMax &= (eng->bLoadKnown && eng->nMax > 0);
+			bAllNodeMax &= (backend->live.nNodeMax > 0);
+		}
+		if (nUp == 0)
+			snprintf(sReply, sizeof(sReply), LOAD_CMD "%s " LOAD_NONE "\n", sEngName);
+		else
+			snprintf(sReply, sizeof(sReply), LOAD_CMD "%s %d %d %d %d %d %d\n", sEngName, nSessions, nInstances,
+				(bAllMax ? nMax : 0), nWaiting, nNodeInstances, (bAllNodeMax ? nNodeMax : 0));
+	}
+	else {
+		int nSessions = 0;
+		for (int i=0; i<engEntry->nClients; i++)
+			nSessions += (engEntry->clients[i]->nSessionId != 0);
+
+		int nWaiting = 0;
+		for (size_t i=0; i<gLoginQueue.size(); i++)
+			nWaiting += (gLoginQueue[i]->engine == engEntry);
+
+		snprintf(sReply, sizeof(sReply), LOAD_CMD "%s %d %d %d %d %d %d\n", sEngName, nSessions,
+			JetsonCountInstances(engEntry, NULL), engEntry->opts.nMaxInstances, nWaiting,
+			JetsonCountInstances(NULL, NULL), gnNodeMaxInstances);
+	}
+	pthread_mutex_unlock(&gJetsonTableLock);
+
+	JetsonMgmtSend(sock, sReply, strlen(sReply));
+}
+
+//1 if one more engine process stays within max=N of the engine and the node-wide max=N
+static int JetsonHasRoom(struct EngineEntry *engEntry)
+{
+	if (engEntry->opts.nMaxInstances > 0 && JetsonCountInstances(engEntry, NULL) >= engEntry->opts.nMaxInstances)
+		return 0;
+	if (gnNodeMaxInstances > 0 && JetsonCountInstances(NULL, NULL) >= gnNodeMaxInstances)
+		return 0;
+	return 1;
+}
+
+//shared sessions start no process, they queue their go commands instead; an idle
+//pool instance is already counted
+static int JetsonCanAdmit(struct EngineEntry *engEntry)
+{
+	if (engEntry->pShared != NULL || JetsonPoolTake(engEntry) != NULL)
+		return 1;
+	return JetsonHasRoom(engEntry);
+}
+
+//0 if the client is gone
+static int JetsonLoginFlush(struct PendingLogin *pending)
+{
+	while (pending->out.len > 0) {
+		int bytesSent = send(pending->sock, pending->out.data, pending->out.len, MSG_NOSIGNAL);
+		if (bytesSent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			return 0;
+		}
+		JetsonIoBufConsume(&pending->out, bytesSent);
+	}
+	JetsonReactorMod(pending->pSockEvt, EPOLLRDHUP | (pending->out.len > 0 ? (unsigned int)EPOLLOUT : 0));
+	return 1;
+}
+
+static void JetsonLoginTellPosition(struct PendingLogin *pending, int nPosition, int nWaiting)
+{
+	if (pending->nLastPosition == nPosition || pending->out.len >= LOGIN_INFO_MAX_QUEUED)
+		return;
+	pending->nLastPosition = nPosition;
+
+	ostringstream ossInfo;
+	ossInfo << "info string " << pending->engine->sEngineName << " is busy, waiting for an engine: "
+		<< nPosition << " of " << nWaiting << " in queue\n";
+	string sInfo = ossInfo.str();
+	int nSent = 0;
+	if (pending->out.len == 0) {
+		//usually all of it goes at once and nothing is buffered; a failed send shows up as a hangup
+		nSent = send(pending->sock, sInfo.c_str(), sInfo.length(), MSG_NOSIGNAL);
+		if (nSent == (int)sInfo.length() || (nSent < 0 && errno != EAGAIN && errno != EWOULDBLOCK))
+			return;
+		nSent = max(nSent, 0);
+	}
+	JetsonIoBufAppend(&pending->out, sInfo.c_str() + nSent, sInfo.length() - nSent);
+	JetsonLoginFlush(pending);
+}
+
+//positions count only logins waiting for the same engine
+static void JetsonLoginTellPositions()
+{
+	unordered_map<struct EngineEntry *, int> waiting, seen;
+	for (size_t i=0; i<gLoginQueue.size(); i++)
+		waiting[gLoginQueue[i]->engine]++;
+	for (size_t i=0; i<gLoginQueue.size(); i++)
+		JetsonLoginTellPosition(gLoginQueue[i], ++seen[gLoginQueue[i]->engine], waiting[gLoginQueue[i]->engine]);
+}
+
+//1 if a new login on this engine has to queue: no room, or others got there first
+static int JetsonLoginMustWait(struct EngineEntry *engEntry)
+{
+	for (size_t i=0; i<gLoginQueue.size(); i++)
+		if (gLoginQueue[i]->engine == engEntry)
+			return 1;
+	return !JetsonCanAdmit(engEntry);
+}
+
+static void JetsonLoginEnqueue(struct EngineEntry *engEntry, SOCKET sock, const char *sIpAddr)
+{
+	struct PendingLogin *pending = new PendingLogin();
+	pending->engine = engEntry;
+	pending->sock = sock;
+	strncpy(pending->sIpAddr, sIpAddr, sizeof(pending->sIpAddr) - 1);
+	pending->nQueuedMsec = JetsonNowMsec();
+	pending->nLastPosition = 0;
+	memset(&pending->out, 0, sizeof(pending->out));
+	pending->pSockEvt = (struct ReactorHandle *)malloc(sizeof(struct ReactorHandle));
+
+	if (!JetsonReactorAdd(pending->pSockEvt, RH_TYPE_WAITING_CLIENT, sock, pending, EPOLLRDHUP)) {
+		CloseSocket(sock);
+		free(pending->pSockEvt);
+		delete pending;
+		return;
+	}
+
+	int nWaiting = 0;
+	for (size_t i=0; i<gLoginQueue.size(); i++)
+		nWaiting += (gLoginQueue[i]->engine == engEntry);
+	gLoginQueue.push_back(pending);
+	nWaiting++;
+
+	JetsonWriteLogs("Client (%s, %d) waits for engine (%s), %d in its queue\n",
+		sIpAddr, sock, engEntry->sEngineName, nWaiting);
+	JetsonLoginTellPosition(pending, nWaiting, nWaiting);
+}
+
+static void JetsonLoginDrop(size_t index, int bCloseSock)
+{
+	struct PendingLogin *pending = gLoginQueue[index];
+	gLoginQueue.erase(gLoginQueue.begin() + index);
+
+	if (bCloseSock)
+		JetsonReactorClose(pending->pSockEvt);
+	else {
+		//socket stays open, the login registers it again
+		epoll_ctl(gEpollFd, EPOLL_CTL_DEL, pending->pSockEvt->fd, NULL);
+		pending->pSockEvt->fd = -1;
+	}
+	gReleasedHandles.push_back(pending->pSockEvt);
+	JetsonIoBufFree(&pending->out);
+	delete pending;
+}
+
+//waiting client can take the rest of a position line, or hung up
+static void JetsonOnWaitingClientEvent(struct ReactorHandle *h, unsigned int events)
+{
+	struct PendingLogin *pending = (struct PendingLogin *)h->owner;
+	if (!(events & (EPOLLRDHUP | EPOLLHUP | EPOLLERR)) && JetsonLoginFlush(pending))
+		return;
+
+	for (size_t i=0; i<gLoginQueue.size(); i++) {
+		if (gLoginQueue[i] != pending)
+			continue;
+
+		JetsonWriteLogs("Client (%s, %d) left the queue of engine (%s) after %lld ms\n",
+			gLoginQueue[i]->sIpAddr, gLoginQueue[i]->sock, gLoginQueue[i]->engine->sEngineName,
+			JetsonNowMsec() - gLoginQueue[i]->nQueuedMsec);
+		JetsonLoginDrop(i, 1);
+		break;
+	}
+	JetsonLoginTellPositions();
+}
+
+//fair share: of the logins that fit, the client address running the fewest
+//instances goes first, the longest waiting one among equals. Runs only after
+//something set gbAdmitCheck, a queue that can't move costs nothing per batch.
+static void JetsonAdmitWaitingLogins()
+{
+	int bAdmitted = 0;
+
+	while (!gLoginQueue.empty()) {
+		int nBest = -1, nBestRunning = 0;
+		unordered_map<struct EngineEntry *, int> seen;	//only the first waiting login of an engine may go
+		for (size_t i=0; i<gLoginQueue.size(); i++) {
+			struct PendingLogin *pending = gLoginQueue[i];
+			if (seen[pending->engine]++ > 0 || !JetsonCanAdmit(pending->engine))
+				continue;
+
+			int nRunning = JetsonCountInstances(NULL, pending->sIpAddr);
+			if (nBest < 0 || nRunning < nBestRunning) {
+				nBest = (int)i;
+				nBestRunning = nRunning;
+			}
+		}
+		if (nBest < 0)
+			break;
+
+		struct PendingLogin *pending = gLoginQueue[nBest];
+		struct EngineEntry *engEntry = pending->engine;
+		SOCKET sock = pending->sock;
+		string sIpAddr = pending->sIpAddr;
+		string sUnsent(pending->out.data, pending->out.len);
+
+		long long nWaitMsec = JetsonNowMsec() - pending->nQueuedMsec;
+		engEntry->nLoginsWaited++;
+		engEntry->nLoginWaitMsecTotal += nWaitMsec;
+		if (nWaitMsec > engEntry->nLoginWaitMsecMax)
+			engEntry->nLoginWaitMsecMax = nWaitMsec;
+
+		JetsonWriteLogs("Client (%s, %d) admitted to engine (%s) after %lld ms in queue\n",
+			sIpAddr.c_str(), sock, engEntry->sEngineName, nWaitMsec);
+		JetsonLoginDrop(nBest, 0);
+		if (!JetsonClientLogin(engEntry, sock, sIpAddr.c_str(), NULL))
+			CloseSocket(sock);
+		else if (!sUnsent.empty()) {
+			//the rest of a position line goes out ahead of the engine's first line
+			struct ClientEntry *client = JetsonRegistryFindSock(&gRegistry, sock);
+			if (client != NULL) {
+				struct IoBuffer out = { NULL, 0, 0 };
+				JetsonIoBufAppend(&out, sUnsent.c_str(), sUnsent.length());
+				JetsonIoBufAppend(&out, client->sockOut.data, client->sockOut.len);
+				JetsonIoBufFree(&client->sockOut);
+				client->sockOut = out;
+				JetsonOnClientWritable(client);
+			}
+		}
+		bAdmitted = 1;
+	}
+
+	if (bAdmitted)
+		JetsonLoginTellPositions();
+}
+
+static void JetsonOnAccept(struct ReactorHandle *h)
+{
+	int sockType = (h->type == RH_TYPE_MGMT_LISTEN ? SOCK_TYPE_MGMT :
+		(h->type == RH_TYPE_METRICS_LISTEN ? SOCK_TYPE_METRICS : SOCK_TYPE_ENGINE));
+	struct EngineEntry *pEng = (struct EngineEntry *)h->owner;
+
+	while (1) {
+		struct sockaddr_storage clientAddr;
+		socklen_t clientLen = sizeof(clientAddr);
+
+		SOCKET sockClient = accept4(h->fd, (struct sockaddr*) &clientAddr, &clientLen, SOCK_CLOEXEC | SOCK_NONBLOCK);
+		if (!IsSockValid(sockClient)) {
+			if (errno == EINTR || errno == ECONNABORTED)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				JetsonErrorLogs("accept() failed. (%d)\n", GetSockErrno());
+			break;
+		}
+
+		char sLocalIp[100];
+		getnameinfo((struct sockaddr*)&clientAddr,
+					clientLen,
+					sLocalIp, sizeof(sLocalIp), 0, 0,
+					NI_NUMERICHOST);
+
+		char *sServIp = GetServIp(sockClient);
+
+		if (sockType == SOCK_TYPE_MGMT) {
+			JetsonWriteLogs("MGMT Received new connection from %s via %s\n", sLocalIp, sServIp);
+
+			if (JetsonMgmtConnNew(RH_TYPE_MGMT_CLIENT, sockClient) == NULL)
+				CloseSocket(sockClient);
+		}
+		else if (sockType == SOCK_TYPE_METRICS) {
+			JetsonTraceLogs("Metrics scrape from %s via %s\n", sLocalIp, sServIp);
+
+			if (JetsonMgmtConnNew(RH_TYPE_METRICS_CLIENT, sockClient) == NULL)
+				CloseSocket(sockClient);
+		}
+		else {
+			int nodelay = 1;
+			setsockopt(sockClient, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+			JetsonWriteLogs("Engine (%s)(ServIP:%s) received new connection from %s\n", pEng->sEngineName, sServIp, sLocalIp);
+			if (pEng->bRouted)
+				JetsonRouteAccept(pEng, sockClient, sLocalIp);
+			else if (JetsonLoginMustWait(pEng))
+				JetsonLoginEnqueue(pEng, sockClient, sLocalIp);
+			else if (!JetsonClientLogin(pEng, sockClient, sLocalIp, NULL))
+				CloseSocket(sockClient);
+		}
+	}
+}
+
+//----- multiplexed connections (common/muxframe.h): a client that sent MUX_HELLO on
+//the management port gets its engine sessions and management commands as channels
+//of that one connection. An engine channel is one end of a socketpair, the other
+//end goes to JetsonClientLogin like an accepted socket, so the login queue, pool,
+//cache and shared mode work on it unchanged
+#define MUX_OUT_HIGH_WATERMARK (4 * MUX_WINDOW)	//channels stop reading while this much is queued
+
+struct MuxConn;
+
+struct MuxChannel {
+	struct ReactorHandle hEvt;		//first member, freed through gReleasedHandles; fd -1 for mgmt
+	struct MuxConn *conn;
+	unsigned int nId;
+	int bIsMgmt;
+	long long nSendCredit;			//bytes the client still takes on this channel
+	int nConsumed;					//client bytes passed to the session since the last CREDIT
+	struct IoBuffer toSession;		//client bytes the socketpair didn't take yet
+};
+
+struct MuxConn {
+	struct ReactorHandle hEvt;
+	char sIpAddr[MAX_ADDR_LEN];
+	char sServIpAddr[MAX_ADDR_LEN];
+	struct IoBuffer in;
+	struct IoBuffer out;
+	unordered_map<unsigned int, struct MuxChannel *> channels;
+	int bFlushQueued;
+	int bClosed;
+};
+
+static vector<struct MuxConn *> gMuxFlushConns;		//frames queued in this batch
+static vector<struct MuxConn *> gReleasedMuxConns;
+static struct MuxChannel *gpMuxMgmtChannel = NULL;	//mgmt channel whose command is running
+
+static void JetsonMuxQueue(struct MuxConn *conn, unsigned int nChannel, int type, const char *data, int len)
+{
+	unsigned char hdr[MUX_HDR_LEN];
+	JetsonMuxPutHeader(hdr, len, nChannel, type);
+	JetsonIoBufAppend(&conn->out, (const char *)hdr, MUX_HDR_LEN);
+	if (len > 0)
+		JetsonIoBufAppend(&conn->out, data, len);
+
+	if (!conn->bFlushQueued) {
+		conn->bFlushQueued = 1;
+		gMuxFlushConns.push_back(conn);
+	}
+}
+
+static void JetsonMuxChannelUpdateEvents(struct MuxChannel *ch)
+{
+	unsigned int events = 0;
+	if (ch->nSendCredit > 0 && ch->conn->out.len < MUX_OUT_HIGH_WATERMARK)
+		events |= EPOLLIN;
+	if (ch->toSession.len > 0)
+		events |= EPOLLOUT;
+	JetsonReactorMod(&ch->hEvt, events);
+}
+
+static void JetsonMuxChannelClose(struct MuxChannel *ch, const char *sReason)
+{
+	struct MuxConn *conn = ch->conn;
+
+	if (sReason != NULL && !conn->bClosed)
+		JetsonMuxQueue(conn, ch->nId, MUX_FRAME_CLOSE, sReason, strlen(sReason));
+	JetsonTraceLogs("Mux (%s, %d) channel %u closed%s%s\n", conn->sIpAddr, conn->hEvt.fd, ch->nId,
+		(sReason != NULL ? ": " : " by client"), (sReason != NULL ? sReason : ""));
+
+	//the session sees EOF on its end; gMuxServIp is overwritten when the fd is reused
+	JetsonReactorClose(&ch->hEvt);
+	conn->channels.erase(ch->nId);
+	JetsonIoBufFree(&ch->toSession);
+	gReleasedHandles.push_back(&ch->hEvt);
+}
+
+static void JetsonMuxConnClose(struct MuxConn *conn, const char *sReason)
+{
+	if (conn->bClosed)
+		return;
+
+	JetsonWriteLogs("Mux connection (%s, %d) closed, %d channels: %s\n", conn->sIpAddr, conn->hEvt.fd,
+		(int)conn->channels.size(), sReason);
+	conn->bClosed = 1;
+	while (!conn->channels.empty())
+		JetsonMuxChannelClose(conn->channels.begin()->second, NULL);
+	JetsonReactorClose(&conn->hEvt);
+	gReleasedMuxConns.push_back(conn);
+}
+
+static void JetsonMuxFlush(struct MuxConn *conn)
+{
+	conn->bFlushQueued = 0;
+	if (conn->bClosed)
+		return;
+
+	int bWasFull = (conn->out.len >= MUX_OUT_HIGH_WATERMARK);
+	while (conn->out.len > 0) {
+		int bytesSent = send(conn->hEvt.fd, conn->out.data, conn->out.len, MSG_NOSIGNAL);
+		if (bytesSent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			JetsonMuxConnClose(conn, "send failed");
+			return;
+		}
+		JetsonIoBufConsume(&conn->out, bytesSent);
+	}
+
+	//channels held back by a full connection read again
+	if (bWasFull && conn->out.len < MUX_OUT_HIGH_WATERMARK) {
+		for (auto it = conn->channels.begin(); it != conn->channels.end(); ++it) {
+			if (!it->second->bIsMgmt)
+				JetsonMuxChannelUpdateEvents(it->second);
+		}
+	}
+	JetsonReactorMod(&conn->hEvt, EPOLLIN | (conn->out.len > 0 ? (unsigned int)EPOLLOUT : 0));
+}
+
+//called by JetsonMgmtSend, takes the reply if the command came on a mux channel
+static int JetsonMuxMgmtReply(SOCKET sock, const char *data, int len)
+{
+	struct MuxChannel *ch = gpMuxMgmtChannel;
+	if (ch == NULL || ch->conn->hEvt.fd != sock)
+		return 0;
+
+	for (int off = 0; off < len; off += MUX_MAX_PAYLOAD)
+		JetsonMuxQueue(ch->conn, ch->nId, MUX_FRAME_DATA, data + off, min(len - off, MUX_MAX_PAYLOAD));
+	return 1;
+}
+
+//client bytes go to the session as far as it takes them, credit is returned for what it took
+static void JetsonMuxChannelFlush(struct MuxChannel *ch)
+{
+	while (ch->toSession.len > 0) {
+		int bytesSent = send(ch->hEvt.fd, ch->toSession.data, ch->toSession.len, MSG_NOSIGNAL);
+		if (bytesSent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno != EAGAIN && errno != EWOULDBLOCK)
+				ch->toSession.len = 0;	//session is gone, its EOF closes the channel
+			break;
+		}
+		JetsonIoBufConsume(&ch->toSession, bytesSent);
+		ch->nConsumed += bytesSent;
+	}
+
+	if (ch->nConsumed >= MUX_CREDIT_BATCH) {
+		string sCredit = JetsonMuxCreditFrame(ch->nId, ch->nConsumed);
+		JetsonMuxQueue(ch->conn, ch->nId, MUX_FRAME_CREDIT, sCredit.c_str() + MUX_HDR_LEN, 4);
+		ch->nConsumed = 0;
+	}
+	JetsonMuxChannelUpdateEvents(ch);
+}
+
+static void JetsonMuxOpen(struct MuxConn *conn, unsigned int nId, const char *payload, int len)
+{
+	string sRequest(payload, len);
+
+	if (conn->channels.count(nId) > 0) {
+		JetsonMuxQueue(conn, nId, MUX_FRAME_CLOSE, "channel in use", 14);
+		return;
+	}
+
+	struct MuxChannel *ch = (struct MuxChannel *)calloc(1, sizeof(struct MuxChannel));
+	if (ch == NULL) {
+		JetsonMuxQueue(conn, nId, MUX_FRAME_CLOSE, "no memory", 9);
+		return;
+	}
+	ch->hEvt.fd = -1;
+	ch->conn = conn;
+	ch->nId = nId;
+	ch->nSendCredit = MUX_WINDOW;
+
+	if (sRequest == "mgmt") {
+		ch->bIsMgmt = 1;
+		conn->channels[nId] = ch;
+		JetsonMuxQueue(conn, nId, MUX_FRAME_OPENED, NULL, 0);
+		return;
+	}
+
+	struct EngineEntry *engEntry = NULL;
+	if (sRequest.compare(0, 7, "engine ") == 0)
+		engEntry = JetsonRegistryFindEngine(&gRegistry, sRequest.c_str() + 7);
+
+	int sv[2];
+	if (engEntry == NULL || socketpair(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0, sv) < 0) {
+		const char *sReason = (engEntry == NULL ? "no such engine" : "socketpair failed");
+		JetsonWriteLogs("Mux (%s, %d) open \"%s\" on channel %u refused: %s\n", conn->sIpAddr, conn->hEvt.fd,
+			sRequest.c_str(), nId, sReason);
+		JetsonMuxQueue(conn, nId, MUX_FRAME_CLOSE, sReason, strlen(sReason));
+		free(ch);
+		return;
+	}
+	if (!JetsonReactorAdd(&ch->hEvt, RH_TYPE_MUX_CHANNEL, sv[0], ch, EPOLLIN)) {
+		close(sv[0]);
+		close(sv[1]);
+		JetsonMuxQueue(conn, nId, MUX_FRAME_CLOSE, "epoll failed", 12);
+		free(ch);
+		return;
+	}
+	conn->channels[nId] = ch;
+	gMuxServIp[sv[1]] = conn->sServIpAddr;
+	JetsonMuxQueue(conn, nId, MUX_FRAME_OPENED, NULL, 0);
+
+	JetsonWriteLogs("Engine (%s)(ServIP:%s) received new mux channel %u from %s\n", engEntry->sEngineName,
+		conn->sServIpAddr, nId, conn->sIpAddr);
+	if (engEntry->bRouted)
+		JetsonRouteAccept(engEntry, sv[1], conn->sIpAddr);
+	else if (JetsonLoginMustWait(engEntry))
+		JetsonLoginEnqueue(engEntry, sv[1], conn->sIpAddr);
+	else if (!JetsonClientLogin(engEntry, sv[1], conn->sIpAddr, NULL))
+		CloseSocket(sv[1]);
+}
+
+static void JetsonMuxOnFrame(struct MuxConn *conn, const char *frame)
+{
+	unsigned int len, nId;
+	int type;
+	JetsonMuxGetHeader((const unsigned char *)frame, &len, &nId, &type);
+	const char *payload = frame + MUX_HDR_LEN;
+
+	if (type == MUX_FRAME_OPEN) {
+		JetsonMuxOpen(conn, nId, payload, len);
+		return;
+	}
+
+	auto it = conn->channels.find(nId);
+	if (it == conn->channels.end())
+		return;		//closed by the agent while the frame was on its way
+	struct MuxChannel *ch = it->second;
+
+	if (type == MUX_FRAME_DATA && ch->bIsMgmt) {
+		char sCmd[REQ_BUFSIZE];
+		int cmdLen = min((int)len, REQ_BUFSIZE - 1);
+		memcpy(sCmd, payload, cmdLen);
+		sCmd[cmdLen] = '\0';
+		JetsonWriteLogs("MGMT received cmd=%s on mux (%s, %d)\n", sCmd, conn->sIpAddr, conn->hEvt.fd);
+
+		gpMuxMgmtChannel = ch;
+		JetsonMgmtCommand(conn->hEvt.fd, sCmd);
+		gpMuxMgmtChannel = NULL;
+	}
+	else if (type == MUX_FRAME_DATA) {
+		if (ch->toSession.len + ch->nConsumed + (int)len > MUX_WINDOW) {
+			JetsonMuxChannelClose(ch, "flow control window exceeded");
+			return;
+		}
+		JetsonIoBufAppend(&ch->toSession, payload, len);
+		JetsonMuxChannelFlush(ch);
+	}
+	else if (type == MUX_FRAME_CREDIT) {
+		ch->nSendCredit += JetsonMuxCreditValue(payload, len);
+		if (!ch->bIsMgmt)
+			JetsonMuxChannelUpdateEvents(ch);
+	}
+	else if (type == MUX_FRAME_CLOSE)
+		JetsonMuxChannelClose(ch, NULL);
+}
+
+static void JetsonOnMuxConnEvent(struct MuxConn *conn, unsigned int events)
+{
+	if (events & EPOLLOUT) {
+		JetsonMuxFlush(conn);
+		if (conn->bClosed)
+			return;
+	}
+	if (!(events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+		return;
+
+	char sSockReadBuf[MUX_MAX_PAYLOAD + MUX_HDR_LEN];
+	for (int nReads = 0; nReads < 4; nReads++) {
+		int bytesReceived = recv(conn->hEvt.fd, sSockReadBuf, sizeof(sSockReadBuf), 0);
+		if (bytesReceived < 0 && errno == EINTR)
+			continue;
+		if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (bytesReceived <= 0) {
+			JetsonMuxConnClose(conn, "connection closed by client");
+			return;
+		}
+		JetsonIoBufAppend(&conn->in, sSockReadBuf, bytesReceived);
+
+		int off = 0, frameLen;
+		while ((frameLen = JetsonMuxFrameLen(conn->in.data + off, conn->in.len - off)) > 0) {
+			JetsonMuxOnFrame(conn, conn->in.data + off);
+			if (conn->bClosed)
+				return;
+			off += frameLen;
+		}
+		if (frameLen < 0) {
+			JetsonMuxConnClose(conn, "invalid frame");
+			return;
+		}
+		JetsonIoBufConsume(&conn->in, off);
+	}
+}
+
+//session output goes out as DATA while the client has credit and the connection has room
+static void JetsonOnMuxChannelEvent(struct MuxChannel *ch, unsigned int events)
+{
+	struct MuxConn *conn = ch->conn;
+
+	if (events & EPOLLOUT)
+		JetsonMuxChannelFlush(ch);
+
+	//a closed session is drained whatever the credit, the client takes the last bytes anyway
+	int bHangup = (events & (EPOLLHUP | EPOLLERR)) != 0;
+	char sSockReadBuf[MUX_MAX_PAYLOAD];
+	for (int nReads = 0; nReads < 8; nReads++) {
+		if (!bHangup && (ch->nSendCredit <= 0 || conn->out.len >= MUX_OUT_HIGH_WATERMARK))
+			break;
+
+		int nWant = (int)(bHangup || ch->nSendCredit > MUX_MAX_PAYLOAD ? MUX_MAX_PAYLOAD : ch->nSendCredit);
+		int bytesReceived = recv(ch->hEvt.fd, sSockReadBuf, nWant, 0);
+		if (bytesReceived < 0 && errno == EINTR)
+			continue;
+		if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			break;
+		if (bytesReceived <= 0) {
+			JetsonMuxChannelClose(ch, "session ended");
+			return;
+		}
+		JetsonMuxQueue(conn, ch->nId, MUX_FRAME_DATA, sSockReadBuf, bytesReceived);
+		ch->nSendCredit -= bytesReceived;
+	}
+	JetsonMuxChannelUpdateEvents(ch);
+}
+
+//management connection that sent MUX_HELLO becomes a mux connection
+static void JetsonMuxAccept(struct ReactorHandle *h)
+{
+	int fd = JetsonMgmtConnHandOver((struct MgmtConn *)h->owner);
+	struct MuxConn *conn = new MuxConn();
+
+	int nodelay = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+	struct sockaddr_storage peerAddr;
+	socklen_t peerLen = sizeof(peerAddr);
+	if (getpeername(fd, (struct sockaddr *)&peerAddr, &peerLen) < 0 ||
+		getnameinfo((struct sockaddr *)&peerAddr, peerLen, conn->sIpAddr, sizeof(conn->sIpAddr), 0, 0, NI_NUMERICHOST) != 0)
+		strcpy(conn->sIpAddr, "unknown");
+	strncpy(conn->sServIpAddr, GetServIp(fd), sizeof(conn->sServIpAddr) - 1);
+
+	if (!JetsonReactorAdd(&conn->hEvt, RH_TYPE_MUX_CONN, fd, conn, EPOLLIN)) {
+		CloseSocket(fd);
+		delete conn;
+		return;
+	}
+
+	JetsonIoBufAppend(&conn->out, MUX_HELLO_OK, strlen(MUX_HELLO_OK));
+	JetsonMuxFlush(conn);
+	JetsonWriteLogs("MGMT connection (%s, %d) switched to multiplexed channels\n", conn->sIpAddr, fd);
+}
+
+static void JetsonMuxFlushAll()
+{
+	for (size_t i=0; i<gMuxFlushConns.size(); i++)
+		JetsonMuxFlush(gMuxFlushConns[i]);
+	gMuxFlushConns.clear();
+
+	for (size_t i=0; i<gReleasedMuxConns.size(); i++) {
+		JetsonIoBufFree(&gReleasedMuxConns[i]->in);
+		JetsonIoBufFree(&gReleasedMuxConns[i]->out);
+		delete gReleasedMuxConns[i];
+	}
+	gReleasedMuxConns.clear();
+}
+
+//----- router mode (agents/router.h): routed engines are registry entries without
+//processes; an accepted session is paired with a connection to a backend agent's
+//engine port and bytes are passed both ways as they come
+struct RouteSession {
+	struct ReactorHandle hClient;
+	struct ReactorHandle hBackend;
+	unsigned int nSessionId;
+	char sIpAddr[MAX_ADDR_LEN];
+	char sServIpAddr[MAX_ADDR_LEN];
+	string sEngineName;
+	vector<shared_ptr<struct RouterBackend> > candidates;	//ranked at accept
+	size_t nNext;
+	shared_ptr<struct RouterBackend> backend;	//NULL until one accepted the connection
+	struct IoBuffer toBackend;
+	struct IoBuffer toClient;
+	int bConnected;
+	int bClosed;
+};
+
+static vector<struct RouteSession *> gRouteSessions;
+static vector<struct RouteSession *> gReleasedRoutes;
+static vector<string> gRouterListenFailed;	//engines whose port couldn't be bound, retried on reload
+
+static void *JetsonRouterThread(void *data)
+{
+	shared_ptr<struct RouterBackend> backend = *(shared_ptr<struct RouterBackend> *)data;
+	delete (shared_ptr<struct RouterBackend> *)data;
+
+	while (!backend->bRemoved) {
+		struct RouterCheck check;
+		JetsonRouterCheck(backend.get(), &check, JetsonNowMsec);
+
+		pthread_mutex_lock(&backend->lock);
+		backend->pending = check;
+		backend->bPending = 1;
+		pthread_mutex_unlock(&backend->lock);
+		gbRouterChecked = 1;
+
+		for (int i=0; i<ROUTER_CHECK_MSEC/100 && !backend->bRemoved; i++)
+			SleepMsec(100);
+	}
+	return NULL;
+}
+
+static void JetsonRouteUpdateEvents(struct RouteSession *rs)
+{
+	JetsonReactorMod(&rs->hClient, (rs->toBackend.len < ROUTER_HIGH_WATERMARK ? (unsigned int)EPOLLIN : 0) |
+		(rs->toClient.len > 0 ? (unsigned int)EPOLLOUT : 0));
+	if (!rs->bConnected)
+		JetsonReactorMod(&rs->hBackend, EPOLLOUT);
+	else
+		JetsonReactorMod(&rs->hBackend, (rs->toClient.len < ROUTER_HIGH_WATERMARK ? (unsigned int)EPOLLIN : 0) |
+			(rs->toBackend.len > 0 ? (unsigned int)EPOLLOUT : 0));
+}
+
+static void JetsonRouteClose(struct RouteSession *rs, const char *sReason)
+{
+	if (rs->bClosed)
+		return;
+
+	JetsonWriteLogs("Routed session (%s, %d) of engine (%s) closed via %s: %s\n", rs->sIpAddr, rs->hClient.fd,
+		rs->sEngineName.c_str(), (rs->backend != NULL ? rs->backend->sAddr.c_str() : "no backend"), sReason);
+	rs->bClosed = 1;
+	JetsonReactorClose(&rs->hClient);
+	JetsonReactorClose(&rs->hBackend);
+	if (rs->backend != NULL)
+		rs->backend->routed[rs->sEngineName].nRouted--;
+
+	for (size_t i=0; i<gRouteSessions.size(); i++) {
+		if (gRouteSessions[i] == rs) {
+			gRouteSessions[i] = gRouteSessions.back();
+			gRouteSessions.pop_back();
+			break;
+		}
+	}
+	gReleasedRoutes.push_back(rs);
+
+	pthread_mutex_lock(&gJetsonTableLock);
+	gRegistry.nVersion++;
+	pthread_mutex_unlock(&gJetsonTableLock);
+}
+
+//bytes for one side go out as far as it takes them; 0 if the session is closed
+static int JetsonRouteFlush(struct RouteSession *rs, int bToBackend)
+{
+	struct IoBuffer *buf = (bToBackend ? &rs->toBackend : &rs->toClient);
+	int fd = (bToBackend ? rs->hBackend.fd : rs->hClient.fd);
+
+	while (buf->len > 0) {
+		int bytesSent = send(fd, buf->data, buf->len, MSG_NOSIGNAL);
+		if (bytesSent < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK)
+				break;
+			JetsonRouteClose(rs, (bToBackend ? "backend connection lost" : "client connection lost"));
+			return 0;
+		}
+		JetsonIoBufConsume(buf, bytesSent);
+	}
+	return 1;
+}
+
+//next backend in the ranking, until one takes the connection attempt
+static int JetsonRouteConnectNext(struct RouteSession *rs)
+{
+	while (rs->nNext < rs->candidates.size()) {
+		shared_ptr<struct RouterBackend> backend = rs->candidates[rs->nNext++];
+		auto it = backend->live.engines.find(rs->sEngineName);
+		if (!backend->bHealthy || it == backend->live.engines.end())
+			continue;	//went down since the session was ranked
+
+		struct sockaddr_in addr;
+		memset(&addr, 0, sizeof(addr));
+		addr.sin_family = AF_INET;
+		addr.sin_port = htons(atoi(it->second.sPort.c_str()));
+		inet_pton(AF_INET, backend->live.sIp.c_str(), &addr.sin_addr);
+
+		int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+		if (fd < 0)
+			return 0;
+		int nodelay = 1;
+		setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+
+		if ((connect(fd, (struct sockaddr *)&addr, sizeof(addr)) < 0 && errno != EINPROGRESS) ||
+			!JetsonReactorAdd(&rs->hBackend, RH_TYPE_ROUTE_BACKEND, fd, rs, EPOLLOUT)) {
+			close(fd);
+			backend->nConnectFailures++;
+			continue;
+		}
+
+		rs->backend = backend;
+		rs->bConnected = 0;
+		struct RouterCounts *counts = &backend->routed[rs->sEngineName];
+		counts->nRouted++;
+		counts->nSinceCheck++;
+		counts->nTotal++;
+		return 1;
+	}
+	return 0;
+}
+
+static void JetsonRouteNoBackend(struct RouteSession *rs)
+{
+	string sInfo = "info string no backend agent serves " + rs->sEngineName + " now\n";
+	JetsonIoBufAppend(&rs->toClient, sInfo.c_str(), sInfo.length());
+	if (JetsonRouteFlush(rs, 0))
+		JetsonRouteClose(rs, "no backend agent took it");
+}
+
+static void JetsonRouteAccept(struct EngineEntry *engEntry, int fd, const char *sIpAddr)
+{
+	struct RouteSession *rs = new RouteSession();
+	rs->hClient.fd = rs->hBackend.fd = -1;
+	rs->sEngineName = engEntry->sEngineName;
+	strncpy(rs->sIpAddr, sIpAddr, sizeof(rs->sIpAddr) - 1);
+	strncpy(rs->sServIpAddr, GetServIp(fd), sizeof(rs->sServIpAddr) - 1);
+
+	if (!JetsonReactorAdd(&rs->hClient, RH_TYPE_ROUTE_CLIENT, fd, rs, EPOLLIN)) {
+		CloseSocket(fd);
+		delete rs;
+		return;
+	}
+
+	pthread_mutex_lock(&gJetsonTableLock);
+	if (++gRegistry.nLastSessionId == 0)
+		++gRegistry.nLastSessionId;
+	rs->nSessionId = gRegistry.nLastSessionId;
+	gRegistry.nVersion++;
+	pthread_mutex_unlock(&gJetsonTableLock);
+	gRouteSessions.push_back(rs);
+
+	rs->candidates = JetsonRouterRank(gRouterBackends, rs->sEngineName, sIpAddr, gnRouteMode);
+	if (!JetsonRouteConnectNext(rs))
+		JetsonRouteNoBackend(rs);
+}
+
+static void JetsonOnRouteEvent(struct RouteSession *rs, int bBackendSide, unsigned int events)
+{
+	if (bBackendSide && !rs->bConnected) {
+		int nSockErr = 0;
+		socklen_t errLen = sizeof(nSockErr);
+		if (getsockopt(rs->hBackend.fd, SOL_SOCKET, SO_ERROR, &nSockErr, &errLen) < 0 || nSockErr != 0) {
+			//down until its next check says otherwise, the session tries the next one
+			JetsonWriteLogs("Backend (%s) refused a session of engine (%s). (%d)\n", rs->backend->sAddr.c_str(),
+				rs->sEngineName.c_str(), nSockErr);
+			rs->backend->bHealthy = 0;
+			rs->backend->nConnectFailures++;
+			rs->backend->routed[rs->sEngineName].nRouted--;
+			rs->backend.reset();
+			JetsonReactorClose(&rs->hBackend);
+			if (!JetsonRouteConnectNext(rs))
+				JetsonRouteNoBackend(rs);
+			return;
+		}
+
+		rs->bConnected = 1;
+		JetsonWriteLogs("Client (%s, %d) of engine (%s) routed to backend %s\n", rs->sIpAddr, rs->hClient.fd,
+			rs->sEngineName.c_str(), rs->backend->sAddr.c_str());
+		if (JetsonRouteFlush(rs, 1))
+			JetsonRouteUpdateEvents(rs);
+		return;
+	}
+
+	if ((events & EPOLLOUT) && !JetsonRouteFlush(rs, bBackendSide))
+		return;
+
+	if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+		int fd = (bBackendSide ? rs->hBackend.fd : rs->hClient.fd);
+		struct IoBuffer *out = (bBackendSide ? &rs->toClient : &rs->toBackend);
+		char sSockReadBuf[RSP_BUFSIZE];
+
+		for (int nReads = 0; nReads < 4 && out->len < ROUTER_HIGH_WATERMARK; nReads++) {
+			int bytesReceived = recv(fd, sSockReadBuf, sizeof(sSockReadBuf), 0);
+			if (bytesReceived < 0 && errno == EINTR)
+				continue;
+			if (bytesReceived < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+				break;
+			if (bytesReceived <= 0) {
+				//whatever the other side still takes right now, e.g. the GUI's quit
+				if (bBackendSide || rs->bConnected)
+					JetsonRouteFlush(rs, !bBackendSide);
+				JetsonRouteClose(rs, (bBackendSide ? "backend ended the session" : "client disconnected"));
+				return;
+			}
+			JetsonIoBufAppend(out, sSockReadBuf, bytesReceived);
+		}
+
+		if ((bBackendSide || rs->bConnected) && !JetsonRouteFlush(rs, !bBackendSide))
+			return;
+	}
+	JetsonRouteUpdateEvents(rs);
+}
+
+//routed engines follow the backends: one listener per engine name any of them offers,
+//unless a local engine has the name; names no backend offers any more are drained
+static void JetsonRouterSync()
+{
+	map<string, string> offered;	//name -> port of the first backend listing it
+	for (size_t i=0; i<gRouterBackends.size(); i++) {
+		const map<string, struct RouterEngine> &engines = gRouterBackends[i]->live.engines;
+		for (auto it = engines.begin(); it != engines.end(); ++it)
+			offered.insert(make_pair(it->first, it->second.sPort));
+	}
+
+	for (auto it = offered.begin(); it != offered.end(); ++it) {
+		if (JetsonRegistryFindEngine(&gRegistry, it->first.c_str()) != NULL ||
+			find(gRouterListenFailed.begin(), gRouterListenFailed.end(), it->first) != gRouterListenFailed.end())
+			continue;
+
+		string sPort = to_string(atoi(it->second.c_str()) + gnRoutePortOffset);
+		struct EngineOptions opts;
+		memset(&opts, 0, sizeof(opts));
+		if (!JetsonListen(SOCK_TYPE_ENGINE, "", "", sPort.c_str(), it->first.c_str(), "", &opts)) {
+			gRouterListenFailed.push_back(it->first);
+			continue;
+		}
+		JetsonRegistryFindEngine(&gRegistry, it->first.c_str())->bRouted = 1;
+		JetsonWriteLogs("Engine (%s) port %s is routed to backend agents\n", it->first.c_str(), sPort.c_str());
+	}
+
+	for (size_t i=0; i<gRegistry.engines.size(); i++) {
+		struct EngineEntry *thisEng = gRegistry.engines[i];
+		if (thisEng->bRouted && !thisEng->bDraining && offered.count(thisEng->sEngineName) == 0)
+			JetsonDrainEngine(thisEng);
+	}
+
+	//health and load are shown by query
+	pthread_mutex_lock(&gJetsonTableLock);
+	gRegistry.nVersion++;
+	pthread_mutex_unlock(&gJetsonTableLock);
+}
+
+static void JetsonRouterTakeChecks()
+{
+	gbRouterChecked = 0;
+
+	int bTaken = 0;
+	for (size_t i=0; i<gRouterBackends.size(); i++) {
+		struct RouterBackend *backend = gRouterBackends[i].get();
+		struct RouterCheck check;
+
+		pthread_mutex_lock(&backend->lock);
+		int bPending = backend->bPending;
+		if (bPending)
+			check = backend->pending;
+		backend->bPending = 0;
+		pthread_mutex_unlock(&backend->lock);
+		if (!bPending)
+			continue;
+
+		//a backend that is down keeps its last inventory, its engines stay routed
+		if (check.bOk) {
+			if (!backend->bHealthy)
+				JetsonWriteLogs("Backend (%s) is up, %d engines\n", backend->sAddr.c_str(), (int)check.engines.size());
+			backend->live = check;
+			for (auto it=backend->routed.begin(); it!=backend->routed.end(); ++it)
+				it->second.nSinceCheck = 0;
+		}
+		else {
+			if (backend->bHealthy || !backend->bEverChecked)
+				JetsonWriteLogs("Backend (%s) is down: %s\n", backend->sAddr.c_str(), check.sError.c_str());
+			backend->live.sError = check.sError;
+		}
+		backend->bHealthy = check.bOk;
+		backend->bEverChecked = 1;
+		bTaken = 1;
+	}
+
+	if (bTaken)
+		JetsonRouterSync();
+}
+
+//after jetson_agent.conf is read: a check thread for each backend= setting
+static void JetsonRouterApplyConf()
+{
+	for (int i=(int)gRouterBackends.size()-1; i>=0; i--) {
+		if (find(gRouterConfBackends.begin(), gRouterConfBackends.end(), gRouterBackends[i]->sAddr) != gRouterConfBackends.end())
+			continue;
+		JetsonWriteLogs("Backend (%s) removed, its sessions stay until they end\n", gRouterBackends[i]->sAddr.c_str());
+		gRouterBackends[i]->bRemoved = 1;
+		gRouterBackends.erase(gRouterBackends.begin() + i);
+	}
+
+	for (size_t i=0; i<gRouterConfBackends.size(); i++) {
+		const string &sAddr = gRouterConfBackends[i];
+		int bKnown = 0;
+		for (size_t k=0; k<gRouterBackends.size(); k++)
+			bKnown |= (gRouterBackends[k]->sAddr == sAddr);
+		if (bKnown)
+			continue;
+
+		shared_ptr<struct RouterBackend> backend = make_shared<struct RouterBackend>();
+		size_t pos = sAddr.rfind(':');
+		backend->sAddr = sAddr;
+		backend->sHost = sAddr.substr(0, pos);
+		backend->sMgmtPort = sAddr.substr(pos + 1);
+		backend->bRemoved = 0;
+		pthread_mutex_init(&backend->lock, NULL);
+
+		pthread_t threadId;
+		shared_ptr<struct RouterBackend> *pArg = new shared_ptr<struct RouterBackend>(backend);
+		if (pthread_create(&threadId, NULL, JetsonRouterThread, pArg) != 0) {
+			JetsonErrorLogs("Backend (%s): check thread not started. (%d)\n", sAddr.c_str(), errno);
+			delete pArg;
+			continue;
+		}
+		pthread_detach(threadId);
+		gRouterBackends.push_back(backend);
+		JetsonWriteLogs("Backend (%s) added, route=%s\n", sAddr.c_str(), (gnRouteMode == ROUTE_MODE_HASH ? "hash" : "load"));
+	}
+
+	gRouterListenFailed.clear();
+	JetsonRouterSync();
+}
+
+static void JetsonReactorDispatch(struct ReactorHandle *h, unsigned int events)
+{
+	struct ClientEntry *client = (struct ClientEntry *)h->owner;
+
+	switch (h->type) {
+	case RH_TYPE_MGMT_LISTEN:
+	case RH_TYPE_ENGINE_LISTEN:
+	case RH_TYPE_METRICS_LISTEN:
+		JetsonOnAccept(h);
+		break;
+	case RH_TYPE_MGMT_CLIENT:
+	case RH_TYPE_METRICS_CLIENT:
+		if (events & EPOLLOUT)
+			JetsonMgmtFlush((struct MgmtConn *)h->owner);
+		else if (h->type == RH_TYPE_MGMT_CLIENT)
+			JetsonOnMgmtReadable((struct MgmtConn *)h->owner);
+		else
+			JetsonOnMetricsReadable((struct MgmtConn *)h->owner);
+		break;
+	case RH_TYPE_MUX_CONN:
+		JetsonOnMuxConnEvent((struct MuxConn *)h->owner, events);
+		break;
+	case RH_TYPE_MUX_CHANNEL:
+		JetsonOnMuxChannelEvent((struct MuxChannel *)h->owner, events);
+		break;
+	case RH_TYPE_DISCOVERY:
+		JetsonOnDiscoveryReadable(h);
+		break;
+	case RH_TYPE_MGMT_DONE:
+		JetsonOnMgmtDone(h);
+		break;
+	case RH_TYPE_ROUTE_CLIENT:
+		JetsonOnRouteEvent((struct RouteSession *)h->owner, 0, events);
+		break;
+	case RH_TYPE_ROUTE_BACKEND:
+		JetsonOnRouteEvent((struct RouteSession *)h->owner, 1, events);
+		break;
+	case RH_TYPE_CLIENT_SOCK:
+		if (events & EPOLLOUT)
+			JetsonOnClientWritable(client);
+		if (h->fd >= 0 && (events & (EPOLLIN | EPOLLHUP | EPOLLERR)))
+			JetsonOnClientReadable(client);
+		break;
+	case RH_TYPE_ENGINE_REQ:
+		JetsonOnRequestPipeWritable(client);
+		break;
+	case RH_TYPE_ENGINE_RSP:
+		JetsonOnResponsePipeReadable(client);
+		break;
+	case RH_TYPE_SIGNAL:
+		JetsonOnSignal(h);
+		break;
+	case RH_TYPE_WAITING_CLIENT:
+		JetsonOnWaitingClientEvent(h, events);
+		break;
+	}
+}
+
+static void JetsonReactorLoop()
+{
+	struct epoll_event events[MAX_REACTOR_EVENTS];
+	int nWaitMsec = 1000;
+	int bSnapshotStale = 1;
+
+	JetsonWriteLogs(">>> Entered reactor loop\n");
+
+	while (!gbAgentExiting) {
+		int nEvents = epoll_wait(gEpollFd, events, MAX_REACTOR_EVENTS, nWaitMsec);
+		if (nEvents < 0) {
+			if (errno == EINTR)
+				continue;
+			JetsonErrorLogs("epoll_wait() failed. (%d)\n", errno);
+			break;
+		}
+
+		for (int i=0; i<nEvents; i++) {
+			struct ReactorHandle *h = (struct ReactorHandle *)events[i].data.ptr;
+			if (h->fd < 0)
+				continue;	//closed earlier in this batch
+			JetsonReactorDispatch(h, events[i].events);
+		}
+
+		if (!gLingeringEngines.empty())
+			JetsonKillLingeringEngines();
+
+		nWaitMsec = (gInfoFlushClients.empty() ? 1000 : JetsonFlushDueInfoLines(1000));
+		nWaitMsec = JetsonSharedPreempt(nWaitMsec);
+		if (gnDetachedSessions > 0)
+			nWaitMsec = JetsonResumeExpire(nWaitMsec);
+		if (!gMgmtSending.empty())
+			nWaitMsec = JetsonMgmtExpire(nWaitMsec);
+
+		//waiting logins get the room first, pools held back by max= take what is left
+		if (gbAdmitCheck) {
+			gbAdmitCheck = 0;
+			JetsonAdmitWaitingLogins();
+			for (size_t i=0; i<gRegistry.engines.size(); i++) {
+				if (gRegistry.engines[i]->nPoolFailures < POOL_MAX_FAILURES)
+					JetsonPoolRefill(gRegistry.engines[i]);
+			}
+		}
+		if (gbRouterChecked)
+			JetsonRouterTakeChecks();
+
+		//----- mux frames queued in this batch go out in as few sends as possible
+		if (!gMuxFlushConns.empty() || !gReleasedMuxConns.empty())
+			JetsonMuxFlushAll();
+
+		//----- release what was closed in this batch, no stale events can refer to it now
+		for (size_t i=0; i<gReleasedClients.size(); i++) {
+			struct ClientEntry *client = gReleasedClients[i];
+
+			JetsonIoBufFree(&client->sockOut);
+			JetsonIoBufFree(&client->pipeOut);
+			JetsonFramerFree(&client->reqFramer);
+			JetsonFramerFree(&client->rspFramer);
+			JetsonIoBufArrayFree(&client->infoPending);
+			JetsonIoBufArrayFree(&client->search.pvLines);
+			JetsonIoBufFree(&client->search.goCmd);
+			JetsonIoBufFree(&client->search.heldReply);
+			JetsonIoBufFree(&client->shared.options);
+			JetsonIoBufFree(&client->shared.position);
+			JetsonIoBufFree(&client->shared.goCmd);
+			JetsonIoBufFree(&client->resume.sent);
+			JetsonIoBufFree(&client->resume.lastInfo);
+			JetsonIoBufFree(&client->lastPosition);
+			if (client->bInfoTimerArmed) {
+				for (size_t k=0; k<gInfoFlushClients.size(); k++) {
+					if (gInfoFlushClients[k] == client) {
+						gInfoFlushClients.erase(gInfoFlushClients.begin() + k);
+						break;
+					}
+				}
+			}
+
+			pthread_mutex_lock(&gJetsonTableLock);
+			JetsonRegistryRemoveInst(client->engine, client);
+			JetsonRegistryRemoveSession(&gRegistry, client);
+			JetsonRegistryRemoveClient(&gRegistry, client);
+			pthread_mutex_unlock(&gJetsonTableLock);
+		}
+		gReleasedClients.clear();
+
+		for (size_t i=0; i<gReleasedHandles.size(); i++)
+			free(gReleasedHandles[i]);
+		gReleasedHandles.clear();
+
+		for (size_t i=0; i<gReleasedRoutes.size(); i++) {
+			JetsonIoBufFree(&gReleasedRoutes[i]->toBackend);
+			JetsonIoBufFree(&gReleasedRoutes[i]->toClient);
+			delete gReleasedRoutes[i];
+		}
+		gReleasedRoutes.clear();
+
+		if (gbReloadPending) {
+			gbReloadPending = 0;
+			JetsonReloadEngines(-1);
+		}
+		if (gnDrainingEngines > 0)
+			JetsonReapDrainedEngines();
+
+		//----- new snapshot once sessions or engines changed, but not more often than
+		//every SNAPSHOT_MIN_MSEC so login churn doesn't rebuild it every batch; counters
+		//in it may lag by SNAPSHOT_REFRESH_MSEC
+		if (nEvents > 0)
+			bSnapshotStale = 1;
+		if (bSnapshotStale) {
+			shared_ptr<const struct RegistrySnapshot> snap = JetsonRegistrySnapshot(&gRegistry);
+			long long nAgeMsec = (snap == NULL ? SNAPSHOT_REFRESH_MSEC : (GetMonotonicUsec() - snap->nBuiltUsec) / 1000);
+			long long nDueMsec = (snap != NULL && snap->nVersion != gRegistry.nVersion ? SNAPSHOT_MIN_MSEC : SNAPSHOT_REFRESH_MSEC);
+			if (nAgeMsec >= nDueMsec) {
+				JetsonPublishSnapshot();
+				bSnapshotStale = 0;
+			}
+			else if (nWaitMsec > nDueMsec - nAgeMsec)
+				nWaitMsec = (int)(nDueMsec - nAgeMsec);
+		}
+	}
+
+	JetsonWriteLogs("<<< Exited reactor loop\n");
+}
+#endif
+
+static int JetsonClientLogin(struct EngineEntry *engEntry, SOCKET sock, const char *sIpAddr, fd_set *pMaster)
+{
+	ostringstream ossReqPipe;
+	ostringstream ossRspPipe;
+	ostringstream ossNewEngExeName;
+	long long loginStartUsec = GetMonotonicUsec();
+
+	try {
+#if defined(_WIN32)
+		HANDLE hReqPipe = INVALID_HANDLE_VALUE;
+		HANDLE hRspPipe = INVALID_HANDLE_VALUE;
+	
+		ossReqPipe << "\\\\.\\pipe\\" << engEntry->sEngineName << "_req_" << sIpAddr;
+		ossRspPipe << "\\\\.\\pipe\\" << engEntry->sEngineName << "_rsp_" << sIpAddr;
+						
+		JetsonWriteLogs("Creating request pipe (%s)\n", ossReqPipe.str().c_str());	
+		hReqPipe = CreateNamedPipe( 
+				ossReqPipe.str().c_str(),	// pipe name 
+				PIPE_ACCESS_DUPLEX,			// read/write access 
+				PIPE_TYPE_MESSAGE |			// message type pipe 
+				PIPE_READMODE_MESSAGE |		// message-read mode 
+				PIPE_WAIT,					// blocking mode 
+				PIPE_UNLIMITED_INSTANCES,	// max. instances  
+				PIPE_BUFSIZE,				// output buffer size 
+				PIPE_BUFSIZE,				// input buffer size 
+				0,							// client time-out 
+				NULL);						// default security attribute 
+
+		if (hReqPipe == INVALID_HANDLE_VALUE) {
+			JetsonErrorLogs("CreateReqPipe (%s) failed, GLE=%d.\n", ossReqPipe.str().c_str(), GetLastError()); 
+			throw runtime_error("CreateReqPipe failed\n");
+		}
+
+		JetsonWriteLogs("Creating response pipe, pipe_name=(%s)\n", ossRspPipe.str().c_str());	
+		hRspPipe = CreateNamedPipe( 
+			ossRspPipe.str().c_str(),					// pipe name 
+			PIPE_ACCESS_DUPLEX,			// read/write access 
+			PIPE_TYPE_MESSAGE |			// message type pipe 
+			PIPE_READMODE_MESSAGE |		// message-read mode 
+			PIPE_WAIT,					// blocking mode 
+			PIPE_UNLIMITED_INSTANCES,	// max. instances  
+			PIPE_BUFSIZE,				// output buffer size 
+			PIPE_BUFSIZE,				// input buffer size 
+			0,							// client time-out 
+			NULL);						// default security attribute 
+
+		if (hRspPipe == INVALID_HANDLE_VALUE) {
+			JetsonErrorLogs("CreateRspPipe (%s) failed, GLE=%d.\n", ossRspPipe.str().c_str(), GetLastError()); 
+			throw runtime_error("CreateRspPipe failed\n");
+		}
+						
+		ossNewEngExeName << "jei_" << sIpAddr << "_" << engEntry->sEngineName << ".exe";
+
+		//instance name is a hard link to the engine executable, created once and
+		//reused by later logins; copy only where the volume has no hard links
+		string sExePath = string(engEntry->sEngineDir) + engEntry->sEngineExeName;
+		string sInstPath = string(engEntry->sEngineDir) + ossNewEngExeName.str();
+		if (GetFileAttributesA(sInstPath.c_str()) == INVALID_FILE_ATTRIBUTES) {
+			JetsonWriteLogs("link instance (%s) -> (%s)\n", sInstPath.c_str(), sExePath.c_str());
+			if (!CreateHardLinkA(sInstPath.c_str(), sExePath.c_str(), NULL) &&
+				!CopyFileA(sExePath.c_str(), sInstPath.c_str(), TRUE)) {
+				JetsonErrorLogs("ERROR: link instance failed, GLE=%d\n", GetLastError());
+				throw runtime_error("link instance failed\n");
+			}
+		}
+#else
+		//anonymous pipes are created when the instance is spawned
+		int hReqPipe = -1;
+		int hRspPipe = -1;
+
+		//the engine executable is launched in place, the instance name only
+		//becomes its argv[0] so ps still tells the instances apart
+		ossNewEngExeName << "jei_" << sIpAddr << "_" << engEntry->sEngineName;
+
+		//----- hand over an initialized instance from the warm pool if there is one
+		struct ClientEntry *pooledClient = JetsonPoolTake(engEntry);
+		if (pooledClient != NULL) {
+			pthread_mutex_lock(&gJetsonTableLock);
+			pooledClient->bIsConnected = 1;
+			pooledClient->sock = sock;
+			strncpy(pooledClient->sIpAddr, sIpAddr, sizeof(pooledClient->sIpAddr) - 1);
+			strncpy(pooledClient->sServIpAddr, GetServIp(sock), sizeof(pooledClient->sServIpAddr) - 1);
+			pooledClient->pMaster = pMaster;
+			JetsonRegistryRemoveInst(engEntry, pooledClient);
+			JetsonRegistryAddSession(&gRegistry, pooledClient);
+			pthread_mutex_unlock(&gJetsonTableLock);
+
+			pooledClient->nPoolState = POOL_STATE_NONE;
+			JetsonSessionStart(pooledClient);
+			pooledClient->nReqFraming = REQ_FRAMING_UNKNOWN;
+			JetsonFramerReset(&pooledClient->reqFramer);
+			JetsonReactorAdd(&pooledClient->hSockEvt, RH_TYPE_CLIENT_SOCK, sock, pooledClient, EPOLLIN);
+			JetsonClientUpdateEvents(pooledClient);
+
+			JetsonWriteLogs("login for client(%s, %d) on engine(%s) took %lld us, pool instance (%s) pid=%d\n",
+				sIpAddr, sock, engEntry->sEngineName, GetMonotonicUsec() - loginStartUsec,
+				pooledClient->sEngInstName, pooledClient->nEnginePid);
+
+			JetsonPoolRefill(engEntry);
+			return 1;
+		}
+#endif
+
+		JetsonWriteLogs("new engine instance name=(%s)\n", ossNewEngExeName.str().c_str());
+
+		//----- add new client login and engine instance
+		//TODO: need to check duplicate client???
+		struct ClientEntry *newClient = NULL;
+		pthread_mutex_lock(&gJetsonTableLock);
+#if defined(_WIN32)
+		//instance threads keep their record, so records are reused here rather than freed
+		for (int i=0; i<engEntry->nClients && newClient == NULL; i++) {
+			if (!engEntry->clients[i]->bIsConnected)
+				newClient = engEntry->clients[i];
+		}
+#endif
+		if (newClient == NULL)
+			newClient = JetsonRegistryAddClient(&gRegistry, engEntry);
+		if (newClient != NULL) {
+			newClient->bIsConnected = 1;
+			newClient->sock = sock;
+			strncpy(newClient->sIpAddr, sIpAddr, sizeof(newClient->sIpAddr) - 1);
+			snprintf(newClient->sEngInstName, sizeof(newClient->sEngInstName), "%s", ossNewEngExeName.str().c_str());
+			newClient->hReqPipe = hReqPipe;
+			newClient->hRspPipe = hRspPipe;
+#if defined(_WIN32)
+			strncpy(newClient->sReqPipe, ossReqPipe.str().c_str(), sizeof(newClient->sReqPipe) - 1);
+			strncpy(newClient->sRspPipe, ossRspPipe.str().c_str(), sizeof(newClient->sRspPipe) - 1);
+#endif
+			newClient->pMaster = pMaster;
+		
+			char *sSrvIp = GetServIp(sock);
+			strncpy(newClient->sServIpAddr, sSrvIp, sizeof(newClient->sServIpAddr) - 1);
+			JetsonRegistryAddSession(&gRegistry, newClient);
+#if defined(_WIN32)
+			JetsonMetricsReset(&newClient->metrics);
+			JetsonMetricAdd(engEntry->metrics.nLogins, 1);
+#endif
+		}
+		pthread_mutex_unlock(&gJetsonTableLock);
+
+		if (newClient == NULL) {
+			JetsonWriteLogs("No memory for a client record on engine (%s)\n", engEntry->sEngineName);
+			return 0;
+		}
+
+		if (newClient != NULL) {
+			JetsonWriteLogs("connected socket = %d, from %s\n", sock, sIpAddr);
+
+#if !defined(_WIN32)
+			newClient->hSockEvt.fd = -1;
+			newClient->hReqPipeEvt.fd = -1;
+			newClient->hRspPipeEvt.fd = -1;
+
+			//shared mode: no process of its own, the slot stays held until released all the same
+			int bSpawned = 0;
+			if (engEntry->pShared != NULL) {
+				newClient->nConfigGen = engEntry->nConfigGen;
+				newClient->nReqFraming = REQ_FRAMING_UNKNOWN;
+				bSpawned = JetsonFramerInit(&newClient->reqFramer, FRAMER_BUFSIZE);
+			}
+			else
+				bSpawned = JetsonSpawnEngineInstance(newClient);
+
+			if (!bSpawned) {
+				pthread_mutex_lock(&gJetsonTableLock);
+				newClient->bIsConnected = 0;
+				JetsonRegistryRemoveSession(&gRegistry, newClient);
+				pthread_mutex_unlock(&gJetsonTableLock);
+				JetsonClientRelease(newClient);
+				throw runtime_error("Unable to spawn engine instance\n");
+			}
+
+			pthread_mutex_lock(&gJetsonTableLock);
+			newClient->bIsEngineRunning = 1;
+			pthread_mutex_unlock(&gJetsonTableLock);
+
+			JetsonSessionStart(newClient);
+			JetsonReactorAdd(&newClient->hSockEvt, RH_TYPE_CLIENT_SOCK, sock, newClient, EPOLLIN);
+			if (engEntry->pShared == NULL) {
+				JetsonReactorAdd(&newClient->hRspPipeEvt, RH_TYPE_ENGINE_RSP, newClient->hRspPipe, newClient, EPOLLIN);
+				JetsonReactorAdd(&newClient->hReqPipeEvt, RH_TYPE_ENGINE_REQ, newClient->hReqPipe, newClient, 0);
+			}
+			else
+				JetsonSharedRefill(engEntry);	//fails the session at once if the workers never came up
+
+			JetsonWriteLogs("login for client(%s, %d) on engine(%s) took %lld us\n",
+				sIpAddr, sock, engEntry->sEngineName, GetMonotonicUsec() - loginStartUsec);
+#else
+			int rc;
+
+			pthread_t engineInstanceReqThreadId;
+			rc = pthread_create(&engineInstanceReqThreadId, NULL, EngineInstanceRequestThread, (void *)newClient);
+			if (rc != 0)
+				throw runtime_error("Unable to create engine instance request thread\n");
+
+			pthread_t engineInstanceRspThreadId;
+			rc = pthread_create(&engineInstanceRspThreadId, NULL, EngineInstanceResponseThread, (void *)newClient);
+			if (rc != 0)
+				throw runtime_error("Unable to create engine instance response thread\n");
+	    
+			pthread_t engineInstanceThreadId;
+			rc = pthread_create(&engineInstanceThreadId, NULL, EngineInstanceThread, (void *)newClient);
+			if (rc != 0)
+				throw runtime_error("Unable to create engine instance thread\n");
+#endif
+		}
+	} catch (exception& e) {
+  		//TODO: better to clean up resources here!!!
+		JetsonErrorLogs("<<< ERROR on login for Client (%s, %d) (%s): %s",
+				sIpAddr, sock, engEntry->sEngineName, e.what());	
+		return 0;
+	}
+	
+	return 1;
+}
+
+static int JetsonFindEngine(const char *sEngName)
+{
+	pthread_mutex_lock(&gJetsonTableLock);
+	//a draining entry only serves the sessions it already has, it isn't listed by name
+	int bIsEngineExist = (JetsonRegistryFindEngine(&gRegistry, sEngName) != NULL);
+	pthread_mutex_unlock(&gJetsonTableLock);
+
+	return bIsEngineExist;	
+}
+
+#if !defined(_WIN32)
+//store file lives in the engine folder, every agent serving the engine from it shares it
+static void JetsonOpenStore(struct EngineEntry *engEntry)
+{
+	string sPath = string(engEntry->sEngineDir) + STORE_FILE_NAME;
+	string sError;
+	engEntry->pStore = JetsonStoreOpen(sPath.c_str(), engEntry->opts.nStoreMb, &sError);
+	if (engEntry->pStore == NULL)
+		JetsonErrorLogs("Engine (%s): analysis store %s not opened, %s\n", engEntry->sEngineName, sPath.c_str(), sError.c_str());
+	else
+		JetsonWriteLogs("Engine (%s): analysis store %s, %llu slots\n", engEntry->sEngineName, sPath.c_str(),
+			(unsigned long long)engEntry->pStore->nSlots);
+}
+#endif
+
+static struct EngineEntry* JetsonAddNewEngine(const char *sEngDir, const char *sEngExeName, 
+		const char *sEngPort, const char *sEngName, const char *arguments, const struct EngineOptions *pOpts)
+{
+	pthread_mutex_lock(&gJetsonTableLock);
+	struct EngineEntry *thisEng = JetsonRegistryAddEngine(&gRegistry, sEngName, sEngPort);
+	if (thisEng != NULL) {
+		strncpy(thisEng->sEngineDir, sEngDir, sizeof(thisEng->sEngineDir) - 1);
+		strncpy(thisEng->sEngineName, sEngName, sizeof(thisEng->sEngineName) - 1);
+		strncpy(thisEng->sEngineExeName, sEngExeName, sizeof(thisEng->sEngineExeName) - 1);
+		strncpy(thisEng->sEngienPort, sEngPort, sizeof(thisEng->sEngienPort) - 1);
+		strncpy(thisEng->arguments, arguments, sizeof(thisEng->arguments) - 1);
+		thisEng->opts = *pOpts;
+#if !defined(_WIN32)
+		if (pOpts->nCacheSize > 0)
+			thisEng->pCache = JetsonCacheCreate(pOpts->nCacheSize);
+		if (pOpts->nStoreMb > 0)
+			JetsonOpenStore(thisEng);
+		if (pOpts->nSharedWorkers > 0) {
+			//shared workers are the engine's only processes, no per-login pool
+			thisEng->opts.nPoolSize = 0;
+			thisEng->pShared = JetsonSharedCreate();
+		}
+#endif
+	}
+	pthread_mutex_unlock(&gJetsonTableLock);
+	
+	return thisEng;
+}
+
+#if !defined(_WIN32)
+//entry without records: never listened, or drained after a reload
+static void JetsonFreeEngine(struct EngineEntry *engEntry)
+{
+	pthread_mutex_lock(&gJetsonTableLock);
+	delete engEntry->pCache;
+	JetsonStoreClose(engEntry->pStore);
+	delete engEntry->pShared;
+	JetsonRegistryRemoveEngine(&gRegistry, engEntry);
+	pthread_mutex_unlock(&gJetsonTableLock);
+}
+#endif
+
+#if defined(_WIN32)
+static int JetsonSocket(int sockType, const char *sEngDir, const char *sEngExeName, const char *sEngPort, const char *sEngName, const char *arguments, const struct EngineOptions *pOpts)
+{
+	if (sockType != SOCK_TYPE_ENGINE &&
+		sockType != SOCK_TYPE_MGMT) {
+		JetsonErrorLogs("ERROR: invalid sockType(%d)\n", sockType);
+		return 0;
+	}
+	
+	if (sockType == SOCK_TYPE_MGMT)
+		JetsonWriteLogs(">>> MGMT creating listening socket...\n");
+	else
+		JetsonWriteLogs(">>> Engine (%s) creating listening socket...\n", sEngName);
+	
+	int bIsSockListenValid = 0;
+    SOCKET sockListen;
+		
+	try {
+		struct addrinfo localAddr;
+		memset(&localAddr, 0, sizeof(localAddr));
+		localAddr.ai_family = AF_INET;
+		localAddr.ai_socktype = SOCK_STREAM;
+		localAddr.ai_flags = AI_PASSIVE;
+
+		struct addrinfo *bindAddr;
+		getaddrinfo(0, sEngPort, &localAddr, &bindAddr);
+
+		sockListen = socket(bindAddr->ai_family,
+				    bindAddr->ai_socktype, bindAddr->ai_protocol);
+		if (!IsSockValid(sockListen)) {
+			JetsonErrorLogs("socket() failed. (%d)\n", GetSockErrno());
+			throw runtime_error("socket() failed\n");
+		}
+		bIsSockListenValid = 1;
+
+		if (bind(sockListen, bindAddr->ai_addr, bindAddr->ai_addrlen)) {
+			JetsonErrorLogs("bind() failed. (%d)\n", GetSockErrno());
+			throw runtime_error("bind() failed\n");
+		}
+		freeaddrinfo(bindAddr);
+
+		if (listen(sockListen, 10) < 0) {
+			JetsonErrorLogs("listen() failed. (%d)\n", GetSockErrno());
+			throw runtime_error("listen() failed\n");
+		}
+
+		fd_set master;
+		FD_ZERO(&master);
+		FD_SET(sockListen, &master);
+		SOCKET maxSock = sockListen;
+
+		struct EngineEntry *pNewEng = NULL;
+
+		if (sockType == SOCK_TYPE_MGMT)
+			printf("MGMT waiting for connections...\n");
+		else {
+			printf("Engine (%s) waiting for connections...\n", sEngName);
+		
+			pNewEng = JetsonAddNewEngine(sEngDir, sEngExeName, sEngPort, sEngName, arguments, pOpts);
+			if (pNewEng == NULL) {
+				JetsonWriteLogs("Unable to add new engine for %s\n", sEngName);
+				throw runtime_error("add engine failed\n");
+			}
+		}
+
+		while(1) {
+			struct timeval timeout;
+			timeout.tv_sec = 1;
+			timeout.tv_usec = 0;
 				   	
 			fd_set reads;
 			reads = master;
 			if (select(maxSock+1, &reads, 0, 0, &timeout) < 0) {
-				JetsonWriteLogs("select() failed. (%d)\n", GetSockErrno());
+				JetsonErrorLogs("select() failed. (%d)\n", GetSockErrno());
 				throw runtime_error("select() failed\n");
 			}
 
@@ -626,7 +4802,7 @@ static int JetsonSocket(int sockType, const char *sEngDir, const char *sEngExeNa
 									(struct sockaddr*) &clientAddr,
 									&clientLen);
 						if (!IsSockValid(sockClient)) {
-							JetsonWriteLogs("accept() failed. (%d)\n", GetSockErrno());
+							JetsonErrorLogs("accept() failed. (%d)\n", GetSockErrno());
 							throw runtime_error("accept() failed\n");
 						}
 
@@ -667,10 +4843,20 @@ static int JetsonSocket(int sockType, const char *sEngDir, const char *sEngExeNa
     
 							JetsonWriteLogs("MGMT received cmd=%s\n", sSockReadBuf);
                     
-							if (strncmp(sSockReadBuf, "scan", 4) == 0)
-								JetsonScanAndLoadEngines(i, 1);
+							if (strncmp(sSockReadBuf, "scan", 4) == 0) {
+								string sScan = JetsonRenderScan(GetServIp(i));
+								send(i, sScan.c_str(), (int)sScan.length(), 0);
+							}
 							else if (strcmp(sSockReadBuf, "query") == 0)
 								JetsonQueryEngines(i);
+							else if (strcmp(sSockReadBuf, "stats") == 0) {
+								string sStats = JetsonRenderStats() + "# statsdone\n";
+								send(i, sStats.c_str(), (int)sStats.length(), 0);
+							}
+							else if (strcmp(sSockReadBuf, "reload") == 0) {
+								const char *sReply = "reload is not supported on Windows, restart the agent\nreloaddone\n";
+								send(i, sReply, strlen(sReply), 0);
+							}
 						}
 					} //receive socket data
 				} //if FD_ISSET
@@ -679,160 +4865,610 @@ static int JetsonSocket(int sockType, const char *sEngDir, const char *sEngExeNa
 		
 		// before exiting out, cleanup all resources
 
-	} catch (exception& e) {
-		//TODO: better to clean up resources here!!!
-		if (sockType == SOCK_TYPE_MGMT)
-			JetsonWriteLogs("<<< ERROR on mgmt socket: %s", e.what());
-		else	
-			JetsonWriteLogs("<<< ERROR on engine socket: %s", e.what());	
+	} catch (exception& e) {
+		//TODO: better to clean up resources here!!!
+		if (sockType == SOCK_TYPE_MGMT)
+			JetsonErrorLogs("<<< ERROR on mgmt socket: %s", e.what());
+		else	
+			JetsonErrorLogs("<<< ERROR on engine socket: %s", e.what());	
+	}
+		
+	if (bIsSockListenValid)
+		CloseSocket(sockListen);
+	
+	if (sockType == SOCK_TYPE_MGMT)
+		JetsonWriteLogs("<<< MGMT closing listening socket...\n");
+	else
+		JetsonWriteLogs("<<< Engine (%s) closing listening socket...\n", sEngName);
+
+	return 0;
+}
+#else
+static int JetsonListen(int sockType, const char *sEngDir, const char *sEngExeName, const char *sEngPort, const char *sEngName, const char *arguments, const struct EngineOptions *pOpts)
+{
+	if (sockType == SOCK_TYPE_MGMT)
+		JetsonWriteLogs(">>> MGMT creating listening socket...\n");
+	else if (sockType == SOCK_TYPE_METRICS)
+		JetsonWriteLogs(">>> Metrics creating listening socket on port %s...\n", sEngPort);
+	else
+		JetsonWriteLogs(">>> Engine (%s) creating listening socket...\n", sEngName);
+	
+	int bIsSockListenValid = 0;
+	SOCKET sockListen;
+		
+	try {
+		struct addrinfo localAddr;
+		memset(&localAddr, 0, sizeof(localAddr));
+		localAddr.ai_family = AF_INET;
+		localAddr.ai_socktype = SOCK_STREAM;
+		localAddr.ai_flags = AI_PASSIVE;
+
+		struct addrinfo *bindAddr;
+		getaddrinfo(0, sEngPort, &localAddr, &bindAddr);
+
+		sockListen = socket(bindAddr->ai_family,
+				    bindAddr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, bindAddr->ai_protocol);
+		if (!IsSockValid(sockListen)) {
+			JetsonErrorLogs("socket() failed. (%d)\n", GetSockErrno());
+			throw runtime_error("socket() failed\n");
+		}
+		bIsSockListenValid = 1;
+
+		//sessions closed by the agent leave TIME_WAIT behind on the engine port
+		int reuse = 1;
+		setsockopt(sockListen, SOL_SOCKET, SO_REUSEADDR, &reuse, sizeof(reuse));
+
+		if (bind(sockListen, bindAddr->ai_addr, bindAddr->ai_addrlen)) {
+			JetsonErrorLogs("bind() failed. (%d)\n", GetSockErrno());
+			throw runtime_error("bind() failed\n");
+		}
+		freeaddrinfo(bindAddr);
+
+		if (listen(sockListen, SOMAXCONN) < 0) {
+			JetsonErrorLogs("listen() failed. (%d)\n", GetSockErrno());
+			throw runtime_error("listen() failed\n");
+		}
+
+		if (sockType == SOCK_TYPE_MGMT) {
+			if (!JetsonReactorAdd(&gMgmtListenEvt, RH_TYPE_MGMT_LISTEN, sockListen, NULL, EPOLLIN))
+				throw runtime_error("register mgmt listener failed\n");
+			printf("MGMT waiting for connections...\n");
+		}
+		else if (sockType == SOCK_TYPE_METRICS) {
+			if (!JetsonReactorAdd(&gMetricsListenEvt, RH_TYPE_METRICS_LISTEN, sockListen, NULL, EPOLLIN))
+				throw runtime_error("register metrics listener failed\n");
+			gsMetricsListenPort = sEngPort;
+		}
+		else {
+			struct EngineEntry *pNewEng = JetsonAddNewEngine(sEngDir, sEngExeName, sEngPort, sEngName, arguments, pOpts);
+			if (pNewEng == NULL) {
+				JetsonWriteLogs("Unable to add new engine for %s\n", sEngName);
+				throw runtime_error("add engine failed\n");
+			}
+
+			pNewEng->sockListen = sockListen;
+			if (!JetsonReactorAdd(&pNewEng->hListenEvt, RH_TYPE_ENGINE_LISTEN, sockListen, pNewEng, EPOLLIN)) {
+				JetsonFreeEngine(pNewEng);
+				throw runtime_error("register engine listener failed\n");
+			}
+			printf("Engine (%s) waiting for connections...\n", sEngName);
+
+			JetsonPoolRefill(pNewEng);
+			JetsonSharedRefill(pNewEng);
+		}
+		return 1;
+	} catch (exception& e) {
+		if (sockType == SOCK_TYPE_MGMT)
+			JetsonErrorLogs("<<< ERROR on mgmt socket: %s", e.what());
+		else if (sockType == SOCK_TYPE_METRICS)
+			JetsonErrorLogs("<<< ERROR on metrics socket: %s", e.what());
+		else	
+			JetsonErrorLogs("<<< ERROR on engine socket: %s", e.what());	
+	}
+		
+	if (bIsSockListenValid)
+		CloseSocket(sockListen);
+	
+	return 0;
+}
+
+//listener follows metrics=PORT after every scan/reload: opened, moved or closed
+static void JetsonApplyMetricsPort()
+{
+	if (gMetricsListenEvt.fd >= 0 && gsMetricsListenPort == gsMetricsPortStr)
+		return;
+
+	if (gMetricsListenEvt.fd >= 0) {
+		JetsonWriteLogs("<<< Metrics closing listening socket on port %s\n", gsMetricsListenPort.c_str());
+		JetsonReactorClose(&gMetricsListenEvt);
+		gsMetricsListenPort.clear();
+	}
+	if (!gsMetricsPortStr.empty())
+		JetsonListen(SOCK_TYPE_METRICS, NULL, NULL, gsMetricsPortStr.c_str(), NULL, NULL, NULL);
+}
+#endif
+
+#if defined(_WIN32)
+static bool FileExists(const string &fileName)
+{
+    return _access_s(fileName.c_str(), 0) == 0;
+}
+#endif
+
+static void JetsonLaunchEngine(struct EngineEntry *pTmpEngEntry)
+{
+	char *sBackendDir = pTmpEngEntry->sEngineDir;
+	char *sEngName = pTmpEngEntry->sEngineName;
+	char *sEngExe = pTmpEngEntry->sEngineExeName;
+	char *sEngPort = pTmpEngEntry->sEngienPort;
+	char *arguments = pTmpEngEntry->arguments;
+	
+	ostringstream ossEngDir;
+#if defined(_WIN32)
+	ossEngDir << sBackendDir << "\\" << sEngName << "\\";
+#else
+	ossEngDir << sBackendDir << "/" << sEngName << "/";
+#endif
+	
+	string sEngDir = ossEngDir.str();
+	
+	JetsonWriteLogs(">>> Entered eng_launch (%s)\n", sEngName);
+	
+	//check if engine exe exists
+	ostringstream ossEngExeFullPath;
+	ossEngExeFullPath << ossEngDir.str() << sEngExe;
+	if (!FileExists(ossEngExeFullPath.str().c_str())) {
+		JetsonErrorLogs("ERROR: engine executable path (%s) not exist\n", ossEngExeFullPath.str().c_str());		
+	}
+	else {
+		if (JetsonFindEngine(sEngName)) {
+			JetsonWriteLogs("Engine (%s) exist!\n", sEngName);
+		}
+		else {
+			JetsonWriteLogs("Launching new engine (%s)\n", sEngName);
+#if !defined(_WIN32)
+			//instances run the executable in place, so it has to be executable itself
+			if (access(ossEngExeFullPath.str().c_str(), X_OK) != 0) {
+				JetsonWriteLogs("Engine executable (%s) is not executable, chmod a+x\n", ossEngExeFullPath.str().c_str());
+				struct stat exeStat;
+				if (stat(ossEngExeFullPath.str().c_str(), &exeStat) == 0)
+					chmod(ossEngExeFullPath.str().c_str(), exeStat.st_mode | S_IXUSR | S_IXGRP | S_IXOTH);
+			}
+#endif
+#if defined(_WIN32)
+			if (pTmpEngEntry->opts.nPoolSize > 0 || pTmpEngEntry->opts.nCoalesceMsec > 0 ||
+				pTmpEngEntry->opts.nCacheSize > 0 || pTmpEngEntry->opts.nSharedWorkers > 0 ||
+				pTmpEngEntry->opts.nStoreMb > 0 || pTmpEngEntry->opts.nMaxInstances > 0 || pTmpEngEntry->opts.bSplice ||
+				gnNodeMaxInstances > 0)
+				JetsonWriteLogs("Engine (%s): pool/coalesce/cache/store/shared/max/splice are not supported on Windows\n", sEngName);
+			JetsonSocket(SOCK_TYPE_ENGINE, sEngDir.c_str(), sEngExe, sEngPort, sEngName, arguments, &pTmpEngEntry->opts);
+#else
+			JetsonListen(SOCK_TYPE_ENGINE, sEngDir.c_str(), sEngExe, sEngPort, sEngName, arguments, &pTmpEngEntry->opts);
+#endif
+		}
+	}
+	
+	JetsonWriteLogs("<<< Exited eng_launch for engine(%s)\n", sEngName);
+	free(pTmpEngEntry);
+}
+
+#if defined(_WIN32)
+static void *EngineLaunchThread(void *data)
+{
+	JetsonLaunchEngine((struct EngineEntry *)data);
+	return NULL;
+}
+#endif
+
+//----- query is answered from gRegistry.pSnapshot: built from the live tables by whoever
+//changes them and swapped in whole, so a reader never waits for a writer or another reader
+static void JetsonPublishSnapshot()
+{
+	shared_ptr<struct RegistrySnapshot> snap = make_shared<struct RegistrySnapshot>();
+
+	pthread_mutex_lock(&gJetsonTableLock);
+	snap->nVersion = gRegistry.nVersion;
+	snap->nBuiltUsec = GetMonotonicUsec();
+	snap->nSessions = gRegistry.bySession.size();
+#if !defined(_WIN32)
+	snap->nSessions += gRouteSessions.size();
+#endif
+	snap->nRecordsAllocated = gRegistry.nRecordsAllocated;
+#if !defined(_WIN32)
+	if (gnNodeMaxInstances > 0 || !gLoginQueue.empty()) {
+		ostringstream oss;
+		oss << "Node Limit(max=" << gnNodeMaxInstances << "): " << JetsonCountInstances(NULL, NULL)
+			<< " instances running, " << gLoginQueue.size() << " logins waiting\n";
+		snap->sNodeLine = oss.str();
+	}
+#endif
+	snap->engines.resize(gRegistry.engines.size());
+	for (size_t i=0; i<gRegistry.engines.size(); i++) {
+		struct EngineEntry *thisEng = gRegistry.engines[i];
+		struct EngineView *view = &snap->engines[i];
+
+		view->sEngineName = thisEng->sEngineName;
+		view->sEngienPort = thisEng->sEngienPort;
+		view->sExecutable = string(thisEng->sEngineDir) + thisEng->sEngineExeName;
+		view->bDraining = thisEng->bDraining;
+		view->bRouted = thisEng->bRouted;
+		view->bOffline = 0;
+		JetsonMetricsCopyEngine(&thisEng->metrics, &view->counters);
+#if !defined(_WIN32)
+		if (thisEng->bRouted) {
+			view->bOffline = 1;
+			for (size_t k=0; k<gRouterBackends.size(); k++) {
+				const struct RouterBackend *backend = gRouterBackends[k].get();
+				auto it = backend->live.engines.find(thisEng->sEngineName);
+				if (it == backend->live.engines.end())
+					continue;
+
+				ostringstream oss;
+				oss << "Backend Agent(" << backend->sAddr << ") Port(" << it->second.sPort << ") "
+					<< (backend->bHealthy ? "up" : "down: " + backend->live.sError);
+				if (it->second.bLoadKnown)
+					oss << ", " << it->second.nSessions << " sessions, " << it->second.nWaiting << " waiting";
+				auto itCounts = backend->routed.find(thisEng->sEngineName);
+				if (itCounts != backend->routed.end())
+					oss << ", " << itCounts->second.nRouted << " routed from here, " << itCounts->second.nTotal << " total";
+				else
+					oss << ", 0 routed from here, 0 total";
+				view->stats.push_back(oss.str());
+				view->bOffline &= !backend->bHealthy;
+			}
+			for (size_t k=0; k<gRouteSessions.size(); k++) {
+				const struct RouteSession *rs = gRouteSessions[k];
+				if (rs->sEngineName != thisEng->sEngineName)
+					continue;
+
+				struct SessionView sv;
+				sv.nSessionId = rs->nSessionId;
+				sv.sock = rs->hClient.fd;
+				sv.sIpAddr = rs->sIpAddr;
+				sv.sServIpAddr = rs->sServIpAddr;
+				sv.sEngInstName = rs->sEngineName;
+				sv.sState = " Routed(" + (rs->backend != NULL ? rs->backend->sAddr : string("connecting")) + ")";
+				sv.bCounted = 0;
+				view->sessions.push_back(sv);
+			}
+		}
+		if (thisEng->opts.nPoolSize > 0) {
+			int nWarming, nIdle, nRecycling;
+			ostringstream oss;
+			JetsonPoolCount(thisEng, &nWarming, &nIdle, &nRecycling);
+			oss << "Warm Pool(" << thisEng->opts.nPoolSize << "): " << nIdle << " ready, "
+				<< nWarming << " starting, " << nRecycling << " recycling";
+			view->stats.push_back(oss.str());
+		}
+		if (thisEng->pCache != NULL) {
+			ostringstream oss;
+			oss << "Analysis Cache(" << thisEng->pCache->nCapacity << "): " << thisEng->pCache->lru.size()
+				<< " entries, " << thisEng->pCache->nHits << " hits, " << thisEng->pCache->nMisses << " misses, "
+				<< thisEng->pCache->nAttached << " shared searches";
+			view->stats.push_back(oss.str());
+		}
+		if (thisEng->pStore != NULL) {
+			ostringstream oss;
+			oss << "Analysis Store(" << thisEng->pStore->nSlots << " slots): " << thisEng->pStore->nHits << " hits, "
+				<< thisEng->pStore->nMisses << " misses, " << thisEng->pStore->nStored << " stored, "
+				<< thisEng->pStore->nSkipped << " not stored";
+			view->stats.push_back(oss.str());
+		}
+		int nWaiting = 0;
+		for (size_t k=0; k<gLoginQueue.size(); k++)
+			nWaiting += (gLoginQueue[k]->engine == thisEng);
+		if (thisEng->opts.nMaxInstances > 0 || nWaiting > 0 || thisEng->nLoginsWaited > 0) {
+			ostringstream oss;
+			oss << "Login Queue(max=" << thisEng->opts.nMaxInstances << "): " << nWaiting << " waiting, "
+				<< thisEng->nLoginsWaited << " admitted after waiting, wait avg "
+				<< (thisEng->nLoginsWaited > 0 ? thisEng->nLoginWaitMsecTotal / thisEng->nLoginsWaited : 0)
+				<< " ms max " << thisEng->nLoginWaitMsecMax << " ms";
+			view->stats.push_back(oss.str());
+		}
+		if (thisEng->pShared != NULL) {
+			struct SharedEngine *shared = thisEng->pShared;
+			int nWarming, nIdle, nBusy;
+			ostringstream oss;
+			JetsonSharedCount(thisEng, &nWarming, &nIdle, &nBusy);
+			oss << "Shared Workers(" << thisEng->opts.nSharedWorkers << "): " << nBusy << " busy, "
+				<< nIdle << " idle, " << nWarming << " starting, " << shared->runQueue.size() << " go queued, "
+				<< shared->nDispatched << " run, " << shared->nPreempted << " preempted, wait avg "
+				<< (shared->nDispatched > 0 ? shared->nWaitMsecTotal / shared->nDispatched : 0)
+				<< " ms max " << shared->nWaitMsecMax << " ms";
+			view->stats.push_back(oss.str());
+		}
+#endif
+		for (int j=0; j<thisEng->nClients; j++) {
+			struct ClientEntry *thisClient = thisEng->clients[j];
+
+			if (!thisClient->bIsConnected)
+				continue;
+
+			struct SessionView sv;
+			sv.nSessionId = thisClient->nSessionId;
+			sv.sock = thisClient->sock;
+			sv.sIpAddr = thisClient->sIpAddr;
+			sv.sServIpAddr = thisClient->sServIpAddr;
+			sv.sEngInstName = thisClient->sEngInstName;
+			sv.bCounted = (thisClient->nSessionId != 0);
+			JetsonMetricsCopySession(&thisClient->metrics, &sv.counters);
+#if !defined(_WIN32)
+			if (thisClient->shared.nState == SHARED_STATE_BUSY)
+				sv.sState = string(" Shared Worker(") + thisClient->shared.pPeer->sEngInstName + ")";
+			else if (thisClient->shared.nState == SHARED_STATE_QUEUED)
+				sv.sState = " Shared(queued)";
+			else
+				sv.sState = " PID(" + to_string(thisClient->nEnginePid) + ")";
+			if (thisClient->resume.bDetached)
+				sv.sState += " Detached(" + to_string((thisClient->resume.nDeadlineMsec - JetsonNowMsec() + 999) / 1000) + "s left)";
+#endif
+			view->sessions.push_back(sv);
+		}
+	}
+	pthread_mutex_unlock(&gJetsonTableLock);
+
+	//query text is rendered once per snapshot, not once per query
+	ostringstream oss;
+	oss << "\n===== Engine Table Entries from Server (" << gsMyHostName
+		<< ") OS-ARCH (" << gsMyOsArch << ")  =====\n";
+	oss << "Registry: " << snap->engines.size() << " engines, " << snap->nSessions
+		<< " sessions, " << snap->nRecordsAllocated << " records in use\n";
+	oss << snap->sNodeLine;
+
+	for (size_t i=0; i<snap->engines.size(); i++) {
+		const struct EngineView *thisEng = &snap->engines[i];
+
+		if (i > 0)
+			oss << "\n";
+
+		oss << "Engine(" << thisEng->sEngineName << ") TCP Port(" << thisEng->sEngienPort << ")"
+			<< (thisEng->bDraining ? " Draining" : "") << "\n";
+		if (thisEng->bRouted)
+			oss << "   " << "Routed To Backend Agents" << (thisEng->bOffline ? ", none up" : "") << "\n";
+		else
+			oss << "   " << "Executable On Server(" << thisEng->sExecutable << ")\n";
+		for (size_t k=0; k<thisEng->stats.size(); k++)
+			oss << "   " << thisEng->stats[k] << "\n";
+		oss << "   " << "Connected Users:\n";
+
+		for (size_t j=0; j<thisEng->sessions.size(); j++) {
+			const struct SessionView *thisClient = &thisEng->sessions[j];
+
+			oss << "      * Session(" << thisClient->nSessionId << ") Client IP[" << thisClient->sIpAddr << "] Socket("
+				<< thisClient->sock << ") Server IP[" << thisClient->sServIpAddr << "] "
+				<< "Engine Instance(" << thisClient->sEngInstName << ")" << thisClient->sState << "\n";
+		}
+	}
+	oss << "================================<<<querydone\n\n";
+	snap->sQueryText = oss.str();
+
+	JetsonRegistryPublish(&gRegistry, snap);
+}
+
+//published snapshot, built here if there is none yet or, on Windows, it is stale
+static shared_ptr<const struct RegistrySnapshot> JetsonCurrentSnapshot()
+{
+	shared_ptr<const struct RegistrySnapshot> snap = JetsonRegistrySnapshot(&gRegistry);
+#if defined(_WIN32)
+	//no reactor to publish after each batch, login threads only bump the version
+	pthread_mutex_lock(&gJetsonTableLock);
+	int bStale = (snap == NULL || snap->nVersion != gRegistry.nVersion
+		|| GetMonotonicUsec() - snap->nBuiltUsec >= SNAPSHOT_REFRESH_MSEC * 1000LL);
+	pthread_mutex_unlock(&gJetsonTableLock);
+#else
+	int bStale = (snap == NULL);
+#endif
+	if (bStale) {
+		JetsonPublishSnapshot();
+		snap = JetsonRegistrySnapshot(&gRegistry);
+	}
+	return snap;
+}
+
+static void JetsonQueryEngines(SOCKET sockClient)
+{
+	shared_ptr<const struct RegistrySnapshot> snap = JetsonCurrentSnapshot();
+	JetsonMgmtSend(sockClient, snap->sQueryText.c_str(), snap->sQueryText.length());
+	JetsonWriteLogs("<<< Engine query done for client socket %d, registry version %llu\n",
+		sockClient, snap->nVersion);
+}
+
+//----- reply to stats and to a metrics scrape, rendered from the published snapshot
+//without taking the table lock; its counters are SNAPSHOT_REFRESH_MSEC old at most
+static string JetsonRenderStats()
+{
+	shared_ptr<const struct RegistrySnapshot> snap = JetsonCurrentSnapshot();
+	ostringstream families[MAX_STAT_FAMILIES];
+
+	for (size_t i=0; i<snap->engines.size(); i++) {
+		const struct EngineView *thisEng = &snap->engines[i];
+		const struct EngineCounters *em = &thisEng->counters;
+		string sEngLabel = "engine=\"" + JetsonPromLabel(thisEng->sEngineName.c_str()) + "\"";
+
+		int nActive = 0;
+		for (size_t j=0; j<thisEng->sessions.size(); j++) {
+			const struct SessionView *thisClient = &thisEng->sessions[j];
+			const struct SessionCounters *m = &thisClient->counters;
+
+			if (!thisClient->bCounted)
+				continue;
+			nActive++;
+
+			string sLabels = sEngLabel + ",session=\"" + to_string(thisClient->nSessionId)
+				+ "\",client=\"" + JetsonPromLabel(thisClient->sIpAddr.c_str()) + "\"";
+			JetsonPromSample(families, STAT_SESSION_BYTES_IN, sLabels, m->nBytesIn);
+			JetsonPromSample(families, STAT_SESSION_BYTES_OUT, sLabels, m->nBytesOut);
+			JetsonPromSample(families, STAT_SESSION_COMMANDS, sLabels, m->nCommands);
+			JetsonPromSample(families, STAT_SESSION_GO, sLabels, m->nGoCount);
+			JetsonPromSample(families, STAT_SESSION_NPS, sLabels, m->nLastNps);
+			JetsonPromSample(families, STAT_SESSION_DEPTH, sLabels, m->nLastDepth);
+			JetsonPromSample(families, STAT_SESSION_FIRST_INFO, sLabels, m->nFirstInfoUsec / 1e6);
+			JetsonPromSample(families, STAT_SESSION_BESTMOVE, sLabels, m->nBestMoveUsec / 1e6);
+		}
+
+		JetsonPromSample(families, STAT_SESSIONS_ACTIVE, sEngLabel, nActive);
+		JetsonPromSample(families, STAT_BYTES_IN, sEngLabel, em->nBytesIn);
+		JetsonPromSample(families, STAT_BYTES_OUT, sEngLabel, em->nBytesOut);
+		JetsonPromSample(families, STAT_COMMANDS, sEngLabel, em->nCommands);
+		JetsonPromSample(families, STAT_GO, sEngLabel, em->nGoCount);
+		JetsonPromSample(families, STAT_LOGINS, sEngLabel, em->nLogins);
+		JetsonPromSample(families, STAT_ENGINE_NPS, sEngLabel, em->nLastNps);
+		JetsonPromSample(families, STAT_ENGINE_DEPTH, sEngLabel, em->nLastDepth);
+		JetsonPromHistogram(families, STAT_FIRST_INFO, sEngLabel, &em->firstInfo);
+		JetsonPromHistogram(families, STAT_BESTMOVE, sEngLabel, &em->bestMove);
 	}
-		
-	if (bIsSockListenValid)
-		CloseSocket(sockListen);
-	
-	if (sockType == SOCK_TYPE_MGMT)
-		JetsonWriteLogs("<<< MGMT closing listening socket...\n");
-	else
-		JetsonWriteLogs("<<< Engine (%s) closing listening socket...\n", sEngName);
 
-	return 0;
+	return JetsonPromJoin(families);
 }
 
-#if defined(_WIN32)
-static bool FileExists(const string &fileName)
+//----- per-engine settings follow EngineArguments as key=value, e.g. pool=2
+static int JetsonParseEngineOption(const string &token, struct EngineOptions *pOpts)
 {
-    return _access_s(fileName.c_str(), 0) == 0;
+	size_t pos = token.find('=');
+	if (pos == string::npos || token[0] == '-')
+		return 0;
+
+	string key = token.substr(0, pos);
+	int value = atoi(token.c_str() + pos + 1);
+
+	if (key == "pool")
+		pOpts->nPoolSize = (value < MAX_NUM_LOGI_PER_ENGINE ? (value > 0 ? value : 0) : MAX_NUM_LOGI_PER_ENGINE);
+	else if (key == "coalesce")
+		pOpts->nCoalesceMsec = (value < MAX_INFO_RATE_MSEC ? value : MAX_INFO_RATE_MSEC);
+	else if (key == "cache")
+		pOpts->nCacheSize = (value > 0 ? value : 0);
+	else if (key == "store")
+		pOpts->nStoreMb = (value > 0 ? value : 0);
+	else if (key == "shared")
+		pOpts->nSharedWorkers = (value < MAX_NUM_LOGI_PER_ENGINE/2 ? value : MAX_NUM_LOGI_PER_ENGINE/2);
+	else if (key == "slice")
+		pOpts->nSliceMsec = (value > 0 ? value : 0);
+	else if (key == "max")
+		pOpts->nMaxInstances = (value > 0 ? value : 0);
+	else if (key == "resume")
+		pOpts->nResumeSec = (value < MAX_RESUME_SEC ? (value > 0 ? value : 0) : MAX_RESUME_SEC);
+	else if (key == "splice")
+		pOpts->bSplice = (value > 0);
+	else
+		return 0;
+
+	return 1;
 }
-#endif
 
-static void *EngineLaunchThread(void *data)
+//a line of key=value tokens only holds node-wide settings, e.g. max=4 log=trace
+static int JetsonParseNodeOptions(const string &line)
 {
-	struct EngineEntry *pTmpEngEntry = (struct EngineEntry *)data;
-	char *sBackendDir = pTmpEngEntry->sEngineDir;
-	char *sEngName = pTmpEngEntry->sEngineName;
-	char *sEngExe = pTmpEngEntry->sEngineExeName;
-	char *sEngPort = pTmpEngEntry->sEngienPort;
-	char *arguments = pTmpEngEntry->arguments;
-	
-	ostringstream ossEngDir;
-#if defined(_WIN32)
-	ossEngDir << sBackendDir << "\\" << sEngName << "\\";
-#else
-	ossEngDir << sBackendDir << "/" << sEngName << "/";
-#endif
-	
-	string sEngDir = ossEngDir.str();
-	
-	JetsonWriteLogs(">>> Entered eng_launch (%s)\n", sEngName);
-	
-	//check if engine exe exists
-	ostringstream ossEngExeFullPath;
-	ossEngExeFullPath << ossEngDir.str() << sEngExe;
-	if (!FileExists(ossEngExeFullPath.str().c_str())) {
-		JetsonWriteLogs("ERROR: engine executable path (%s) not exist\n", ossEngExeFullPath.str().c_str());		
-	}
-	else {
-		if (JetsonFindEngine(sEngName)) {
-			JetsonWriteLogs("Engine (%s) exist!\n", sEngName);
+	istringstream iss(line);
+	string token;
+
+	iss >> token;
+	if (token.find('=') == string::npos)
+		return 0;
+
+	do {
+		size_t pos = token.find('=');
+		int value = (pos != string::npos ? atoi(token.c_str() + pos + 1) : 0);
+		if (token.compare(0, pos, "max") == 0)
+			gnNodeMaxInstances = (value > 0 ? value : 0);
+		else if (token.compare(0, pos, "log") == 0) {
+			string level = token.substr(pos + 1);
+			JetsonLogSetLevel(level == "trace" ? LOG_LEVEL_TRACE : (level == "error" ? LOG_LEVEL_ERROR : LOG_LEVEL_INFO));
 		}
-		else {
-			JetsonWriteLogs("Launching new engine (%s)\n", sEngName);
-			JetsonSocket(SOCK_TYPE_ENGINE, sEngDir.c_str(), sEngExe, sEngPort, sEngName, arguments);
+		else if (token.compare(0, pos, "logsize") == 0)
+			JetsonLogSetRotateMb(value);
+		else if (token.compare(0, pos, "metrics") == 0)
+			gsMetricsPortStr = (value > 0 ? to_string(value) : "");
+		else if (token.compare(0, pos, "backend") == 0 && pos + 1 < token.length()) {
+			string sAddr = token.substr(pos + 1);
+			if (sAddr.find(':') == string::npos)
+				sAddr += string(":") + STR_MGMT_PORT;
+			if (find(gRouterConfBackends.begin(), gRouterConfBackends.end(), sAddr) == gRouterConfBackends.end())
+				gRouterConfBackends.push_back(sAddr);
 		}
-	}
-	
-	JetsonWriteLogs("<<< Exited eng_launch for engine(%s)\n", sEngName);
-	free(pTmpEngEntry);
-	
-	return NULL;
-}	
+		else if (token.compare(0, pos, "route") == 0)
+			gnRouteMode = (token.substr(pos + 1) == "hash" ? 1 : 0);
+		else if (token.compare(0, pos, "portoffset") == 0)
+			gnRoutePortOffset = value;
+	} while (iss >> token);
+	return 1;
+}
 
-static void JetsonQueryEngines(SOCKET sockClient)
+//settings missing from jetson_agent.conf go back to their defaults on scan/reload
+static void JetsonResetNodeOptions()
 {
-	pthread_mutex_lock(&gJetsonTableLock);
-	while (gbIsTableLockOn) {
-		pthread_mutex_unlock(&gJetsonTableLock);
-		SleepMsec(1000);
-		pthread_mutex_lock(&gJetsonTableLock);
+	gnNodeMaxInstances = 0;
+	gsMetricsPortStr.clear();
+	gRouterConfBackends.clear();
+	gnRouteMode = 0;
+	gnRoutePortOffset = 0;
+	JetsonLogSetLevel(LOG_LEVEL_INFO);
+	JetsonLogSetRotateMb(LOG_ROTATE_DEFAULT_MB);
+}
+
+//----- one jetson_agent.conf line -> engine entry to launch (malloc'd, JetsonLaunchEngine
+//frees it), NULL for comments, node settings and engines whose folder is missing
+static struct EngineEntry *JetsonParseEngineLine(const string &line, const char *sBackendDir)
+{
+	const char *sLineStr = line.c_str();
+
+	//skip comments, whitespaces, or empty lines
+	if (sLineStr[0] == '#' || isspace(sLineStr[0]) || line.empty() )
+		return NULL;
+
+	if (JetsonParseNodeOptions(line)) {
+		JetsonWriteLogs("Node settings: max=%d log level=%d logsize=%lld bytes metrics port=%s\n", gnNodeMaxInstances,
+			gLogger.nLevel.load(), gLogger.nRotateBytes.load(), (gsMetricsPortStr.empty() ? "off" : gsMetricsPortStr.c_str()));
+#if defined(_WIN32)
+		if (!gsMetricsPortStr.empty())
+			JetsonWriteLogs("metrics=PORT is not supported on Windows, use the stats command\n");
+#endif
+		return NULL;
 	}
-	gbIsTableLockOn = 1;
-	JetsonWriteLogs(">>> Client socket (%d) acquired lock to query engine...\n", sockClient);
-	pthread_mutex_unlock(&gJetsonTableLock);
 
-	try {			
-		ostringstream oss;
-	
-		oss << "\n===== Engine Table Entries from Server (" << gsMyHostName
-			<< ") OS-ARCH (" << gsMyOsArch << ")  =====\n";
-				
-		int engCnt=0;
-			
-		pthread_mutex_lock(&gJetsonTableLock);
-		for (int i=0; i<MAX_NUM_ENGINE; i++) {
-			struct EngineEntry *thisEng = &gEngineTables[i];
-				
-			if (!thisEng->bIsAllocated)
-				continue;
-				
-			if (engCnt++ > 0)
-				oss << "\n";
-				
-			//allocated engine
-			oss << "Engine(" << thisEng->sEngineName << ") TCP Port(" << thisEng->sEngienPort << ")\n";
-			oss << "   " << "Executable On Server(" << thisEng->sEngineDir << thisEng->sEngineExeName << ")\n";
-			oss << "   " << "Connected Users:\n";
-				
-			for (int j=0; j<MAX_NUM_LOGI_PER_ENGINE; j++) {
-				struct ClientEntry *thisClient = &thisEng->clients[j];
-					
-				if (!thisClient->bIsConnected)
-					continue;
-					
-				//connected client
-				oss << "      * Client IP[" << thisClient->sIpAddr << "] Socket(" 
-					<< thisClient->sock << ") Server IP[" << thisClient->sServIpAddr << "] "
-					<< "Engine Instance(" << thisClient->sEngInstName << ")\n";
-			}
-		}
-			
-		oss << "================================<<<querydone\n\n";
-		pthread_mutex_unlock(&gJetsonTableLock);
-			
-		string sRetStr = oss.str();
-			
-		send(sockClient, sRetStr.c_str(), sRetStr.length(), 0);
-			
-		JetsonWriteLogs("<<< Engine query done, lock released by client socket %d.\n", sockClient);	
-	} catch (exception& e) {
-		JetsonWriteLogs("<<< ERROR on engine query for socket (%d): %s", sockClient, e.what());			
+	string sEngName, port, sEngExe, args, token;
+	struct EngineOptions engOpts;
+	memset(&engOpts, 0, sizeof(engOpts));
+
+	istringstream iss(line);
+	iss >> sEngName >> port >> sEngExe;
+	while (iss >> token) {
+		if (!JetsonParseEngineOption(token, &engOpts) && args.empty())
+			args = token;
 	}
-  
-	pthread_mutex_lock(&gJetsonTableLock);
-	gbIsTableLockOn = 0;
-	pthread_mutex_unlock(&gJetsonTableLock);
 
-	return;
+#if defined(_WIN32)			
+	if (!strstr(sEngExe.c_str(), ".exe")) {
+		JetsonWriteLogs("%s doesn't have exe\n", sEngExe.c_str());
+		ostringstream oss1;
+		oss1 << sEngExe << ".exe";
+		sEngExe = oss1.str();
+	}
+#endif
+	//check if engine folder exists
+	if (!FileExists(sEngName.c_str()))
+	{
+		JetsonErrorLogs("ERROR: Engine folder(%s) doesn't exist\n", sEngName.c_str());
+		return NULL;
+	}
+	
+	JetsonWriteLogs("Engine n(%s) p(%s) exe(%s) arg(%s)\n",
+		sEngName.c_str(), port.c_str(), sEngExe.c_str(), args.c_str());
+	struct EngineEntry *pTmpEngEntry = (struct EngineEntry *)calloc(1, sizeof(struct EngineEntry));
+	strncpy(pTmpEngEntry->sEngineDir, sBackendDir, sizeof(pTmpEngEntry->sEngineDir) - 1);//ATTN: at this moment it is only backend dir
+	strncpy(pTmpEngEntry->sEngineName, sEngName.c_str(), sizeof(pTmpEngEntry->sEngineName) - 1);
+	strncpy(pTmpEngEntry->sEngineExeName, sEngExe.c_str(), sizeof(pTmpEngEntry->sEngineExeName) - 1);
+	strncpy(pTmpEngEntry->sEngienPort, port.c_str(), sizeof(pTmpEngEntry->sEngienPort) - 1);
+	strncpy(pTmpEngEntry->arguments, args.c_str(), sizeof(pTmpEngEntry->arguments) - 1);
+	pTmpEngEntry->opts = engOpts;
+	return pTmpEngEntry;
 }
-static void JetsonScanAndLoadEngines(SOCKET sockClient, int bIsScan)
+
+static void JetsonScanAndLoadEngines()
 {
-	pthread_mutex_lock(&gJetsonTableLock);
-	while (gbIsTableLockOn) {
-		pthread_mutex_unlock(&gJetsonTableLock);
-		SleepMsec(1000);
-		pthread_mutex_lock(&gJetsonTableLock);
-	}
-	gbIsTableLockOn = 1;
-	JetsonWriteLogs(">>> Client socket (%d) acquired lock to scan/load engine...\n", (bIsScan ? sockClient : 0));
-	pthread_mutex_unlock(&gJetsonTableLock);
+	pthread_mutex_lock(&gJetsonScanLock);
+	JetsonWriteLogs(">>> Acquired lock to load engines...\n");
 
 	try {
-		char *sServIp = NULL;
-	
-		if (bIsScan) {
-			sServIp = GetServIp(sockClient);
-			JetsonWriteLogs("[MGMT] Local IP is (%s)\n", sServIp);
-		}
-	
 		char cCurrentPath[MAX_NAME_LEN];
 		if (!GetCurrDir(cCurrentPath, sizeof(cCurrentPath))) {
 			throw runtime_error("ERROR: failed to get current path\n");
@@ -842,95 +5478,351 @@ static void JetsonScanAndLoadEngines(SOCKET sockClient, int bIsScan)
 		string line;
 		ifstream myAgentFile(gsAgentConfFile);
 		if (myAgentFile) {
+			JetsonResetNodeOptions();
 			while (getline( myAgentFile, line )) {
-				const char *sLineStr = line.c_str();
-			
-				//skip comments, whitespaces, or empty lines
-				if (sLineStr[0] == '#' || isspace(sLineStr[0]) || line.empty() )
-					continue;
-			
-				string sEngName, port, sEngExe, args;
-				istringstream iss(line);
-				iss >> sEngName >> port >> sEngExe >> args;
-			
-#if defined(_WIN32)			
-				if (!strstr(sEngExe.c_str(), ".exe")) {
-					JetsonWriteLogs("%s doesn't have exe\n", sEngExe.c_str());
-					ostringstream oss1;
-					oss1 << sEngExe << ".exe";
-					sEngExe = oss1.str();
-				}
-#endif
-				//check if engine folder exists
-				if (!FileExists(sEngName.c_str()))
-				{
-					JetsonWriteLogs("ERROR: Engine folder(%s) doesn't exist\n", sEngName.c_str());
+				struct EngineEntry *pTmpEngEntry = JetsonParseEngineLine(line, cCurrentPath);
+				if (pTmpEngEntry == NULL)
 					continue;
-				}
-				
-				JetsonWriteLogs("Engine n(%s) p(%s) exe(%s) arg(%s)\n",
-					sEngName.c_str(), port.c_str(), sEngExe.c_str(), args.c_str());
-				//launch individual engine thread
-				struct EngineEntry *pTmpEngEntry = (struct EngineEntry *)malloc(sizeof(struct EngineEntry));
-				strncpy(pTmpEngEntry->sEngineDir, cCurrentPath, MAX_NAME_LEN);//ATTN: at this moment it is only backend dir
-				strncpy(pTmpEngEntry->sEngineName, sEngName.c_str(), MAX_NAME_LEN);
-				strncpy(pTmpEngEntry->sEngineExeName, sEngExe.c_str(), MAX_NAME_LEN);
-				strncpy(pTmpEngEntry->sEngienPort, port.c_str(), MAX_NAME_LEN);
-				strncpy(pTmpEngEntry->arguments, args.c_str(), MAX_NAME_LEN);
 
+#if defined(_WIN32)
 				pthread_t launch_thread_id;
 				int rc = pthread_create(&launch_thread_id, NULL, EngineLaunchThread, (void *)pTmpEngEntry);
 				if (rc != 0) {
-					JetsonWriteLogs("Unable to create launch thread for engine(%s)\n", sEngName.c_str());
+					JetsonWriteLogs("Unable to create launch thread for engine(%s)\n", pTmpEngEntry->sEngineName);
 					continue;
 				}
 			
 				SleepMsec(50);
-			
-				if (bIsScan) {
-					ostringstream oss;
-					oss << gsJreHeader << sServIp << "_" << port.c_str() << "_" << sEngName.c_str() << "\n";
-					string sRetStr = oss.str();
-				
-					send(sockClient, sRetStr.c_str(), sRetStr.length(), 0);
-					//SleepMsec(300);
-				}
-			}
-		
-			if (bIsScan) {
-				char *scan_done = (char *)"scanisdone\n";
-				send(sockClient, "scanisdone", strlen(scan_done), 0);
+#else
+				//listener is registered with the reactor right away, no thread to wait for
+				JetsonLaunchEngine(pTmpEngEntry);
+#endif
 			}
 		
 			myAgentFile.close();
 		
-			JetsonWriteLogs("<<< Engine scan done, lock released by client socket\n", sockClient);
+			JetsonWriteLogs("<<< Engines loaded, lock released\n");
 		}
 	} catch (exception& e) {	
 		
-    	JetsonWriteLogs("<<< ERROR on engine scan for socket (%d): %s", sockClient, e.what());	
+    	JetsonErrorLogs("<<< ERROR on engine load: %s", e.what());	
 	}
+#if !defined(_WIN32)
+	JetsonApplyMetricsPort();
+	JetsonRouterApplyConf();
+#else
+	if (!gRouterConfBackends.empty())
+		JetsonWriteLogs("backend=: router mode is not supported on Windows\n");
+#endif
   
+	pthread_mutex_unlock(&gJetsonScanLock);
+
+	return;
+}
+
+//----- scan reply: one engine file name per engine taking logins, as the client
+//reached this agent, built from the registry snapshot; nothing is read or started
+static string JetsonRenderScan(const char *sServIp)
+{
+	shared_ptr<const struct RegistrySnapshot> snap = JetsonCurrentSnapshot();
+
+	string sScan;
+	int nEngines = 0;
+	for (size_t i=0; i<snap->engines.size(); i++) {
+		const struct EngineView &view = snap->engines[i];
+		if (view.bDraining || view.bOffline)
+			continue;
+		sScan += string(gsJreHeader) + sServIp + "_" + view.sEngienPort + "_" + view.sEngineName + "\n";
+		nEngines++;
+	}
+	JetsonWriteLogs("<<< Engine scan for %s done, %d engines, registry version %llu\n", sServIp, nEngines, snap->nVersion);
+	return sScan + "scanisdone";
+}
+
+#if !defined(_WIN32)
+//----- reload: jetson_agent.conf is read again and compared with gRegistry, sessions
+//already running keep the instance and the settings they started with
+//no more logins, the entry is released by JetsonReapDrainedEngines() after its last session
+static void JetsonDrainEngine(struct EngineEntry *engEntry)
+{
+	JetsonWriteLogs("Engine (%s) port %s is draining, %d sessions left\n",
+		engEntry->sEngineName, engEntry->sEngienPort, JetsonSessionCount(engEntry));
+
 	pthread_mutex_lock(&gJetsonTableLock);
-	gbIsTableLockOn = 0;
+	engEntry->bDraining = 1;
+	JetsonRegistryUnlistEngine(&gRegistry, engEntry);
 	pthread_mutex_unlock(&gJetsonTableLock);
+	gnDrainingEngines++;
+	JetsonReactorClose(&engEntry->hListenEvt);
 
-	return;
+	//retiring takes the instance off the list, walk it from the end
+	for (int i=engEntry->nInsts-1; i>=0; i--) {
+		struct ClientEntry *thisClient = engEntry->insts[i];
+		if (thisClient->bIsEngineRunning &&
+			(thisClient->nPoolState == POOL_STATE_WARMING || thisClient->nPoolState == POOL_STATE_IDLE))
+			JetsonPoolRetire(thisClient);
+	}
+}
+
+static void JetsonReapDrainedEngines()
+{
+	//freeing an entry takes it off gRegistry.engines, walk it from the end
+	for (int i=(int)gRegistry.engines.size()-1; i>=0; i--) {
+		struct EngineEntry *thisEng = gRegistry.engines[i];
+		if (!thisEng->bDraining)
+			continue;
+
+		//shared workers outlive the sessions only until their current go ends
+		if (thisEng->pShared != NULL && JetsonSessionCount(thisEng) == 0) {
+			for (int j=0; j<thisEng->nInsts; j++) {
+				struct ClientEntry *worker = thisEng->insts[j];
+				if (worker->bIsEngineRunning && worker->shared.bIsWorker &&
+					(worker->shared.nState == SHARED_STATE_WARMING || worker->shared.nState == SHARED_STATE_IDLE))
+					JetsonSharedRetire(worker);
+			}
+		}
+
+		//records are freed as they are released, none left means nothing refers to the entry
+		if (thisEng->nClients > 0)
+			continue;
+
+		JetsonWriteLogs("Engine (%s) port %s drained, entry released\n", thisEng->sEngineName, thisEng->sEngienPort);
+		JetsonFreeEngine(thisEng);
+		gnDrainingEngines--;
+	}
+}
+
+//new arguments and settings for the same port and executable, returns 1 if anything changed
+static int JetsonUpdateEngine(struct EngineEntry *engEntry, const struct EngineEntry *pNew)
+{
+	struct EngineOptions opts = pNew->opts;
+	if (opts.nSharedWorkers > 0)
+		opts.nPoolSize = 0;
+
+	int bArgsChanged = (strcmp(engEntry->arguments, pNew->arguments) != 0);
+	if (!bArgsChanged && memcmp(&opts, &engEntry->opts, sizeof(opts)) == 0)
+		return 0;
+
+	JetsonWriteLogs("Engine (%s) updated, arg(%s)%s\n", engEntry->sEngineName, pNew->arguments,
+		(bArgsChanged ? ", instances started from now on use it" : ""));
+
+	engEntry->opts = opts;
+	if (bArgsChanged) {
+		strncpy(engEntry->arguments, pNew->arguments, MAX_NAME_LEN);
+		engEntry->nConfigGen++;
+		engEntry->nPoolFailures = 0;
+	}
+
+	//results found with the old arguments don't answer searches run with the new ones
+	if (engEntry->pCache != NULL && (opts.nCacheSize <= 0 || bArgsChanged)) {
+		delete engEntry->pCache;
+		engEntry->pCache = NULL;
+	}
+	if (opts.nCacheSize > 0) {
+		if (engEntry->pCache == NULL)
+			engEntry->pCache = JetsonCacheCreate(opts.nCacheSize);
+		else
+			JetsonCacheResize(engEntry->pCache, opts.nCacheSize);
+	}
+
+	//the store keys results by the arguments too, a file already open stays as it is
+	if (engEntry->pStore != NULL && opts.nStoreMb <= 0) {
+		JetsonStoreClose(engEntry->pStore);
+		engEntry->pStore = NULL;
+	}
+	if (opts.nStoreMb > 0 && engEntry->pStore == NULL)
+		JetsonOpenStore(engEntry);
+
+	if (bArgsChanged && engEntry->pShared != NULL) {
+		engEntry->pShared->sUciReply.clear();
+		engEntry->pShared->bUciReplyDone = 0;
+		engEntry->pShared->pUciWorker = NULL;
+	}
+
+	//idle instances go now: those on the old arguments, then any beyond the new sizes;
+	//busy ones follow when their session or go is over
+	int nPoolWarming, nPoolIdle, nRecycling, nWarming, nIdle, nBusy;
+	JetsonPoolCount(engEntry, &nPoolWarming, &nPoolIdle, &nRecycling);
+	JetsonSharedCount(engEntry, &nWarming, &nIdle, &nBusy);
+	int nPoolExtra = nPoolWarming + nPoolIdle - opts.nPoolSize;
+	int nSharedExtra = nWarming + nIdle + nBusy - opts.nSharedWorkers;
+
+	for (int i=engEntry->nInsts-1; i>=0; i--) {
+		struct ClientEntry *thisClient = engEntry->insts[i];
+		if (!thisClient->bIsEngineRunning)
+			continue;
+
+		int bStale = (thisClient->nConfigGen != engEntry->nConfigGen);
+		if (thisClient->nPoolState == POOL_STATE_WARMING || thisClient->nPoolState == POOL_STATE_IDLE) {
+			if (bStale || nPoolExtra > 0) {
+				nPoolExtra--;
+				JetsonPoolRetire(thisClient);
+			}
+		}
+		else if (thisClient->shared.bIsWorker &&
+			(thisClient->shared.nState == SHARED_STATE_WARMING || thisClient->shared.nState == SHARED_STATE_IDLE)) {
+			if (bStale || nSharedExtra > 0) {
+				nSharedExtra--;
+				JetsonSharedRetire(thisClient);
+			}
+		}
+	}
+
+	JetsonPoolRefill(engEntry);
+	if (engEntry->pShared != NULL) {
+		JetsonSharedRefill(engEntry);
+		JetsonSharedDispatch(engEntry);
+	}
+	return 1;
 }
 
+static void JetsonReloadEngines(SOCKET sockClient)
+{
+	pthread_mutex_lock(&gJetsonScanLock);
+	JetsonWriteLogs(">>> Client socket (%d) acquired lock to reload engines...\n", sockClient);
+
+	ostringstream oss;
+	int nAdded = 0, nRemoved = 0, nRestarted = 0, nUpdated = 0;
+
+	try {
+		char cCurrentPath[MAX_NAME_LEN];
+		if (!GetCurrDir(cCurrentPath, sizeof(cCurrentPath))) {
+			throw runtime_error("ERROR: failed to get current path\n");
+		}
+		cCurrentPath[sizeof(cCurrentPath) - 1] = '\0';
+
+		ifstream myAgentFile(gsAgentConfFile);
+		if (!myAgentFile)
+			throw runtime_error("unable to open jetson_agent.conf\n");
+
+		vector<struct EngineEntry *> newEngines;
+		string line;
+		JetsonResetNodeOptions();
+		while (getline( myAgentFile, line )) {
+			struct EngineEntry *pTmpEngEntry = JetsonParseEngineLine(line, cCurrentPath);
+			if (pTmpEngEntry == NULL)
+				continue;
+
+			int bDuplicate = 0;
+			for (size_t i=0; i<newEngines.size(); i++)
+				bDuplicate |= (strcmp(newEngines[i]->sEngineName, pTmpEngEntry->sEngineName) == 0);
+			if (bDuplicate) {
+				JetsonWriteLogs("Engine (%s) listed twice, first one is used\n", pTmpEngEntry->sEngineName);
+				free(pTmpEngEntry);
+				continue;
+			}
+			newEngines.push_back(pTmpEngEntry);
+		}
+		myAgentFile.close();
+
+		//----- engines gone from the file, routed ones follow their backends instead
+		for (size_t i=0; i<gRegistry.engines.size(); i++) {
+			struct EngineEntry *thisEng = gRegistry.engines[i];
+			if (thisEng->bDraining || thisEng->bRouted)
+				continue;
+
+			int bListed = 0;
+			for (size_t k=0; k<newEngines.size(); k++)
+				bListed |= (strcmp(newEngines[k]->sEngineName, thisEng->sEngineName) == 0);
+			if (bListed)
+				continue;
+
+			oss << "removed Engine(" << thisEng->sEngineName << ") TCP Port(" << thisEng->sEngienPort << ")\n";
+			JetsonDrainEngine(thisEng);
+			nRemoved++;
+		}
+
+		//----- new engines, and those that need a new listener or executable
+		for (size_t k=0; k<newEngines.size(); k++) {
+			struct EngineEntry *pTmpEngEntry = newEngines[k];
+			string sEngName = pTmpEngEntry->sEngineName;
+			string port = pTmpEngEntry->sEngienPort;
+			struct EngineEntry *thisEng = JetsonRegistryFindEngine(&gRegistry, sEngName.c_str());
+
+			if (thisEng != NULL && strcmp(thisEng->sEngienPort, pTmpEngEntry->sEngienPort) == 0 &&
+				strcmp(thisEng->sEngineExeName, pTmpEngEntry->sEngineExeName) == 0 &&
+				(thisEng->pShared != NULL) == (pTmpEngEntry->opts.nSharedWorkers > 0)) {
+				if (JetsonUpdateEngine(thisEng, pTmpEngEntry)) {
+					oss << "updated Engine(" << sEngName << ") TCP Port(" << port << ")\n";
+					nUpdated++;
+				}
+				free(pTmpEngEntry);
+				continue;
+			}
+
+			if (thisEng != NULL) {
+				JetsonDrainEngine(thisEng);
+				nRestarted++;
+			}
+			else
+				nAdded++;
+
+			JetsonLaunchEngine(pTmpEngEntry);
+			if (JetsonRegistryFindEngine(&gRegistry, sEngName.c_str()) == NULL)
+				oss << "failed Engine(" << sEngName << ") TCP Port(" << port << ")\n";
+			else
+				oss << (thisEng != NULL ? "restarted" : "added") << " Engine(" << sEngName << ") TCP Port(" << port << ")\n";
+		}
+
+		//----- waiting logins follow their engine to its replacement, if it has one
+		for (size_t i=0; i<gLoginQueue.size(); ) {
+			struct PendingLogin *pending = gLoginQueue[i];
+			if (!pending->engine->bDraining) {
+				i++;
+				continue;
+			}
+
+			struct EngineEntry *pReplacement = JetsonRegistryFindEngine(&gRegistry, pending->engine->sEngineName);
+			if (pReplacement != NULL) {
+				pending->engine = pReplacement;
+				i++;
+				continue;
+			}
+
+			JetsonWriteLogs("Client (%s, %d) waited for engine (%s), which is removed\n",
+				pending->sIpAddr, pending->sock, pending->engine->sEngineName);
+			JetsonLoginDrop(i, 1);
+		}
+		JetsonLoginTellPositions();
+		gbAdmitCheck = 1;	//limits may have changed
+	} catch (exception& e) {
+		JetsonErrorLogs("<<< ERROR on engine reload for socket (%d): %s", sockClient, e.what());
+		oss << "ERROR: " << e.what();
+	}
+
+	JetsonWriteLogs("<<< Engine reload done: %d added, %d removed, %d restarted, %d updated\n",
+		nAdded, nRemoved, nRestarted, nUpdated);
+
+	JetsonPublishSnapshot();	//a scan right after reloaddone sees the new engines
+	if (sockClient >= 0) {
+		oss << nAdded << " added, " << nRemoved << " removed, " << nRestarted << " restarted, "
+			<< nUpdated << " updated\nreloaddone\n";
+		string sRetStr = oss.str();
+		JetsonMgmtSend(sockClient, sRetStr.c_str(), sRetStr.length());
+	}
+
+	JetsonApplyMetricsPort();
+	JetsonRouterApplyConf();
+	pthread_mutex_unlock(&gJetsonScanLock);
+}
+#endif
+
+#if defined(_WIN32)
 static void *JetsonMgmtThread(void *data)
 {
 	JetsonWriteLogs(">>> Entered JetsonMgmtThread\n");
-	JetsonSocket(SOCK_TYPE_MGMT, NULL, NULL, gsMgmtPortStr.c_str(), NULL, NULL);
+	JetsonSocket(SOCK_TYPE_MGMT, NULL, NULL, gsMgmtPortStr.c_str(), NULL, NULL, NULL);
 	JetsonWriteLogs("<<< Exited JetsonMgmtThread\n");
 	
 	return NULL;
 }	
+#endif
 
 int main()
 {
 	int rc = 1;
 
+	JetsonLogStart();
 	try {
 #if defined(_WIN32)
 		strcpy(gsMyOsArch, STR_OS_ARCH_WIN);
@@ -969,13 +5861,15 @@ int main()
 
 		/* set signal blocking */	
 		signal(SIGABRT, JetsonSignalHandler); 
+#if defined(_WIN32)
 		signal(SIGINT, JetsonSignalHandler); 
 		signal(SIGTERM, JetsonSignalHandler);
+#endif
 	
-		pthread_mutex_init(&gLogFileLock, NULL);
 		pthread_mutex_init(&gJetsonTableLock, NULL);
-		memset((void *)gEngineTables, 0, sizeof(EngineEntry) * MAX_NUM_ENGINE);
-		JetsonWriteLogs("total engine table size = %ld\n", sizeof(EngineEntry) * MAX_NUM_ENGINE);
+		pthread_mutex_init(&gJetsonScanLock, NULL);
+		JetsonWriteLogs("engine entry size = %ld, session record size = %ld\n",
+			sizeof(EngineEntry), sizeof(ClientEntry));
 		
 		//----- load customized mgmt port -----
 		ifstream myMgmtPortFile(gsMgmtPortFile);
@@ -989,6 +5883,7 @@ int main()
 		}
 		JetsonWriteLogs("MGMT TCP Port = %s\n", gsMgmtPortStr.c_str());
 	
+#if defined(_WIN32)
 		//----- launch management thread for scan and query -----
 		pthread_t mgmtThreadId;
 		rc = pthread_create(&mgmtThreadId, NULL, JetsonMgmtThread, NULL);
@@ -996,8 +5891,7 @@ int main()
 			throw runtime_error("Unable to create management thread\n");
 	
 		//----- load jetson_agent.conf file and launch socket thread for each engine
-		SOCKET dummySock;
-		JetsonScanAndLoadEngines(dummySock, 0);
+		JetsonScanAndLoadEngines();
 
 		//TODO: join all threads?
 	
@@ -1007,22 +5901,62 @@ int main()
         			break;
 			SleepMsec(3000);
 		}
+#else
+		signal(SIGPIPE, SIG_IGN);
+
+		//every session holds a socket and two pipes, lift the default 1024 fd cap
+		struct rlimit fdLimit;
+		if (getrlimit(RLIMIT_NOFILE, &fdLimit) == 0 && fdLimit.rlim_cur < fdLimit.rlim_max) {
+			fdLimit.rlim_cur = fdLimit.rlim_max;
+			setrlimit(RLIMIT_NOFILE, &fdLimit);
+		}
+
+		gEpollFd = epoll_create1(EPOLL_CLOEXEC);
+		if (gEpollFd < 0)
+			throw runtime_error("Unable to create epoll instance\n");
+
+		//----- engine exits are reaped in the reactor through a signalfd
+		sigset_t sigMask;
+		sigemptyset(&sigMask);
+		sigaddset(&sigMask, SIGCHLD);
+		sigaddset(&sigMask, SIGHUP);	//reload jetson_agent.conf
+		sigaddset(&sigMask, SIGINT);	//the log is flushed before exiting
+		sigaddset(&sigMask, SIGTERM);
+		sigprocmask(SIG_BLOCK, &sigMask, NULL);
+		int fdSignal = signalfd(-1, &sigMask, SFD_NONBLOCK | SFD_CLOEXEC);
+		if (fdSignal < 0 || !JetsonReactorAdd(&gSignalEvt, RH_TYPE_SIGNAL, fdSignal, NULL, EPOLLIN))
+			throw runtime_error("Unable to create signalfd\n");
+
+		//----- management listener for scan and query -----
+		if (!JetsonListen(SOCK_TYPE_MGMT, NULL, NULL, gsMgmtPortStr.c_str(), NULL, NULL, NULL))
+			throw runtime_error("Unable to create management listener\n");
+		JetsonDiscoveryListen();
+		JetsonMgmtStartWorkers();
+
+		//----- load jetson_agent.conf file and register a listener for each engine
+		JetsonScanAndLoadEngines();
+
+		//----- main thread runs the reactor until a signal ends the agent -----
+		JetsonReactorLoop();
+		close(gEpollFd);
+#endif
 
 		JetsonWriteLogs("<<<<<<<<<< Server stopped\n");
 		JetsonWriteLogs("<<<<<<<<<<\n");
 
 		pthread_mutex_destroy(&gJetsonTableLock);
-		pthread_mutex_destroy(&gLogFileLock);
+		pthread_mutex_destroy(&gJetsonScanLock);
 		//ATTN: any other resource need cleanup here???
 		
-		rc = 0;
+		rc = gnExitSignal;
 	} catch (exception& e) {
-		JetsonWriteLogs("<<< ERROR on Main: %s", e.what());
+		JetsonErrorLogs("<<< ERROR on Main: %s", e.what());
 	}
 
 #if defined(_WIN32)
     WSACleanup();
 #endif
 
+	JetsonLogStop();
 	return rc;
 }
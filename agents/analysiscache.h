@@ -0,0 +1,173 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ * 
+ * Copyright (C) 2020 Evelyn Zhu
+ * 
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant 
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the 
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+#ifndef _JET_ANALYSISCACHE_H
+#define _JET_ANALYSISCACHE_H
+
+#include <cstring>
+#include <list>
+#include <sstream>
+#include <string>
+#include <unordered_map>
+#include <utility>
+#include <vector>
+
+//----- finished searches per engine, keyed by position and engine options
+struct AnalysisResult {
+	int nDepth;
+	long long nNodes;
+	long long nTimeMsec;
+	std::vector<std::string> infoLines;	//last info line with a pv, per multipv
+	std::string sBestMove;				//"bestmove ..." line as the engine sent it
+};
+
+struct AnalysisCache {
+	size_t nCapacity;
+	std::list<std::pair<unsigned long long, struct AnalysisResult> > lru;	//most recent first
+	std::unordered_map<unsigned long long,
+		std::list<std::pair<unsigned long long, struct AnalysisResult> >::iterator> index;
+	long long nHits;
+	long long nMisses;
+	long long nAttached;		//searches that joined one already running
+};
+
+static inline struct AnalysisCache *JetsonCacheCreate(size_t nCapacity)
+{
+	struct AnalysisCache *cache = new AnalysisCache();
+	cache->nCapacity = nCapacity;
+	cache->index.reserve(nCapacity);
+	cache->nHits = cache->nMisses = cache->nAttached = 0;
+	return cache;
+}
+
+static inline const struct AnalysisResult *JetsonCacheLookup(struct AnalysisCache *cache, unsigned long long key)
+{
+	auto it = cache->index.find(key);
+	if (it == cache->index.end())
+		return NULL;
+
+	cache->lru.splice(cache->lru.begin(), cache->lru, it->second);
+	return &it->second->second;
+}
+
+//a shallower result never replaces a deeper one for the same key
+static inline void JetsonCacheStore(struct AnalysisCache *cache, unsigned long long key, const struct AnalysisResult &result)
+{
+	auto it = cache->index.find(key);
+	if (it != cache->index.end()) {
+		if (it->second->second.nDepth <= result.nDepth)
+			it->second->second = result;
+		cache->lru.splice(cache->lru.begin(), cache->lru, it->second);
+		return;
+	}
+
+	if (cache->lru.size() >= cache->nCapacity && !cache->lru.empty()) {
+		cache->index.erase(cache->lru.back().first);
+		cache->lru.pop_back();
+	}
+
+	cache->lru.push_front(std::make_pair(key, result));
+	cache->index[key] = cache->lru.begin();
+}
+
+//capacity changed by a reload, least recently used entries go first
+static inline void JetsonCacheResize(struct AnalysisCache *cache, size_t nCapacity)
+{
+	cache->nCapacity = nCapacity;
+	while (cache->lru.size() > cache->nCapacity) {
+		cache->index.erase(cache->lru.back().first);
+		cache->lru.pop_back();
+	}
+}
+
+//what a go command asks for, as far as a finished search can answer it
+struct GoLimits {
+	int nDepth;
+	long long nNodes;
+	long long nMoveTime;
+	int bInfinite;
+	int bCacheable;		//only depth/nodes/movetime, nothing the cache can't judge
+	int bShareable;		//no ponder/searchmoves, result may go to another session
+};
+
+static inline void JetsonParseGoLimits(const char *sLine, struct GoLimits *pLimits)
+{
+	std::istringstream iss(sLine);
+	std::string token;
+	int nKnown = 0, nOther = 0;
+
+	memset(pLimits, 0, sizeof(*pLimits));
+	pLimits->bShareable = 1;
+
+	iss >> token;	//go
+	while (iss >> token) {
+		if (token == "depth" && iss >> pLimits->nDepth)
+			nKnown++;
+		else if (token == "nodes" && iss >> pLimits->nNodes)
+			nKnown++;
+		else if (token == "movetime" && iss >> pLimits->nMoveTime)
+			nKnown++;
+		else if (token == "infinite")
+			pLimits->bInfinite = 1;
+		else if (token == "ponder" || token == "searchmoves" || token == "mate") {
+			pLimits->bShareable = 0;
+			nOther++;
+		}
+		else
+			nOther++;	//clock and its arguments
+	}
+
+	pLimits->bCacheable = (nKnown == 1 && nOther == 0 && !pLimits->bInfinite &&
+		(pLimits->nDepth > 0 || pLimits->nNodes > 0 || pLimits->nMoveTime > 0));
+}
+
+static inline int JetsonResultSatisfies(const struct AnalysisResult *result, const struct GoLimits *pLimits)
+{
+	if (!pLimits->bCacheable)
+		return 0;
+	if (pLimits->nDepth > 0)
+		return result->nDepth >= pLimits->nDepth;
+	if (pLimits->nNodes > 0)
+		return result->nNodes >= pLimits->nNodes;
+	return result->nTimeMsec >= pLimits->nMoveTime;
+}
+
+#endif	//_JET_ANALYSISCACHE_H
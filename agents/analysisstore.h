@@ -0,0 +1,332 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ * 
+ * Copyright (C) 2020 Evelyn Zhu
+ * 
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant 
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the 
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+#ifndef _JET_ANALYSISSTORE_H
+#define _JET_ANALYSISSTORE_H
+
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <ctime>
+#include <string>
+#include <fcntl.h>
+#include <sys/file.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <unistd.h>
+
+#include "analysiscache.h"
+
+//----- finished searches on disk, per engine folder: a file of fixed size slots
+//mapped by every agent that serves the engine, so results outlive the session and
+//the agent. A slot is written under a sequence lock and carries a checksum; a reader
+//takes only a slot whose sequence is even and unchanged and whose checksum holds,
+//so a writer that crashed, or pages torn by a power loss, cost that slot only.
+#define STORE_MAGIC			"JETSTOR1"
+#define STORE_HEADER_SIZE	4096
+#define STORE_SLOT_SIZE		2048	//two per page, a slot never spans pages
+#define STORE_PROBE			4		//slots a key may live in, from its home slot on
+#define STORE_STALE_SEC		2		//slot locked this long belongs to a writer that died
+#define STORE_FILE_NAME		"jetson_analysis.store"
+
+struct StoreHeader {
+	char sMagic[8];			//written last, a file without it is initialized again
+	uint32_t nSlotSize;
+	uint32_t nReserved;
+	uint64_t nSlots;
+};
+
+struct StoreSlot {
+	uint32_t nSeq;			//odd while a writer fills the slot
+	uint32_t nCheck;		//FNV-1a of key through text
+	int64_t nLockSec;		//when the current writer took the slot
+	uint64_t nKey;			//0 for a slot never written
+	int32_t nDepth;
+	int32_t nTextLen;		//info lines, then the bestmove line
+	int32_t nBestMoveOff;
+	int32_t nReserved;
+	int64_t nNodes;
+	int64_t nTimeMsec;
+	char text[STORE_SLOT_SIZE - 56];
+};
+
+struct AnalysisStore {
+	std::string sPath;
+	unsigned char *pMap;
+	size_t nMapLen;
+	uint64_t nSlots;
+	long long nHits;		//this agent's counters, the file keeps none
+	long long nMisses;
+	long long nStored;
+	long long nSkipped;		//results a deeper one or a busy slot kept out
+};
+
+static inline uint32_t JetsonStoreChecksum(const struct StoreSlot *slot)
+{
+	const unsigned char *p = (const unsigned char *)&slot->nKey;
+	size_t len = offsetof(struct StoreSlot, text) - offsetof(struct StoreSlot, nKey) + slot->nTextLen;
+	uint32_t hash = 2166136261U;
+	for (size_t i=0; i<len; i++) {
+		hash ^= p[i];
+		hash *= 16777619U;
+	}
+	return hash;
+}
+
+static inline struct StoreSlot *JetsonStoreSlot(struct AnalysisStore *store, uint64_t index)
+{
+	return (struct StoreSlot *)(store->pMap + STORE_HEADER_SIZE + (index % store->nSlots) * STORE_SLOT_SIZE);
+}
+
+//results of one engine configuration only answer searches of the same one
+static inline unsigned long long JetsonStoreKey(unsigned long long nSearchKey, const char *sExeName, const char *sArgs)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for (const char *s = sExeName; *s; s++)
+		hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+	hash = (hash ^ ' ') * 1099511628211ULL;
+	for (const char *s = sArgs; *s; s++)
+		hash = (hash ^ (unsigned char)*s) * 1099511628211ULL;
+
+	unsigned long long key = nSearchKey ^ (hash * 0xC2B2AE3D27D4EB4FULL);
+	return (key != 0 ? key : 1);
+}
+
+//maps an existing file as it is, whatever nMb says, or creates one of nMb megabytes;
+//nothing is read at open, an unused slot is a hole of the sparse file until written
+static inline struct AnalysisStore *JetsonStoreOpen(const char *sPath, size_t nMb, std::string *pError)
+{
+	int fd = open(sPath, O_RDWR | O_CREAT | O_CLOEXEC, 0644);
+	if (fd < 0) {
+		*pError = std::string("open: ") + strerror(errno);
+		return NULL;
+	}
+
+	//other agents may open the same file right now, one of them initializes it
+	flock(fd, LOCK_EX);
+
+	struct StoreHeader header;
+	struct stat st;
+	memset(&header, 0, sizeof(header));
+	if (fstat(fd, &st) < 0 || pread(fd, &header, sizeof(header), 0) < 0) {
+		*pError = std::string("read: ") + strerror(errno);
+		close(fd);
+		return NULL;
+	}
+
+	if (memcmp(header.sMagic, STORE_MAGIC, sizeof(header.sMagic)) != 0) {
+		//never finished initializing, no agent can have it mapped
+		memset(&header, 0, sizeof(header));
+		header.nSlotSize = STORE_SLOT_SIZE;
+		header.nSlots = (nMb << 20) / STORE_SLOT_SIZE;
+		if (header.nSlots < STORE_PROBE)
+			header.nSlots = STORE_PROBE;
+		st.st_size = STORE_HEADER_SIZE + header.nSlots * STORE_SLOT_SIZE;
+
+		if (ftruncate(fd, 0) < 0 || ftruncate(fd, st.st_size) < 0 ||
+			pwrite(fd, &header, sizeof(header), 0) != (ssize_t)sizeof(header) || fdatasync(fd) < 0 ||
+			pwrite(fd, STORE_MAGIC, sizeof(header.sMagic), 0) != (ssize_t)sizeof(header.sMagic)) {
+			*pError = std::string("create: ") + strerror(errno);
+			close(fd);
+			return NULL;
+		}
+		memcpy(header.sMagic, STORE_MAGIC, sizeof(header.sMagic));
+	}
+	else if (header.nSlotSize != STORE_SLOT_SIZE || header.nSlots < STORE_PROBE ||
+		(uint64_t)st.st_size != STORE_HEADER_SIZE + header.nSlots * STORE_SLOT_SIZE) {
+		*pError = "not a store of this version, or truncated";
+		close(fd);
+		return NULL;
+	}
+
+	void *pMap = mmap(NULL, st.st_size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+	flock(fd, LOCK_UN);
+	close(fd);
+	if (pMap == MAP_FAILED) {
+		*pError = std::string("mmap: ") + strerror(errno);
+		return NULL;
+	}
+
+	struct AnalysisStore *store = new AnalysisStore();
+	store->sPath = sPath;
+	store->pMap = (unsigned char *)pMap;
+	store->nMapLen = st.st_size;
+	store->nSlots = header.nSlots;
+	store->nHits = store->nMisses = store->nStored = store->nSkipped = 0;
+	return store;
+}
+
+static inline void JetsonStoreClose(struct AnalysisStore *store)
+{
+	if (store == NULL)
+		return;
+	munmap(store->pMap, store->nMapLen);
+	delete store;
+}
+
+//copy of the slot holding the key, taken only if no writer touched it meanwhile
+static inline int JetsonStoreLookup(struct AnalysisStore *store, unsigned long long key, struct AnalysisResult *pResult)
+{
+	for (int i=0; i<STORE_PROBE; i++) {
+		struct StoreSlot *slot = JetsonStoreSlot(store, key + i);
+		uint32_t seq = __atomic_load_n(&slot->nSeq, __ATOMIC_ACQUIRE);
+		if ((seq & 1) || slot->nKey != key)
+			continue;
+
+		struct StoreSlot copy;
+		memcpy(&copy, slot, offsetof(struct StoreSlot, text));
+		if (copy.nTextLen < 0 || copy.nTextLen > (int)sizeof(copy.text) ||
+			copy.nBestMoveOff < 0 || copy.nBestMoveOff > copy.nTextLen)
+			continue;
+		memcpy(copy.text, slot->text, copy.nTextLen);
+
+		__atomic_thread_fence(__ATOMIC_ACQUIRE);
+		if (__atomic_load_n(&slot->nSeq, __ATOMIC_RELAXED) != seq ||
+			copy.nKey != key || JetsonStoreChecksum(&copy) != copy.nCheck)
+			continue;
+
+		pResult->nDepth = copy.nDepth;
+		pResult->nNodes = copy.nNodes;
+		pResult->nTimeMsec = copy.nTimeMsec;
+		pResult->infoLines.clear();
+		size_t start = 0;
+		std::string sInfo(copy.text, copy.nBestMoveOff);
+		while (start < sInfo.length()) {
+			size_t end = sInfo.find('\n', start);
+			end = (end == std::string::npos ? sInfo.length() : end + 1);
+			pResult->infoLines.push_back(sInfo.substr(start, end - start));
+			start = end;
+		}
+		pResult->sBestMove.assign(copy.text + copy.nBestMoveOff, copy.nTextLen - copy.nBestMoveOff);
+		return 1;
+	}
+	return 0;
+}
+
+//slot locked by this writer, or NULL if another one holds it
+static inline struct StoreSlot *JetsonStoreLockSlot(struct StoreSlot *slot)
+{
+	uint32_t seq = __atomic_load_n(&slot->nSeq, __ATOMIC_ACQUIRE);
+	int64_t now = (int64_t)time(NULL);
+
+	if (seq & 1) {
+		int64_t since = __atomic_load_n(&slot->nLockSec, __ATOMIC_RELAXED);
+		if (now - since < STORE_STALE_SEC && since - now < STORE_STALE_SEC)
+			return NULL;
+		//still odd: the new owner keeps it locked
+		if (!__atomic_compare_exchange_n(&slot->nSeq, &seq, seq + 2, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+			return NULL;
+	}
+	else if (!__atomic_compare_exchange_n(&slot->nSeq, &seq, seq + 1, 0, __ATOMIC_ACQ_REL, __ATOMIC_RELAXED))
+		return NULL;
+
+	__atomic_store_n(&slot->nLockSec, now, __ATOMIC_RELAXED);
+	return slot;
+}
+
+static inline void JetsonStoreUnlockSlot(struct StoreSlot *slot)
+{
+	__atomic_fetch_add(&slot->nSeq, 1, __ATOMIC_RELEASE);
+}
+
+//same key: kept if not deeper than the new one; otherwise a free slot, or the shallowest
+//of the probed ones if the new result goes at least as deep. Info lines that don't fit
+//are left out from the last multipv on
+static inline int JetsonStoreSave(struct AnalysisStore *store, unsigned long long key, const struct AnalysisResult &result)
+{
+	struct StoreSlot *target = NULL;
+	for (int i=0; i<STORE_PROBE && target == NULL; i++) {
+		struct StoreSlot *slot = JetsonStoreSlot(store, key + i);
+		if (slot->nKey == key)
+			target = slot;
+	}
+	if (target != NULL && target->nDepth > result.nDepth) {
+		store->nSkipped++;
+		return 0;
+	}
+	for (int i=0; i<STORE_PROBE && target == NULL; i++) {
+		struct StoreSlot *slot = JetsonStoreSlot(store, key + i);
+		if (slot->nKey == 0)
+			target = slot;
+	}
+	for (int i=0; i<STORE_PROBE && target == NULL; i++) {
+		struct StoreSlot *slot = JetsonStoreSlot(store, key + i);
+		if (slot->nDepth <= result.nDepth &&
+			(target == NULL || slot->nDepth < target->nDepth))
+			target = slot;
+	}
+
+	if (target == NULL || result.sBestMove.length() > sizeof(target->text) || JetsonStoreLockSlot(target) == NULL) {
+		store->nSkipped++;
+		return 0;
+	}
+
+	int len = 0;
+	for (size_t i=0; i<result.infoLines.size(); i++) {
+		const std::string &sInfo = result.infoLines[i];
+		if (len + sInfo.length() + result.sBestMove.length() > sizeof(target->text))
+			break;
+		memcpy(target->text + len, sInfo.data(), sInfo.length());
+		len += sInfo.length();
+	}
+	target->nBestMoveOff = len;
+	memcpy(target->text + len, result.sBestMove.data(), result.sBestMove.length());
+	len += result.sBestMove.length();
+
+	target->nKey = key;
+	target->nDepth = result.nDepth;
+	target->nTextLen = len;
+	target->nReserved = 0;
+	target->nNodes = result.nNodes;
+	target->nTimeMsec = result.nTimeMsec;
+	target->nCheck = JetsonStoreChecksum(target);
+	JetsonStoreUnlockSlot(target);
+
+	//written back soon, not waited for
+	uintptr_t nPageSize = (uintptr_t)sysconf(_SC_PAGESIZE);
+	uintptr_t page = (uintptr_t)target & ~(nPageSize - 1);
+	msync((void *)page, nPageSize, MS_ASYNC);
+
+	store->nStored++;
+	return 1;
+}
+
+#endif	//_JET_ANALYSISSTORE_H
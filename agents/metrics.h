@@ -0,0 +1,273 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ * 
+ * Copyright (C) 2020 Evelyn Zhu
+ * 
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant 
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the 
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+#ifndef _JET_METRICS_H
+#define _JET_METRICS_H
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+//----- relay metrics: counters live in the session and engine entries and are only
+//ever added to with relaxed atomics, the stats command reads them while sessions run
+static const long long gLatencyBucketUsec[MAX_LATENCY_BUCKETS-1] = {
+	1000, 5000, 10000, 25000, 50000, 100000, 250000, 500000,
+	1000000, 2500000, 5000000, 10000000, 30000000, 60000000
+};
+
+static inline void JetsonMetricAdd(std::atomic<unsigned long long> &counter, unsigned long long n)
+{
+	counter.fetch_add(n, std::memory_order_relaxed);
+}
+
+static inline void JetsonHistogramRecord(struct LatencyHistogram *hist, long long usec)
+{
+	int i = 0;
+	while (i < MAX_LATENCY_BUCKETS-1 && usec > gLatencyBucketUsec[i])
+		i++;
+	JetsonMetricAdd(hist->buckets[i], 1);
+	JetsonMetricAdd(hist->nSumUsec, (unsigned long long)usec);
+}
+
+//record is handed to a new session
+static inline void JetsonMetricsReset(struct SessionMetrics *m)
+{
+	m->nBytesIn.store(0);
+	m->nBytesOut.store(0);
+	m->nCommands.store(0);
+	m->nGoCount.store(0);
+	m->nLastNps.store(0);
+	m->nLastDepth.store(0);
+	m->nFirstInfoUsec.store(0);
+	m->nBestMoveUsec.store(0);
+	m->nGoStartUsec = 0;
+	m->bFirstInfoSeen = 0;
+}
+
+static inline void JetsonMetricsOnClientBytes(struct ClientEntry *client, int nBytesIn, int nBytesOut)
+{
+	if (nBytesIn > 0) {
+		JetsonMetricAdd(client->metrics.nBytesIn, nBytesIn);
+		JetsonMetricAdd(client->engine->metrics.nBytesIn, nBytesIn);
+	}
+	if (nBytesOut > 0) {
+		JetsonMetricAdd(client->metrics.nBytesOut, nBytesOut);
+		JetsonMetricAdd(client->engine->metrics.nBytesOut, nBytesOut);
+	}
+}
+
+//one complete command from the client, go starts the latency clock
+static inline void JetsonMetricsOnCommand(struct ClientEntry *client, const char *sLine)
+{
+	JetsonMetricAdd(client->metrics.nCommands, 1);
+	JetsonMetricAdd(client->engine->metrics.nCommands, 1);
+
+	if (strncmp(sLine, "go", 2) == 0 && (sLine[2] == ' ' || sLine[2] == '\r' || sLine[2] == '\n' || sLine[2] == '\0')) {
+		JetsonMetricAdd(client->metrics.nGoCount, 1);
+		JetsonMetricAdd(client->engine->metrics.nGoCount, 1);
+		client->metrics.nGoStartUsec = GetMonotonicUsec();
+		client->metrics.bFirstInfoSeen = 0;
+	}
+}
+
+//engine line on its way to the client, whichever instance or cache produced it
+static inline void JetsonMetricsOnEngineLine(struct ClientEntry *client, const char *sLine)
+{
+	struct SessionMetrics *m = &client->metrics;
+	struct EngineMetrics *em = &client->engine->metrics;
+
+	if (strncmp(sLine, "info ", 5) == 0 && strncmp(sLine, "info string", 11) != 0) {
+		if (m->nGoStartUsec != 0 && !m->bFirstInfoSeen) {
+			long long usec = GetMonotonicUsec() - m->nGoStartUsec;
+			m->bFirstInfoSeen = 1;
+			m->nFirstInfoUsec.store(usec, std::memory_order_relaxed);
+			JetsonHistogramRecord(&em->firstInfo, usec);
+		}
+
+		const char *sDepth = strstr(sLine, " depth ");
+		const char *sNps = strstr(sLine, " nps ");
+		if (sDepth != NULL) {
+			m->nLastDepth.store(atoi(sDepth + 7), std::memory_order_relaxed);
+			em->nLastDepth.store(atoi(sDepth + 7), std::memory_order_relaxed);
+		}
+		if (sNps != NULL) {
+			m->nLastNps.store(atoll(sNps + 5), std::memory_order_relaxed);
+			em->nLastNps.store(atoll(sNps + 5), std::memory_order_relaxed);
+		}
+	}
+	else if (strncmp(sLine, "bestmove", 8) == 0 && m->nGoStartUsec != 0) {
+		long long usec = GetMonotonicUsec() - m->nGoStartUsec;
+		m->nGoStartUsec = 0;
+		m->nBestMoveUsec.store(usec, std::memory_order_relaxed);
+		JetsonHistogramRecord(&em->bestMove, usec);
+	}
+}
+
+//----- counters are copied into the registry snapshot, stats is rendered from that copy
+static inline void JetsonHistogramCopy(const struct LatencyHistogram *hist, struct HistogramCounts *counts)
+{
+	for (int i=0; i<MAX_LATENCY_BUCKETS; i++)
+		counts->buckets[i] = hist->buckets[i].load(std::memory_order_relaxed);
+	counts->nSumUsec = hist->nSumUsec.load(std::memory_order_relaxed);
+}
+
+static inline void JetsonMetricsCopySession(const struct SessionMetrics *m, struct SessionCounters *c)
+{
+	c->nBytesIn = m->nBytesIn.load(std::memory_order_relaxed);
+	c->nBytesOut = m->nBytesOut.load(std::memory_order_relaxed);
+	c->nCommands = m->nCommands.load(std::memory_order_relaxed);
+	c->nGoCount = m->nGoCount.load(std::memory_order_relaxed);
+	c->nLastNps = m->nLastNps.load(std::memory_order_relaxed);
+	c->nLastDepth = m->nLastDepth.load(std::memory_order_relaxed);
+	c->nFirstInfoUsec = m->nFirstInfoUsec.load(std::memory_order_relaxed);
+	c->nBestMoveUsec = m->nBestMoveUsec.load(std::memory_order_relaxed);
+}
+
+static inline void JetsonMetricsCopyEngine(const struct EngineMetrics *em, struct EngineCounters *c)
+{
+	c->nBytesIn = em->nBytesIn.load(std::memory_order_relaxed);
+	c->nBytesOut = em->nBytesOut.load(std::memory_order_relaxed);
+	c->nCommands = em->nCommands.load(std::memory_order_relaxed);
+	c->nGoCount = em->nGoCount.load(std::memory_order_relaxed);
+	c->nLogins = em->nLogins.load(std::memory_order_relaxed);
+	c->nLastNps = em->nLastNps.load(std::memory_order_relaxed);
+	c->nLastDepth = em->nLastDepth.load(std::memory_order_relaxed);
+	JetsonHistogramCopy(&em->firstInfo, &c->firstInfo);
+	JetsonHistogramCopy(&em->bestMove, &c->bestMove);
+}
+
+//----- Prometheus text format, also the reply to the stats command. Samples of one
+//metric have to stay together, each family is collected in its own stream
+enum {
+	STAT_SESSIONS_ACTIVE = 0,
+	STAT_BYTES_IN,
+	STAT_BYTES_OUT,
+	STAT_COMMANDS,
+	STAT_GO,
+	STAT_LOGINS,
+	STAT_ENGINE_NPS,
+	STAT_ENGINE_DEPTH,
+	STAT_FIRST_INFO,
+	STAT_BESTMOVE,
+	STAT_SESSION_BYTES_IN,
+	STAT_SESSION_BYTES_OUT,
+	STAT_SESSION_COMMANDS,
+	STAT_SESSION_GO,
+	STAT_SESSION_NPS,
+	STAT_SESSION_DEPTH,
+	STAT_SESSION_FIRST_INFO,
+	STAT_SESSION_BESTMOVE,
+	MAX_STAT_FAMILIES
+};
+
+static const char *gsStatFamilies[MAX_STAT_FAMILIES][3] = {	//name, type, help
+	{ "jetson_sessions_active", "gauge", "Connected client sessions." },
+	{ "jetson_bytes_in_total", "counter", "Bytes received from clients." },
+	{ "jetson_bytes_out_total", "counter", "Bytes sent to clients." },
+	{ "jetson_commands_total", "counter", "UCI commands relayed to the engine." },
+	{ "jetson_go_total", "counter", "go commands relayed to the engine." },
+	{ "jetson_logins_total", "counter", "Sessions started." },
+	{ "jetson_engine_nps", "gauge", "Last nps reported by any instance." },
+	{ "jetson_engine_depth", "gauge", "Last depth reported by any instance." },
+	{ "jetson_go_first_info_seconds", "histogram", "Time from go to the first info line." },
+	{ "jetson_go_bestmove_seconds", "histogram", "Time from go to bestmove." },
+	{ "jetson_session_bytes_in_total", "counter", "Bytes received from the session's client." },
+	{ "jetson_session_bytes_out_total", "counter", "Bytes sent to the session's client." },
+	{ "jetson_session_commands_total", "counter", "UCI commands relayed for the session." },
+	{ "jetson_session_go_total", "counter", "go commands relayed for the session." },
+	{ "jetson_session_nps", "gauge", "Last nps reported to the session." },
+	{ "jetson_session_depth", "gauge", "Last depth reported to the session." },
+	{ "jetson_session_last_first_info_seconds", "gauge", "Last time from go to the first info line." },
+	{ "jetson_session_last_bestmove_seconds", "gauge", "Last time from go to bestmove." }
+};
+
+static inline std::string JetsonPromLabel(const char *sValue)
+{
+	std::string s;
+	for (const char *p = sValue; *p != '\0'; p++) {
+		if (*p == '\\' || *p == '"')
+			s += '\\';
+		if (*p == '\n')
+			s += "\\n";
+		else
+			s += *p;
+	}
+	return s;
+}
+
+template <typename T>
+static inline void JetsonPromSample(std::ostringstream *families, int nFamily, const std::string &sLabels, T value)
+{
+	families[nFamily] << gsStatFamilies[nFamily][0] << "{" << sLabels << "} " << value << "\n";
+}
+
+static inline void JetsonPromHistogram(std::ostringstream *families, int nFamily, const std::string &sLabels,
+	const struct HistogramCounts *hist)
+{
+	std::ostringstream &oss = families[nFamily];
+	const char *sName = gsStatFamilies[nFamily][0];
+	unsigned long long nCumulative = 0;
+	for (int i=0; i<MAX_LATENCY_BUCKETS; i++) {
+		nCumulative += hist->buckets[i];
+		oss << sName << "_bucket{" << sLabels << ",le=\"";
+		if (i < MAX_LATENCY_BUCKETS-1)
+			oss << gLatencyBucketUsec[i] / 1e6;
+		else
+			oss << "+Inf";
+		oss << "\"} " << nCumulative << "\n";
+	}
+	oss << sName << "_sum{" << sLabels << "} " << hist->nSumUsec / 1e6 << "\n";
+	oss << sName << "_count{" << sLabels << "} " << nCumulative << "\n";
+}
+
+static inline std::string JetsonPromJoin(const std::ostringstream *families)
+{
+	std::ostringstream oss;
+	for (int i=0; i<MAX_STAT_FAMILIES; i++) {
+		oss << "# HELP " << gsStatFamilies[i][0] << " " << gsStatFamilies[i][2] << "\n";
+		oss << "# TYPE " << gsStatFamilies[i][0] << " " << gsStatFamilies[i][1] << "\n";
+		oss << families[i].str();
+	}
+	return oss.str();
+}
+
+#endif
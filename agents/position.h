@@ -0,0 +1,312 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ * 
+ * Copyright (C) 2020 Evelyn Zhu
+ * 
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant 
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the 
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+#ifndef _JET_POSITION_H
+#define _JET_POSITION_H
+
+#include <cstdlib>
+#include <cstring>
+#include <sstream>
+#include <string>
+
+//----- just enough chess to turn "position ... moves ..." into the position
+//it describes and a Zobrist key for it. Moves are trusted, not validated.
+#define PIECE_COLOR_BLACK	8	//piece = type | color, type 1..6 = P N B R Q K
+#define PIECE_PAWN			1
+#define PIECE_ROOK			4
+#define PIECE_KING			6
+
+struct ChessPosition {
+	unsigned char board[64];	//a1 = 0, h1 = 7, a8 = 56
+	int sideToMove;				//0 white, 1 black
+	int castleRook[2][2];		//[color][0 king side, 1 queen side], rook square or -1
+	int epSquare;				//-1 if none
+};
+
+static inline unsigned long long JetsonSplitMix64(unsigned long long *pState)
+{
+	unsigned long long z = (*pState += 0x9E3779B97F4A7C15ULL);
+	z = (z ^ (z >> 30)) * 0xBF58476D1CE4E5B9ULL;
+	z = (z ^ (z >> 27)) * 0x94D049BB133111EBULL;
+	return z ^ (z >> 31);
+}
+
+struct ZobristKeys {
+	unsigned long long piece[16][64];
+	unsigned long long castle[4][8];	//[color*2 + side][rook file]
+	unsigned long long epFile[8];
+	unsigned long long blackToMove;
+
+	ZobristKeys() {
+		unsigned long long seed = 0x4A657473;	//fixed, keys must stay the same across restarts
+		for (int p=0; p<16; p++)
+			for (int sq=0; sq<64; sq++)
+				piece[p][sq] = JetsonSplitMix64(&seed);
+		for (int i=0; i<4; i++)
+			for (int f=0; f<8; f++)
+				castle[i][f] = JetsonSplitMix64(&seed);
+		for (int f=0; f<8; f++)
+			epFile[f] = JetsonSplitMix64(&seed);
+		blackToMove = JetsonSplitMix64(&seed);
+	}
+};
+
+static inline const struct ZobristKeys &JetsonZobrist()
+{
+	static const struct ZobristKeys keys;
+	return keys;
+}
+
+static inline int JetsonPieceFromChar(char c)
+{
+	const char *sTypes = "pnbrqk";
+	const char *p = strchr(sTypes, (c >= 'A' && c <= 'Z') ? c - 'A' + 'a' : c);
+	if (c == '\0' || p == NULL)
+		return 0;
+	return (int)(p - sTypes) + 1 + ((c >= 'a' && c <= 'z') ? PIECE_COLOR_BLACK : 0);
+}
+
+//outermost rook of the color on its back rank, beyond the king in direction dir
+static inline int JetsonFindCastleRook(const struct ChessPosition *pos, int color, int side)
+{
+	int rank = (color == 0 ? 0 : 56);
+	int rook = PIECE_ROOK | (color ? PIECE_COLOR_BLACK : 0);
+	int king = PIECE_KING | (color ? PIECE_COLOR_BLACK : 0);
+
+	for (int i=0; i<8; i++) {
+		int f = (side == 0 ? 7 - i : i);
+		if (pos->board[rank + f] == king)
+			break;
+		if (pos->board[rank + f] == rook)
+			return rank + f;
+	}
+	return -1;
+}
+
+static inline int JetsonPositionSetFen(struct ChessPosition *pos, const std::string &sFen)
+{
+	std::istringstream iss(sFen);
+	std::string sBoard, sSide = "w", sCastle = "-", sEp = "-";
+	iss >> sBoard >> sSide >> sCastle >> sEp;
+
+	memset(pos, 0, sizeof(*pos));
+	int rank = 7, file = 0;
+	for (size_t i=0; i<sBoard.length(); i++) {
+		char c = sBoard[i];
+		if (c == '/') {
+			rank--;
+			file = 0;
+		}
+		else if (c >= '1' && c <= '8')
+			file += c - '0';
+		else {
+			int piece = JetsonPieceFromChar(c);
+			if (piece == 0 || rank < 0 || file > 7)
+				return 0;
+			pos->board[rank*8 + file++] = (unsigned char)piece;
+		}
+	}
+	if (rank != 0)
+		return 0;
+
+	pos->sideToMove = (sSide == "b" ? 1 : 0);
+
+	pos->castleRook[0][0] = pos->castleRook[0][1] = -1;
+	pos->castleRook[1][0] = pos->castleRook[1][1] = -1;
+	for (size_t i=0; i<sCastle.length(); i++) {
+		char c = sCastle[i];
+		int color = (c >= 'a' && c <= 'z') ? 1 : 0;
+		char lc = (char)(color ? c : c - 'A' + 'a');
+		if (lc == 'k')
+			pos->castleRook[color][0] = JetsonFindCastleRook(pos, color, 0);
+		else if (lc == 'q')
+			pos->castleRook[color][1] = JetsonFindCastleRook(pos, color, 1);
+		else if (lc >= 'a' && lc <= 'h') {
+			//Shredder-FEN / X-FEN for Chess960: file of the castling rook
+			int rookSq = (color ? 56 : 0) + (lc - 'a');
+			int kingSq = -1;
+			for (int f=0; f<8; f++)
+				if ((pos->board[(color ? 56 : 0) + f] & 7) == PIECE_KING)
+					kingSq = (color ? 56 : 0) + f;
+			pos->castleRook[color][rookSq > kingSq ? 0 : 1] = rookSq;
+		}
+	}
+
+	pos->epSquare = -1;
+	if (sEp.length() == 2 && sEp[0] >= 'a' && sEp[0] <= 'h' && sEp[1] >= '1' && sEp[1] <= '8')
+		pos->epSquare = (sEp[1] - '1')*8 + (sEp[0] - 'a');
+	return 1;
+}
+
+static inline void JetsonPositionSetStart(struct ChessPosition *pos)
+{
+	JetsonPositionSetFen(pos, "rnbqkbnr/pppppppp/8/8/8/8/PPPPPPPP/RNBQKBNR w KQkq - 0 1");
+}
+
+static inline int JetsonSquareFromStr(const char *s)
+{
+	if (s[0] < 'a' || s[0] > 'h' || s[1] < '1' || s[1] > '8')
+		return -1;
+	return (s[1] - '1')*8 + (s[0] - 'a');
+}
+
+//applies a move in UCI notation (e2e4, e7e8q, e1g1 or e1h1 for castling)
+static inline int JetsonPositionApplyMove(struct ChessPosition *pos, const char *sMove)
+{
+	int from = JetsonSquareFromStr(sMove);
+	int to = (from < 0 ? -1 : JetsonSquareFromStr(sMove + 2));
+	if (to < 0)
+		return 0;
+
+	int color = pos->sideToMove;
+	int piece = pos->board[from];
+	if (piece == 0 || ((piece & PIECE_COLOR_BLACK) ? 1 : 0) != color)
+		return 0;
+
+	int ownRook = PIECE_ROOK | (color ? PIECE_COLOR_BLACK : 0);
+	int epSquare = pos->epSquare;
+	pos->epSquare = -1;
+
+	if ((piece & 7) == PIECE_KING && (pos->board[to] == ownRook || abs((to & 7) - (from & 7)) >= 2)) {
+		int side = ((to & 7) > (from & 7) ? 0 : 1);
+		int rookSq = (pos->board[to] == ownRook ? to : pos->castleRook[color][side]);
+		if (rookSq < 0)
+			rookSq = JetsonFindCastleRook(pos, color, side);
+		if (rookSq < 0)
+			return 0;
+
+		int rank = (color ? 56 : 0);
+		pos->board[from] = 0;
+		pos->board[rookSq] = 0;
+		pos->board[rank + (side == 0 ? 6 : 2)] = (unsigned char)piece;
+		pos->board[rank + (side == 0 ? 5 : 3)] = (unsigned char)ownRook;
+	}
+	else {
+		if ((piece & 7) == PIECE_PAWN && to == epSquare && (to & 7) != (from & 7))
+			pos->board[to + (color ? 8 : -8)] = 0;
+
+		if ((piece & 7) == PIECE_PAWN && abs(to - from) == 16)
+			pos->epSquare = (from + to) / 2;
+
+		int promoted = JetsonPieceFromChar(sMove[4]);
+		if (promoted != 0)
+			piece = (promoted & 7) | (color ? PIECE_COLOR_BLACK : 0);
+
+		pos->board[to] = (unsigned char)piece;
+		pos->board[from] = 0;
+	}
+
+	for (int c=0; c<2; c++) {
+		for (int side=0; side<2; side++) {
+			int r = pos->castleRook[c][side];
+			if ((c == color && (piece & 7) == PIECE_KING) || r == from || r == to)
+				pos->castleRook[c][side] = -1;
+		}
+	}
+
+	pos->sideToMove = 1 - color;
+	return 1;
+}
+
+static inline unsigned long long JetsonPositionHash(const struct ChessPosition *pos)
+{
+	const struct ZobristKeys &z = JetsonZobrist();
+	unsigned long long key = 0;
+
+	for (int sq=0; sq<64; sq++)
+		if (pos->board[sq])
+			key ^= z.piece[pos->board[sq]][sq];
+
+	if (pos->sideToMove)
+		key ^= z.blackToMove;
+
+	for (int c=0; c<2; c++)
+		for (int side=0; side<2; side++)
+			if (pos->castleRook[c][side] >= 0)
+				key ^= z.castle[c*2 + side][pos->castleRook[c][side] & 7];
+
+	//en passant only counts when a pawn can actually take
+	if (pos->epSquare >= 0) {
+		int pawn = PIECE_PAWN | (pos->sideToMove ? PIECE_COLOR_BLACK : 0);
+		int from = pos->epSquare + (pos->sideToMove ? 8 : -8);
+		int file = pos->epSquare & 7;
+		if ((file > 0 && pos->board[from - 1] == pawn) || (file < 7 && pos->board[from + 1] == pawn))
+			key ^= z.epFile[file];
+	}
+
+	return key;
+}
+
+//"position startpos|fen <fen> [moves ...]" -> key of the resulting position, 0 if not understood
+static inline unsigned long long JetsonPositionKeyFromCmd(const char *sLine)
+{
+	std::istringstream iss(sLine);
+	std::string token, sFen;
+	struct ChessPosition pos;
+
+	iss >> token;
+	if (token != "position" || !(iss >> token))
+		return 0;
+
+	if (token == "startpos") {
+		JetsonPositionSetStart(&pos);
+		iss >> token;
+	}
+	else if (token == "fen") {
+		while (iss >> token && token != "moves")
+			sFen += token + " ";
+		if (!JetsonPositionSetFen(&pos, sFen))
+			return 0;
+	}
+	else
+		return 0;
+
+	if (token == "moves") {
+		while (iss >> token)
+			if (!JetsonPositionApplyMove(&pos, token.c_str()))
+				return 0;
+	}
+
+	unsigned long long key = JetsonPositionHash(&pos);
+	return (key != 0 ? key : 1);
+}
+
+#endif	//_JET_POSITION_H
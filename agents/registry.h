@@ -0,0 +1,322 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ *
+ * Copyright (C) 2020 Evelyn Zhu
+ *
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+#ifndef _JET_REGISTRY_H
+#define _JET_REGISTRY_H
+
+#include <cstdlib>
+#include <memory>
+#include <string>
+#include <unordered_map>
+#include <vector>
+
+#define SNAPSHOT_REFRESH_MSEC 250	//counters in a published snapshot are at most this old
+#define SNAPSHOT_MIN_MSEC 50		//a changed registry is published at most this often
+
+//----- read-only copy of the registry for query/scan/stats, published as a whole and
+//never changed afterwards, a reader keeps the version it loaded for as long as it needs it
+struct HistogramCounts {
+	unsigned long long buckets[MAX_LATENCY_BUCKETS];
+	unsigned long long nSumUsec;
+};
+
+//values of the relay metrics when the snapshot was built, see agents/metrics.h
+struct SessionCounters {
+	unsigned long long nBytesIn;
+	unsigned long long nBytesOut;
+	unsigned long long nCommands;
+	unsigned long long nGoCount;
+	long long nLastNps;
+	int nLastDepth;
+	long long nFirstInfoUsec;
+	long long nBestMoveUsec;
+};
+
+struct EngineCounters {
+	unsigned long long nBytesIn;
+	unsigned long long nBytesOut;
+	unsigned long long nCommands;
+	unsigned long long nGoCount;
+	unsigned long long nLogins;
+	long long nLastNps;
+	int nLastDepth;
+	struct HistogramCounts firstInfo;
+	struct HistogramCounts bestMove;
+};
+
+struct SessionView {
+	unsigned int nSessionId;
+	int sock;
+	std::string sIpAddr;
+	std::string sServIpAddr;
+	std::string sEngInstName;
+	std::string sState;		//what runs the session, e.g. " PID(1234)"
+	int bCounted;			//has relay metrics, routed sessions don't
+	struct SessionCounters counters;
+};
+
+struct EngineView {
+	std::string sEngineName;
+	std::string sEngienPort;
+	std::string sExecutable;
+	int bDraining;
+	int bRouted;
+	int bOffline;		//routed, and no backend that has it is up: left out of scan
+	std::vector<std::string> stats;		//pool/cache/queue/shared lines, formatted
+	struct EngineCounters counters;
+	std::vector<struct SessionView> sessions;
+};
+
+struct RegistrySnapshot {
+	unsigned long long nVersion;	//registry version it was built from
+	long long nBuiltUsec;
+	size_t nSessions;
+	long long nRecordsAllocated;
+	std::string sNodeLine;			//node limit line, empty if none
+	std::vector<struct EngineView> engines;
+	std::string sQueryText;			//rendered reply to "query"
+};
+
+//----- engine/session registry: engines are allocated as the conf lists them and
+//session records only while in use, each engine keeps a compact array of its own
+//records; the maps answer lookups without walking any table
+struct EngineRegistry {
+	std::vector<struct EngineEntry *> engines;	//draining entries included
+	std::unordered_map<std::string, struct EngineEntry *> byName;	//engines taking logins only
+	std::unordered_map<std::string, struct EngineEntry *> byPort;
+	std::unordered_map<int, struct ClientEntry *> bySock;	//connected sessions
+	std::unordered_map<int, struct ClientEntry *> byPid;	//running engine processes
+	std::unordered_map<unsigned int, struct ClientEntry *> bySession;
+	unsigned int nLastSessionId;
+	long long nRecordsAllocated;	//session records alive, all engines
+	unsigned long long nVersion;	//bumped on every engine/session change
+	std::shared_ptr<const struct RegistrySnapshot> pSnapshot;	//atomic load/store only
+};
+
+static inline std::shared_ptr<const struct RegistrySnapshot> JetsonRegistrySnapshot(struct EngineRegistry *reg)
+{
+	return std::atomic_load(&reg->pSnapshot);
+}
+
+//readers holding the old version keep it alive until they drop it
+static inline void JetsonRegistryPublish(struct EngineRegistry *reg, std::shared_ptr<const struct RegistrySnapshot> snap)
+{
+	std::atomic_store(&reg->pSnapshot, snap);
+}
+
+static inline struct EngineEntry *JetsonRegistryFindEngine(struct EngineRegistry *reg, const char *sEngName)
+{
+	auto it = reg->byName.find(sEngName);
+	return (it == reg->byName.end() ? NULL : it->second);
+}
+
+static inline struct EngineEntry *JetsonRegistryFindPort(struct EngineRegistry *reg, const char *sPort)
+{
+	auto it = reg->byPort.find(sPort);
+	return (it == reg->byPort.end() ? NULL : it->second);
+}
+
+static inline struct ClientEntry *JetsonRegistryFindSock(struct EngineRegistry *reg, int sock)
+{
+	auto it = reg->bySock.find(sock);
+	return (it == reg->bySock.end() ? NULL : it->second);
+}
+
+static inline struct ClientEntry *JetsonRegistryFindPid(struct EngineRegistry *reg, int pid)
+{
+	auto it = reg->byPid.find(pid);
+	return (it == reg->byPid.end() ? NULL : it->second);
+}
+
+static inline struct ClientEntry *JetsonRegistryFindSession(struct EngineRegistry *reg, unsigned int nSessionId)
+{
+	auto it = reg->bySession.find(nSessionId);
+	return (it == reg->bySession.end() ? NULL : it->second);
+}
+
+//zeroed entry, listed by name and port
+static inline struct EngineEntry *JetsonRegistryAddEngine(struct EngineRegistry *reg, const char *sEngName, const char *sPort)
+{
+	struct EngineEntry *engEntry = (struct EngineEntry *)calloc(1, sizeof(struct EngineEntry));
+	if (engEntry == NULL)
+		return NULL;
+
+	reg->engines.push_back(engEntry);
+	reg->byName[sEngName] = engEntry;
+	reg->byPort[sPort] = engEntry;
+	reg->nVersion++;
+	return engEntry;
+}
+
+//no more logins: name and port are free for a replacement
+static inline void JetsonRegistryUnlistEngine(struct EngineRegistry *reg, struct EngineEntry *engEntry)
+{
+	auto itName = reg->byName.find(engEntry->sEngineName);
+	if (itName != reg->byName.end() && itName->second == engEntry)
+		reg->byName.erase(itName);
+
+	auto itPort = reg->byPort.find(engEntry->sEngienPort);
+	if (itPort != reg->byPort.end() && itPort->second == engEntry)
+		reg->byPort.erase(itPort);
+	reg->nVersion++;
+}
+
+//entry has no records left
+static inline void JetsonRegistryRemoveEngine(struct EngineRegistry *reg, struct EngineEntry *engEntry)
+{
+	JetsonRegistryUnlistEngine(reg, engEntry);
+	for (size_t i=0; i<reg->engines.size(); i++) {
+		if (reg->engines[i] == engEntry) {
+			reg->engines.erase(reg->engines.begin() + i);
+			break;
+		}
+	}
+	free(engEntry->clients);
+	free(engEntry->insts);
+	free(engEntry);
+}
+
+//zeroed record appended to the engine's array
+static inline struct ClientEntry *JetsonRegistryAddClient(struct EngineRegistry *reg, struct EngineEntry *engEntry)
+{
+	if (engEntry->nClients == engEntry->nClientsCap) {
+		int newCap = (engEntry->nClientsCap > 0 ? engEntry->nClientsCap * 2 : 8);
+		struct ClientEntry **newClients = (struct ClientEntry **)realloc(engEntry->clients, newCap * sizeof(struct ClientEntry *));
+		if (newClients == NULL)
+			return NULL;
+		engEntry->clients = newClients;
+		engEntry->nClientsCap = newCap;
+	}
+
+	struct ClientEntry *client = (struct ClientEntry *)calloc(1, sizeof(struct ClientEntry));
+	if (client == NULL)
+		return NULL;
+
+	client->engine = engEntry;
+	client->nSlot = engEntry->nClients;
+	engEntry->clients[engEntry->nClients++] = client;
+	reg->nRecordsAllocated++;
+	reg->nVersion++;
+	return client;
+}
+
+//last one in the array takes the freed place, buffers must be released already
+static inline void JetsonRegistryRemoveClient(struct EngineRegistry *reg, struct ClientEntry *client)
+{
+	struct EngineEntry *engEntry = client->engine;
+	struct ClientEntry *last = engEntry->clients[--engEntry->nClients];
+
+	engEntry->clients[client->nSlot] = last;
+	last->nSlot = client->nSlot;
+	reg->nRecordsAllocated--;
+	reg->nVersion++;
+	free(client);
+}
+
+//agent-owned instances, warm pool members and shared workers, are listed in
+//engine->insts too so their bookkeeping doesn't walk all sessions of the engine
+static inline int JetsonRegistryAddInst(struct EngineEntry *engEntry, struct ClientEntry *inst)
+{
+	if (inst->nInstSlot > 0)
+		return 1;
+
+	if (engEntry->nInsts == engEntry->nInstsCap) {
+		int newCap = (engEntry->nInstsCap > 0 ? engEntry->nInstsCap * 2 : 8);
+		struct ClientEntry **newInsts = (struct ClientEntry **)realloc(engEntry->insts, newCap * sizeof(struct ClientEntry *));
+		if (newInsts == NULL)
+			return 0;
+		engEntry->insts = newInsts;
+		engEntry->nInstsCap = newCap;
+	}
+
+	engEntry->insts[engEntry->nInsts++] = inst;
+	inst->nInstSlot = engEntry->nInsts;
+	return 1;
+}
+
+static inline void JetsonRegistryRemoveInst(struct EngineEntry *engEntry, struct ClientEntry *inst)
+{
+	if (inst->nInstSlot <= 0)
+		return;
+
+	struct ClientEntry *last = engEntry->insts[--engEntry->nInsts];
+	engEntry->insts[inst->nInstSlot - 1] = last;
+	last->nInstSlot = inst->nInstSlot;
+	inst->nInstSlot = 0;
+}
+
+//connected client gets a session id, which stays unique for the life of the agent
+static inline void JetsonRegistryAddSession(struct EngineRegistry *reg, struct ClientEntry *client)
+{
+	if (++reg->nLastSessionId == 0)
+		++reg->nLastSessionId;
+	client->nSessionId = reg->nLastSessionId;
+	reg->bySession[client->nSessionId] = client;
+	reg->bySock[client->sock] = client;
+	reg->nVersion++;
+}
+
+static inline void JetsonRegistryRemoveSession(struct EngineRegistry *reg, struct ClientEntry *client)
+{
+	if (client->nSessionId == 0)
+		return;
+
+	reg->bySession.erase(client->nSessionId);
+	auto it = reg->bySock.find(client->sock);
+	if (it != reg->bySock.end() && it->second == client)
+		reg->bySock.erase(it);
+	client->nSessionId = 0;
+	reg->nVersion++;
+}
+
+//session keeps its id over a dropped connection, sock -1 while it has none
+static inline void JetsonRegistrySetSock(struct EngineRegistry *reg, struct ClientEntry *client, int sock)
+{
+	auto it = reg->bySock.find(client->sock);
+	if (it != reg->bySock.end() && it->second == client)
+		reg->bySock.erase(it);
+	client->sock = sock;
+	if (sock >= 0)
+		reg->bySock[sock] = client;
+	reg->nVersion++;
+}
+
+#endif
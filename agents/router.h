@@ -0,0 +1,287 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ * 
+ * Copyright (C) 2020 Evelyn Zhu
+ * 
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant 
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the 
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+#ifndef _JET_ROUTER_H
+#define _JET_ROUTER_H
+
+#include <algorithm>
+#include <atomic>
+#include <cstring>
+#include <map>
+#include <memory>
+#include <sstream>
+#include <string>
+#include <vector>
+#include <arpa/inet.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sys/socket.h>
+#include <unistd.h>
+
+//----- router mode: backend=HOST[:MGMTPORT] node settings make the agent a front end.
+//Each backend's scan and load replies are fetched by a thread of its own; the reactor
+//takes the results, listens for every engine the backends offer and relays each
+//session to one backend, picked by load or by hashing the client address
+#define ROUTER_CHECK_MSEC		2000	//backend inventory and load are this old at most
+#define ROUTER_IO_TIMEOUT_MSEC	1000	//connect, and each reply of a check
+#define ROUTER_HIGH_WATERMARK	(256 * 1024)	//a side stops reading while this much waits for the other
+
+enum RouteMode {
+	ROUTE_MODE_LOAD = 0,		//route=load: fewest sessions and waiting logins
+	ROUTE_MODE_HASH = 1			//route=hash: a client address keeps its backend while that is up
+};
+
+//one engine of a backend, as its last check saw it
+struct RouterEngine {
+	std::string sPort;
+	int bLoadKnown;				//agent answered load, older ones don't
+	int nSessions;
+	int nInstances;
+	int nMax;
+	int nWaiting;
+};
+
+//sessions this agent sent to one engine of a backend
+struct RouterCounts {
+	int nRouted;				//relayed now
+	int nSinceCheck;			//added to its load until the next check counts them
+	long long nTotal;
+};
+
+struct RouterCheck {
+	int bOk;
+	std::string sIp;			//resolved address of the backend
+	std::string sError;
+	std::map<std::string, struct RouterEngine> engines;
+	int nNodeInstances;
+	int nNodeMax;
+};
+
+struct RouterBackend {
+	std::string sAddr;			//as configured, host:mgmtport
+	std::string sHost;
+	std::string sMgmtPort;
+	std::atomic<int> bRemoved;	//taken out by a reload, its thread ends
+	pthread_mutex_t lock;		//guards pending between the check thread and the reactor
+	struct RouterCheck pending;
+	int bPending;
+
+	//reactor only
+	struct RouterCheck live;
+	int bHealthy;
+	int bEverChecked;
+	std::map<std::string, struct RouterCounts> routed;	//by engine name
+	long long nConnectFailures;
+};
+
+//"JRE_<arch>_<ip>_<port>_<name>" as a scan reply lists an engine
+static inline int JetsonRouterParseScanLine(const std::string &sLine, std::string *pName, std::string *pPort)
+{
+	size_t pos = 0;
+	for (int i=0; i<3; i++) {
+		pos = sLine.find('_', pos);
+		if (pos == std::string::npos)
+			return 0;
+		pos++;
+	}
+	size_t end = sLine.find('_', pos);
+	if (end == std::string::npos || end == pos || end + 1 >= sLine.length())
+		return 0;
+
+	*pPort = sLine.substr(pos, end - pos);
+	*pName = sLine.substr(end + 1);
+	return (strspn(pPort->c_str(), "0123456789") == pPort->length());
+}
+
+//"load <eng> <sessions> <instances> <max> <waiting> <node inst> <node max>", see LOAD_CMD
+static inline int JetsonRouterParseLoad(const std::string &sLine, struct RouterEngine *pEng, int *pNodeInstances, int *pNodeMax)
+{
+	std::istringstream iss(sLine);
+	std::string sCmd, sName;
+	if (!(iss >> sCmd >> sName >> pEng->nSessions >> pEng->nInstances >> pEng->nMax >> pEng->nWaiting
+		>> *pNodeInstances >> *pNodeMax))
+		return 0;
+	pEng->bLoadKnown = 1;
+	return 1;
+}
+
+static inline int JetsonRouterWait(int fd, short events, long long nDeadlineMsec, long long nNowMsec)
+{
+	struct pollfd pfd = { fd, events, 0 };
+	int nWait = (int)(nDeadlineMsec > nNowMsec ? nDeadlineMsec - nNowMsec : 0);
+	return (poll(&pfd, 1, nWait) > 0 && (pfd.revents & (events | POLLHUP | POLLERR)));
+}
+
+//reply of one command, until sEnd is in it
+static inline int JetsonRouterAsk(int fd, const std::string &sCmd, const char *sEnd, std::string *pReply, long long (*now)())
+{
+	long long nDeadline = now() + ROUTER_IO_TIMEOUT_MSEC;
+	if (send(fd, sCmd.c_str(), sCmd.length(), MSG_NOSIGNAL) != (ssize_t)sCmd.length())
+		return 0;
+
+	pReply->clear();
+	while (pReply->find(sEnd) == std::string::npos) {
+		char buf[4096];
+		if (!JetsonRouterWait(fd, POLLIN, nDeadline, now()))
+			return 0;
+		ssize_t bytes = recv(fd, buf, sizeof(buf), 0);
+		if (bytes <= 0)
+			return 0;
+		pReply->append(buf, bytes);
+	}
+	return 1;
+}
+
+//scan, then load of each engine, over one management connection; blocking, for the check thread
+static inline void JetsonRouterCheck(struct RouterBackend *backend, struct RouterCheck *pCheck, long long (*now)())
+{
+	pCheck->bOk = 0;
+	pCheck->engines.clear();
+	pCheck->nNodeInstances = pCheck->nNodeMax = 0;
+
+	struct addrinfo hints, *addr = NULL;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(backend->sHost.c_str(), backend->sMgmtPort.c_str(), &hints, &addr) != 0 || addr == NULL) {
+		pCheck->sError = "unknown host";
+		return;
+	}
+	char sIp[INET_ADDRSTRLEN] = "";
+	inet_ntop(AF_INET, &((struct sockaddr_in *)addr->ai_addr)->sin_addr, sIp, sizeof(sIp));
+	pCheck->sIp = sIp;
+
+	int fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+	long long nDeadline = now() + ROUTER_IO_TIMEOUT_MSEC;
+	int nSockErr = 0;
+	socklen_t errLen = sizeof(nSockErr);
+	int bConnected = (fd >= 0 &&
+		(connect(fd, addr->ai_addr, addr->ai_addrlen) == 0 ||
+			(errno == EINPROGRESS && JetsonRouterWait(fd, POLLOUT, nDeadline, now()) &&
+			getsockopt(fd, SOL_SOCKET, SO_ERROR, &nSockErr, &errLen) == 0 && nSockErr == 0)));
+	freeaddrinfo(addr);
+	if (!bConnected) {
+		pCheck->sError = "management port not reachable";
+		if (fd >= 0)
+			close(fd);
+		return;
+	}
+
+	std::string sReply;
+	if (!JetsonRouterAsk(fd, "scan", "scanisdone", &sReply, now)) {
+		pCheck->sError = "no scan reply";
+		close(fd);
+		return;
+	}
+
+	std::istringstream iss(sReply);
+	std::string sLine;
+	while (std::getline(iss, sLine)) {
+		std::string sName, sPort;
+		if (sLine.find("scanisdone") == std::string::npos && JetsonRouterParseScanLine(sLine, &sName, &sPort)) {
+			struct RouterEngine eng = { sPort, 0, 0, 0, 0, 0 };
+			pCheck->engines[sName] = eng;
+		}
+	}
+
+	//an agent without load leaves the command unanswered, the rest of the check is skipped
+	for (auto it = pCheck->engines.begin(); it != pCheck->engines.end(); ++it) {
+		if (!JetsonRouterAsk(fd, "load " + it->first, "\n", &sReply, now))
+			break;
+		JetsonRouterParseLoad(sReply, &it->second, &pCheck->nNodeInstances, &pCheck->nNodeMax);
+	}
+	close(fd);
+	pCheck->bOk = 1;
+}
+
+static inline int JetsonRouterAtLimit(const struct RouterBackend *backend, const struct RouterEngine *eng)
+{
+	return (eng->bLoadKnown && ((eng->nMax > 0 && eng->nInstances >= eng->nMax) ||
+		(backend->live.nNodeMax > 0 && backend->live.nNodeInstances >= backend->live.nNodeMax)));
+}
+
+static inline unsigned long long JetsonRouterHash(const std::string &s)
+{
+	unsigned long long hash = 14695981039346656037ULL;
+	for (size_t i=0; i<s.length(); i++)
+		hash = (hash ^ (unsigned char)s[i]) * 1099511628211ULL;
+	hash ^= hash >> 33;
+	hash *= 0xFF51AFD7ED558CCDULL;
+	return hash ^ (hash >> 33);
+}
+
+//healthy backends serving the engine, best first; the rest of the list is where a
+//session goes when its first pick refuses the connection. Hashing is rendezvous
+//hashing: a backend going away moves only the clients it had
+static inline std::vector<std::shared_ptr<struct RouterBackend> > JetsonRouterRank(
+	const std::vector<std::shared_ptr<struct RouterBackend> > &backends, const std::string &sEngName,
+	const char *sClientIp, int nMode)
+{
+	std::vector<std::pair<std::pair<long long, long long>, size_t> > keys;
+	for (size_t i=0; i<backends.size(); i++) {
+		const struct RouterBackend *backend = backends[i].get();
+		auto it = backend->live.engines.find(sEngName);
+		if (!backend->bHealthy || it == backend->live.engines.end())
+			continue;
+
+		const struct RouterEngine *eng = &it->second;
+		if (nMode == ROUTE_MODE_HASH) {
+			unsigned long long score = JetsonRouterHash(std::string(sClientIp) + "|" + sEngName + "|" + backend->sAddr);
+			keys.push_back(std::make_pair(std::make_pair(0LL, -(long long)(score >> 1)), i));
+		}
+		else {
+			auto itCounts = backend->routed.find(sEngName);
+			struct RouterCounts counts = (itCounts != backend->routed.end() ? itCounts->second : RouterCounts());
+			long long nLoad = counts.nSinceCheck + (eng->bLoadKnown ? eng->nSessions + eng->nWaiting : counts.nRouted);
+			keys.push_back(std::make_pair(std::make_pair((long long)JetsonRouterAtLimit(backend, eng), nLoad), i));
+		}
+	}
+	std::stable_sort(keys.begin(), keys.end());
+
+	std::vector<std::shared_ptr<struct RouterBackend> > ranked;
+	for (size_t i=0; i<keys.size(); i++)
+		ranked.push_back(backends[keys[i].second]);
+	return ranked;
+}
+
+#endif	//_JET_ROUTER_H
@@ -0,0 +1,174 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ * 
+ * Copyright (C) 2020 Evelyn Zhu
+ * 
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant 
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the 
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+#ifndef _JET_SHAREDENGINE_H
+#define _JET_SHAREDENGINE_H
+
+#include <cctype>
+#include <deque>
+#include <sstream>
+#include <string>
+
+//----- shared mode: a few engine processes owned by the agent, sessions'
+//go commands are queued and run on whichever one is free
+struct SharedEngine {
+	std::string sUciReply;		//first worker's answer to uci, up to uciok
+	int bUciReplyDone;
+	struct ClientEntry *pUciWorker;	//worker whose answer is being kept
+	std::deque<struct ClientEntry *> runQueue;	//sessions whose go waits for a worker
+	long long nDispatched;
+	long long nPreempted;		//analysis searches stopped to let a queued go run
+	long long nWaitMsecTotal;	//queue wait of all dispatched go commands
+	long long nWaitMsecMax;
+};
+
+static inline struct SharedEngine *JetsonSharedCreate()
+{
+	struct SharedEngine *shared = new SharedEngine();
+	shared->bUciReplyDone = 0;
+	shared->pUciWorker = NULL;
+	shared->nDispatched = shared->nPreempted = 0;
+	shared->nWaitMsecTotal = shared->nWaitMsecMax = 0;
+	return shared;
+}
+
+//"setoption name <name> [value <v>]" or "option name <name> type ..." -> lower case name
+static inline std::string JetsonOptionName(const std::string &sLine, const char *sEndToken)
+{
+	std::istringstream iss(sLine);
+	std::string token, sName;
+
+	iss >> token;
+	if (!(iss >> token) || token != "name")
+		return "";
+
+	while (iss >> token && token != sEndToken) {
+		if (!sName.empty())
+			sName += " ";
+		sName += token;
+	}
+
+	for (size_t i=0; i<sName.length(); i++)
+		sName[i] = (char)tolower((unsigned char)sName[i]);
+	return sName;
+}
+
+//the setoption line that puts an option back to the default from the uci reply
+static inline std::string JetsonOptionDefault(const std::string &sUciReply, const std::string &sName)
+{
+	std::istringstream iss(sUciReply);
+	std::string sLine;
+
+	while (getline(iss, sLine)) {
+		if (sLine.compare(0, 12, "option name ") != 0 || JetsonOptionName(sLine, "type") != sName)
+			continue;
+
+		size_t posType = sLine.find(" type ");
+		size_t posDefault = sLine.find(" default ");
+		if (posType == std::string::npos || posDefault == std::string::npos)
+			return "";	//button, nothing to reset
+
+		std::string sValue = sLine.substr(posDefault + 9);
+		size_t posEnd = sValue.find(" min ");
+		if (posEnd == std::string::npos)
+			posEnd = sValue.find(" var ");
+		if (posEnd != std::string::npos)
+			sValue.erase(posEnd);
+		while (!sValue.empty() && (sValue[sValue.length()-1] == '\r' || sValue[sValue.length()-1] == ' '))
+			sValue.erase(sValue.length()-1);
+		if (sValue == "<empty>")
+			sValue = "";
+
+		return "setoption name " + sLine.substr(12, posType - 12) + " value " + sValue + "\n";
+	}
+	return "";
+}
+
+//option lines keep the latest setoption per name, in the order first sent
+static inline void JetsonOptionsSet(std::string &sOptions, const std::string &sLine)
+{
+	std::string sName = JetsonOptionName(sLine, "value");
+	std::istringstream iss(sOptions);
+	std::string sOld, sNew;
+	int bReplaced = 0;
+
+	while (getline(iss, sOld)) {
+		if (!bReplaced && JetsonOptionName(sOld, "value") == sName) {
+			sOld = sLine.substr(0, sLine.find_last_not_of("\r\n") + 1);
+			bReplaced = 1;
+		}
+		sNew += sOld + "\n";
+	}
+	if (!bReplaced)
+		sNew += sLine.substr(0, sLine.find_last_not_of("\r\n") + 1) + "\n";
+	sOptions = sNew;
+}
+
+//setoption lines that turn a worker set up with sFrom into one set up with sTo
+static inline std::string JetsonOptionsSwitch(const struct SharedEngine *shared,
+	const std::string &sFrom, const std::string &sTo)
+{
+	std::string sCmds, sLine;
+
+	std::istringstream issFrom(sFrom);
+	while (getline(issFrom, sLine)) {
+		std::string sName = JetsonOptionName(sLine, "value");
+		if (("\n" + sTo).find("\n" + sLine + "\n") != std::string::npos)
+			continue;
+
+		int bStillSet = 0;
+		std::istringstream issTo(sTo);
+		std::string sToLine;
+		while (getline(issTo, sToLine))
+			bStillSet |= (JetsonOptionName(sToLine, "value") == sName);
+		if (!bStillSet)
+			sCmds += JetsonOptionDefault(shared->sUciReply, sName);
+	}
+
+	std::istringstream issTo(sTo);
+	while (getline(issTo, sLine)) {
+		if (("\n" + sFrom).find("\n" + sLine + "\n") == std::string::npos)
+			sCmds += sLine + "\n";
+	}
+	return sCmds;
+}
+
+#endif	//_JET_SHAREDENGINE_H
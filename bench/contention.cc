@@ -0,0 +1,413 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ *
+ * Copyright (C) 2020 Evelyn Zhu
+ *
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+//----- management contention: logins measured once on a quiet agent and once
+//while threads repeat a management command (stats, query or scan) as fast as
+//the agent answers, with held sessions making the registry big enough for the
+//snapshot and the reports to cost something. Reports login latency for both
+//runs, management replies per second and latency, and the agent's CPU read
+//from /proc. Linux only.
+//
+//    jetson_contention -p 61241 -n 300 -q 4 -c stats -l 500
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#include <errno.h>
+#include <netdb.h>
+#include <pthread.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+using namespace std;
+
+#define CONT_TIMEOUT_SEC 5		//a reply later than this counts as lost
+#define CONT_READ_SIZE 65536
+
+struct ContOptions {
+	string sHost;
+	string sPort;
+	string sMgmtPort;
+	int nHeld;
+	int nThreads;
+	int nLogins;
+	string sCmd;
+	int nAgentPid;
+};
+
+//one management thread: a connection that repeats the command until told to stop
+struct ContWorker {
+	pthread_t tid;
+	const struct ContOptions *opts;
+	const char *sDone;			//the reply ends with this
+	vector<long long> replies;	//command -> full reply
+	int bFailed;
+};
+
+static volatile int gbStop = 0;
+
+static long long ContNowUsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//----- agent process, found by name unless -a was given
+static int ContFindAgentPid()
+{
+	DIR *dir = opendir("/proc");
+	if (dir == NULL)
+		return 0;
+
+	int pid = 0;
+	struct dirent *entry;
+	while (pid == 0 && (entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+			continue;
+
+		ifstream comm(string("/proc/") + entry->d_name + "/comm");
+		string name;
+		if (getline(comm, name) && name == "jetson_agent")
+			pid = atoi(entry->d_name);
+	}
+	closedir(dir);
+	return pid;
+}
+
+//utime + stime in clock ticks, -1 if the process is gone
+static long long ContCpuTicks(int pid)
+{
+	if (pid <= 0)
+		return -1;
+
+	ifstream statFile("/proc/" + to_string(pid) + "/stat");
+	string stat;
+	if (!getline(statFile, stat))
+		return -1;
+
+	//fields after the ")" closing comm: state is field 3, utime 14, stime 15
+	size_t pos = stat.rfind(')');
+	if (pos == string::npos)
+		return -1;
+	istringstream iss(stat.substr(pos + 2));
+	string field;
+	long long utime = 0, stime = 0;
+	for (int i=3; i<=15 && (iss >> field); i++) {
+		if (i == 14)
+			utime = atoll(field.c_str());
+		else if (i == 15)
+			stime = atoll(field.c_str());
+	}
+	return utime + stime;
+}
+
+//----- blocking connections with a receive timeout
+static int ContConnect(const struct ContOptions *opts, const string &sPort)
+{
+	struct addrinfo hints, *addr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(opts->sHost.c_str(), sPort.c_str(), &hints, &addr) != 0)
+		return -1;
+
+	int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addr);
+	if (fd < 0)
+		return -1;
+
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	struct timeval tv;
+	tv.tv_sec = CONT_TIMEOUT_SEC;
+	tv.tv_usec = 0;
+	setsockopt(fd, SOL_SOCKET, SO_RCVTIMEO, &tv, sizeof(tv));
+	return fd;
+}
+
+static int ContSend(int fd, const char *data, size_t len)
+{
+	while (len > 0) {
+		ssize_t bytes = send(fd, data, len, MSG_NOSIGNAL);
+		if (bytes <= 0)
+			return 0;
+		data += bytes;
+		len -= bytes;
+	}
+	return 1;
+}
+
+//reads until sDone shows up, 0 on timeout or EOF
+static int ContWaitFor(int fd, const char *sDone)
+{
+	static __thread char buf[CONT_READ_SIZE];
+	string sTail;
+	size_t nDoneLen = strlen(sDone);
+
+	while (1) {
+		ssize_t bytes = recv(fd, buf, sizeof(buf), 0);
+		if (bytes <= 0)
+			return 0;
+		sTail.append(buf, bytes);
+		if (sTail.find(sDone) != string::npos)
+			return 1;
+		if (sTail.length() > nDoneLen)
+			sTail.erase(0, sTail.length() - nDoneLen);
+	}
+}
+
+//uci and isready up to readyok, the fd stays open; -1 if the agent didn't answer
+static int ContLogin(const struct ContOptions *opts, long long *pnUsec)
+{
+	long long nStart = ContNowUsec();
+	int fd = ContConnect(opts, opts->sPort);
+	if (fd < 0)
+		return -1;
+	if (!ContSend(fd, "uci\nisready\n", 12) || !ContWaitFor(fd, "readyok")) {
+		close(fd);
+		return -1;
+	}
+	*pnUsec = ContNowUsec() - nStart;
+	return fd;
+}
+
+static void ContLogout(int fd)
+{
+	ContSend(fd, "quit\n", 5);
+	close(fd);
+}
+
+static void *ContWorkerMain(void *data)
+{
+	struct ContWorker *w = (struct ContWorker *)data;
+	int fd = ContConnect(w->opts, w->opts->sMgmtPort);
+	if (fd < 0) {
+		w->bFailed = 1;
+		return NULL;
+	}
+
+	while (!gbStop) {
+		long long nStart = ContNowUsec();
+		if (!ContSend(fd, w->opts->sCmd.c_str(), w->opts->sCmd.length()) || !ContWaitFor(fd, w->sDone)) {
+			w->bFailed = 1;
+			break;
+		}
+		w->replies.push_back(ContNowUsec() - nStart);
+	}
+	close(fd);
+	return NULL;
+}
+
+//----- report
+static long long ContPercentile(vector<long long> &v, double p)
+{
+	if (v.empty())
+		return 0;
+	size_t i = (size_t)(p * (v.size() - 1) + 0.5);
+	return v[i];
+}
+
+static void ContPrintLatency(const char *sName, vector<long long> &v)
+{
+	sort(v.begin(), v.end());
+	if (v.empty()) {
+		printf("  %-24s n=0\n", sName);
+		return;
+	}
+	printf("  %-24s n=%-8zu p50=%8.2f  p90=%8.2f  p99=%8.2f  max=%8.2f ms\n", sName, v.size(),
+		ContPercentile(v, 0.50) / 1000.0, ContPercentile(v, 0.90) / 1000.0,
+		ContPercentile(v, 0.99) / 1000.0, v.back() / 1000.0);
+}
+
+//nLogins logins one after another, each quits before the next; returns the failures
+static int ContRunLogins(const struct ContOptions *opts, vector<long long> &lat)
+{
+	int nFailed = 0;
+	for (int i=0; i<opts->nLogins; i++) {
+		long long nUsec;
+		int fd = ContLogin(opts, &nUsec);
+		if (fd < 0) {
+			nFailed++;
+			continue;
+		}
+		lat.push_back(nUsec);
+		ContLogout(fd);
+	}
+	return nFailed;
+}
+
+static void ContUsage()
+{
+	fprintf(stderr, "Usage: jetson_contention -p port [-H host] [-m mgmt_port] [-n held_sessions]\n");
+	fprintf(stderr, "                         [-q threads] [-c stats|query|scan] [-l logins] [-a agent_pid]\n");
+	fprintf(stderr, "  -p  engine port on the agent (required)\n");
+	fprintf(stderr, "  -H  agent address (default 127.0.0.1)\n");
+	fprintf(stderr, "  -m  management port (default 53350)\n");
+	fprintf(stderr, "  -n  sessions held open during both runs (default 100)\n");
+	fprintf(stderr, "  -q  threads repeating the management command (default 4)\n");
+	fprintf(stderr, "  -c  management command (default stats)\n");
+	fprintf(stderr, "  -l  logins measured in each run (default 200)\n");
+	fprintf(stderr, "  -a  agent pid for CPU, default: process named jetson_agent\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct ContOptions opts;
+	opts.sHost = "127.0.0.1";
+	opts.sMgmtPort = "53350";
+	opts.nHeld = 100;
+	opts.nThreads = 4;
+	opts.nLogins = 200;
+	opts.sCmd = "stats";
+	opts.nAgentPid = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "p:H:m:n:q:c:l:a:")) != -1) {
+		switch (c) {
+		case 'p': opts.sPort = optarg; break;
+		case 'H': opts.sHost = optarg; break;
+		case 'm': opts.sMgmtPort = optarg; break;
+		case 'n': opts.nHeld = atoi(optarg); break;
+		case 'q': opts.nThreads = atoi(optarg); break;
+		case 'c': opts.sCmd = optarg; break;
+		case 'l': opts.nLogins = atoi(optarg); break;
+		case 'a': opts.nAgentPid = atoi(optarg); break;
+		default: ContUsage(); return 1;
+		}
+	}
+
+	const char *sDone = NULL;
+	if (opts.sCmd == "stats")
+		sDone = "statsdone";
+	else if (opts.sCmd == "query")
+		sDone = "querydone";
+	else if (opts.sCmd == "scan")
+		sDone = "scanisdone";
+	if (opts.sPort.empty() || sDone == NULL || opts.nHeld < 0 || opts.nThreads <= 0 || opts.nLogins <= 0) {
+		ContUsage();
+		return 1;
+	}
+	if (opts.nAgentPid == 0)
+		opts.nAgentPid = ContFindAgentPid();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	printf("jetson_contention: %d held sessions on %s:%s, %d threads repeating \"%s\" on port %s, %d logins per run, agent pid %d\n",
+		opts.nHeld, opts.sHost.c_str(), opts.sPort.c_str(), opts.nThreads, opts.sCmd.c_str(),
+		opts.sMgmtPort.c_str(), opts.nLogins, (ContCpuTicks(opts.nAgentPid) >= 0 ? opts.nAgentPid : 0));
+
+	//----- held sessions stay logged in through both runs
+	vector<int> held;
+	for (int i=0; i<opts.nHeld; i++) {
+		long long nUsec;
+		int fd = ContLogin(&opts, &nUsec);
+		if (fd < 0) {
+			fprintf(stderr, "held session %d didn't log in, is the engine limit lower than -n?\n", i);
+			break;
+		}
+		held.push_back(fd);
+	}
+
+	//----- quiet run
+	vector<long long> quiet;
+	long long nCpu0 = ContCpuTicks(opts.nAgentPid);
+	long long nStart = ContNowUsec();
+	int nQuietFailed = ContRunLogins(&opts, quiet);
+	double fQuietSec = (ContNowUsec() - nStart) / 1e6;
+	long long nCpu1 = ContCpuTicks(opts.nAgentPid);
+
+	//----- the same logins with the management threads running
+	vector<struct ContWorker> workers(opts.nThreads);
+	for (int i=0; i<opts.nThreads; i++) {
+		workers[i].opts = &opts;
+		workers[i].sDone = sDone;
+		workers[i].bFailed = 0;
+		pthread_create(&workers[i].tid, NULL, ContWorkerMain, &workers[i]);
+	}
+	vector<long long> busy;
+	nStart = ContNowUsec();
+	int nBusyFailed = ContRunLogins(&opts, busy);
+	double fBusySec = (ContNowUsec() - nStart) / 1e6;
+	long long nCpu2 = ContCpuTicks(opts.nAgentPid);
+	gbStop = 1;
+
+	vector<long long> replies;
+	int nWorkersFailed = 0;
+	for (int i=0; i<opts.nThreads; i++) {
+		pthread_join(workers[i].tid, NULL);
+		replies.insert(replies.end(), workers[i].replies.begin(), workers[i].replies.end());
+		nWorkersFailed += workers[i].bFailed;
+	}
+	for (size_t i=0; i<held.size(); i++)
+		ContLogout(held[i]);
+
+	printf("\nHeld sessions: %zu of %d\n", held.size(), opts.nHeld);
+	printf("Quiet run: %.1f s, %d logins failed\n", fQuietSec, nQuietFailed);
+	printf("Busy run: %.1f s, %d logins failed, %.0f %s replies/s, %d of %d threads failed\n", fBusySec,
+		nBusyFailed, replies.size() / fBusySec, opts.sCmd.c_str(), nWorkersFailed, opts.nThreads);
+	printf("Latency:\n");
+	ContPrintLatency("login, quiet", quiet);
+	ContPrintLatency("login, busy", busy);
+	ContPrintLatency((opts.sCmd + " reply").c_str(), replies);
+	if (nCpu0 >= 0 && nCpu2 >= 0) {
+		double fTick = (double)sysconf(_SC_CLK_TCK);
+		printf("Agent pid %d: CPU %.1f%% of one core quiet, %.1f%% busy\n", opts.nAgentPid,
+			100.0 * (nCpu1 - nCpu0) / fTick / fQuietSec, 100.0 * (nCpu2 - nCpu1) / fTick / fBusySec);
+	}
+	else
+		printf("Agent: not found, no CPU figures (use -a pid)\n");
+
+	return (busy.empty() ? 1 : 0);
+}
@@ -0,0 +1,207 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ *
+ * Copyright (C) 2020 Evelyn Zhu
+ *
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+//----- line framer throughput: engine output as recv()/read() would hand it
+//over, in chunks of a given size, framed into lines by common/lineframer.h and,
+//for comparison, by a std::string that is appended to and cut at each '\n'.
+//Reports MB/s and lines/s for each chunk size.
+//
+//    jetson_framerbench -m 256 -b 1,64,1460,4096,65536
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <time.h>
+#include <unistd.h>
+
+#include "../common/lineframer.h"
+
+using namespace std;
+
+#define BENCH_RING_SIZE 65536	//the agent's engine output framer
+#define BENCH_OUT_SIZE 65536
+
+static char gsOut[BENCH_OUT_SIZE];
+
+static long long BenchNowUsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//info lines of the lengths an engine sends during a search, with a bestmove now and then
+static string BenchMakeStream(size_t nBytes)
+{
+	static const char *sPv = " pv e2e4 e7e5 g1f3 b8c6 f1b5 a7a6 b5a4 g8f6 e1g1 f8e7 f1e1 b7b5 a4b3 d7d6 c2c3 e8g8";
+	string s;
+	for (int i=0; s.length() < nBytes; i++) {
+		if (i % 50 == 49) {
+			s += "bestmove e2e4 ponder e7e5\n";
+			continue;
+		}
+		char sLine[512];
+		int nPv = 13 + (i * 7) % 72;
+		snprintf(sLine, sizeof(sLine), "info depth %d seldepth %d multipv 1 score cp %d nodes %d nps 2150000 hashfull %d tbhits 0 time %d%.*s\n",
+			i % 40, i % 40 + 9, (i * 13) % 200 - 100, i * 4099, i % 1000, i * 3, nPv, sPv);
+		s += sLine;
+	}
+	return s;
+}
+
+//the stream through the ring nRounds times, returns lines framed
+static long long BenchFramer(const string &s, int nChunk, int nRounds, long long *pnCheck)
+{
+	struct LineFramer f;
+	memset(&f, 0, sizeof(f));
+	JetsonFramerInit(&f, BENCH_RING_SIZE);
+
+	long long nLines = 0;
+	for (int r=0; r<nRounds; r++) {
+		for (size_t pos=0; pos<s.length(); ) {
+			int space;
+			char *dst = JetsonFramerWritePtr(&f, &space);
+			int n = (int)min((size_t)min(space, nChunk), s.length() - pos);
+			memcpy(dst, s.data() + pos, n);
+			JetsonFramerCommit(&f, n);
+			pos += n;
+
+			int len;
+			while ((len = JetsonFramerNextLine(&f, gsOut, BENCH_OUT_SIZE)) > 0) {
+				nLines++;
+				*pnCheck += gsOut[len / 2];
+			}
+		}
+	}
+	JetsonFramerFree(&f);
+	return nLines;
+}
+
+static long long BenchString(const string &s, int nChunk, int nRounds, long long *pnCheck)
+{
+	string sPending;
+	long long nLines = 0;
+	for (int r=0; r<nRounds; r++) {
+		for (size_t pos=0; pos<s.length(); ) {
+			size_t n = min((size_t)nChunk, s.length() - pos);
+			sPending.append(s.data() + pos, n);
+			pos += n;
+
+			size_t nl;
+			while ((nl = sPending.find('\n')) != string::npos) {
+				string sLine = sPending.substr(0, nl + 1);
+				sPending.erase(0, nl + 1);
+				nLines++;
+				*pnCheck += sLine[sLine.length() / 2];
+			}
+		}
+	}
+	return nLines;
+}
+
+static void BenchUsage()
+{
+	fprintf(stderr, "Usage: jetson_framerbench [-m megabytes] [-b chunk,chunk,...]\n");
+	fprintf(stderr, "  -m  bytes framed per chunk size and method, in MB (default 256)\n");
+	fprintf(stderr, "  -b  chunk sizes handed to the framer (default 1,64,1460,4096,65536)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	int nMegabytes = 256;
+	string sChunks = "1,64,1460,4096,65536";
+
+	int c;
+	while ((c = getopt(argc, argv, "m:b:")) != -1) {
+		switch (c) {
+		case 'm': nMegabytes = atoi(optarg); break;
+		case 'b': sChunks = optarg; break;
+		default: BenchUsage(); return 1;
+		}
+	}
+
+	vector<int> chunks;
+	for (const char *p = sChunks.c_str(); *p; ) {
+		int n = atoi(p);
+		if (n > 0)
+			chunks.push_back(n);
+		p = strchr(p, ',');
+		if (p == NULL)
+			break;
+		p++;
+	}
+	if (nMegabytes <= 0 || chunks.empty()) {
+		BenchUsage();
+		return 1;
+	}
+
+	string s = BenchMakeStream(4 << 20);
+	int nRounds = (int)(((long long)nMegabytes << 20) / s.length());
+	if (nRounds < 1)
+		nRounds = 1;
+	double fMb = (double)s.length() * nRounds / (1 << 20);
+
+	long long nCheck = 0;
+	printf("jetson_framerbench: %.0f MB of engine output per chunk size and method, %lld lines in each 4 MB\n", fMb,
+		BenchFramer(s, BENCH_RING_SIZE, 1, &nCheck));
+	printf("  %-8s %-12s %10s %14s\n", "chunk", "method", "MB/s", "lines/s");
+
+	for (size_t i=0; i<chunks.size(); i++) {
+		//a byte at a time is slow for both, a smaller share of the stream keeps it short
+		int nRuns = (chunks[i] < 64 ? max(1, nRounds / 16) : nRounds);
+		double fRunMb = (double)s.length() * nRuns / (1 << 20);
+
+		long long nStart = BenchNowUsec();
+		long long nLines = BenchFramer(s, chunks[i], nRuns, &nCheck);
+		double fSec = (BenchNowUsec() - nStart) / 1e6;
+		printf("  %-8d %-12s %10.1f %14.0f\n", chunks[i], "lineframer", fRunMb / fSec, nLines / fSec);
+
+		nStart = BenchNowUsec();
+		nLines = BenchString(s, chunks[i], nRuns, &nCheck);
+		fSec = (BenchNowUsec() - nStart) / 1e6;
+		printf("  %-8d %-12s %10.1f %14.0f\n", chunks[i], "std::string", fRunMb / fSec, nLines / fSec);
+	}
+
+	//keeps the copies from being optimized away
+	return (nCheck == 42 ? 2 : 0);
+}
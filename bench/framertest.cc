@@ -0,0 +1,326 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ *
+ * Copyright (C) 2020 Evelyn Zhu
+ *
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+//----- line framer test: feeds common/lineframer.h streams split at every byte
+//offset, many lines in one read, lines across the end of the ring and around
+//the free-running counters, and lines longer than the ring, and checks every
+//line comes out whole and in order. Prints each failure, exits 1 if any.
+//
+//    jetson_framertest
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <climits>
+#include <string>
+#include <vector>
+
+#include "../common/lineframer.h"
+
+using namespace std;
+
+#define TEST_OUT_SIZE 65536
+
+static int gnChecks = 0;
+static int gnFailed = 0;
+
+#define TEST_CHECK(cond, ...) do { \
+		gnChecks++; \
+		if (!(cond)) { \
+			gnFailed++; \
+			printf("FAIL %s:%d: ", __FUNCTION__, __LINE__); \
+			printf(__VA_ARGS__); \
+			printf("\n"); \
+		} \
+	} while (0)
+
+static char gsOut[TEST_OUT_SIZE];
+
+//pulls every complete line, returns FRAMER_NEED_MORE or FRAMER_LINE_TOO_LONG
+static int TestPullLines(struct LineFramer *f, vector<string> &lines, int outSize = TEST_OUT_SIZE)
+{
+	int len;
+	while ((len = JetsonFramerNextLine(f, gsOut, outSize)) > 0)
+		lines.push_back(string(gsOut, len));
+	return len;
+}
+
+//the way the agent reads: recv() straight into the ring through WritePtr/Commit
+static int TestRecv(struct LineFramer *f, const char *data, int len)
+{
+	int total = 0;
+	while (total < len) {
+		int space;
+		char *dst = JetsonFramerWritePtr(f, &space);
+		if (space == 0)
+			break;
+		int n = (len - total < space ? len - total : space);
+		memcpy(dst, data + total, n);
+		JetsonFramerCommit(f, n);
+		total += n;
+	}
+	return total;
+}
+
+static vector<string> TestSplitLines(const string &s)
+{
+	vector<string> lines;
+	size_t start = 0, nl;
+	while ((nl = s.find('\n', start)) != string::npos) {
+		lines.push_back(s.substr(start, nl - start + 1));
+		start = nl + 1;
+	}
+	return lines;
+}
+
+static const char *gsStream =
+	"id name mock\n"
+	"\n"
+	"option name Hash type spin default 16 min 1 max 33554432\n"
+	"uciok\n"
+	"info depth 1 seldepth 1 score cp 20 nodes 20 pv e2e4\n"
+	"readyok\n"
+	"bestmove e2e4 ponder e7e5\n";
+
+//----- one stream cut in two and in three at every offset, into rings small
+//enough that most cuts also cross the end of the ring
+static void TestEverySplit()
+{
+	string s = gsStream;
+	vector<string> expected = TestSplitLines(s);
+	int n = (int)s.length();
+
+	for (int cut=0; cut<=n; cut++) {
+		struct LineFramer f;
+		memset(&f, 0, sizeof(f));
+		JetsonFramerInit(&f, 256);
+		f.head = f.tail = 200;	//the stream crosses the end of the ring
+
+		vector<string> lines;
+		int nTaken = TestRecv(&f, s.data(), cut);
+		TestPullLines(&f, lines);
+		nTaken += TestRecv(&f, s.data() + cut, n - cut);
+		int ret = TestPullLines(&f, lines);
+
+		TEST_CHECK(nTaken == n, "cut %d: %d of %d bytes taken", cut, nTaken, n);
+		TEST_CHECK(ret == FRAMER_NEED_MORE, "cut %d: ends with %d", cut, ret);
+		TEST_CHECK(lines == expected, "cut %d: %zu lines instead of %zu, or changed", cut, lines.size(), expected.size());
+		JetsonFramerFree(&f);
+	}
+
+	for (int cut1=0; cut1<=n; cut1++) {
+		for (int cut2=cut1; cut2<=n; cut2++) {
+			struct LineFramer f;
+			memset(&f, 0, sizeof(f));
+			JetsonFramerInit(&f, 64);
+
+			//the ring holds 64 bytes, lines are pulled after every piece so it never overflows
+			vector<string> lines;
+			int pieces[4] = { 0, cut1, cut2, n };
+			int bOverflow = 0;
+			for (int i=0; i<3; i++) {
+				for (int pos=pieces[i]; pos<pieces[i + 1]; ) {
+					int nTaken = JetsonFramerPush(&f, s.data() + pos, pieces[i + 1] - pos);
+					pos += nTaken;
+					if (TestPullLines(&f, lines) == FRAMER_LINE_TOO_LONG || (nTaken == 0 && pos < pieces[i + 1])) {
+						bOverflow = 1;
+						break;
+					}
+				}
+			}
+			TEST_CHECK(!bOverflow && lines == expected, "cuts %d/%d: %zu lines instead of %zu, or changed",
+				cut1, cut2, lines.size(), expected.size());
+			JetsonFramerFree(&f);
+		}
+	}
+}
+
+//----- a byte at a time: every line is found only when its '\n' arrives
+static void TestByteByByte()
+{
+	string s = gsStream;
+	vector<string> expected = TestSplitLines(s);
+
+	struct LineFramer f;
+	memset(&f, 0, sizeof(f));
+	JetsonFramerInit(&f, 64);
+
+	vector<string> lines;
+	for (size_t i=0; i<s.length(); i++) {
+		size_t nBefore = lines.size();
+		TestRecv(&f, s.data() + i, 1);
+		TestPullLines(&f, lines);
+		TEST_CHECK(lines.size() == nBefore + (s[i] == '\n' ? 1 : 0), "byte %zu: line count %zu", i, lines.size());
+	}
+	TEST_CHECK(lines == expected, "%zu lines instead of %zu, or changed", lines.size(), expected.size());
+	JetsonFramerFree(&f);
+}
+
+//----- many lines in one read come out one by one, in order
+static void TestManyLinesOneRead()
+{
+	string s;
+	for (int i=0; i<2000; i++)
+		s += "info depth " + to_string(i % 40) + " nodes " + to_string(i * 1000) + " pv e2e4 e7e5\n";
+	vector<string> expected = TestSplitLines(s);
+
+	struct LineFramer f;
+	memset(&f, 0, sizeof(f));
+	JetsonFramerInit(&f, (unsigned int)s.length());
+
+	vector<string> lines;
+	int nTaken = TestRecv(&f, s.data(), (int)s.length());
+	int ret = TestPullLines(&f, lines);
+	TEST_CHECK(nTaken == (int)s.length(), "%d of %zu bytes taken", nTaken, s.length());
+	TEST_CHECK(ret == FRAMER_NEED_MORE, "ends with %d", ret);
+	TEST_CHECK(lines == expected, "%zu lines instead of %zu, or changed", lines.size(), expected.size());
+	TEST_CHECK(JetsonFramerUsed(&f) == 0, "%u bytes left", JetsonFramerUsed(&f));
+
+	//the same with a partial line at the end, it stays until its '\n'
+	lines.clear();
+	TestRecv(&f, s.data(), 500);
+	TestPullLines(&f, lines);
+	int nPartial = (int)JetsonFramerUsed(&f);
+	TEST_CHECK(nPartial > 0 && TestPullLines(&f, lines) == FRAMER_NEED_MORE, "partial line of %d bytes", nPartial);
+	JetsonFramerFree(&f);
+}
+
+//----- lines of every length up to the ring size, so they start and end at
+//every position in the ring and cross its end
+static void TestWraparound()
+{
+	struct LineFramer f;
+	memset(&f, 0, sizeof(f));
+	JetsonFramerInit(&f, 64);
+
+	for (int round=0; round<3; round++) {
+		for (int len=1; len<=64; len++) {
+			string line(len - 1, (char)('a' + len % 26));
+			line += '\n';
+			vector<string> lines;
+			int nTaken = TestRecv(&f, line.data(), len);
+			int ret = TestPullLines(&f, lines);
+			TEST_CHECK(nTaken == len && ret == FRAMER_NEED_MORE && lines.size() == 1 && lines[0] == line,
+				"round %d, length %d, head %u: taken %d, ret %d, %zu lines", round, len, f.head, nTaken, ret, lines.size());
+		}
+	}
+
+	//head and tail are free-running: start them just below the 32-bit wrap
+	JetsonFramerReset(&f);
+	f.head = f.tail = UINT_MAX - 20;
+	string s = gsStream;
+	vector<string> expected = TestSplitLines(s);
+	vector<string> lines;
+	for (size_t pos=0; pos<s.length(); ) {
+		pos += JetsonFramerPush(&f, s.data() + pos, (int)(s.length() - pos));
+		TestPullLines(&f, lines);
+	}
+	TEST_CHECK(lines == expected, "across UINT_MAX: %zu lines instead of %zu, or changed", lines.size(), expected.size());
+	TEST_CHECK(f.tail < f.head || f.head < UINT_MAX - 20, "counters didn't wrap, head %u tail %u", f.head, f.tail);
+
+	//growing keeps a partial line that crosses the end of the ring
+	JetsonFramerReset(&f);
+	string filler(50, 'x');
+	filler += '\n';
+	JetsonFramerPush(&f, filler.data(), (int)filler.length());
+	lines.clear();
+	TestPullLines(&f, lines);
+	string big(40, 'y');
+	JetsonFramerPush(&f, big.data(), (int)big.length());
+	TEST_CHECK(JetsonFramerGrow(&f, 128) && f.cap == 128, "grow to 128, cap %u", f.cap);
+	JetsonFramerPush(&f, "z\n", 2);
+	lines.clear();
+	TestPullLines(&f, lines);
+	TEST_CHECK(lines.size() == 1 && lines[0] == big + "z\n", "after grow: %zu lines", lines.size());
+	TEST_CHECK(!JetsonFramerGrow(&f, 128), "grew past its maximum, cap %u", f.cap);
+	JetsonFramerFree(&f);
+}
+
+//----- a full ring without '\n' is FRAMER_LINE_TOO_LONG, draining it lets the
+//stream go on; so is a line longer than the caller's buffer
+static void TestLineTooLong()
+{
+	struct LineFramer f;
+	memset(&f, 0, sizeof(f));
+	JetsonFramerInit(&f, 64);
+
+	string junk(100, 'j');
+	int nTaken = JetsonFramerPush(&f, junk.data(), (int)junk.length());
+	vector<string> lines;
+	int ret = TestPullLines(&f, lines);
+	TEST_CHECK(nTaken == 64, "%d bytes taken into a 64 byte ring", nTaken);
+	TEST_CHECK(ret == FRAMER_LINE_TOO_LONG && lines.empty(), "full ring gives %d, %zu lines", ret, lines.size());
+
+	int nDrained = JetsonFramerDrain(&f, gsOut, TEST_OUT_SIZE);
+	TEST_CHECK(nDrained == 64 && JetsonFramerUsed(&f) == 0, "drained %d, %u left", nDrained, JetsonFramerUsed(&f));
+
+	JetsonFramerPush(&f, junk.data(), 36);
+	JetsonFramerPush(&f, "\nuciok\n", 7);
+	ret = TestPullLines(&f, lines);
+	TEST_CHECK(ret == FRAMER_NEED_MORE && lines.size() == 2 && lines[0] == junk.substr(0, 36) + "\n" && lines[1] == "uciok\n",
+		"after drain: ret %d, %zu lines", ret, lines.size());
+
+	//one byte short of full is still waiting for more
+	JetsonFramerReset(&f);
+	JetsonFramerPush(&f, junk.data(), 63);
+	TEST_CHECK(JetsonFramerNextLine(&f, gsOut, TEST_OUT_SIZE) == FRAMER_NEED_MORE, "63 bytes without '\\n'");
+
+	//a whole line longer than outSize stays in the ring
+	JetsonFramerReset(&f);
+	JetsonFramerPush(&f, "readyok\n", 8);
+	ret = JetsonFramerNextLine(&f, gsOut, 4);
+	TEST_CHECK(ret == FRAMER_LINE_TOO_LONG && JetsonFramerUsed(&f) == 8, "small out buffer: ret %d, %u left", ret, JetsonFramerUsed(&f));
+	ret = JetsonFramerNextLine(&f, gsOut, TEST_OUT_SIZE);
+	TEST_CHECK(ret == 8 && memcmp(gsOut, "readyok\n", 8) == 0, "then %d", ret);
+	JetsonFramerFree(&f);
+}
+
+int main()
+{
+	TestEverySplit();
+	TestByteByByte();
+	TestManyLinesOneRead();
+	TestWraparound();
+	TestLineTooLong();
+
+	printf("%s: %d of %d checks failed\n", (gnFailed == 0 ? "PASS" : "FAIL"), gnFailed, gnChecks);
+	return (gnFailed == 0 ? 0 : 1);
+}
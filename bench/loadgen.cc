@@ -0,0 +1,626 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ *
+ * Copyright (C) 2020 Evelyn Zhu
+ *
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+//----- load generator for jetson_agent: N concurrent sessions against one engine
+//port on one epoll loop, each running uci/isready and then position/go (and stop
+//for "go infinite") until the run time is over. Reports login and go latencies,
+//throughput, and the agent's CPU and memory use read from /proc. Linux only.
+//
+//    jetson_loadgen -p 61240 -n 200 -t 30 -g "go infinite" -s 200
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <fstream>
+#include <sstream>
+#include <dirent.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <netdb.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <arpa/inet.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/epoll.h>
+#include <sys/socket.h>
+
+#include "../common/lineframer.h"
+
+using namespace std;
+
+#define LOADGEN_MAX_EVENTS 256
+#define LOADGEN_DRAIN_SEC 10		//sessions still searching this long after the run are cut off
+#define LOADGEN_LINE_MAX 8192
+
+enum {
+	LG_STATE_CONNECTING = 0,
+	LG_STATE_UCI,			//uci sent, waiting for uciok
+	LG_STATE_READY,			//isready sent, waiting for readyok
+	LG_STATE_SEARCHING,		//go sent, waiting for bestmove
+	LG_STATE_CLOSED
+};
+
+struct LoadSession {
+	int fd;
+	int nIndex;
+	int nState;
+	int bFailed;			//closed by the agent or never connected
+	int nGoCount;
+	long long nConnectUsec;
+	long long nGoUsec;
+	long long nStopDueUsec;	//0 while no stop is pending
+	long long nStopSentUsec;
+	int bFirstInfoSeen;
+	string sPending;		//not yet accepted by the socket
+	struct LineFramer framer;
+};
+
+struct LoadOptions {
+	string sHost;
+	string sPort;
+	int nSessions;
+	int nSeconds;
+	int nRampPerSec;		//new connections per second, 0 connects all at once
+	int nStopAfterMsec;		//stop sent this long after go, for infinite searches
+	string sGoCmd;
+	int nAgentPid;
+};
+
+struct LoadStats {
+	vector<long long> login;		//connect -> readyok
+	vector<long long> firstInfo;	//go -> first info
+	vector<long long> bestMove;		//go -> bestmove
+	vector<long long> stopReply;	//stop -> bestmove
+	long long nInfoLines;
+	long long nBytesIn;
+	long long nBytesOut;
+	int nConnectFailed;
+	int nDropped;
+};
+
+struct ProcSample {
+	long long nCpuTicks;	//utime + stime
+	long long nRssKb;
+	long long nHwmKb;
+};
+
+//openings cycled through so an analysis cache doesn't answer every go
+static const char *gsPositions[] = {
+	"position startpos",
+	"position startpos moves e2e4",
+	"position startpos moves e2e4 e7e5 g1f3",
+	"position startpos moves d2d4 g8f6 c2c4",
+	"position startpos moves e2e4 c7c5 g1f3 d7d6",
+	"position startpos moves c2c4 e7e5 b1c3",
+	"position startpos moves d2d4 d7d5 c2c4 e7e6 b1c3",
+	"position startpos moves e2e4 e7e6 d2d4 d7d5"
+};
+#define NUM_POSITIONS (int)(sizeof(gsPositions) / sizeof(gsPositions[0]))
+
+static int gEpollFd = -1;
+
+static long long LoadNowUsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+//----- agent process, found by name unless -a was given
+static int LoadFindAgentPid()
+{
+	DIR *dir = opendir("/proc");
+	if (dir == NULL)
+		return 0;
+
+	int pid = 0;
+	struct dirent *entry;
+	while (pid == 0 && (entry = readdir(dir)) != NULL) {
+		if (entry->d_name[0] < '0' || entry->d_name[0] > '9')
+			continue;
+
+		ifstream comm(string("/proc/") + entry->d_name + "/comm");
+		string name;
+		if (getline(comm, name) && name == "jetson_agent")
+			pid = atoi(entry->d_name);
+	}
+	closedir(dir);
+	return pid;
+}
+
+static int LoadSampleProc(int pid, struct ProcSample *sample)
+{
+	memset(sample, 0, sizeof(*sample));
+	if (pid <= 0)
+		return 0;
+
+	ifstream statFile("/proc/" + to_string(pid) + "/stat");
+	string stat;
+	if (!getline(statFile, stat))
+		return 0;
+
+	//fields after the ")" closing comm: state is field 3, utime 14, stime 15
+	size_t pos = stat.rfind(')');
+	if (pos == string::npos)
+		return 0;
+	istringstream iss(stat.substr(pos + 2));
+	string field;
+	long long utime = 0, stime = 0;
+	for (int i=3; i<=15 && (iss >> field); i++) {
+		if (i == 14)
+			utime = atoll(field.c_str());
+		else if (i == 15)
+			stime = atoll(field.c_str());
+	}
+	sample->nCpuTicks = utime + stime;
+
+	ifstream statusFile("/proc/" + to_string(pid) + "/status");
+	string line;
+	while (getline(statusFile, line)) {
+		if (line.compare(0, 6, "VmRSS:") == 0)
+			sample->nRssKb = atoll(line.c_str() + 6);
+		else if (line.compare(0, 6, "VmHWM:") == 0)
+			sample->nHwmKb = atoll(line.c_str() + 6);
+	}
+	return 1;
+}
+
+//----- session I/O
+static void LoadWatch(struct LoadSession *s, int bWantWrite)
+{
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | (bWantWrite ? (uint32_t)EPOLLOUT : 0);
+	ev.data.ptr = s;
+	epoll_ctl(gEpollFd, EPOLL_CTL_MOD, s->fd, &ev);
+}
+
+static void LoadClose(struct LoadSession *s, int bFailed, struct LoadStats *stats)
+{
+	if (s->nState == LG_STATE_CLOSED)
+		return;
+	if (bFailed) {
+		s->bFailed = 1;
+		if (s->nState == LG_STATE_CONNECTING)
+			stats->nConnectFailed++;
+		else
+			stats->nDropped++;
+	}
+	epoll_ctl(gEpollFd, EPOLL_CTL_DEL, s->fd, NULL);
+	close(s->fd);
+	s->fd = -1;
+	s->nState = LG_STATE_CLOSED;
+	JetsonFramerFree(&s->framer);
+}
+
+static int LoadFlush(struct LoadSession *s)
+{
+	while (!s->sPending.empty()) {
+		ssize_t n = send(s->fd, s->sPending.c_str(), s->sPending.length(), MSG_NOSIGNAL);
+		if (n < 0) {
+			if (errno == EINTR)
+				continue;
+			if (errno == EAGAIN || errno == EWOULDBLOCK) {
+				LoadWatch(s, 1);
+				return 1;
+			}
+			return 0;
+		}
+		s->sPending.erase(0, n);
+	}
+	LoadWatch(s, 0);
+	return 1;
+}
+
+static void LoadSend(struct LoadSession *s, const string &sCmds, struct LoadStats *stats)
+{
+	int bWasEmpty = s->sPending.empty();
+	s->sPending += sCmds;
+	stats->nBytesOut += sCmds.length();
+	if (bWasEmpty && !LoadFlush(s))
+		LoadClose(s, 1, stats);
+}
+
+static void LoadStartGo(struct LoadSession *s, const struct LoadOptions *opts, struct LoadStats *stats, long long now)
+{
+	string sCmds = string(gsPositions[(s->nIndex + s->nGoCount) % NUM_POSITIONS]) + "\n" + opts->sGoCmd + "\n";
+	s->nState = LG_STATE_SEARCHING;
+	s->nGoCount++;
+	s->nGoUsec = now;
+	s->bFirstInfoSeen = 0;
+	s->nStopSentUsec = 0;
+	s->nStopDueUsec = (opts->nStopAfterMsec > 0 ? now + opts->nStopAfterMsec * 1000LL : 0);
+	LoadSend(s, sCmds, stats);
+}
+
+static void LoadSendStop(struct LoadSession *s, struct LoadStats *stats, long long now)
+{
+	s->nStopDueUsec = 0;
+	s->nStopSentUsec = now;
+	LoadSend(s, "stop\n", stats);
+}
+
+static void LoadOnLine(struct LoadSession *s, const char *sLine, const struct LoadOptions *opts,
+	struct LoadStats *stats, long long now, int bRunOver)
+{
+	switch (s->nState) {
+	case LG_STATE_UCI:
+		if (strcmp(sLine, "uciok") == 0) {
+			s->nState = LG_STATE_READY;
+			LoadSend(s, "isready\n", stats);
+		}
+		break;
+	case LG_STATE_READY:
+		if (strcmp(sLine, "readyok") == 0) {
+			stats->login.push_back(now - s->nConnectUsec);
+			if (bRunOver)
+				LoadClose(s, 0, stats);
+			else
+				LoadStartGo(s, opts, stats, now);
+		}
+		break;
+	case LG_STATE_SEARCHING:
+		if (strncmp(sLine, "info ", 5) == 0) {
+			stats->nInfoLines++;
+			if (!s->bFirstInfoSeen && strncmp(sLine, "info string", 11) != 0) {
+				s->bFirstInfoSeen = 1;
+				stats->firstInfo.push_back(now - s->nGoUsec);
+			}
+		}
+		else if (strncmp(sLine, "bestmove", 8) == 0) {
+			stats->bestMove.push_back(now - s->nGoUsec);
+			if (s->nStopSentUsec > 0)
+				stats->stopReply.push_back(now - s->nStopSentUsec);
+			if (bRunOver) {
+				LoadSend(s, "quit\n", stats);
+				LoadClose(s, 0, stats);
+			}
+			else
+				LoadStartGo(s, opts, stats, now);
+		}
+		break;
+	}
+}
+
+static void LoadOnReadable(struct LoadSession *s, const struct LoadOptions *opts, struct LoadStats *stats, int bRunOver)
+{
+	char sLine[LOADGEN_LINE_MAX];
+
+	while (s->nState != LG_STATE_CLOSED) {
+		int nSpace;
+		char *dst = JetsonFramerWritePtr(&s->framer, &nSpace);
+		ssize_t n = recv(s->fd, dst, nSpace, 0);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n < 0 && (errno == EAGAIN || errno == EWOULDBLOCK))
+			return;
+		if (n <= 0) {
+			LoadClose(s, 1, stats);
+			return;
+		}
+		JetsonFramerCommit(&s->framer, (int)n);
+		stats->nBytesIn += n;
+
+		long long now = LoadNowUsec();
+		int len;
+		while (s->nState != LG_STATE_CLOSED && (len = JetsonFramerNextLine(&s->framer, sLine, sizeof(sLine))) > 0) {
+			while (len > 0 && (sLine[len-1] == '\n' || sLine[len-1] == '\r'))
+				len--;
+			sLine[len] = '\0';
+			LoadOnLine(s, sLine, opts, stats, now, bRunOver);
+		}
+		if (s->nState != LG_STATE_CLOSED && len == FRAMER_LINE_TOO_LONG)
+			JetsonFramerReset(&s->framer);
+	}
+}
+
+static int LoadConnect(struct LoadSession *s, const struct addrinfo *addr, struct LoadStats *stats)
+{
+	memset(&s->framer, 0, sizeof(s->framer));
+	s->nConnectUsec = LoadNowUsec();
+	s->nState = LG_STATE_CONNECTING;
+	s->fd = socket(addr->ai_family, addr->ai_socktype | SOCK_NONBLOCK | SOCK_CLOEXEC, addr->ai_protocol);
+	if (s->fd < 0 || !JetsonFramerInit(&s->framer, LOADGEN_LINE_MAX)) {
+		stats->nConnectFailed++;
+		s->nState = LG_STATE_CLOSED;
+		s->bFailed = 1;
+		return 0;
+	}
+
+	int nodelay = 1;
+	setsockopt(s->fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, sizeof(nodelay));
+	if (connect(s->fd, addr->ai_addr, addr->ai_addrlen) < 0 && errno != EINPROGRESS) {
+		close(s->fd);
+		s->fd = -1;
+		stats->nConnectFailed++;
+		s->nState = LG_STATE_CLOSED;
+		s->bFailed = 1;
+		return 0;
+	}
+
+	struct epoll_event ev;
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN | EPOLLOUT;
+	ev.data.ptr = s;
+	epoll_ctl(gEpollFd, EPOLL_CTL_ADD, s->fd, &ev);
+	return 1;
+}
+
+static void LoadOnConnected(struct LoadSession *s, struct LoadStats *stats)
+{
+	int err = 0;
+	socklen_t len = sizeof(err);
+	getsockopt(s->fd, SOL_SOCKET, SO_ERROR, &err, &len);
+	if (err != 0) {
+		LoadClose(s, 1, stats);
+		return;
+	}
+	s->nState = LG_STATE_UCI;
+	LoadSend(s, "uci\n", stats);
+}
+
+//----- report
+static long long LoadPercentile(vector<long long> &v, double p)
+{
+	if (v.empty())
+		return 0;
+	size_t i = (size_t)(p * (v.size() - 1) + 0.5);
+	return v[i];
+}
+
+static void LoadPrintLatency(const char *sName, vector<long long> &v)
+{
+	sort(v.begin(), v.end());
+	if (v.empty()) {
+		printf("  %-22s n=0\n", sName);
+		return;
+	}
+	printf("  %-22s n=%-8zu p50=%8.2f  p90=%8.2f  p99=%8.2f  max=%8.2f ms\n", sName, v.size(),
+		LoadPercentile(v, 0.50) / 1000.0, LoadPercentile(v, 0.90) / 1000.0,
+		LoadPercentile(v, 0.99) / 1000.0, v.back() / 1000.0);
+}
+
+static void LoadUsage()
+{
+	fprintf(stderr, "Usage: jetson_loadgen -p port [-H host] [-n sessions] [-t seconds] [-r connects/sec]\n");
+	fprintf(stderr, "                      [-g \"go command\"] [-s stop_after_ms] [-a agent_pid]\n");
+	fprintf(stderr, "  -p  engine port on the agent (required)\n");
+	fprintf(stderr, "  -H  agent address (default 127.0.0.1)\n");
+	fprintf(stderr, "  -n  concurrent sessions (default 10)\n");
+	fprintf(stderr, "  -t  run time in seconds, searches running then are finished (default 10)\n");
+	fprintf(stderr, "  -r  sessions connected per second, 0 for all at once (default 0)\n");
+	fprintf(stderr, "  -g  go command each session repeats (default \"go movetime 100\")\n");
+	fprintf(stderr, "  -s  send stop this many ms after go, e.g. with \"go infinite\" (default 0)\n");
+	fprintf(stderr, "  -a  agent pid for CPU/RSS, default: process named jetson_agent\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct LoadOptions opts;
+	opts.sHost = "127.0.0.1";
+	opts.nSessions = 10;
+	opts.nSeconds = 10;
+	opts.nRampPerSec = 0;
+	opts.nStopAfterMsec = 0;
+	opts.sGoCmd = "go movetime 100";
+	opts.nAgentPid = 0;
+
+	int c;
+	while ((c = getopt(argc, argv, "p:H:n:t:r:g:s:a:")) != -1) {
+		switch (c) {
+		case 'p': opts.sPort = optarg; break;
+		case 'H': opts.sHost = optarg; break;
+		case 'n': opts.nSessions = atoi(optarg); break;
+		case 't': opts.nSeconds = atoi(optarg); break;
+		case 'r': opts.nRampPerSec = atoi(optarg); break;
+		case 'g': opts.sGoCmd = optarg; break;
+		case 's': opts.nStopAfterMsec = atoi(optarg); break;
+		case 'a': opts.nAgentPid = atoi(optarg); break;
+		default: LoadUsage(); return 1;
+		}
+	}
+	if (opts.sPort.empty() || opts.nSessions <= 0 || opts.nSeconds <= 0) {
+		LoadUsage();
+		return 1;
+	}
+	if (strstr(opts.sGoCmd.c_str(), "infinite") != NULL && opts.nStopAfterMsec <= 0)
+		opts.nStopAfterMsec = 100;	//an infinite search needs a stop to finish
+	if (opts.nAgentPid == 0)
+		opts.nAgentPid = LoadFindAgentPid();
+
+	signal(SIGPIPE, SIG_IGN);
+
+	struct addrinfo hints, *addr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(opts.sHost.c_str(), opts.sPort.c_str(), &hints, &addr) != 0) {
+		fprintf(stderr, "unable to resolve %s:%s\n", opts.sHost.c_str(), opts.sPort.c_str());
+		return 1;
+	}
+
+	gEpollFd = epoll_create1(EPOLL_CLOEXEC);
+	if (gEpollFd < 0)
+		return 1;
+
+	vector<struct LoadSession> sessions(opts.nSessions);
+	struct LoadStats stats;
+	stats.nInfoLines = stats.nBytesIn = stats.nBytesOut = 0;
+	stats.nConnectFailed = stats.nDropped = 0;
+
+	struct ProcSample startSample, endSample, sample;
+	int bHaveAgent = LoadSampleProc(opts.nAgentPid, &startSample);
+	long long nPeakRssKb = startSample.nRssKb;
+
+	printf("jetson_loadgen: %d sessions on %s:%s for %d s, \"%s\"", opts.nSessions, opts.sHost.c_str(),
+		opts.sPort.c_str(), opts.nSeconds, opts.sGoCmd.c_str());
+	if (opts.nStopAfterMsec > 0)
+		printf(", stop after %d ms", opts.nStopAfterMsec);
+	printf(", agent pid %d\n", (bHaveAgent ? opts.nAgentPid : 0));
+
+	long long nStartUsec = LoadNowUsec();
+	long long nRunEndUsec = nStartUsec + opts.nSeconds * 1000000LL;
+	long long nHardEndUsec = nRunEndUsec + LOADGEN_DRAIN_SEC * 1000000LL;
+	long long nNextSampleUsec = nStartUsec + 1000000LL;
+	long long nNextTimerUsec = 0;
+	int nConnected = 0;
+	int nOpen = 0;
+	int bRunOver = 0;
+
+	struct epoll_event events[LOADGEN_MAX_EVENTS];
+	while (1) {
+		long long now = LoadNowUsec();
+
+		//----- new connections, all at once or ramped
+		int nDue = opts.nSessions;
+		if (opts.nRampPerSec > 0)
+			nDue = min<long long>(opts.nSessions, 1 + (now - nStartUsec) * opts.nRampPerSec / 1000000LL);
+		while (!bRunOver && nConnected < nDue) {
+			struct LoadSession *s = &sessions[nConnected];
+			s->nIndex = nConnected++;
+			LoadConnect(s, addr, &stats);
+		}
+
+		//----- run over: no new go, searches waiting on stop get it now
+		if (!bRunOver && now >= nRunEndUsec) {
+			bRunOver = 1;
+			for (int i=0; i<nConnected; i++) {
+				struct LoadSession *s = &sessions[i];
+				if (s->nState == LG_STATE_SEARCHING && s->nStopSentUsec == 0 && opts.nStopAfterMsec > 0)
+					LoadSendStop(s, &stats, now);
+				else if (s->nState == LG_STATE_CONNECTING || s->nState == LG_STATE_UCI)
+					LoadClose(s, 0, &stats);
+			}
+		}
+
+		//----- stops due, the earliest next one sets the wait
+		if (nNextTimerUsec > 0 && now >= nNextTimerUsec) {
+			nNextTimerUsec = 0;
+			for (int i=0; i<nConnected; i++) {
+				struct LoadSession *s = &sessions[i];
+				if (s->nState != LG_STATE_SEARCHING || s->nStopDueUsec == 0)
+					continue;
+				if (s->nStopDueUsec <= now)
+					LoadSendStop(s, &stats, now);
+				else if (nNextTimerUsec == 0 || s->nStopDueUsec < nNextTimerUsec)
+					nNextTimerUsec = s->nStopDueUsec;
+			}
+		}
+
+		if (now >= nNextSampleUsec) {
+			if (LoadSampleProc(opts.nAgentPid, &sample))
+				nPeakRssKb = max(nPeakRssKb, sample.nRssKb);
+			nNextSampleUsec += 1000000LL;
+		}
+
+		nOpen = 0;
+		for (int i=0; i<nConnected; i++)
+			nOpen += (sessions[i].nState != LG_STATE_CLOSED);
+		if ((bRunOver && nOpen == 0) || now >= nHardEndUsec)
+			break;
+
+		int nWaitMsec = 100;
+		if (opts.nStopAfterMsec > 0)
+			nWaitMsec = 1;
+		if (opts.nRampPerSec > 0 && nConnected < opts.nSessions)
+			nWaitMsec = min(nWaitMsec, 1000 / opts.nRampPerSec + 1);
+
+		int nEvents = epoll_wait(gEpollFd, events, LOADGEN_MAX_EVENTS, nWaitMsec);
+		for (int i=0; i<nEvents; i++) {
+			struct LoadSession *s = (struct LoadSession *)events[i].data.ptr;
+			if (s->nState == LG_STATE_CLOSED)
+				continue;
+
+			if (s->nState == LG_STATE_CONNECTING) {
+				if (events[i].events & (EPOLLOUT | EPOLLERR | EPOLLHUP))
+					LoadOnConnected(s, &stats);
+				continue;
+			}
+			if ((events[i].events & EPOLLOUT) && !LoadFlush(s)) {
+				LoadClose(s, 1, &stats);
+				continue;
+			}
+			if (events[i].events & (EPOLLIN | EPOLLHUP | EPOLLERR))
+				LoadOnReadable(s, &opts, &stats, bRunOver);
+			if (s->nState == LG_STATE_SEARCHING && s->nStopDueUsec > 0 &&
+				(nNextTimerUsec == 0 || s->nStopDueUsec < nNextTimerUsec))
+				nNextTimerUsec = s->nStopDueUsec;
+		}
+	}
+
+	long long nEndUsec = LoadNowUsec();
+	LoadSampleProc(opts.nAgentPid, &endSample);
+	nPeakRssKb = max(nPeakRssKb, endSample.nRssKb);
+
+	int nCutOff = 0;
+	for (int i=0; i<nConnected; i++) {
+		if (sessions[i].nState != LG_STATE_CLOSED) {
+			nCutOff++;
+			LoadClose(&sessions[i], 0, &stats);
+		}
+	}
+	freeaddrinfo(addr);
+	close(gEpollFd);
+
+	double fSec = (nEndUsec - nStartUsec) / 1e6;
+	printf("\nSessions: %d started, %zu logged in, %d connect failed, %d dropped by agent, %d cut off\n",
+		nConnected, stats.login.size(), stats.nConnectFailed, stats.nDropped, nCutOff);
+	printf("Throughput over %.1f s: %.1f go/s, %.0f info lines/s, %.1f KB/s in, %.1f KB/s out\n", fSec,
+		stats.bestMove.size() / fSec, stats.nInfoLines / fSec, stats.nBytesIn / 1024.0 / fSec, stats.nBytesOut / 1024.0 / fSec);
+	printf("Latency:\n");
+	LoadPrintLatency("login (connect-readyok)", stats.login);
+	LoadPrintLatency("go -> first info", stats.firstInfo);
+	LoadPrintLatency("go -> bestmove", stats.bestMove);
+	LoadPrintLatency("stop -> bestmove", stats.stopReply);
+	if (bHaveAgent) {
+		double fCpuSec = (double)(endSample.nCpuTicks - startSample.nCpuTicks) / sysconf(_SC_CLK_TCK);
+		printf("Agent pid %d: CPU %.2f s (%.1f%% of one core), RSS %lld KB at end, peak sampled %lld KB, high water %lld KB\n",
+			opts.nAgentPid, fCpuSec, 100.0 * fCpuSec / fSec, endSample.nRssKb, nPeakRssKb, endSample.nHwmKb);
+	}
+	else
+		printf("Agent: not found, no CPU/RSS figures (use -a pid)\n");
+
+	return (stats.login.empty() ? 1 : 0);
+}
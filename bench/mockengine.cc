@@ -0,0 +1,268 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ *
+ * Copyright (C) 2020 Evelyn Zhu
+ *
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+//----- mock UCI engine for benchmarking jetson_agent without a real engine.
+//It answers uci/isready at once (or after --uci-delay), emits "info" lines at
+//--info-rate per second while searching, and sends bestmove after --go-delay
+//ms, after "movetime" ms, or on stop for "go infinite"/"go ponder".
+//Arguments are taken as --key=value; in jetson_agent.conf separate them with
+//':' in EngineArguments, e.g.
+//    mock    61240    jetson_mock_engine    --info-rate=20:--go-delay=500
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <poll.h>
+#include <time.h>
+#include <unistd.h>
+#include <errno.h>
+
+#include "../common/lineframer.h"
+
+using namespace std;
+
+struct MockOptions {
+	int nInfoRate;			//info lines per second while searching, 0 for none
+	int nGoDelayMsec;		//bestmove after this long unless the go says otherwise
+	int nUciDelayMsec;		//uciok after this long, a slow engine start
+	long long nNps;			//reported in every info line
+	string sName;
+};
+
+struct MockSearch {
+	int bRunning;
+	int bInfinite;			//waits for stop
+	long long nStartUsec;
+	long long nEndUsec;		//bestmove due, 0 if infinite
+	long long nNextInfoUsec;
+	int nDepth;
+};
+
+static long long MockNowUsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static string gsOut;	//written out once per wakeup
+
+static void MockFlush()
+{
+	size_t off = 0;
+	while (off < gsOut.length()) {
+		ssize_t n = write(1, gsOut.c_str() + off, gsOut.length() - off);
+		if (n < 0 && errno == EINTR)
+			continue;
+		if (n <= 0)
+			exit(0);	//agent went away
+		off += n;
+	}
+	gsOut.clear();
+}
+
+static void MockInfoLine(const struct MockOptions *opts, struct MockSearch *search, long long now)
+{
+	long long nElapsedMsec = (now - search->nStartUsec) / 1000;
+	long long nNodes = opts->nNps * nElapsedMsec / 1000;
+	char sLine[256];
+
+	search->nDepth++;
+	snprintf(sLine, sizeof(sLine), "info depth %d seldepth %d time %lld nodes %lld nps %lld score cp %d pv e2e4 e7e5 g1f3\n",
+		search->nDepth, search->nDepth + 2, nElapsedMsec, nNodes, opts->nNps, 10 + search->nDepth % 7);
+	gsOut += sLine;
+}
+
+static void MockBestMove(const struct MockOptions *opts, struct MockSearch *search, long long now)
+{
+	if (!search->bRunning)
+		return;
+	if (opts->nInfoRate > 0 || search->nDepth == 0)
+		MockInfoLine(opts, search, now);	//a final line like real engines send
+	gsOut += "bestmove e2e4 ponder e7e5\n";
+	search->bRunning = 0;
+}
+
+static void MockGo(const struct MockOptions *opts, struct MockSearch *search, const char *sLine, long long now)
+{
+	memset(search, 0, sizeof(*search));
+	search->bRunning = 1;
+	search->nStartUsec = now;
+	search->nNextInfoUsec = now + (opts->nInfoRate > 0 ? 1000000LL / opts->nInfoRate : 0);
+
+	long long nMsec = opts->nGoDelayMsec;
+	const char *sMoveTime = strstr(sLine, " movetime ");
+	if (sMoveTime != NULL)
+		nMsec = atoll(sMoveTime + 10);
+	if (strstr(sLine, " infinite") != NULL || strstr(sLine, " ponder") != NULL)
+		search->bInfinite = 1;
+	search->nEndUsec = (search->bInfinite ? 0 : now + nMsec * 1000);
+}
+
+static void MockCommand(const struct MockOptions *opts, struct MockSearch *search, const char *sLine, long long now)
+{
+	if (strncmp(sLine, "uci", 3) == 0 && (sLine[3] == '\0' || sLine[3] == ' ')) {
+		if (opts->nUciDelayMsec > 0)
+			usleep(opts->nUciDelayMsec * 1000);
+		gsOut += "id name " + opts->sName + "\nid author Jetson Engine\n"
+			"option name Hash type spin default 16 min 1 max 4096\n"
+			"option name Threads type spin default 1 min 1 max 256\n"
+			"option name MultiPV type spin default 1 min 1 max 16\n"
+			"uciok\n";
+	}
+	else if (strcmp(sLine, "isready") == 0)
+		gsOut += "readyok\n";
+	else if (strncmp(sLine, "go", 2) == 0 && (sLine[2] == '\0' || sLine[2] == ' '))
+		MockGo(opts, search, sLine, now);
+	else if (strcmp(sLine, "stop") == 0 || strcmp(sLine, "ponderhit") == 0)
+		MockBestMove(opts, search, now);
+	else if (strcmp(sLine, "quit") == 0) {
+		MockFlush();
+		exit(0);
+	}
+	//position, setoption, ucinewgame: nothing to do
+}
+
+static void MockUsage()
+{
+	fprintf(stderr, "Usage: jetson_mock_engine [--info-rate=N] [--go-delay=ms] [--uci-delay=ms] [--nps=N] [--name=S]\n");
+	fprintf(stderr, "  --info-rate=N  info lines per second while searching (default 10)\n");
+	fprintf(stderr, "  --go-delay=ms  bestmove this long after go, unless movetime/infinite (default 1000)\n");
+	fprintf(stderr, "  --uci-delay=ms wait before answering uci (default 0)\n");
+	fprintf(stderr, "  --nps=N        nps reported in info lines (default 1000000)\n");
+	fprintf(stderr, "  --name=S       id name (default MockEngine)\n");
+}
+
+int main(int argc, char *argv[])
+{
+	struct MockOptions opts;
+	opts.nInfoRate = 10;
+	opts.nGoDelayMsec = 1000;
+	opts.nUciDelayMsec = 0;
+	opts.nNps = 1000000;
+	opts.sName = "MockEngine";
+
+	for (int i=1; i<argc; i++) {
+		const char *sEq = strchr(argv[i], '=');
+		string key = (sEq != NULL ? string(argv[i], sEq - argv[i]) : argv[i]);
+		const char *sValue = (sEq != NULL ? sEq + 1 : "");
+
+		if (key == "--info-rate")
+			opts.nInfoRate = atoi(sValue);
+		else if (key == "--go-delay")
+			opts.nGoDelayMsec = atoi(sValue);
+		else if (key == "--uci-delay")
+			opts.nUciDelayMsec = atoi(sValue);
+		else if (key == "--nps")
+			opts.nNps = atoll(sValue);
+		else if (key == "--name")
+			opts.sName = sValue;
+		else {
+			MockUsage();
+			return 1;
+		}
+	}
+	if (opts.nInfoRate > 1000)
+		opts.nInfoRate = 1000;
+
+	struct LineFramer framer;
+	memset(&framer, 0, sizeof(framer));
+	if (!JetsonFramerInit(&framer, 8192))
+		return 1;
+
+	struct MockSearch search;
+	memset(&search, 0, sizeof(search));
+	char sLine[8192];
+
+	while (1) {
+		int nWaitMsec = -1;
+		long long now = MockNowUsec();
+		if (search.bRunning) {
+			long long nNext = (opts.nInfoRate > 0 ? search.nNextInfoUsec : 0);
+			if (search.nEndUsec > 0 && (nNext == 0 || search.nEndUsec < nNext))
+				nNext = search.nEndUsec;
+			if (nNext > 0)
+				nWaitMsec = (nNext > now ? (int)((nNext - now + 999) / 1000) : 0);
+		}
+
+		struct pollfd pfd;
+		pfd.fd = 0;
+		pfd.events = POLLIN;
+		pfd.revents = 0;
+		if (poll(&pfd, 1, nWaitMsec) < 0 && errno != EINTR)
+			return 1;
+
+		now = MockNowUsec();
+		if (pfd.revents & (POLLIN | POLLHUP | POLLERR)) {
+			int nSpace;
+			char *dst = JetsonFramerWritePtr(&framer, &nSpace);
+			ssize_t n = read(0, dst, nSpace);
+			if (n <= 0 && !(n < 0 && errno == EINTR))
+				return 0;	//stdin closed
+			if (n > 0)
+				JetsonFramerCommit(&framer, (int)n);
+
+			int len;
+			while ((len = JetsonFramerNextLine(&framer, sLine, sizeof(sLine))) > 0) {
+				while (len > 0 && (sLine[len-1] == '\n' || sLine[len-1] == '\r'))
+					len--;
+				sLine[len] = '\0';
+				MockCommand(&opts, &search, sLine, now);
+			}
+			if (len == FRAMER_LINE_TOO_LONG)
+				JetsonFramerReset(&framer);
+		}
+
+		if (search.bRunning && opts.nInfoRate > 0) {
+			while (search.nNextInfoUsec <= now && (search.nEndUsec == 0 || search.nNextInfoUsec < search.nEndUsec)) {
+				MockInfoLine(&opts, &search, now);
+				search.nNextInfoUsec += 1000000LL / opts.nInfoRate;
+			}
+		}
+		if (search.bRunning && search.nEndUsec > 0 && now >= search.nEndUsec)
+			MockBestMove(&opts, &search, now);
+
+		if (!gsOut.empty())
+			MockFlush();
+	}
+	return 0;
+}
@@ -0,0 +1,311 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ *
+ * Copyright (C) 2020 Evelyn Zhu
+ *
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+//----- client relay latency: the same commands once straight to an engine port
+//and once through a frontend client (a JRE_... copy of jetson_scan) started on
+//pipes the way a GUI starts it; the difference is what the client adds to each
+//command. Measures isready -> readyok and, with go infinite running, stop ->
+//bestmove. Linux only.
+//
+//    jetson_relaylat -p 61240 -c ./JRE_X64LNX_127.0.0.1_61240_mock -n 200
+
+#include <cstdio>
+#include <cstdlib>
+#include <cstring>
+#include <string>
+#include <vector>
+#include <algorithm>
+#include <errno.h>
+#include <netdb.h>
+#include <poll.h>
+#include <signal.h>
+#include <time.h>
+#include <unistd.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+#include <sys/wait.h>
+
+#include "../common/lineframer.h"
+
+using namespace std;
+
+#define RELAY_LINE_MAX 8192
+#define RELAY_TIMEOUT_MSEC 5000		//a reply later than this counts as lost
+
+//one way to reach the engine: a socket, or the pipes of a client process
+struct RelayPath {
+	const char *sName;
+	int fdWrite;
+	int fdRead;
+	pid_t pid;
+	struct LineFramer framer;
+	vector<long long> ready;		//isready -> readyok
+	vector<long long> stop;			//stop -> bestmove
+};
+
+static long long RelayNowUsec()
+{
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec * 1000000LL + ts.tv_nsec / 1000;
+}
+
+static int RelaySend(struct RelayPath *path, const char *sCmds)
+{
+	size_t len = strlen(sCmds);
+	while (len > 0) {
+		ssize_t bytes = write(path->fdWrite, sCmds, len);
+		if (bytes <= 0)
+			return 0;
+		sCmds += bytes;
+		len -= bytes;
+	}
+	return 1;
+}
+
+//reads until a line starting with sPrefix, 0 on timeout or EOF
+static int RelayWaitFor(struct RelayPath *path, const char *sPrefix)
+{
+	char sLine[RELAY_LINE_MAX];
+	long long nDeadline = RelayNowUsec() + RELAY_TIMEOUT_MSEC * 1000LL;
+
+	while (1) {
+		int len;
+		while ((len = JetsonFramerNextLine(&path->framer, sLine, sizeof(sLine))) > 0) {
+			if (strncmp(sLine, sPrefix, strlen(sPrefix)) == 0)
+				return 1;
+		}
+		if (len == FRAMER_LINE_TOO_LONG)
+			JetsonFramerDrain(&path->framer, sLine, sizeof(sLine));
+
+		long long nLeft = nDeadline - RelayNowUsec();
+		if (nLeft <= 0)
+			return 0;
+
+		struct pollfd pfd;
+		pfd.fd = path->fdRead;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, (int)(nLeft / 1000) + 1) <= 0)
+			continue;
+
+		int nSpace;
+		char *p = JetsonFramerWritePtr(&path->framer, &nSpace);
+		ssize_t bytes = read(path->fdRead, p, nSpace);
+		if (bytes <= 0)
+			return 0;
+		JetsonFramerCommit(&path->framer, bytes);
+	}
+}
+
+static int RelayRun(struct RelayPath *path, int nRounds)
+{
+	if (!RelaySend(path, "uci\n") || !RelayWaitFor(path, "uciok"))
+		return 0;
+
+	for (int i=0; i<nRounds; i++) {
+		long long nStart = RelayNowUsec();
+		if (!RelaySend(path, "isready\n") || !RelayWaitFor(path, "readyok"))
+			return 0;
+		path->ready.push_back(RelayNowUsec() - nStart);
+
+		if (!RelaySend(path, "position startpos\ngo infinite\n"))
+			return 0;
+		usleep(2000);
+		nStart = RelayNowUsec();
+		if (!RelaySend(path, "stop\n") || !RelayWaitFor(path, "bestmove"))
+			return 0;
+		path->stop.push_back(RelayNowUsec() - nStart);
+	}
+
+	RelaySend(path, "quit\n");
+	return 1;
+}
+
+static int RelayOpenDirect(struct RelayPath *path, const char *sHost, const char *sPort)
+{
+	struct addrinfo hints, *addr;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+	if (getaddrinfo(sHost, sPort, &hints, &addr) != 0)
+		return 0;
+
+	int fd = socket(addr->ai_family, addr->ai_socktype, addr->ai_protocol);
+	if (fd >= 0 && connect(fd, addr->ai_addr, addr->ai_addrlen) != 0) {
+		close(fd);
+		fd = -1;
+	}
+	freeaddrinfo(addr);
+	if (fd < 0)
+		return 0;
+
+	int flag = 1;
+	setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &flag, sizeof(flag));
+	path->fdWrite = path->fdRead = fd;
+	path->pid = 0;
+	return 1;
+}
+
+static int RelayOpenClient(struct RelayPath *path, const char *sClient)
+{
+	int toClient[2], fromClient[2];
+	if (pipe(toClient) != 0 || pipe(fromClient) != 0)
+		return 0;
+
+	pid_t pid = fork();
+	if (pid < 0)
+		return 0;
+	if (pid == 0) {
+		dup2(toClient[0], 0);
+		dup2(fromClient[1], 1);
+		close(toClient[0]);
+		close(toClient[1]);
+		close(fromClient[0]);
+		close(fromClient[1]);
+		execl(sClient, sClient, (char *)NULL);
+		_exit(127);
+	}
+
+	close(toClient[0]);
+	close(fromClient[1]);
+	path->fdWrite = toClient[1];
+	path->fdRead = fromClient[0];
+	path->pid = pid;
+	return 1;
+}
+
+static void RelayClose(struct RelayPath *path)
+{
+	close(path->fdWrite);
+	if (path->fdRead != path->fdWrite)
+		close(path->fdRead);
+	if (path->pid > 0)
+		waitpid(path->pid, NULL, 0);
+	JetsonFramerFree(&path->framer);
+}
+
+static long long RelayPercentile(vector<long long> &v, double p)
+{
+	if (v.empty())
+		return 0;
+	size_t idx = (size_t)(p * (v.size() - 1) + 0.5);
+	return v[idx];
+}
+
+static void RelayPrintLatency(const char *sName, vector<long long> &v)
+{
+	sort(v.begin(), v.end());
+	if (v.empty()) {
+		printf("  %-22s n=0\n", sName);
+		return;
+	}
+	printf("  %-22s n=%-6zu p50=%8.3f  p90=%8.3f  p99=%8.3f  max=%8.3f ms\n", sName, v.size(),
+		RelayPercentile(v, 0.50) / 1000.0, RelayPercentile(v, 0.90) / 1000.0,
+		RelayPercentile(v, 0.99) / 1000.0, v.back() / 1000.0);
+}
+
+static void RelayUsage()
+{
+	fprintf(stderr, "Usage: jetson_relaylat -p port -c client [-H host] [-n rounds]\n");
+	fprintf(stderr, "  -p  engine port the client connects to\n");
+	fprintf(stderr, "  -c  frontend client file, e.g. ./JRE_X64LNX_127.0.0.1_61240_mock\n");
+	fprintf(stderr, "  -H  agent address, default 127.0.0.1\n");
+	fprintf(stderr, "  -n  isready and stop round trips per path, default 100\n");
+}
+
+int main(int argc, char *argv[])
+{
+	const char *sHost = "127.0.0.1";
+	const char *sPort = NULL;
+	const char *sClient = NULL;
+	int nRounds = 100;
+
+	int c;
+	while ((c = getopt(argc, argv, "p:c:H:n:")) != -1) {
+		switch (c) {
+		case 'p': sPort = optarg; break;
+		case 'c': sClient = optarg; break;
+		case 'H': sHost = optarg; break;
+		case 'n': nRounds = atoi(optarg); break;
+		default: RelayUsage(); return 1;
+		}
+	}
+	if (sPort == NULL || sClient == NULL || nRounds <= 0) {
+		RelayUsage();
+		return 1;
+	}
+
+	signal(SIGPIPE, SIG_IGN);
+
+	struct RelayPath direct, client;
+	direct.sName = "direct";
+	client.sName = "client";
+	JetsonFramerInit(&direct.framer, RELAY_LINE_MAX);
+	JetsonFramerInit(&client.framer, RELAY_LINE_MAX);
+
+	if (!RelayOpenDirect(&direct, sHost, sPort)) {
+		fprintf(stderr, "unable to connect to %s:%s\n", sHost, sPort);
+		return 1;
+	}
+	int bDirectOk = RelayRun(&direct, nRounds);
+	RelayClose(&direct);
+
+	if (!RelayOpenClient(&client, sClient)) {
+		fprintf(stderr, "unable to start %s\n", sClient);
+		return 1;
+	}
+	int bClientOk = RelayRun(&client, nRounds);
+	RelayClose(&client);
+
+	printf("jetson_relaylat: %d rounds on %s:%s\n", nRounds, sHost, sPort);
+	RelayPrintLatency("direct isready", direct.ready);
+	RelayPrintLatency("client isready", client.ready);
+	RelayPrintLatency("direct stop", direct.stop);
+	RelayPrintLatency("client stop", client.stop);
+	if (!bDirectOk || !bClientOk) {
+		printf("  %s path stopped answering\n", (!bDirectOk ? "direct" : "client"));
+		return 1;
+	}
+	printf("  client overhead p50: isready %.3f ms, stop %.3f ms\n",
+		(RelayPercentile(client.ready, 0.50) - RelayPercentile(direct.ready, 0.50)) / 1000.0,
+		(RelayPercentile(client.stop, 0.50) - RelayPercentile(direct.stop, 0.50)) / 1000.0);
+	return 0;
+}
@@ -50,6 +50,8 @@
 #include <csignal>
 #include <time.h>
 #include <cstdarg>
+#include <chrono>
+#include <atomic>
 
 #if defined(_WIN32)
 	#ifndef _WIN32_WINNT
@@ -75,6 +77,9 @@
 	#include <cstring>
 #endif
 
+#include "lineframer.h"
+#include "muxframe.h"
+
 #if defined(_WIN32)
 	#define IsSockValid(s) ((s) != INVALID_SOCKET)
 	#define CloseSocket(s) closesocket(s)
@@ -94,40 +99,296 @@
 #endif
 
 #define MAX_NAME_LEN				256	//max length for all types of names
-#define MAX_NUM_ENGINE				32	//max numbers of engine folders allowed to set in server
-#define MAX_NUM_LOGI_PER_ENGINE		64	//max numbers of client connections for each individual
+#define MAX_ADDR_LEN				64	//numeric IPv4/IPv6 address
+#if defined(_WIN32)
+#define MAX_INST_NAME_LEN			MAX_NAME_LEN	//the instance runs as a copy of the engine exe by this name
+#else
+#define MAX_INST_NAME_LEN			96	//argv[0] and logs only, longer names are cut
+#endif
+#define MAX_NUM_LOGI_PER_ENGINE		64	//upper bound for pool=N, shared=N is held to half of it
+#define MAX_TRACKED_MULTIPV		16	//per-multipv info lines kept for coalescing and caching
+#define MAX_INFO_RATE_MSEC			5000
+#define MAX_LATENCY_BUCKETS		15	//go latency histogram, bounds in agents/metrics.h
+#define MAX_RESUME_SEC				3600
+
+//----- session resume: the client asks for a token with the agent option below and
+//gets it back as an info string; after a dropped connection it connects to the
+//management port, sends "resume <token> <bytes received since the token>"; once
+//the agent answered RESUME_OK, both sides resend what the other one missed and
+//carry on with the same engine
+#define RESUME_REQUEST		"setoption name JetsonSession value new\n"
+#define RESUME_TOKEN_LINE	"info string jetson session "
+#define RESUME_CMD			"resume "
+#define RESUME_OK			"resume ok "	//followed by both stream offsets the replay starts from
+#define RESUME_FAILED		"resume failed\n"
+
+//----- position delta: a client that sent POSITION_DELTA_REQUEST and got POSITION_DELTA_OK
+//back may send a position command that only adds moves to its last one as
+//POSITION_DELTA_CMD "<moves the last one had> <added moves>"; the agent rebuilds the
+//full command. Both count moves with JetsonPositionNormalize()
+#define POSITION_DELTA_REQUEST	"setoption name JetsonPositionDelta value on\n"
+#define POSITION_DELTA_OK		"info string jetson position delta\n"
+#define POSITION_DELTA_CMD		"jetson moves "
+
+//----- backend selection: a client with several agents for one engine sends
+//"load <engine>" to each management port and is answered with one line,
+//"load <engine> <sessions> <instances> <max> <waiting> <node instances> <node max>",
+//or "load <engine> none" if the agent doesn't serve it
+#define LOAD_CMD			"load "
+#define LOAD_NONE			"none"
+
+//----- jetson_scan discover: a UDP datagram to the management port number is
+//answered with the reply line and the management port
+#define DISCOVER_PROBE		"jetson discover\n"
+#define DISCOVER_REPLY		"jetson agent "
 
 struct EngineEntry;
+struct AnalysisCache;
+struct SharedEngine;
+
+//----- event-driven agent core (Linux): every fd registered with epoll
+//carries a handle telling the reactor which object owns it
+struct ReactorHandle {
+	int type;
+	int fd;
+	unsigned int events;
+	void *owner;
+};
+
+//growable byte queue used for pending socket/pipe writes
+struct IoBuffer {
+	char *data;
+	int len;
+	int cap;
+};
+
+//per-engine settings, given as key=value after EngineArguments in jetson_agent.conf
+struct EngineOptions {
+	int nPoolSize;				//pool=N: initialized instances kept ready for logins
+	int nCoalesceMsec;			//coalesce=ms: relay engine info lines at most this often
+	int nCacheSize;				//cache=N: finished searches kept, identical searches shared
+	int nSharedWorkers;			//shared=N: sessions share N engine processes owned by the agent
+	int nSliceMsec;				//slice=ms: go infinite gives up its worker after this if others wait
+	int nMaxInstances;			//max=N: logins beyond N running instances wait in a queue
+	int nResumeSec;				//resume=s: engine of a dropped session is kept this long
+	int nStoreMb;				//store=MB: finished searches kept on disk, shared by agents
+	int bSplice;				//splice=1: engine output after uciok is spliced to the socket
+};
+
+//a go command as the agent follows it for the analysis cache
+struct SearchEntry {
+	int nState;					//SEARCH_STATE_*
+	unsigned long long nKey;	//position and engine options searched
+	struct ClientEntry *pLeader;	//session whose engine runs the search this one joined
+	long long nStartMsec;
+	int nDepth;
+	long long nNodes;
+	int bStopped;				//client sent stop, result may fall short of the go limits
+	struct IoBuffer goCmd;		//go line as the client sent it
+	struct IoBuffer *pvLines;	//latest info line with a pv, per multipv; NULL before the first tracked go
+	struct IoBuffer heldReply;	//go answered by the agent, waits for replies the engine owes
+	int nHeldReadyAhead;		//readyok lines to pass on before the one that releases heldReply
+};
+
+//a session or engine process of an engine in shared mode
+struct SharedSlot {
+	int nState;					//SHARED_STATE_*
+	int bIsWorker;				//engine process owned by the agent, no client socket
+	struct ClientEntry *pPeer;	//worker: session whose go it runs, session: its worker
+	long long nQueuedMsec;		//session: when its go was queued
+	long long nStartMsec;		//worker: when the current go was sent
+	int bStopNow;				//session: stop came before the go got a worker
+	int bPonderHit;
+	int bNewGame;				//session: ucinewgame goes out with its next go
+	int bUciPending;			//session: uci came before any worker answered it
+	int bReadyPending;
+	int bPreempting;			//worker: stopped for a queued session, bestmove is dropped
+	char sPvMove[16];			//session: latest first pv move, answers a stop while queued
+	struct IoBuffer options;	//setoption lines, latest per option name
+	struct IoBuffer position;	//session: last position command
+	struct IoBuffer goCmd;		//session: go to run on a worker
+};
+
+//a session that asked for a resume token
+struct ResumeState {
+	unsigned long long nToken;	//0 unless the client asked for one
+	int bDetached;				//connection lost, engine kept until nDeadlineMsec
+	long long nDeadlineMsec;
+	long long nBytesSent;		//agent -> client stream offset, 0 right after the token line
+	long long nBytesReceived;	//client -> agent offset, whole lines after the token request
+	struct IoBuffer sent;		//tail of the stream, replayed from the client's offset
+	struct IoBuffer lastInfo;	//latest info line while detached
+};
+
+//----- counters read by the stats command while relays update them, lock-free
+struct LatencyHistogram {
+	std::atomic<unsigned long long> buckets[MAX_LATENCY_BUCKETS];	//last one is +Inf
+	std::atomic<unsigned long long> nSumUsec;
+};
+
+struct SessionMetrics {
+	std::atomic<unsigned long long> nBytesIn;	//from the client
+	std::atomic<unsigned long long> nBytesOut;	//to the client
+	std::atomic<unsigned long long> nCommands;	//uci commands from the client
+	std::atomic<unsigned long long> nGoCount;
+	std::atomic<long long> nLastNps;			//latest nps/depth the engine reported
+	std::atomic<int> nLastDepth;
+	std::atomic<long long> nFirstInfoUsec;		//go -> first info, latest go
+	std::atomic<long long> nBestMoveUsec;		//go -> bestmove, latest go
+	long long nGoStartUsec;		//relay side only, 0 while no go is outstanding
+	int bFirstInfoSeen;
+};
+
+struct EngineMetrics {
+	std::atomic<unsigned long long> nBytesIn;
+	std::atomic<unsigned long long> nBytesOut;
+	std::atomic<unsigned long long> nCommands;
+	std::atomic<unsigned long long> nGoCount;
+	std::atomic<unsigned long long> nLogins;
+	std::atomic<long long> nLastNps;
+	std::atomic<int> nLastDepth;
+	struct LatencyHistogram firstInfo;	//go -> first info line
+	struct LatencyHistogram bestMove;	//go -> bestmove
+};
 
 struct ClientEntry {
 	int bIsConnected;
 	int bIsDataLogOn;
+#if defined(_WIN32)
 	char sReqPipe[MAX_NAME_LEN];
 	char sRspPipe[MAX_NAME_LEN];
+#endif
 	HANDLE hReqPipe;
 	HANDLE hRspPipe;
 	SOCKET sock;
-	char sIpAddr[MAX_NAME_LEN];
-	char sServIpAddr[MAX_NAME_LEN];
-	char sEngInstName[MAX_NAME_LEN];//engine instance name
+	char sIpAddr[MAX_ADDR_LEN];
+	char sServIpAddr[MAX_ADDR_LEN];
+	char sEngInstName[MAX_INST_NAME_LEN];//engine instance name
 	struct EngineEntry *engine;
+	int nSlot;					//index in engine->clients
+	int nInstSlot;				//1 + index in engine->insts, 0 while not listed
+	int bReleased;				//queued in gReleasedClients, freed after the batch
+	unsigned int nSessionId;	//0 unless a client is connected
 	fd_set *pMaster;
+	int bIsEngineRunning;		//engine process/pipes not yet released
+	int nEnginePid;				//0 once the engine process is reaped
+	int nEngineExitStatus;		//waitpid() status of the last engine process
+	int nPoolState;				//POOL_STATE_NONE while a client owns the instance
+	int bIsPooled;				//instance came from the warm pool, may go back to it
+	int bOptionsChanged;		//client sent setoption, instance can't be recycled
+	int bQuitSent;
+	int nReadyPending;			//isready sent to the engine, its readyok not read yet
+	int bUciokPending;			//uci sent to the engine, its uciok not read yet
+	int bCloseAfterFlush;		//close client once sockOut is drained
+	int nReqFraming;			//REQ_FRAMING_*, decided by the first bytes from the client
+	struct LineFramer reqFramer;	//client -> engine, partial command not yet forwarded
+	struct LineFramer rspFramer;	//engine -> client, partial output line
+	int nInfoRateMsec;			//0 relays info lines as they come, else coalesces them
+	int bSpliceReady;			//uciok relayed with splice=1, nothing left to rewrite
+	int bSpliceOff;				//splice() failed on this socket, copy path only
+	int bPositionDelta;			//client asked for POSITION_DELTA_CMD, lastPosition is kept
+	int nLastPositionMoves;
+	struct IoBuffer lastPosition;	//last position command, normalized, no line end
+	long long nInfoLastFlush;	//msec
+	long long nInfoFlushDeadline;	//msec, 0 while nothing is held back
+	int bInfoTimerArmed;		//listed in the reactor's info flush timers
+	long long nInfoLinesIn;
+	long long nInfoLinesOut;
+	struct IoBuffer *infoPending;	//latest info line per multipv, [0] without pv; NULL until a line is held back
+	unsigned long long nPositionKey;	//Zobrist key of the last position command, 0 if unknown
+	unsigned long long nOptionsHash;	//setoption lines sent so far, 0 for engine defaults
+	struct SearchEntry search;
+	struct SharedSlot shared;
+	struct ResumeState resume;
+	int nConfigGen;				//engine's nConfigGen when the instance was started
+	struct ReactorHandle hSockEvt;
+	struct ReactorHandle hReqPipeEvt;
+	struct ReactorHandle hRspPipeEvt;
+	struct IoBuffer sockOut;	//engine -> client, not yet sent
+	struct IoBuffer pipeOut;	//client -> engine, not yet written
+	struct SessionMetrics metrics;
 } __attribute__((aligned(8)));
 
 struct EngineEntry {
-	int bIsAllocated;
 	int reserved;
 	char sEngineDir[MAX_NAME_LEN];
 	char sEngineName[MAX_NAME_LEN];
 	char sEngineExeName[MAX_NAME_LEN];
 	char sEngienPort[MAX_NAME_LEN];
 	char arguments[MAX_NAME_LEN];
-	struct ClientEntry clients[MAX_NUM_LOGI_PER_ENGINE];
+	SOCKET sockListen;
+	struct ReactorHandle hListenEvt;
+	struct EngineOptions opts;
+	int nPoolSeq;				//names pool instances jei_pool<seq>_<engine>
+	int nPoolFailures;			//consecutive pool instances that died before readyok
+	struct AnalysisCache *pCache;	//NULL unless cache=N is set
+	struct AnalysisStore *pStore;	//NULL unless store=MB is set, see agents/analysisstore.h
+	struct SharedEngine *pShared;	//NULL unless shared=N is set
+	long long nLoginsWaited;	//logins admitted from the queue
+	long long nLoginWaitMsecTotal;
+	long long nLoginWaitMsecMax;
+	int bDraining;				//removed or replaced by a reload, freed once its sessions are gone
+	int bRouted;				//router mode: offered by backend agents, sessions are relayed to one
+	int nConfigGen;				//bumped when a reload changes the engine arguments
+	struct ClientEntry **clients;	//records in use, see agents/registry.h
+	int nClients;
+	int nClientsCap;
+	struct ClientEntry **insts;	//pool members and shared workers, also in clients
+	int nInsts;
+	int nInstsCap;
+	struct EngineMetrics metrics;	//sessions of all instances, kept over logouts
 } __attribute__((aligned(8)));
 
 enum SocketType {
 	SOCK_TYPE_MGMT = 1,
-	SOCK_TYPE_ENGINE = 2
+	SOCK_TYPE_ENGINE = 2,
+	SOCK_TYPE_METRICS = 3		//Prometheus scrape listener, metrics=PORT
+};
+
+enum ReactorHandleType {
+	RH_TYPE_MGMT_LISTEN = 1,
+	RH_TYPE_MGMT_CLIENT = 2,
+	RH_TYPE_ENGINE_LISTEN = 3,
+	RH_TYPE_CLIENT_SOCK = 4,
+	RH_TYPE_ENGINE_REQ = 5,		//agent -> engine stdin
+	RH_TYPE_ENGINE_RSP = 6,		//engine stdout -> agent
+	RH_TYPE_SIGNAL = 7,			//signalfd, SIGCHLD
+	RH_TYPE_WAITING_CLIENT = 8,	//login waiting for an engine instance
+	RH_TYPE_METRICS_LISTEN = 9,
+	RH_TYPE_METRICS_CLIENT = 10,	//HTTP scrape, answered and closed
+	RH_TYPE_MUX_CONN = 11,		//multiplexed client connection
+	RH_TYPE_MUX_CHANNEL = 12,	//agent end of a mux channel's socketpair
+	RH_TYPE_DISCOVERY = 13,		//UDP, answers jetson_scan discover
+	RH_TYPE_MGMT_DONE = 14,		//eventfd, management workers finished a reply
+	RH_TYPE_ROUTE_CLIENT = 15,	//router mode: client side of a relayed session
+	RH_TYPE_ROUTE_BACKEND = 16	//router mode: backend agent side of it
+};
+
+enum PoolState {
+	POOL_STATE_NONE = 0,
+	POOL_STATE_WARMING = 1,		//uci/isready sent, waiting for readyok
+	POOL_STATE_IDLE = 2,		//ready to be handed to a login
+	POOL_STATE_RECYCLING = 3	//client left, ucinewgame/isready sent
+};
+
+enum ReqFraming {
+	REQ_FRAMING_UNKNOWN = 0,
+	REQ_FRAMING_LINES = 1,		//commands are '\n' terminated
+	REQ_FRAMING_PER_SEND = 2	//older jetson_scan: one command per send(), no '\n'
+};
+
+enum SearchState {
+	SEARCH_STATE_NONE = 0,
+	SEARCH_STATE_RUNNING = 1,	//own engine is searching
+	SEARCH_STATE_ATTACHED = 2	//gets the output of another session's identical search
+};
+
+enum SharedState {
+	SHARED_STATE_NONE = 0,		//dedicated engine instance per session
+	SHARED_STATE_WARMING = 1,	//worker: uci/isready sent, waiting for readyok
+	SHARED_STATE_IDLE = 2,		//worker: free, session: no go outstanding
+	SHARED_STATE_BUSY = 3,		//worker: runs a session's go, session: go runs on a worker
+	SHARED_STATE_QUEUED = 4		//session: go waits for a free worker
 };
 
 enum OsArch {
@@ -139,8 +400,11 @@ enum OsArch {
 
 #define RSP_BUFSIZE 8192			//uci command, mgmt command
 #define REQ_BUFSIZE	1024			//uci response
+#define FRAMER_BUFSIZE RSP_BUFSIZE	//longest uci line a session relays in one piece
+#define FRAMER_MAX_CMD_BUFSIZE 1048576	//a client command may grow the request framer to this
 #define PIPE_BUFSIZE RSP_BUFSIZE	//pipe read/write
 #define QUERY_BUFSIZE 32768			//query response
+#define IO_HIGH_WATERMARK 1048576	//stop reading a peer while this much is queued for the other side
 
 #define STR_OS_ARCH_WIN		(char *)"Windows X86-64"
 #define STR_OS_ARCH_LINUX	(char *)"Linux X86-64"
@@ -164,32 +428,45 @@ static inline const std::string GetCurrentDateTime()
 	return buf;
 }
 
+static inline long long GetMonotonicUsec()
+{
+	return std::chrono::duration_cast<std::chrono::microseconds>(
+		std::chrono::steady_clock::now().time_since_epoch()).count();
+}
+
 static inline bool IsFileExist(const char *fileName)
 {
     std::ifstream inFile(fileName);
     return inFile.good();
 }
 
-extern char gsMyHostName[];
-extern pthread_mutex_t gLogFileLock;
-extern char gsLogFile[];
-static inline void JetsonWriteLogs(const char *fmt, ...)
+//blank separated words, the moves of a move list
+static inline int JetsonCountMoves(const char *s)
 {
-	//Please ensure sErrMsg ended with '\n'
-	pthread_mutex_lock(&gLogFileLock);
-	FILE *p = fopen(gsLogFile, "a");
-	if (p!= NULL) {
-		std::ostringstream oss;
-		oss << GetCurrentDateTime() << " [" << gsMyHostName << "] " << fmt;
-		
-		va_list args;
-		va_start(args, fmt);
-		vfprintf(p, oss.str().c_str(), args);
-		va_end(args);
-		
-		fclose(p);
+	int nMoves = 0;
+	for (const char *p = s; *p != '\0'; p++) {
+		if (*p != ' ' && *p != '\t' && (p == s || p[-1] == ' ' || p[-1] == '\t'))
+			nMoves++;
 	}
-	pthread_mutex_unlock(&gLogFileLock);
+	return nMoves;
 }
 
+//position command without line end, trailing blanks and an empty "moves"; returns
+//the number of moves it lists
+static inline int JetsonPositionNormalize(std::string &sLine)
+{
+	size_t end = sLine.find_last_not_of(" \t\r\n");
+	sLine.erase(end == std::string::npos ? 0 : end + 1);
+	if (sLine.length() >= 6 && sLine.compare(sLine.length() - 6, 6, " moves") == 0) {
+		sLine.erase(sLine.length() - 6);
+		end = sLine.find_last_not_of(" \t");
+		sLine.erase(end == std::string::npos ? 0 : end + 1);
+	}
+
+	size_t pos = sLine.find(" moves ");
+	return (pos == std::string::npos ? 0 : JetsonCountMoves(sLine.c_str() + pos + 7));
+}
+
+#include "logger.h"
+
 #endif	//_JET_COMMON_H
@@ -0,0 +1,208 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ *
+ * Copyright (C) 2020 Evelyn Zhu
+ *
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+#ifndef _JET_LINEFRAMER_H
+#define _JET_LINEFRAMER_H
+
+#include <cstdlib>
+#include <cstring>
+
+//----- incremental UCI line framer
+//Bytes go into a ring buffer exactly as recv()/read() returned them and
+//come out as whole '\n' terminated lines, no matter how the stream was
+//split or coalesced on the way.
+struct LineFramer {
+	char *buf;
+	unsigned int cap;			//power of two
+	unsigned int head;			//next byte to hand out, free-running
+	unsigned int tail;			//next byte to fill, free-running
+	unsigned int scanned;		//bytes after head already known to hold no '\n'
+};
+
+#define FRAMER_NEED_MORE	-1	//no complete line buffered yet
+#define FRAMER_LINE_TOO_LONG	-2	//buffer is full and holds no '\n'
+
+static inline int JetsonFramerInit(struct LineFramer *f, unsigned int nMinCap)
+{
+	unsigned int cap = 64;
+	while (cap < nMinCap)
+		cap <<= 1;
+
+	if (f->buf == NULL || f->cap != cap) {
+		free(f->buf);
+		f->buf = (char *)malloc(cap);
+		if (f->buf == NULL) {
+			f->cap = 0;
+			return 0;
+		}
+	}
+	f->cap = cap;
+	f->head = f->tail = f->scanned = 0;
+	return 1;
+}
+
+//doubles the ring, keeping what it holds; 0 once it has nMaxCap bytes or no memory
+static inline int JetsonFramerGrow(struct LineFramer *f, unsigned int nMaxCap)
+{
+	if (f->cap == 0 || f->cap * 2 > nMaxCap)
+		return 0;
+
+	char *buf = (char *)malloc(f->cap * 2);
+	if (buf == NULL)
+		return 0;
+
+	unsigned int used = f->tail - f->head;
+	unsigned int off = f->head & (f->cap - 1);
+	unsigned int first = (used < f->cap - off ? used : f->cap - off);
+	memcpy(buf, f->buf + off, first);
+	memcpy(buf + first, f->buf, used - first);
+
+	free(f->buf);
+	f->buf = buf;
+	f->cap *= 2;
+	f->head = 0;
+	f->tail = used;
+	return 1;
+}
+
+static inline void JetsonFramerFree(struct LineFramer *f)
+{
+	free(f->buf);
+	f->buf = NULL;
+	f->cap = 0;
+	f->head = f->tail = f->scanned = 0;
+}
+
+static inline void JetsonFramerReset(struct LineFramer *f)
+{
+	f->head = f->tail = f->scanned = 0;
+}
+
+static inline unsigned int JetsonFramerUsed(const struct LineFramer *f)
+{
+	return f->tail - f->head;
+}
+
+//contiguous free space at the tail, so recv()/read() can fill the ring directly
+static inline char *JetsonFramerWritePtr(struct LineFramer *f, int *pnSpace)
+{
+	unsigned int used = f->tail - f->head;
+	unsigned int off = f->tail & (f->cap - 1);
+	unsigned int toEnd = f->cap - off;
+	unsigned int space = f->cap - used;
+
+	*pnSpace = (int)(space < toEnd ? space : toEnd);
+	return f->buf + off;
+}
+
+static inline void JetsonFramerCommit(struct LineFramer *f, int len)
+{
+	f->tail += len;
+}
+
+//copy in as much as fits, returns bytes taken
+static inline int JetsonFramerPush(struct LineFramer *f, const char *data, int len)
+{
+	int total = 0;
+	while (total < len) {
+		int space;
+		char *dst = JetsonFramerWritePtr(f, &space);
+		if (space == 0)
+			break;
+
+		int n = (len - total < space ? len - total : space);
+		memcpy(dst, data + total, n);
+		JetsonFramerCommit(f, n);
+		total += n;
+	}
+	return total;
+}
+
+static inline void JetsonFramerCopyOut(struct LineFramer *f, char *out, unsigned int len)
+{
+	unsigned int off = f->head & (f->cap - 1);
+	unsigned int first = (len < f->cap - off ? len : f->cap - off);
+
+	memcpy(out, f->buf + off, first);
+	memcpy(out + first, f->buf, len - first);
+	f->head += len;
+	f->scanned = 0;
+}
+
+//Copies the next line, '\n' included, into out (outSize must be >= cap) and
+//returns its length, or FRAMER_NEED_MORE / FRAMER_LINE_TOO_LONG.
+static inline int JetsonFramerNextLine(struct LineFramer *f, char *out, int outSize)
+{
+	unsigned int used = f->tail - f->head;
+
+	while (f->scanned < used) {
+		unsigned int off = (f->head + f->scanned) & (f->cap - 1);
+		unsigned int len = used - f->scanned;
+		if (len > f->cap - off)
+			len = f->cap - off;
+
+		const char *nl = (const char *)memchr(f->buf + off, '\n', len);
+		if (nl != NULL) {
+			unsigned int lineLen = f->scanned + (unsigned int)(nl - (f->buf + off)) + 1;
+			if ((int)lineLen > outSize)
+				return FRAMER_LINE_TOO_LONG;
+
+			JetsonFramerCopyOut(f, out, lineLen);
+			return (int)lineLen;
+		}
+		f->scanned += len;
+	}
+
+	return (used == f->cap ? FRAMER_LINE_TOO_LONG : FRAMER_NEED_MORE);
+}
+
+//hands out whatever is buffered, for peers that overflow the ring without a '\n'
+static inline int JetsonFramerDrain(struct LineFramer *f, char *out, int outSize)
+{
+	unsigned int len = f->tail - f->head;
+	if ((int)len > outSize)
+		len = outSize;
+
+	JetsonFramerCopyOut(f, out, len);
+	return (int)len;
+}
+
+#endif	//_JET_LINEFRAMER_H
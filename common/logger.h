@@ -0,0 +1,370 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ *
+ * Copyright (C) 2020 Evelyn Zhu
+ *
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+#ifndef _JET_LOGGER_H
+#define _JET_LOGGER_H
+
+#include <atomic>
+#include <cstdio>
+#include <cstdarg>
+#include <cstring>
+#include <ctime>
+#include <pthread.h>
+#if !defined(_WIN32)
+	#include <signal.h>
+	#include <thread>
+	#include <chrono>
+#endif
+
+//----- asynchronous logger
+//Every thread that logs formats into a ring of its own and never waits: when
+//the ring is full the message is dropped and counted. A single writer thread
+//keeps the log file open, drains the rings and rotates the file by size.
+//Lines of one thread keep their order, lines of different threads may be
+//written a drain pass apart.
+#define LOG_LEVEL_ERROR		0
+#define LOG_LEVEL_INFO		1
+#define LOG_LEVEL_TRACE		2	//every relayed UCI command
+
+#define LOG_RING_SIZE		(64*1024)	//per logging thread, power of two
+#define MAX_LOG_RINGS		256			//threads logging at the same time
+#define MAX_LOG_LINE		1024		//longer messages are cut
+#define LOG_WRITER_IDLE_MSEC	20
+#define LOG_ROTATE_DEFAULT_MB	10
+
+#define LOG_RECORD_PAD		0xffffffffu	//rest of the ring is unused, go on at its start
+
+struct LogRecordHdr {
+	unsigned int len;		//message bytes, or LOG_RECORD_PAD
+	unsigned int reserved;
+	long long sec;			//time(0) when logged
+};
+
+struct LogRing {
+	std::atomic<int> bInUse;					//owned by a running thread
+	std::atomic<unsigned long long> nHead;		//bytes produced, free-running
+	std::atomic<unsigned long long> nTail;		//bytes written out, free-running
+	std::atomic<unsigned long long> nDropped;
+	char buf[LOG_RING_SIZE];
+};
+
+struct JetsonLogger {
+	std::atomic<int> nLevel{LOG_LEVEL_INFO};
+	std::atomic<long long> nRotateBytes{LOG_ROTATE_DEFAULT_MB * 1024LL * 1024LL};	//0: never rotate
+	std::atomic<int> nRings;
+	std::atomic<struct LogRing *> rings[MAX_LOG_RINGS];
+	std::atomic<unsigned long long> nDroppedNoRing;
+	std::atomic<int> bRunning;
+	//writer thread only
+	pthread_t writerThread;
+	FILE *fp;
+	long long nFileBytes;
+	unsigned long long nDroppedReported;
+	long long nStampSec;
+	char sStamp[MAX_NAME_LEN + 40];	//"date [host] " of nStampSec
+};
+
+extern char gsMyHostName[];
+extern char gsLogFile[];
+extern struct JetsonLogger gLogger;
+
+struct LogRingOwner {
+	struct LogRing *ring;
+	~LogRingOwner() {
+		if (ring != NULL)
+			ring->bInUse.store(0, std::memory_order_release);
+	}
+};
+
+//ring of the calling thread, a ring left by an exited thread is taken over
+static inline struct LogRing *JetsonLogThreadRing()
+{
+	static thread_local struct LogRingOwner owner = { NULL };
+	if (owner.ring != NULL)
+		return owner.ring;
+
+	int nRings = gLogger.nRings.load(std::memory_order_acquire);
+	if (nRings > MAX_LOG_RINGS)
+		nRings = MAX_LOG_RINGS;
+	for (int i=0; i<nRings; i++) {
+		struct LogRing *ring = gLogger.rings[i].load(std::memory_order_acquire);
+		int bFree = 0;
+		if (ring != NULL && ring->bInUse.compare_exchange_strong(bFree, 1, std::memory_order_acquire))
+			return (owner.ring = ring);
+	}
+
+	int nSlot = gLogger.nRings.fetch_add(1);
+	if (nSlot >= MAX_LOG_RINGS)
+		return NULL;
+	struct LogRing *ring = new struct LogRing();
+	ring->bInUse.store(1);
+	gLogger.rings[nSlot].store(ring, std::memory_order_release);
+	return (owner.ring = ring);
+}
+
+static inline void JetsonLogVWrite(int level, const char *fmt, va_list args)
+{
+	if (level > gLogger.nLevel.load(std::memory_order_relaxed))
+		return;
+
+	struct LogRing *ring = JetsonLogThreadRing();
+	if (ring == NULL) {
+		gLogger.nDroppedNoRing.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+
+	char sLine[MAX_LOG_LINE];
+	int len = vsnprintf(sLine, sizeof(sLine), fmt, args);
+	if (len <= 0)
+		return;
+	if (len >= MAX_LOG_LINE) {
+		len = MAX_LOG_LINE - 1;
+		sLine[len - 1] = '\n';
+	}
+
+	unsigned int need = sizeof(struct LogRecordHdr) + ((len + 7) & ~7u);
+	unsigned long long head = ring->nHead.load(std::memory_order_relaxed);
+	unsigned long long tail = ring->nTail.load(std::memory_order_acquire);
+	unsigned int off = (unsigned int)(head & (LOG_RING_SIZE - 1));
+	unsigned int pad = (off + need > LOG_RING_SIZE ? LOG_RING_SIZE - off : 0);
+
+	if (head + pad + need - tail > LOG_RING_SIZE) {
+		ring->nDropped.fetch_add(1, std::memory_order_relaxed);
+		return;
+	}
+	if (pad > 0) {
+		((struct LogRecordHdr *)(ring->buf + off))->len = LOG_RECORD_PAD;
+		head += pad;
+		off = 0;
+	}
+
+	struct LogRecordHdr *hdr = (struct LogRecordHdr *)(ring->buf + off);
+	hdr->len = len;
+	hdr->sec = (long long)time(0);
+	memcpy(ring->buf + off + sizeof(struct LogRecordHdr), sLine, len);
+	ring->nHead.store(head + need, std::memory_order_release);
+}
+
+//Please ensure fmt ends with '\n'
+static inline void JetsonWriteLogs(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	JetsonLogVWrite(LOG_LEVEL_INFO, fmt, args);
+	va_end(args);
+}
+
+static inline void JetsonErrorLogs(const char *fmt, ...)
+{
+	va_list args;
+	va_start(args, fmt);
+	JetsonLogVWrite(LOG_LEVEL_ERROR, fmt, args);
+	va_end(args);
+}
+
+static inline void JetsonTraceLogs(const char *fmt, ...)
+{
+	if (gLogger.nLevel.load(std::memory_order_relaxed) < LOG_LEVEL_TRACE)
+		return;
+
+	va_list args;
+	va_start(args, fmt);
+	JetsonLogVWrite(LOG_LEVEL_TRACE, fmt, args);
+	va_end(args);
+}
+
+//----- writer side
+static inline void JetsonLogEmit(long long sec, const char *msg, unsigned int len)
+{
+	if (gLogger.fp == NULL)
+		return;
+
+	if (sec != gLogger.nStampSec) {
+		time_t now = (time_t)sec;
+		char sTime[32];
+		strftime(sTime, sizeof(sTime), "%Y-%m-%d.%X", localtime(&now));
+		snprintf(gLogger.sStamp, sizeof(gLogger.sStamp), "%s [%s] ", sTime, gsMyHostName);
+		gLogger.nStampSec = sec;
+	}
+	size_t nStampLen = strlen(gLogger.sStamp);
+	fwrite(gLogger.sStamp, 1, nStampLen, gLogger.fp);
+	fwrite(msg, 1, len, gLogger.fp);
+	gLogger.nFileBytes += nStampLen + len;
+}
+
+static inline void JetsonLogOpen()
+{
+	//engine processes must not inherit the log, rotation reopens it here as well
+#if defined(_WIN32)
+	gLogger.fp = fopen(gsLogFile, "aN");
+#else
+	gLogger.fp = fopen(gsLogFile, "ae");
+#endif
+	gLogger.nFileBytes = 0;
+	if (gLogger.fp != NULL) {
+		fseek(gLogger.fp, 0, SEEK_END);
+		gLogger.nFileBytes = ftell(gLogger.fp);
+	}
+}
+
+//current file becomes <name>.1, the one before it is removed
+static inline void JetsonLogRotate()
+{
+	char sOldFile[512];
+	snprintf(sOldFile, sizeof(sOldFile), "%s.1", gsLogFile);
+
+	fclose(gLogger.fp);
+	remove(sOldFile);
+	rename(gsLogFile, sOldFile);
+	JetsonLogOpen();
+}
+
+//returns number of message bytes written out
+static inline long long JetsonLogDrain()
+{
+	long long nBytes = 0;
+	unsigned long long nDropped = gLogger.nDroppedNoRing.load(std::memory_order_relaxed);
+
+	int nRings = gLogger.nRings.load(std::memory_order_acquire);
+	if (nRings > MAX_LOG_RINGS)
+		nRings = MAX_LOG_RINGS;
+	for (int i=0; i<nRings; i++) {
+		struct LogRing *ring = gLogger.rings[i].load(std::memory_order_acquire);
+		if (ring == NULL)
+			continue;
+
+		unsigned long long tail = ring->nTail.load(std::memory_order_relaxed);
+		unsigned long long head = ring->nHead.load(std::memory_order_acquire);
+		while (tail != head) {
+			unsigned int off = (unsigned int)(tail & (LOG_RING_SIZE - 1));
+			struct LogRecordHdr *hdr = (struct LogRecordHdr *)(ring->buf + off);
+			if (hdr->len == LOG_RECORD_PAD) {
+				tail += LOG_RING_SIZE - off;
+				continue;
+			}
+			JetsonLogEmit(hdr->sec, ring->buf + off + sizeof(struct LogRecordHdr), hdr->len);
+			nBytes += hdr->len;
+			tail += sizeof(struct LogRecordHdr) + ((hdr->len + 7) & ~7u);
+		}
+		ring->nTail.store(tail, std::memory_order_release);
+		nDropped += ring->nDropped.load(std::memory_order_relaxed);
+	}
+
+	if (nDropped > gLogger.nDroppedReported) {
+		char sLine[128];
+		int len = snprintf(sLine, sizeof(sLine), "%llu log messages dropped, log buffer full\n",
+			nDropped - gLogger.nDroppedReported);
+		JetsonLogEmit((long long)time(0), sLine, len);
+		gLogger.nDroppedReported = nDropped;
+		nBytes += len;
+	}
+
+	if (nBytes > 0 && gLogger.fp != NULL) {
+		fflush(gLogger.fp);
+		long long nRotateBytes = gLogger.nRotateBytes.load(std::memory_order_relaxed);
+		if (nRotateBytes > 0 && gLogger.nFileBytes >= nRotateBytes)
+			JetsonLogRotate();
+	}
+	return nBytes;
+}
+
+static inline void *JetsonLogWriterThread(void *)
+{
+	while (gLogger.bRunning.load(std::memory_order_acquire)) {
+		if (JetsonLogDrain() == 0) {
+#if defined(_WIN32)
+			Sleep(LOG_WRITER_IDLE_MSEC);
+#else
+			std::this_thread::sleep_for(std::chrono::milliseconds(LOG_WRITER_IDLE_MSEC));
+#endif
+		}
+	}
+	JetsonLogDrain();
+	return NULL;
+}
+
+//gsLogFile must be final, lines logged before are kept in the rings
+static inline int JetsonLogStart()
+{
+	JetsonLogOpen();
+	gLogger.bRunning.store(1);
+
+#if !defined(_WIN32)
+	//signals go to the other threads, the writer is never interrupted holding the file
+	sigset_t sigAll, sigOld;
+	sigfillset(&sigAll);
+	pthread_sigmask(SIG_SETMASK, &sigAll, &sigOld);
+#endif
+	int rc = pthread_create(&gLogger.writerThread, NULL, JetsonLogWriterThread, NULL);
+#if !defined(_WIN32)
+	pthread_sigmask(SIG_SETMASK, &sigOld, NULL);
+#endif
+	if (rc != 0) {
+		gLogger.bRunning.store(0);
+		return 0;
+	}
+	return 1;
+}
+
+//writes out what is still buffered and closes the file
+static inline void JetsonLogStop()
+{
+	if (!gLogger.bRunning.exchange(0))
+		return;
+
+	pthread_join(gLogger.writerThread, NULL);
+	if (gLogger.fp != NULL) {
+		fclose(gLogger.fp);
+		gLogger.fp = NULL;
+	}
+}
+
+static inline void JetsonLogSetLevel(int level)
+{
+	gLogger.nLevel.store(level);
+}
+
+static inline void JetsonLogSetRotateMb(int nMb)
+{
+	gLogger.nRotateBytes.store(nMb > 0 ? nMb * 1024LL * 1024LL : 0);
+}
+
+#endif
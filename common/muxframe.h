@@ -0,0 +1,139 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ *
+ * Copyright (C) 2020 Evelyn Zhu
+ *
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+#ifndef _JET_MUXFRAME_H
+#define _JET_MUXFRAME_H
+
+#include <string>
+
+//----- multiplexed connection: one TCP connection to the agent's management port
+//carries any number of engine sessions and management exchanges as channels.
+//The client sends MUX_HELLO as a plain line; an agent that knows the protocol
+//answers MUX_HELLO_OK and both sides switch to frames, an older agent doesn't
+//answer and the client falls back to one connection per engine port.
+//
+//Frame: 8 byte header, payload length (4 bytes) and channel (2 bytes) in network
+//order, frame type, a zero byte; then the payload.
+//
+//Each engine channel is flow controlled on its own in both directions: a side may
+//send DATA only while it holds credit for that channel, starting at MUX_WINDOW
+//bytes, and the peer hands credit back with CREDIT once it passed the data on.
+//Management channels carry one command per DATA frame and are not flow controlled.
+#define MUX_HELLO			"JMUX 1\n"
+#define MUX_HELLO_OK		"JMUX 1 ok\n"
+#define MUX_HDR_LEN			8
+#define MUX_MAX_PAYLOAD		16384
+#define MUX_WINDOW			65536		//initial credit per channel and direction
+#define MUX_CREDIT_BATCH	(MUX_WINDOW/4)	//credit is returned once this much was passed on
+#define MUX_MAX_CHANNEL		65535		//channel 0 is not used
+
+enum {
+	MUX_FRAME_OPEN = 1,		//client: "engine <name>" or "mgmt"
+	MUX_FRAME_OPENED = 2,	//agent: channel is usable
+	MUX_FRAME_DATA = 3,
+	MUX_FRAME_CREDIT = 4,	//4 byte count in network order
+	MUX_FRAME_CLOSE = 5		//either side, payload is a reason for the log
+};
+
+static inline void JetsonMuxPutHeader(unsigned char *hdr, unsigned int len, unsigned int nChannel, int type)
+{
+	hdr[0] = (unsigned char)(len >> 24);
+	hdr[1] = (unsigned char)(len >> 16);
+	hdr[2] = (unsigned char)(len >> 8);
+	hdr[3] = (unsigned char)len;
+	hdr[4] = (unsigned char)(nChannel >> 8);
+	hdr[5] = (unsigned char)nChannel;
+	hdr[6] = (unsigned char)type;
+	hdr[7] = 0;
+}
+
+static inline void JetsonMuxGetHeader(const unsigned char *hdr, unsigned int *pLen, unsigned int *pChannel, int *pType)
+{
+	*pLen = ((unsigned int)hdr[0] << 24) | ((unsigned int)hdr[1] << 16) | ((unsigned int)hdr[2] << 8) | hdr[3];
+	*pChannel = ((unsigned int)hdr[4] << 8) | hdr[5];
+	*pType = hdr[6];
+}
+
+//whole frame as bytes, for writers that queue std::string
+static inline std::string JetsonMuxFrame(unsigned int nChannel, int type, const char *data, unsigned int len)
+{
+	unsigned char hdr[MUX_HDR_LEN];
+	JetsonMuxPutHeader(hdr, len, nChannel, type);
+
+	std::string sFrame((const char *)hdr, MUX_HDR_LEN);
+	sFrame.append(data, len);
+	return sFrame;
+}
+
+static inline std::string JetsonMuxCreditFrame(unsigned int nChannel, unsigned int nCredit)
+{
+	unsigned char grant[4];
+	grant[0] = (unsigned char)(nCredit >> 24);
+	grant[1] = (unsigned char)(nCredit >> 16);
+	grant[2] = (unsigned char)(nCredit >> 8);
+	grant[3] = (unsigned char)nCredit;
+	return JetsonMuxFrame(nChannel, MUX_FRAME_CREDIT, (const char *)grant, 4);
+}
+
+static inline unsigned int JetsonMuxCreditValue(const char *payload, unsigned int len)
+{
+	const unsigned char *p = (const unsigned char *)payload;
+	if (len < 4)
+		return 0;
+	return ((unsigned int)p[0] << 24) | ((unsigned int)p[1] << 16) | ((unsigned int)p[2] << 8) | p[3];
+}
+
+//Length of the complete frame at the start of data, 0 if more bytes are needed,
+//-1 if the header is invalid
+static inline int JetsonMuxFrameLen(const char *data, unsigned int avail)
+{
+	if (avail < MUX_HDR_LEN)
+		return 0;
+
+	unsigned int len, nChannel;
+	int type;
+	JetsonMuxGetHeader((const unsigned char *)data, &len, &nChannel, &type);
+	if (len > MUX_MAX_PAYLOAD || nChannel == 0 || type < MUX_FRAME_OPEN || type > MUX_FRAME_CLOSE)
+		return -1;
+	return (avail >= MUX_HDR_LEN + len ? (int)(MUX_HDR_LEN + len) : 0);
+}
+
+#endif	//_JET_MUXFRAME_H
@@ -39,19 +39,37 @@
  *
  ****************************************************************************/
 
+#include <algorithm>
+#include <cctype>
+#include <climits>
+#include <map>
 #include "../common/common.h"
+#include "muxclient.h"
 
 using namespace std;
 
+#define STR_JREHDR_SIZE 16
+#define STR_OSARCH_SIZE 16
+#define STR_IPADDR_SIZE 32
+#define STR_TCPPORT_SIZE 16
+
 static int gbClientExiting = 0;
 static int gbScanNeeded = 0;
 static int gbQueryNeeded = 0;
 
-static char gsScanBuffer[RSP_BUFSIZE];
+static string gsScanReply;		//whole scan answer, any number of engines
 static char gsQueryBuffer[QUERY_BUFSIZE];
 
 static SOCKET gServSock;
 
+//mux mode: gServSock carries frames, the session is channel 1
+#define MUX_CLIENT_CHANNEL 1
+static int gbMux = 0;
+static std::string gsMuxSuffix;		//appended to the engine files scan creates
+static pthread_mutex_t gMuxLock = PTHREAD_MUTEX_INITIALIZER;	//credit and frame writes
+static pthread_cond_t gMuxCreditCond = PTHREAD_COND_INITIALIZER;
+static long gnMuxSendCredit = MUX_WINDOW;
+
 #if defined(_WIN32)
 static char *gsJetsonScanFile = (char *)"jetson_scan.exe";
 #else
@@ -59,15 +77,131 @@ static char *gsJetsonScanFile = (char *)"jetson_scan";
 #endif
 
 char gsMyHostName[MAX_NAME_LEN] = "UNKNOWN_HOST";
-pthread_mutex_t gLogFileLock;
+struct JetsonLogger gLogger;
 char gsLogFile[MAX_NAME_LEN] = "JetsonErr_";
 
+//one piece of agent output, returns 1 once the scan/query reply is complete
+static int ClientOnAgentData(const char *sSockReadBuf)
+{
+	if (gbScanNeeded) {
+		size_t nSearchFrom = (gsScanReply.length() > 10 ? gsScanReply.length() - 10 : 0);
+		gsScanReply += sSockReadBuf;
+
+		if (gsScanReply.find("scanisdone", nSearchFrom) != string::npos)
+			return 1;
+	}
+	else if (gbQueryNeeded) {
+		cout << sSockReadBuf;
+		JetsonWriteLogs("%s", sSockReadBuf);
+		if (strstr(sSockReadBuf, "querydone") || strstr(sSockReadBuf, "statsdone")) {
+			gbClientExiting = 1;
+			return 1;
+		}
+	}
+	else
+		cout << sSockReadBuf;//uci response data to ChessBase
+	return 0;
+}
+
+//engine names of a scan answer, up to its "scanisdone"
+static void ClientScanLines(const string &sReply, vector<string> &names)
+{
+	size_t pos = 0;
+	while (pos < sReply.length()) {
+		size_t eol = sReply.find('\n', pos);
+		string sLine = sReply.substr(pos, (eol == string::npos ? string::npos : eol - pos));
+		pos = (eol == string::npos ? sReply.length() : eol + 1);
+
+		if (!sLine.empty() && sLine[sLine.length()-1] == '\r')
+			sLine.erase(sLine.length()-1);
+		if (sLine.find("scanisdone") != string::npos)
+			break;
+		if (!sLine.empty())
+			names.push_back(sLine);
+	}
+}
+
+//names come from whatever host answered the scan: only a plain JRE_ file name of
+//letters, digits, '.', '_' and '-' is written, nothing that could leave the folder
+static int ClientIsEngineFileName(const string &sName)
+{
+	if (sName.length() <= 4 || sName.length() >= MAX_NAME_LEN || sName.compare(0, 4, "JRE_") != 0)
+		return 0;
+	if (sName.find("..") != string::npos)
+		return 0;
+	for (size_t i=0; i<sName.length(); i++) {
+		char c = sName[i];
+		if (!isalnum((unsigned char)c) && c != '.' && c != '_' && c != '-')
+			return 0;
+	}
+	return 1;
+}
+
+//one copy of this executable per engine name, all written from one read of it
+static void ClientCreateEngineFiles(const char *sBaseFile, const vector<string> &names)
+{
+	char cCurrentPath[FILENAME_MAX];
+
+	if (!GetCurrDir(cCurrentPath, sizeof(cCurrentPath)))
+		throw runtime_error("unable to get current path\n");
+
+	cCurrentPath[sizeof(cCurrentPath) - 1] = '\0'; /* not really required */
+
+#if defined(_WIN32)
+	string sBasePath = string(cCurrentPath) + "\\" + sBaseFile;
+#else
+	string sBasePath = string(cCurrentPath) + "/" + sBaseFile;
+#endif
+	ifstream base(sBasePath, ios::binary);
+	ostringstream ossImage;
+	ossImage << base.rdbuf();
+	string sImage = ossImage.str();
+	if (!base || sImage.empty()) {
+		cout << "ERROR: unable to read " << sBasePath << endl;
+		JetsonErrorLogs("ERROR: unable to read %s\n", sBasePath.c_str());
+		return;
+	}
+
+	int nCreated = 0;
+	for (size_t i=0; i<names.size(); i++) {
+		if (!ClientIsEngineFileName(names[i])) {
+			cout << "WARNING: engine file name " << names[i] << " ignored" << endl;
+			JetsonErrorLogs("WARNING: engine file name %s ignored\n", names[i].c_str());
+			continue;
+		}
+		cout << names[i] << endl;
+		JetsonWriteLogs("%s\n", names[i].c_str());
+
+		ostringstream ossNewFile;
+#if defined(_WIN32)
+		ossNewFile << cCurrentPath << "\\" << names[i] << ".exe";
+#else
+		ossNewFile << cCurrentPath << "/" << names[i];
+#endif
+
+		ofstream ifs (ossNewFile.str(), ios::binary | ios::trunc);
+		if (!ifs.is_open()) {
+			cout << "ERROR: file " << ossNewFile.str() << " is open" << endl;
+			JetsonErrorLogs("ERROR: file %s is open\n", ossNewFile.str().c_str());
+			continue;
+		}
+		ifs.write(sImage.data(), sImage.length());
+		ifs.close();
+#if !defined(_WIN32)
+		chmod(ossNewFile.str().c_str(), 0755);
+#endif
+		nCreated++;
+	}
+	cout << nCreated << " engine files created in " << cCurrentPath << endl;
+	JetsonWriteLogs("%d engine files created in %s\n", nCreated, cCurrentPath);
+}
+
 static void *ClientReciverThread(void *data)
 {
 	JetsonWriteLogs(">>> Entered receiver thread\n");
 	
 	if (gbScanNeeded)
-		memset(gsScanBuffer, 0, RSP_BUFSIZE);
+		gsScanReply.clear();
 		
 	if (gbQueryNeeded)
 		memset(gsQueryBuffer, 0, QUERY_BUFSIZE);
@@ -88,105 +222,966 @@ static void *ClientReciverThread(void *data)
 				break;
 
 			if (select(gServSock+1, &reads, 0, 0, &timeout) < 0) {
-				JetsonWriteLogs("select() failed. (%d)\n", GetSockErrno());
+				JetsonErrorLogs("select() failed. (%d)\n", GetSockErrno());
 				throw runtime_error("select() failed\n");
 			}
 
 			if (FD_ISSET(gServSock, &reads)) {
 				char sSockReadBuf[RSP_BUFSIZE];
 				memset(sSockReadBuf, 0, RSP_BUFSIZE);
-				int bytes_received = recv(gServSock, sSockReadBuf, RSP_BUFSIZE, 0);
+				int bytes_received = recv(gServSock, sSockReadBuf, RSP_BUFSIZE - 1, 0);
 				if (bytes_received < 1) {
 					gbClientExiting = 1;
 					break;
 				}
 
-				std::string line = sSockReadBuf;
-			
-				if (gbScanNeeded) {
-				   	strncat(gsScanBuffer, sSockReadBuf, RSP_BUFSIZE);
+				if (ClientOnAgentData(sSockReadBuf))
+					break;
+			}
+		}//while()
+
+		if (gbScanNeeded) {
+			vector<string> names;
+			ClientScanLines(gsScanReply, names);
+			for (size_t i=0; i<names.size(); i++)
+				names[i] += gsMuxSuffix;
+			ClientCreateEngineFiles((char *)data, names);
+			gbClientExiting = 1;
+		}
+	} catch (exception& e) {		
+		JetsonErrorLogs("<<< ERROR: %s", e.what());
+	}
+	
+	JetsonWriteLogs("<<< Exited receiver thread\n");
+	
+	return NULL;
+}
+
+//frames on channel 1 go to the same handling as legacy recv() data; credit for
+//what reached the GUI goes back in batches, credit the agent grants wakes the sender
+static void *ClientMuxReceiverThread(void *data)
+{
+	JetsonWriteLogs(">>> Entered mux receiver thread\n");
 
-					if (strstr(line.c_str(), "scanisdone"))
-				   		break;
+	if (gbScanNeeded)
+		gsScanReply.clear();
+
+	try {
+		unsigned int nConsumed = 0;
+		unsigned int nChannel;
+		int type;
+		std::string payload;
+		while (!gbClientExiting && JetsonMuxReadFrame(gServSock, &nChannel, &type, payload)) {
+			if (nChannel != MUX_CLIENT_CHANNEL)
+				continue;
+
+			if (type == MUX_FRAME_DATA) {
+				int bDone = 0;
+				for (size_t off=0; off<payload.length() && !bDone; off+=RSP_BUFSIZE-1) {
+					char sSockReadBuf[RSP_BUFSIZE];
+					size_t len = min(payload.length() - off, (size_t)RSP_BUFSIZE - 1);
+					memcpy(sSockReadBuf, payload.data() + off, len);
+					sSockReadBuf[len] = '\0';
+					bDone = ClientOnAgentData(sSockReadBuf);
 				}
-				else if (gbQueryNeeded) {
-					cout << sSockReadBuf;
-					JetsonWriteLogs("%s", sSockReadBuf);
-					if (strstr(line.c_str(), "querydone")) {
-						gbClientExiting = 1;
-						break;
-					}
+				if (bDone)
+					break;
+
+				nConsumed += payload.length();
+				if (nConsumed >= MUX_CREDIT_BATCH) {
+					pthread_mutex_lock(&gMuxLock);
+					std::string sFrame = JetsonMuxCreditFrame(MUX_CLIENT_CHANNEL, nConsumed);
+					JetsonSendAll(gServSock, sFrame.data(), sFrame.length());
+					pthread_mutex_unlock(&gMuxLock);
+					nConsumed = 0;
 				}
-				else
-		   			cout << sSockReadBuf;//uci response data to ChessBase
 			}
-		}//while()
+			else if (type == MUX_FRAME_CREDIT) {
+				pthread_mutex_lock(&gMuxLock);
+				gnMuxSendCredit += JetsonMuxCreditValue(payload.data(), payload.length());
+				pthread_cond_broadcast(&gMuxCreditCond);
+				pthread_mutex_unlock(&gMuxLock);
+			}
+			else if (type == MUX_FRAME_OPENED)
+				JetsonWriteLogs("mux channel opened\n");
+			else if (type == MUX_FRAME_CLOSE) {
+				JetsonWriteLogs("mux channel closed by agent: %s\n", payload.c_str());
+				break;
+			}
+		}
 
 		if (gbScanNeeded) {
-			char *sBaseFile = (char *)data;
-			char cCurrentPath[FILENAME_MAX];
+			vector<string> names;
+			ClientScanLines(gsScanReply, names);
+			for (size_t i=0; i<names.size(); i++)
+				names[i] += gsMuxSuffix;
+			ClientCreateEngineFiles((char *)data, names);
+		}
+	} catch (exception& e) {
+		JetsonErrorLogs("<<< ERROR: %s", e.what());
+	}
+
+	pthread_mutex_lock(&gMuxLock);
+	gbClientExiting = 1;
+	pthread_cond_broadcast(&gMuxCreditCond);
+	pthread_mutex_unlock(&gMuxLock);
+
+	JetsonWriteLogs("<<< Exited mux receiver thread\n");
+	return NULL;
+}
 
-			if (!GetCurrDir(cCurrentPath, sizeof(cCurrentPath)))
-				throw runtime_error("unable to get current path\n");
+//----- equivalent agents for this engine: the one in the file name, then those
+//listed in "<engine file>.backends", one "<ip> [engine port] [mgmt port]" per line.
+//Each is asked for its load at start and the session goes to the least loaded
+#define CLIENT_LOAD_TIMEOUT_MSEC 1000	//agents that haven't answered by then are tried last
+#define CLIENT_LOAD_FULL 1000			//added when a login there would wait in the queue
 
-			cCurrentPath[sizeof(cCurrentPath) - 1] = '\0'; /* not really required */
+struct Backend {
+	string sIp;
+	string sPort;
+	string sMgmtPort;
+	int nLoad;			//from the "load" reply, -1 if there was none
+};
 
-			char * line = strtok(strdup(gsScanBuffer), "\n");
-			while(line) {
-				cout << line << endl;
-				JetsonWriteLogs("%s\n", line);
-   			
-				if (strstr(line, "scanisdone"))
-					break;
-				else {
-					ostringstream ossNewFile;
+static vector<struct Backend> gBackends;
+static size_t gnBackend = 0;		//the one gServSock is connected to
+static string gsEngName;
+
+static void ClientLoadBackends(const char *sExePath, const char *sServIp, const char *sServPort)
+{
+	struct Backend first = { sServIp, sServPort, STR_MGMT_PORT, -1 };
+	gBackends.push_back(first);
+
+	string sListFile = string(sExePath) + ".backends";
+	FILE *fp = fopen(sListFile.c_str(), "r");
+	if (fp == NULL)
+		return;
+
+	char sLine[MAX_NAME_LEN];
+	while (fgets(sLine, sizeof(sLine), fp) != NULL) {
+		char sIp[MAX_NAME_LEN], sPort[MAX_NAME_LEN], sMgmtPort[MAX_NAME_LEN];
+		int n = sscanf(sLine, "%255s %255s %255s", sIp, sPort, sMgmtPort);
+		if (n < 1 || sIp[0] == '#')
+			continue;
+
+		struct Backend b = { sIp, (n >= 2 ? sPort : sServPort), (n >= 3 ? sMgmtPort : STR_MGMT_PORT), -1 };
+		int bKnown = 0;
+		for (size_t i=0; i<gBackends.size(); i++)
+			bKnown |= (gBackends[i].sIp == b.sIp && gBackends[i].sPort == b.sPort);
+		if (!bKnown)
+			gBackends.push_back(b);
+	}
+	fclose(fp);
+	JetsonWriteLogs("%d backends listed in %s\n", (int)gBackends.size(), sListFile.c_str());
+}
+
+static int ClientParseLoad(const string &sReply)
+{
+	char sName[MAX_NAME_LEN];
+	int nSessions, nInstances, nMax, nWaiting, nNodeInstances, nNodeMax;
+	if (sscanf(sReply.c_str(), LOAD_CMD "%255s %d %d %d %d %d %d", sName, &nSessions, &nInstances,
+			&nMax, &nWaiting, &nNodeInstances, &nNodeMax) != 7)
+		return -1;
+
+	int nLoad = nSessions + nWaiting;
+	if ((nMax > 0 && nInstances >= nMax) || (nNodeMax > 0 && nNodeInstances >= nNodeMax))
+		nLoad += CLIENT_LOAD_FULL;
+	return nLoad;
+}
+
+static void ClientSetBlocking(SOCKET sock, int bBlocking)
+{
 #if defined(_WIN32)
-					ossNewFile << cCurrentPath << "\\" << line << ".exe";
+	u_long mode = !bBlocking;
+	ioctlsocket(sock, FIONBIO, &mode);
 #else
-					ossNewFile << cCurrentPath << "/" << line;
+	int flags = fcntl(sock, F_GETFL, 0);
+	fcntl(sock, F_SETFL, (bBlocking ? flags & ~O_NONBLOCK : flags | O_NONBLOCK));
 #endif
+}
 
-					ofstream ifs (ossNewFile.str());
-					if (!ifs.is_open()) {
-						cout << "ERROR: file " << ossNewFile.str() << " is open" << endl;
-						JetsonWriteLogs("ERROR: file %s is open\n", ossNewFile.str().c_str());
-					}
-					else
-					{
-						ifs.close();
-						ostringstream ossCmdline;
-
-#if defined(_WIN32)						
-						ossCmdline << "copy " << cCurrentPath << "\\" << sBaseFile << " " << cCurrentPath << "\\" << line << ".exe";
+//connect in progress, or already done, on a non-blocking socket; invalid if it failed at once
+static SOCKET ClientStartConnect(const char *sIp, const char *sPort)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_family = AF_INET;
+	hints.ai_socktype = SOCK_STREAM;
+	struct addrinfo *pPeerAddr;
+	if (getaddrinfo(sIp, sPort, &hints, &pPeerAddr))
+		return (SOCKET)-1;
+
+	SOCKET sock = socket(pPeerAddr->ai_family, pPeerAddr->ai_socktype, pPeerAddr->ai_protocol);
+	if (IsSockValid(sock)) {
+		ClientSetBlocking(sock, 0);
+		int rc = connect(sock, pPeerAddr->ai_addr, pPeerAddr->ai_addrlen);
+#if defined(_WIN32)
+		int bPending = (rc != 0 && GetSockErrno() == WSAEWOULDBLOCK);
 #else
-						ossCmdline << "cp " << cCurrentPath << "/" << sBaseFile << " " << cCurrentPath << "/" << line;
-						ossCmdline << "; " << "chmod a+x " << cCurrentPath << "/" << line;
+		int bPending = (rc != 0 && GetSockErrno() == EINPROGRESS);
 #endif
-						JetsonWriteLogs("exec cmd is(%s)\n", ossCmdline.str().c_str());
-						cout << "exec cmd is(" << ossCmdline.str() << ")" << endl;
-						system(ossCmdline.str().c_str());
-						SleepMsec(100);
-					}
-   				}
-				
-				line  = strtok(NULL, "\n");
+		if (rc != 0 && !bPending) {
+			CloseSocket(sock);
+			sock = (SOCKET)-1;
+		}
+	}
+	freeaddrinfo(pPeerAddr);
+	return sock;
+}
+
+//writable after ClientStartConnect: did the connect succeed
+static int ClientConnectDone(SOCKET sock)
+{
+	int err = 0;
+	socklen_t errLen = sizeof(err);
+	getsockopt(sock, SOL_SOCKET, SO_ERROR, (char *)&err, &errLen);
+	return (err == 0);
+}
+
+//all agents are asked at once, a node that is down costs the timeout only once
+static void ClientQueryLoads()
+{
+	size_t n = gBackends.size();
+	vector<SOCKET> socks(n, (SOCKET)-1);
+	vector<int> bSent(n, 0);
+	vector<string> replies(n);
+	string sCmd = string(LOAD_CMD) + gsEngName + "\n";
+
+	for (size_t i=0; i<n; i++) {
+		gBackends[i].nLoad = -1;
+		socks[i] = ClientStartConnect(gBackends[i].sIp.c_str(), gBackends[i].sMgmtPort.c_str());
+	}
+
+	long long nDeadline = GetMonotonicUsec() + CLIENT_LOAD_TIMEOUT_MSEC * 1000LL;
+	long long nLeft;
+	while ((nLeft = nDeadline - GetMonotonicUsec()) > 0) {
+		fd_set reads, writes;
+		FD_ZERO(&reads);
+		FD_ZERO(&writes);
+		SOCKET maxSock = 0;
+		for (size_t i=0; i<n; i++) {
+			if (!IsSockValid(socks[i]))
+				continue;
+			FD_SET(socks[i], (bSent[i] ? &reads : &writes));
+			if (socks[i] > maxSock)
+				maxSock = socks[i];
+		}
+		if (maxSock == 0)
+			break;
+
+		struct timeval timeout;
+		timeout.tv_sec = nLeft / 1000000;
+		timeout.tv_usec = nLeft % 1000000;
+		if (select(maxSock+1, &reads, &writes, 0, &timeout) <= 0)
+			break;
+
+		for (size_t i=0; i<n; i++) {
+			if (!IsSockValid(socks[i]))
+				continue;
+
+			int bDone = 0;
+			if (FD_ISSET(socks[i], &writes)) {
+				bDone = (!ClientConnectDone(socks[i]) || send(socks[i], sCmd.c_str(), sCmd.length(), 0) != (int)sCmd.length());
+				bSent[i] = 1;
+			}
+			else if (FD_ISSET(socks[i], &reads)) {
+				char buf[MAX_NAME_LEN];
+				int bytes = recv(socks[i], buf, sizeof(buf), 0);
+				if (bytes > 0)
+					replies[i].append(buf, bytes);
+				if (bytes < 1 || replies[i].find('\n') != string::npos) {
+					gBackends[i].nLoad = ClientParseLoad(replies[i]);
+					bDone = 1;
+				}
+			}
+			if (bDone) {
+				CloseSocket(socks[i]);
+				socks[i] = (SOCKET)-1;
 			}
-		
-			gbClientExiting = 1;
 		}
-	} catch (exception& e) {		
-		JetsonWriteLogs("<<< ERROR: %s", e.what());
 	}
-	
-	JetsonWriteLogs("<<< Exited receiver thread\n");
-	
-	return NULL;
+
+	for (size_t i=0; i<n; i++) {
+		if (IsSockValid(socks[i]))
+			CloseSocket(socks[i]);
+		JetsonWriteLogs("backend %s:%s load %d\n", gBackends[i].sIp.c_str(), gBackends[i].sPort.c_str(), gBackends[i].nLoad);
+	}
 }
 
-#define STR_JREHDR_SIZE 16
-#define STR_OSARCH_SIZE 16
-#define STR_IPADDR_SIZE 32
-#define STR_TCPPORT_SIZE 16
+//least loaded first, those that didn't answer last, listed order otherwise
+static void ClientRankBackends()
+{
+	ClientQueryLoads();
+	stable_sort(gBackends.begin(), gBackends.end(), [](const struct Backend &a, const struct Backend &b) {
+		return (a.nLoad < 0 ? INT_MAX : a.nLoad) < (b.nLoad < 0 ? INT_MAX : b.nLoad);
+	});
+}
+
+//engine port of the first backend in order that accepts, skipping sSkipIp:sSkipPort
+static SOCKET ClientConnectBackend(const string &sSkipIp, const string &sSkipPort)
+{
+	for (size_t i=0; i<gBackends.size(); i++) {
+		if (gBackends[i].sIp == sSkipIp && gBackends[i].sPort == sSkipPort)
+			continue;
+
+		SOCKET sock = JetsonTcpConnect(gBackends[i].sIp.c_str(), gBackends[i].sPort.c_str());
+		if (IsSockValid(sock)) {
+			gnBackend = i;
+			JetsonWriteLogs("connected to backend %s:%s\n", gBackends[i].sIp.c_str(), gBackends[i].sPort.c_str());
+			return sock;
+		}
+	}
+	return (SOCKET)-1;
+}
+
+//----- jetson_scan discover: every address of a subnet, or every agent answering a
+//broadcast, is scanned with many connects in flight; the engines found are merged
+//into one list and their files written in one go
+#define CLIENT_DISCOVER_INFLIGHT 200		//connects and scans at a time, FD_SETSIZE permitting
+#define CLIENT_DISCOVER_CONNECT_MSEC 500	//an address that hasn't accepted by then runs no agent
+#define CLIENT_DISCOVER_REPLY_MSEC 10000	//an agent that hasn't finished its scan answer by then
+#define CLIENT_DISCOVER_UDP_MSEC 1000		//broadcast answers are collected this long
+#define CLIENT_DISCOVER_MIN_PREFIX 16
+
+struct DiscoverProbe {
+	string sIp;
+	string sPort;
+	SOCKET sock;
+	int bSent;			//connected, "scan" sent
+	int bDone;			//whole scan answer received
+	long long nDeadline;
+	string sReply;
+};
+
+//"a.b.c.d/nn" or a single address; network and broadcast addresses are left out
+static int ClientExpandCidr(const char *sCidr, const char *sMgmtPort, vector<struct DiscoverProbe> &probes)
+{
+	unsigned int a, b, c, d, nPrefix = 32;
+	int n = sscanf(sCidr, "%u.%u.%u.%u/%u", &a, &b, &c, &d, &nPrefix);
+	if (n < 4 || a > 255 || b > 255 || c > 255 || d > 255 || nPrefix > 32 || nPrefix < CLIENT_DISCOVER_MIN_PREFIX)
+		return 0;
+
+	unsigned int nMask = (0xffffffffu << (32 - nPrefix)) & 0xffffffffu;
+	if (nPrefix == 32)
+		nMask = 0xffffffffu;
+	unsigned int nFirst = ((a << 24) | (b << 16) | (c << 8) | d) & nMask;
+	unsigned int nLast = nFirst | ~nMask;
+	if (nPrefix < 31) {
+		nFirst++;
+		nLast--;
+	}
+
+	for (unsigned int nAddr=nFirst; ; nAddr++) {
+		char sIp[STR_IPADDR_SIZE];
+		snprintf(sIp, sizeof(sIp), "%u.%u.%u.%u", nAddr >> 24, (nAddr >> 16) & 0xff, (nAddr >> 8) & 0xff, nAddr & 0xff);
+		struct DiscoverProbe probe = { sIp, sMgmtPort, (SOCKET)-1, 0, 0, 0, "" };
+		probes.push_back(probe);
+		if (nAddr == nLast)
+			break;
+	}
+	return 1;
+}
+
+//agents answer DISCOVER_PROBE on their management port number with that port
+static void ClientBroadcastProbe(const char *sMgmtPort, vector<struct DiscoverProbe> &probes)
+{
+	SOCKET sock = socket(AF_INET, SOCK_DGRAM, 0);
+	if (!IsSockValid(sock)) {
+		JetsonErrorLogs("discovery socket() failed. (%d)\n", GetSockErrno());
+		return;
+	}
+	int on = 1;
+	setsockopt(sock, SOL_SOCKET, SO_BROADCAST, (const char *)&on, sizeof(on));
+
+	struct sockaddr_in to;
+	memset(&to, 0, sizeof(to));
+	to.sin_family = AF_INET;
+	to.sin_addr.s_addr = htonl(INADDR_BROADCAST);
+	to.sin_port = htons(atoi(sMgmtPort));
+
+	//sent again halfway, a lost datagram shouldn't lose an agent
+	long long nStart = GetMonotonicUsec();
+	long long nResend = nStart;
+	long long nLeft;
+	while ((nLeft = nStart + CLIENT_DISCOVER_UDP_MSEC * 1000LL - GetMonotonicUsec()) > 0) {
+		if (GetMonotonicUsec() >= nResend) {
+			if (sendto(sock, DISCOVER_PROBE, strlen(DISCOVER_PROBE), 0, (struct sockaddr *)&to, sizeof(to)) < 0)
+				JetsonErrorLogs("discovery broadcast failed. (%d)\n", GetSockErrno());
+			nResend = (nResend == nStart ? nStart + CLIENT_DISCOVER_UDP_MSEC * 500LL : LLONG_MAX);
+		}
+
+		fd_set reads;
+		FD_ZERO(&reads);
+		FD_SET(sock, &reads);
+		long long nWait = min(nLeft, (nResend == LLONG_MAX ? nLeft : nResend - GetMonotonicUsec()));
+		struct timeval timeout;
+		timeout.tv_sec = (nWait > 0 ? nWait : 0) / 1000000;
+		timeout.tv_usec = (nWait > 0 ? nWait : 0) % 1000000;
+		if (select(sock+1, &reads, 0, 0, &timeout) <= 0)
+			continue;
+
+		char buf[MAX_NAME_LEN];
+		struct sockaddr_in from;
+		socklen_t fromLen = sizeof(from);
+		int bytes = recvfrom(sock, buf, sizeof(buf) - 1, 0, (struct sockaddr *)&from, &fromLen);
+		if (bytes <= (int)strlen(DISCOVER_REPLY) || strncmp(buf, DISCOVER_REPLY, strlen(DISCOVER_REPLY)) != 0)
+			continue;
+		buf[bytes] = '\0';
+
+		char sPort[STR_TCPPORT_SIZE];
+		if (sscanf(buf + strlen(DISCOVER_REPLY), "%15s", sPort) != 1)
+			continue;
+		struct DiscoverProbe probe = { inet_ntoa(from.sin_addr), sPort, (SOCKET)-1, 0, 0, 0, "" };
+		int bKnown = 0;
+		for (size_t i=0; i<probes.size(); i++)
+			bKnown |= (probes[i].sIp == probe.sIp && probes[i].sPort == probe.sPort);
+		if (!bKnown)
+			probes.push_back(probe);
+	}
+	CloseSocket(sock);
+}
+
+//connect, send "scan", read the answer to its end; at most CLIENT_DISCOVER_INFLIGHT
+//probes are open at any time and each has a deadline for its current step
+static void ClientScanProbes(vector<struct DiscoverProbe> &probes)
+{
+	size_t nMaxInFlight = min((size_t)CLIENT_DISCOVER_INFLIGHT, (size_t)FD_SETSIZE - 8);
+	size_t nNext = 0;
+	vector<size_t> active;
+
+	while (nNext < probes.size() || !active.empty()) {
+		while (active.size() < nMaxInFlight && nNext < probes.size()) {
+			struct DiscoverProbe &probe = probes[nNext];
+			probe.sock = ClientStartConnect(probe.sIp.c_str(), probe.sPort.c_str());
+			probe.nDeadline = GetMonotonicUsec() + CLIENT_DISCOVER_CONNECT_MSEC * 1000LL;
+			if (IsSockValid(probe.sock))
+				active.push_back(nNext);
+			nNext++;
+		}
+		if (active.empty())
+			break;
+
+		fd_set reads, writes;
+		FD_ZERO(&reads);
+		FD_ZERO(&writes);
+		SOCKET maxSock = 0;
+		long long nNow = GetMonotonicUsec();
+		long long nWait = CLIENT_DISCOVER_CONNECT_MSEC * 1000LL;
+		for (size_t i=0; i<active.size(); i++) {
+			struct DiscoverProbe &probe = probes[active[i]];
+			FD_SET(probe.sock, (probe.bSent ? &reads : &writes));
+			if (probe.sock > maxSock)
+				maxSock = probe.sock;
+			nWait = min(nWait, max(probe.nDeadline - nNow, 0LL));
+		}
+
+		struct timeval timeout;
+		timeout.tv_sec = nWait / 1000000;
+		timeout.tv_usec = nWait % 1000000;
+		if (select(maxSock+1, &reads, &writes, 0, &timeout) < 0) {
+			JetsonErrorLogs("select() failed. (%d)\n", GetSockErrno());
+			break;
+		}
+
+		nNow = GetMonotonicUsec();
+		size_t nKept = 0;
+		for (size_t i=0; i<active.size(); i++) {
+			struct DiscoverProbe &probe = probes[active[i]];
+			int bClose = 0;
+			if (!probe.bSent && FD_ISSET(probe.sock, &writes)) {
+				bClose = (!ClientConnectDone(probe.sock) || send(probe.sock, "scan", 4, 0) != 4);
+				probe.bSent = 1;
+				probe.nDeadline = nNow + CLIENT_DISCOVER_REPLY_MSEC * 1000LL;
+			}
+			else if (probe.bSent && FD_ISSET(probe.sock, &reads)) {
+				char buf[RSP_BUFSIZE];
+				int bytes = recv(probe.sock, buf, sizeof(buf), 0);
+				if (bytes > 0) {
+					size_t nSearchFrom = (probe.sReply.length() > 10 ? probe.sReply.length() - 10 : 0);
+					probe.sReply.append(buf, bytes);
+					probe.bDone = (probe.sReply.find("scanisdone", nSearchFrom) != string::npos);
+				}
+				bClose = (bytes < 1 || probe.bDone);
+			}
+			else
+				bClose = (nNow >= probe.nDeadline);
+
+			if (bClose) {
+				if (probe.bSent && !probe.bDone)
+					JetsonErrorLogs("agent %s:%s gave no complete scan answer\n", probe.sIp.c_str(), probe.sPort.c_str());
+				CloseSocket(probe.sock);
+				probe.sock = (SOCKET)-1;
+			}
+			else
+				active[nKept++] = active[i];
+		}
+		active.resize(nKept);
+	}
+}
+
+static int ClientDiscover(const char *sTarget, const char *sMgmtPort, const char *sBaseFile)
+{
+	vector<struct DiscoverProbe> probes;
+	if (strcmp(sTarget, "broadcast") == 0) {
+		ClientBroadcastProbe(sMgmtPort, probes);
+		printf("%d agents answered the broadcast on port %s\n", (int)probes.size(), sMgmtPort);
+	}
+	else if (ClientExpandCidr(sTarget, sMgmtPort, probes))
+		printf("probing %d addresses on port %s\n", (int)probes.size(), sMgmtPort);
+	else {
+		printf("Invalid address range %s, expected a.b.c.d/nn with nn >= %d or broadcast\n", sTarget, CLIENT_DISCOVER_MIN_PREFIX);
+		return 1;
+	}
+
+	long long nStart = GetMonotonicUsec();
+	ClientScanProbes(probes);
+
+	//the same engine file from two answers is created once
+	map<string, string> inventory;
+	int nAgents = 0;
+	for (size_t i=0; i<probes.size(); i++) {
+		if (!probes[i].bDone)
+			continue;
+
+		vector<string> names;
+		ClientScanLines(probes[i].sReply, names);
+		printf("agent %s:%s: %d engines\n", probes[i].sIp.c_str(), probes[i].sPort.c_str(), (int)names.size());
+		JetsonWriteLogs("agent %s:%s: %d engines\n", probes[i].sIp.c_str(), probes[i].sPort.c_str(), (int)names.size());
+		for (size_t j=0; j<names.size(); j++)
+			inventory[names[j] + (gbMux ? "_MUX" + probes[i].sPort : string())] = probes[i].sIp;
+		nAgents++;
+	}
+	printf("%d agents, %d engines found in %.1f s\n", nAgents, (int)inventory.size(), (GetMonotonicUsec() - nStart) / 1e6);
+
+	vector<string> names;
+	for (auto it=inventory.begin(); it!=inventory.end(); ++it)
+		names.push_back(it->first);
+	if (!names.empty())
+		ClientCreateEngineFiles(sBaseFile, names);
+	return 0;
+}
+
+#if !defined(_WIN32)
+#define CLIENT_QUIT_DRAIN_MSEC 500	//agent output still accepted after quit
+#define CLIENT_RESEND_BYTES 65536	//commands kept to be sent again after a resume
+#define CLIENT_RESUME_RETRY_MSEC 500
+#define CLIENT_RESUME_REPLY_MSEC 2000
+
+//session resume, see RESUME_REQUEST: set once the agent sent the token line
+static unsigned long long gnResumeToken = 0;
+static int gnResumeSec = 0;
+static char gsResumeMgmtPort[16];
+static long long gnAgentBytesSeen = 0;	//agent stream bytes after the token line
+static long long gnBytesToAgent = 0;	//command bytes sent after the token request
+static string gsSentTail;				//last CLIENT_RESEND_BYTES of them
+static int gbTokenPending = 0;			//request sent, token line not seen yet
+
+//failover to another backend: what a fresh engine needs to be where this one was
+static vector<string> gSetOptions;		//latest line per option, in the order first sent
+static string gsPositionLine;
+static string gsGoLine;
+static int gbSearching = 0;			//go sent, bestmove not seen yet
+static int gbStopSent = 0;
+static int gbUciPending = 0;
+static int gnReadyPending = 0;
+static int gbSwallowUci = 0;		//replayed uci: the GUI has seen that answer already
+static char gsAgentHead[8];			//start of the agent output line being received
+static int gnAgentHeadLen = 0;
+
+//position delta, see POSITION_DELTA_REQUEST: once the agent agreed, GUI commands are
+//passed on line by line and a position that only adds moves goes out as those moves
+static int gbDeltaPending = 0;			//request sent, answer not seen yet
+static int gbDeltaOn = 0;				//agent takes POSITION_DELTA_CMD
+static int gbWholeLines = 0;			//stdin is forwarded per complete line
+static string gsDeltaBase;				//last position sent, normalized
+static int gnDeltaBaseMoves = 0;
+
+static void ClientWriteAll(int fd, const char *data, int len)
+{
+	while (len > 0) {
+		ssize_t bytes = write(fd, data, len);
+		if (bytes < 0 && errno == EINTR)
+			continue;
+		if (bytes <= 0)
+			throw runtime_error("write to GUI failed\n");
+		data += bytes;
+		len -= bytes;
+	}
+}
+
+//replies the GUI gets, looked at only when there is a backend to fail over to
+static void ClientTrackAgentOutput(const char *data, int len)
+{
+	for (int i=0; i<len; i++) {
+		if (data[i] != '\n') {
+			if (gnAgentHeadLen < (int)sizeof(gsAgentHead))
+				gsAgentHead[gnAgentHeadLen++] = data[i];
+			continue;
+		}
+
+		if (gnAgentHeadLen >= 8 && strncmp(gsAgentHead, "bestmove", 8) == 0)
+			gbSearching = gbStopSent = 0;
+		else if (gnAgentHeadLen >= 7 && strncmp(gsAgentHead, "readyok", 7) == 0)
+			gnReadyPending -= (gnReadyPending > 0);
+		else if (gnAgentHeadLen >= 5 && strncmp(gsAgentHead, "uciok", 5) == 0)
+			gbUciPending = 0;
+		gnAgentHeadLen = 0;
+	}
+}
+
+static void ClientTrackCommand(const string &sLine)
+{
+	if (sLine == "uci")
+		gbUciPending = 1;
+	else if (sLine == "isready")
+		gnReadyPending++;
+	else if (sLine.compare(0, 9, "position ") == 0)
+		gsPositionLine = sLine;
+	else if (sLine == "go" || sLine.compare(0, 3, "go ") == 0) {
+		gsGoLine = sLine;
+		gbSearching = 1;
+		gbStopSent = 0;
+	}
+	else if (sLine == "stop")
+		gbStopSent = gbSearching;
+	else if (sLine == "ponderhit") {
+		size_t pos = gsGoLine.find(" ponder");
+		if (pos != string::npos)
+			gsGoLine.erase(pos, 7);
+	}
+	else if (sLine.compare(0, 15, "setoption name ") == 0) {
+		size_t nameEnd = sLine.find(" value");
+		string sName = sLine.substr(0, nameEnd);
+		for (size_t i=0; i<gSetOptions.size(); i++) {
+			if (gSetOptions[i].substr(0, gSetOptions[i].find(" value")) == sName) {
+				gSetOptions[i] = sLine;
+				return;
+			}
+		}
+		gSetOptions.push_back(sLine);
+	}
+}
+
+//agent output at the start of a session is looked at line by line: the token
+//and position delta lines are kept from the GUI, anything but an info string
+//before them means no resume or delta; after a failover the answer to the
+//replayed uci is kept back as well
+static int ClientFilterAgentLines(string &sPending)
+{
+	size_t eol;
+	while ((gbTokenPending || gbDeltaPending || gbSwallowUci) && (eol = sPending.find('\n')) != string::npos) {
+		string sLine = sPending.substr(0, eol + 1);
+		sPending.erase(0, eol + 1);
+		if (gnResumeToken != 0)
+			gnAgentBytesSeen += sLine.length();
+
+		if (gbTokenPending && sLine.compare(0, strlen(RESUME_TOKEN_LINE), RESUME_TOKEN_LINE) == 0) {
+			if (sscanf(sLine.c_str() + strlen(RESUME_TOKEN_LINE), "%llx %d %15s",
+					&gnResumeToken, &gnResumeSec, gsResumeMgmtPort) != 3)
+				gnResumeToken = 0;
+			JetsonWriteLogs("session token received, resume within %d s on port %s\n", gnResumeSec, gsResumeMgmtPort);
+			gbTokenPending = 0;
+			gnAgentBytesSeen = 0;
+			continue;
+		}
+		if (gbDeltaPending && sLine == POSITION_DELTA_OK) {
+			gbDeltaPending = 0;
+			gbDeltaOn = 1;
+			continue;
+		}
+		if (sLine.compare(0, 11, "info string") != 0)
+			gbTokenPending = gbDeltaPending = 0;
+
+		if (gbSwallowUci)
+			gbSwallowUci = (sLine.compare(0, 5, "uciok") != 0);
+		else {
+			if (gBackends.size() > 1)
+				ClientTrackAgentOutput(sLine.c_str(), sLine.length());
+			ClientWriteAll(1, sLine.c_str(), sLine.length());
+		}
+	}
+	return !(gbTokenPending || gbDeltaPending || gbSwallowUci);
+}
+
+//a position command that only adds moves to the last one sent becomes
+//POSITION_DELTA_CMD "<moves of the last one> <added moves>"
+static string ClientPositionLine(const string &sLine)
+{
+	if (sLine.compare(0, 9, "position ") != 0)
+		return sLine;
+
+	//moves are counted only past the part the agent has already
+	string sOut = sLine;
+	string sNorm = sLine;
+	size_t end = sNorm.find_last_not_of(" \t\r\n");
+	if (gbDeltaOn && !gsDeltaBase.empty() && end != string::npos && end + 1 >= gsDeltaBase.length() &&
+		sNorm.compare(0, gsDeltaBase.length(), gsDeltaBase) == 0) {
+		string sRest = sNorm.substr(gsDeltaBase.length());
+		const char *sSep = (gnDeltaBaseMoves > 0 ? " " : " moves ");
+		size_t restEnd = sRest.find_last_not_of(" \t\r\n");
+		if (restEnd == string::npos || (sRest.compare(0, strlen(sSep), sSep) == 0 && sRest != " moves")) {
+			string sAdded = (restEnd == string::npos ? "" : sRest.substr(strlen(sSep), restEnd + 1 - strlen(sSep)));
+			sOut = POSITION_DELTA_CMD + to_string(gnDeltaBaseMoves) + (sAdded.empty() ? "" : " " + sAdded);
+			gsDeltaBase += (sAdded.empty() ? "" : (gnDeltaBaseMoves > 0 ? " " : " moves ") + sAdded);
+			gnDeltaBaseMoves += JetsonCountMoves(sAdded.c_str());
+			return sOut;
+		}
+	}
+	gnDeltaBaseMoves = JetsonPositionNormalize(sNorm);
+	gsDeltaBase = sNorm;
+	return sOut;
+}
+
+static void ClientSendCommands(const char *data, int len)
+{
+	if (gnResumeToken != 0 || gbTokenPending) {
+		gnBytesToAgent += len;
+		gsSentTail.append(data, len);
+		if (gsSentTail.length() > 2 * CLIENT_RESEND_BYTES)
+			gsSentTail.erase(0, gsSentTail.length() - CLIENT_RESEND_BYTES);
+	}
+	//a failed send shows up as a disconnect on the next recv, the resume resends it
+	JetsonSendAll(gServSock, data, len);
+}
+
+//connection to the agent lost: reattach to the same engine through the
+//management port, retried for as long as the agent keeps the session
+static int ClientResume()
+{
+	const char *sServIp = gBackends[gnBackend].sIp.c_str();
+	CloseSocket(gServSock);
+	gServSock = (SOCKET)-1;
+	JetsonWriteLogs("connection lost, resuming session (%lld bytes received, %lld sent)\n",
+		gnAgentBytesSeen, gnBytesToAgent);
+
+	long long nDeadline = GetMonotonicUsec() + gnResumeSec * 1000000LL;
+	while (GetMonotonicUsec() < nDeadline) {
+		SOCKET sock = JetsonTcpConnect(sServIp, gsResumeMgmtPort);
+		if (!IsSockValid(sock)) {
+			if (gBackends.size() > 1)
+				break;		//node down, another backend takes the session
+			SleepMsec(CLIENT_RESUME_RETRY_MSEC);
+			continue;
+		}
+
+		char sCmd[128];
+		snprintf(sCmd, sizeof(sCmd), RESUME_CMD "%016llx %lld\n", gnResumeToken, gnAgentBytesSeen);
+		string sReply;
+		long long nAgentOut, nAgentIn;
+		if (JetsonSendAll(sock, sCmd, strlen(sCmd)) &&
+			JetsonRecvLine(sock, sReply, 128, CLIENT_RESUME_REPLY_MSEC) &&
+			sReply.compare(0, strlen(RESUME_OK), RESUME_OK) == 0 &&
+			sscanf(sReply.c_str() + strlen(RESUME_OK), "%lld %lld", &nAgentOut, &nAgentIn) == 2) {
+			gServSock = sock;
+			gnAgentBytesSeen = nAgentOut;
+
+			//commands the agent never got, as far as they are still kept
+			long long nResend = gnBytesToAgent - nAgentIn;
+			if (nResend > (long long)gsSentTail.length()) {
+				JetsonErrorLogs("%lld command bytes lost in the drop\n", nResend - (long long)gsSentTail.length());
+				nResend = gsSentTail.length();
+			}
+			if (nResend > 0)
+				JetsonSendAll(gServSock, gsSentTail.c_str() + gsSentTail.length() - nResend, (int)nResend);
+			JetsonWriteLogs("session resumed, %lld command bytes sent again\n", (nResend > 0 ? nResend : 0));
+			return 1;
+		}
+
+		CloseSocket(sock);
+		if (sReply == RESUME_FAILED)
+			break;
+		SleepMsec(CLIENT_RESUME_RETRY_MSEC);
+	}
+	JetsonErrorLogs("session could not be resumed\n");
+	return 0;
+}
+
+//the agent is gone for good: another backend gets a new session, brought to the
+//same options, position and search; uci is answered again but not passed on
+static int ClientFailover()
+{
+	if (IsSockValid(gServSock))
+		CloseSocket(gServSock);
+	gServSock = (SOCKET)-1;
+	if (gBackends.size() < 2)
+		return 0;
+
+	string sFailedIp = gBackends[gnBackend].sIp;
+	string sFailedPort = gBackends[gnBackend].sPort;
+	ClientRankBackends();
+	gServSock = ClientConnectBackend(sFailedIp, sFailedPort);
+	if (!IsSockValid(gServSock)) {
+		JetsonErrorLogs("no backend left to fail over to\n");
+		return 0;
+	}
+	JetsonWriteLogs("failed over from %s:%s, replaying %d options%s%s\n", sFailedIp.c_str(), sFailedPort.c_str(),
+		(int)gSetOptions.size(), (gsPositionLine.empty() ? "" : ", position"), (gbSearching ? ", go" : ""));
+
+	gnResumeToken = 0;
+	gnAgentBytesSeen = 0;
+	gnBytesToAgent = 0;
+	gsSentTail.clear();
+	gnAgentHeadLen = 0;
+	gbTokenPending = JetsonSendAll(gServSock, RESUME_REQUEST, strlen(RESUME_REQUEST));
+	gbSwallowUci = !gbUciPending;
+
+	//the new agent is asked again; until it agrees positions go out in full
+	gbDeltaOn = 0;
+	gsDeltaBase.clear();
+	gbDeltaPending = 1;
+
+	string sReplay = string(POSITION_DELTA_REQUEST) + "uci\n";
+	for (size_t i=0; i<gSetOptions.size(); i++)
+		sReplay += gSetOptions[i] + "\n";
+	if (!gsPositionLine.empty())
+		sReplay += gsPositionLine + "\n";
+	for (int i=0; i<gnReadyPending; i++)
+		sReplay += "isready\n";
+	if (gbSearching)
+		sReplay += gsGoLine + "\n" + (gbStopSent ? "stop\n" : "");
+	ClientSendCommands(sReplay.c_str(), sReplay.length());
+	return 1;
+}
+
+//----- engine session relay: GUI stdin and the agent connection on one poll loop,
+//both directions forwarded the moment they are readable, in the chunks read()
+//returned; the agent frames commands by '\n' itself, lines are only looked at
+//to stop after "quit" and, with other backends to fail over to, to know the
+//session's state
+static void ClientRelayLoop()
+{
+	char buf[RSP_BUFSIZE];
+	string sCmdLine;
+	int bQuit = 0;
+	int bTrack = (gBackends.size() > 1);
+
+	//an agent without resume support passes the request on to the engine, which ignores it
+	string sPending;
+	gbTokenPending = JetsonSendAll(gServSock, RESUME_REQUEST, strlen(RESUME_REQUEST));
+	ClientSendCommands(POSITION_DELTA_REQUEST, strlen(POSITION_DELTA_REQUEST));
+	gbDeltaPending = 1;
+
+	while (!bQuit) {
+		struct pollfd fds[2];
+		fds[0].fd = 0;
+		fds[0].events = POLLIN;
+		fds[1].fd = gServSock;
+		fds[1].events = POLLIN;
+		if (poll(fds, 2, -1) < 0) {
+			if (errno == EINTR)
+				continue;
+			JetsonErrorLogs("poll() failed. (%d)\n", GetSockErrno());
+			throw runtime_error("poll() failed\n");
+		}
+
+		if (fds[1].revents & (POLLIN | POLLHUP | POLLERR)) {
+			int bytes = recv(gServSock, buf, sizeof(buf), 0);
+			if (bytes < 1) {
+				if (gnResumeToken != 0 && ClientResume())
+					continue;
+				if (ClientFailover()) {
+					sPending.clear();
+					continue;
+				}
+				throw runtime_error("Connection closed by Jetson device\n");
+			}
+
+			if (gbTokenPending || gbDeltaPending || gbSwallowUci) {
+				sPending.append(buf, bytes);
+				if (ClientFilterAgentLines(sPending)) {
+					gnAgentBytesSeen += sPending.length();
+					if (bTrack)
+						ClientTrackAgentOutput(sPending.c_str(), sPending.length());
+					ClientWriteAll(1, sPending.c_str(), sPending.length());
+					sPending.clear();
+				}
+			}
+			else {
+				gnAgentBytesSeen += bytes;
+				if (bTrack)
+					ClientTrackAgentOutput(buf, bytes);
+				ClientWriteAll(1, buf, bytes);//uci response data to ChessBase
+			}
+		}
+
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			int bytes = read(0, buf, sizeof(buf));
+			if (bytes < 0 && errno == EINTR)
+				continue;
+			if (bytes < 1)
+				break;
+
+			//bytes before the first whole line once the agent took deltas go as read
+			int len = 0;
+			int nRaw = 0;
+			string sLines;
+			while (len < bytes && !bQuit) {
+				if (gbDeltaOn && sCmdLine.empty())
+					gbWholeLines = 1;
+
+				//up to the end of the line in one piece
+				const char *eol = (const char *)memchr(buf + len, '\n', bytes - len);
+				int spanEnd = (eol != NULL ? (int)(eol - buf) : bytes);
+				int nKeep = spanEnd - len;
+				if (!bTrack && !gbWholeLines && nKeep > 4 - (int)sCmdLine.length())
+					nKeep = max(0, 4 - (int)sCmdLine.length());
+				sCmdLine.append(buf + len, nKeep);
+				len = (eol != NULL ? spanEnd + 1 : spanEnd);
+				if (!gbWholeLines)
+					nRaw = len;
+
+				if (eol != NULL) {
+					if (!sCmdLine.empty() && sCmdLine[sCmdLine.length()-1] == '\r')
+						sCmdLine.erase(sCmdLine.length()-1);
+					bQuit = (sCmdLine.compare(0, 4, "quit") == 0);
+					if (bTrack)
+						ClientTrackCommand(sCmdLine);
+					if (gbWholeLines)
+						sLines += ClientPositionLine(sCmdLine) + "\n";
+					sCmdLine.clear();
+				}
+			}
+			if (nRaw > 0)
+				ClientSendCommands(buf, nRaw);
+			if (!sLines.empty())
+				ClientSendCommands(sLines.c_str(), sLines.length());
+		}
+	}
+
+	//replies already on their way still reach the GUI, the agent closes the
+	//session once the engine is gone
+	long long nDeadline = GetMonotonicUsec() + CLIENT_QUIT_DRAIN_MSEC * 1000LL;
+	long long nLeft;
+	while ((nLeft = nDeadline - GetMonotonicUsec()) > 0) {
+		struct pollfd pfd;
+		pfd.fd = gServSock;
+		pfd.events = POLLIN;
+		if (poll(&pfd, 1, (int)(nLeft / 1000) + 1) <= 0)
+			break;
+		int bytes = recv(gServSock, buf, sizeof(buf), 0);
+		if (bytes < 1)
+			break;
+		ClientWriteAll(1, buf, bytes);
+	}
+}
+#endif
+
+//DATA on channel 1 once the agent granted room for it, 0 if the session is over
+static int ClientMuxSend(int type, const char *data, unsigned int len)
+{
+	pthread_mutex_lock(&gMuxLock);
+	if (type == MUX_FRAME_DATA) {
+		while (gnMuxSendCredit < (long)len && !gbClientExiting)
+			pthread_cond_wait(&gMuxCreditCond, &gMuxLock);
+		gnMuxSendCredit -= len;
+	}
+
+	int rc = 0;
+	if (!gbClientExiting || type == MUX_FRAME_CLOSE)
+		rc = JetsonSendFrame(gServSock, MUX_CLIENT_CHANNEL, type, data, len);
+	pthread_mutex_unlock(&gMuxLock);
+	return rc;
+}
 
 int main(int argc, char *argv[])
 {
@@ -196,10 +1191,14 @@ int main(int argc, char *argv[])
 	char sServIp[STR_IPADDR_SIZE];
 	char sServPort[STR_TCPPORT_SIZE];
 	char sEngName[MAX_NAME_LEN];
+	char sMuxToken[MAX_NAME_LEN];
+	char sMuxPort[STR_TCPPORT_SIZE];
 	char sThisExeFileName[MAX_NAME_LEN];
 	
 	memset(sServIp, 0, STR_IPADDR_SIZE);
 	memset(sServPort, 0, STR_TCPPORT_SIZE);
+	memset(sMuxToken, 0, MAX_NAME_LEN);
+	memset(sMuxPort, 0, STR_TCPPORT_SIZE);
 
 #if defined(_WIN32)
 	WSADATA d;
@@ -237,6 +1236,7 @@ int main(int argc, char *argv[])
 	ostringstream ossLogFile;
 	ossLogFile << sThisExeFileName << ".log";
 	strncat(gsLogFile, ossLogFile.str().c_str(), MAX_NAME_LEN);
+	JetsonLogStart();
 	
 	ostringstream oss;
 	oss << "Received incoming command line=";
@@ -248,12 +1248,39 @@ int main(int argc, char *argv[])
 	
 	JetsonWriteLogs("Filename = %s\n", sThisExeFileName);
 
+#if !defined(_WIN32)
+	/* shared mux connection for this host, started by the first mux client */
+	if (argc >= 4 && strcmp(argv[1], "--mux-hub") == 0) {
+		signal(SIGPIPE, SIG_IGN);
+		rc = JetsonMuxHubMain(argv[2], argv[3]);
+		JetsonLogStop();
+		return rc;
+	}
+#endif
+
 	/* engine server scan or query */
 	if (argc >= 3 &&
 		strcmp(sThisExeFileName, gsJetsonScanFile) == 0) {
 		string mgmtPortStr = STR_MGMT_PORT;
-		if (argc >= 4)
+		int nMuxArg = 0;
+		if (argc >= 4 && strcmp(argv[3], "mux") == 0)
+			nMuxArg = 3;
+		else if (argc >= 4) {
 			mgmtPortStr = argv[3];
+			if (argc >= 5 && strcmp(argv[4], "mux") == 0)
+				nMuxArg = 4;
+		}
+		if (nMuxArg > 0) {
+			gbMux = 1;
+			strncpy(sMuxPort, mgmtPortStr.c_str(), STR_TCPPORT_SIZE - 1);
+			gsMuxSuffix = string("_MUX") + mgmtPortStr;
+		}
+		if (strcmp(argv[1], "discover") == 0) {
+			rc = ClientDiscover(argv[2], mgmtPortStr.c_str(), sThisExeFileName);
+			JetsonLogStop();
+			return rc;
+		}
+
 		if (strcmp(argv[1], "scan") == 0) {
 			gbScanNeeded = 1;
 			strncpy(sServIp, argv[2], STR_IPADDR_SIZE);
@@ -262,24 +1289,33 @@ int main(int argc, char *argv[])
 			printf("scanning server %s on port %s\n", sServIp, sServPort);
 		}
 		
-		if (strcmp(argv[1], "query") == 0) {
+		//stats is printed the same way as query, it only ends with "statsdone"
+		if (strcmp(argv[1], "query") == 0 || strcmp(argv[1], "stats") == 0) {
 			gbQueryNeeded = 1;
 			strncpy(sServIp, argv[2], STR_IPADDR_SIZE);
 			strncpy(sServPort, mgmtPortStr.c_str(), STR_TCPPORT_SIZE);
 			
-			printf("query server %s on port %s\n", sServIp, sServPort);
+			printf("%s server %s on port %s\n", argv[1], sServIp, sServPort);
 		}
 	}
 	else if (strcmp(sThisExeFileName, gsJetsonScanFile) == 0) {
 		printf("Incorrect syntax\n");
-		printf("To scan agent run: jetson_scan scan <agent ip address> [mgmt_port]\n");
-		printf("To query agent run: jetson_scan query <agent ip address> [mgmt_port]\n");
+		printf("To scan agent run: jetson_scan scan <agent ip address> [mgmt_port] [mux]\n");
+		printf("To query agent run: jetson_scan query <agent ip address> [mgmt_port] [mux]\n");
+		printf("To get agent metrics run: jetson_scan stats <agent ip address> [mgmt_port] [mux]\n");
+		printf("To scan all agents of a subnet run: jetson_scan discover <a.b.c.d/nn | broadcast> [mgmt_port] [mux]\n");
 		printf("Note: mgmt_port is optional. Default port = 53350.\n");
+		printf("Note: with mux, all engines created by scan share one connection to the agent.\n");
 		printf("Example:\n");
 		printf("jetson_scan scan 192.168.55.1\n");
 		printf("jetson_scan scan 192.168.55.1 61234\n");
 		printf("jetson_scan query 192.168.55.1\n");
 		printf("jetson_scan query 192.168.55.1 61234\n");
+		printf("jetson_scan stats 192.168.55.1\n");
+		printf("jetson_scan scan 192.168.55.1 mux\n");
+		printf("jetson_scan discover 192.168.55.0/24\n");
+		printf("jetson_scan discover broadcast\n");
+		JetsonLogStop();
 		return 0;
 	}
 	else {	//JRE engine
@@ -288,51 +1324,102 @@ int main(int argc, char *argv[])
 				sThisExeFileName[i] = ' ';
 		}
 
-		sscanf(sThisExeFileName, "%s %s %s %s %s", sJreHeader, sOsArch, sServIp, sServPort, sEngName);
+		sscanf(sThisExeFileName, "%s %s %s %s %s %s", sJreHeader, sOsArch, sServIp, sServPort, sEngName, sMuxToken);
+
+		//optional MUX<mgmt port> token, e.g. JRE_X64LNX_192.168.55.1_61234_sf_MUX53350
+		if (strncmp(sMuxToken, "MUX", 3) == 0 && sMuxToken[3] != '\0') {
+			gbMux = 1;
+			strncpy(sMuxPort, sMuxToken + 3, STR_TCPPORT_SIZE - 1);
+		}
+		else {
+			gsEngName = sEngName;
+			ClientLoadBackends(argv[0], sServIp, sServPort);
+			if (gBackends.size() > 1)
+				ClientRankBackends();
+		}
 	}
 	
 	try {	
-		struct addrinfo localAddr;
-		memset(&localAddr, 0, sizeof(localAddr));
-		localAddr.ai_socktype = SOCK_STREAM;
-	
-		struct addrinfo *pPeerAddr;
-		if (getaddrinfo(sServIp, sServPort, &localAddr, &pPeerAddr)) {
-			JetsonWriteLogs("getaddrinfo() failed. (%d)\n", GetSockErrno());
-			throw runtime_error("getaddrinfo() failed\n");
+		if (gbMux) {
+			gServSock = JetsonMuxConnect(sServIp, sMuxPort);
+			if (IsSockValid(gServSock)) {
+				string sOpen = (gbScanNeeded || gbQueryNeeded ? string("mgmt") : string("engine ") + sEngName);
+				if (!JetsonSendFrame(gServSock, MUX_CLIENT_CHANNEL, MUX_FRAME_OPEN, sOpen.c_str(), sOpen.length()))
+					throw runtime_error("mux open failed\n");
+				JetsonWriteLogs("mux channel requested: %s\n", sOpen.c_str());
+			}
+			else {
+				JetsonWriteLogs("agent %s:%s has no mux support, using port %s\n", sServIp, sMuxPort, sServPort);
+				gbMux = 0;
+				gsMuxSuffix.clear();
+			}
 		}
 
-		char sAddrBuf[100];
-		char sServBuf[100];
-		getnameinfo(pPeerAddr->ai_addr, pPeerAddr->ai_addrlen,
-			sAddrBuf, sizeof(sAddrBuf),
-			sServBuf, sizeof(sServBuf),
-			NI_NUMERICHOST);
+		if (!gbMux && gBackends.size() > 1) {
+			gServSock = ClientConnectBackend("", "");
+			if (!IsSockValid(gServSock))
+				throw runtime_error("connect() failed\n");
+			strncpy(sServIp, gBackends[gnBackend].sIp.c_str(), STR_IPADDR_SIZE - 1);
+		}
+		else if (!gbMux) {
+			struct addrinfo localAddr;
+			memset(&localAddr, 0, sizeof(localAddr));
+			localAddr.ai_socktype = SOCK_STREAM;
+		
+			struct addrinfo *pPeerAddr;
+			if (getaddrinfo(sServIp, sServPort, &localAddr, &pPeerAddr)) {
+				JetsonErrorLogs("getaddrinfo() failed. (%d)\n", GetSockErrno());
+				throw runtime_error("getaddrinfo() failed\n");
+			}
 
-		gServSock = socket(pPeerAddr->ai_family,
-			pPeerAddr->ai_socktype, pPeerAddr->ai_protocol);
-		if (!IsSockValid(gServSock)) {
-			JetsonWriteLogs("socket() failed. (%d)\n", GetSockErrno());
-			throw runtime_error("socket() failed\n");
+			char sAddrBuf[100];
+			char sServBuf[100];
+			getnameinfo(pPeerAddr->ai_addr, pPeerAddr->ai_addrlen,
+				sAddrBuf, sizeof(sAddrBuf),
+				sServBuf, sizeof(sServBuf),
+				NI_NUMERICHOST);
+
+			gServSock = socket(pPeerAddr->ai_family,
+				pPeerAddr->ai_socktype, pPeerAddr->ai_protocol);
+			if (!IsSockValid(gServSock)) {
+				JetsonErrorLogs("socket() failed. (%d)\n", GetSockErrno());
+				throw runtime_error("socket() failed\n");
+			}
+
+			if (connect(gServSock,
+					pPeerAddr->ai_addr, pPeerAddr->ai_addrlen)) {
+				JetsonErrorLogs("connect() failed. (%d)\n", GetSockErrno());
+				throw runtime_error("connect() failed\n");
+			}
+			freeaddrinfo(pPeerAddr);
+
+			int flag = 1;
+			setsockopt(gServSock, IPPROTO_TCP, TCP_NODELAY, (const char *)&flag, sizeof(flag));
 		}
 
-		if (connect(gServSock,
-				pPeerAddr->ai_addr, pPeerAddr->ai_addrlen)) {
-			JetsonWriteLogs("connect() failed. (%d)\n", GetSockErrno());
-			throw runtime_error("connect() failed\n");
+#if !defined(_WIN32)
+		//stdin can be polled here, an engine session needs no receiver thread
+		if (!gbMux && !gbScanNeeded && !gbQueryNeeded) {
+			ClientRelayLoop();
+			CloseSocket(gServSock);
+			JetsonLogStop();
+			return 0;
 		}
-		freeaddrinfo(pPeerAddr);
+#endif
 	
 		void *pThreadData = (gbScanNeeded ? (void *)sThisExeFileName : NULL);
 
 		pthread_t clientReceiverThreadId = 0;
-		rc = pthread_create(&clientReceiverThreadId, NULL,  ClientReciverThread, pThreadData);
+		rc = pthread_create(&clientReceiverThreadId, NULL,  (gbMux ? ClientMuxReceiverThread : ClientReciverThread), pThreadData);
 		if (rc != 0) {
 			throw std::runtime_error("Unable to create recv_thread\n");
 		}
 	
 		if (gbScanNeeded || gbQueryNeeded) {
-			send(gServSock, argv[1], strlen(argv[1]), 0);
+			if (gbMux)
+				ClientMuxSend(MUX_FRAME_DATA, argv[1], strlen(argv[1]));
+			else
+				send(gServSock, argv[1], strlen(argv[1]), 0);
 		
 			while(1) {
 				SleepMsec(1000);
@@ -347,28 +1434,37 @@ int main(int argc, char *argv[])
 				if (gbClientExiting)
 					throw std::runtime_error("Connection closed by Jetson device\n");			
 		
-				int bytesSent = send(gServSock, line.c_str(), line.length(), 0);
-			
-				SleepMsec(300);
+				//agent frames commands by '\n', getline() strips it
+				line += '\n';
+				if (gbMux) {
+					if (!ClientMuxSend(MUX_FRAME_DATA, line.c_str(), line.length()))
+						throw std::runtime_error("Connection closed by Jetson device\n");
+				}
+				else if (!JetsonSendAll(gServSock, line.c_str(), line.length()))
+					throw std::runtime_error("Connection closed by Jetson device\n");
 
 				if(!strncmp(line.c_str(), "quit", 4)) {
 					gbClientExiting = 1;
-					SleepMsec(500);
+					if (!gbMux)
+						SleepMsec(500);
 					break;
 				}
 			}
 		}
 
+		if (gbMux)
+			ClientMuxSend(MUX_FRAME_CLOSE, "client exit", 11);
 		CloseSocket(gServSock);
 
 #if defined(_WIN32)
 		WSACleanup();
 #endif
 
+		JetsonLogStop();
 		return 0;
 	
 	} catch (std::exception& e) {
-		JetsonWriteLogs("Unhandled exception: %s", e.what());
+		JetsonErrorLogs("Unhandled exception: %s", e.what());
 		
 		CloseSocket(gServSock);
 #if defined(_WIN32)
@@ -376,4 +1472,5 @@ int main(int argc, char *argv[])
 #endif
 		std::cerr << "Unhandled exception: " << e.what() << endl;
 	}
+	JetsonLogStop();
 }
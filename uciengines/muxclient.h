@@ -0,0 +1,558 @@
+/*****************************************************************************
+ * This file is part of Jetson Engine.
+ *
+ * Copyright (C) 2020 Evelyn Zhu
+ *
+ * Jetson Engine is a client-server based chess engine framework designed for
+ * chess software like ChessBase or Fritz to remotely access UCI-compliant
+ * chess engines that run on external devices or computer nodes.
+ *
+ * More information about Jetson Engine can be found at http://ezchess.org/
+ *
+ * Jetson Engine is a free software. You can redistribute it and/or modify
+ * it under the terms of the GNU General Public License as published by
+ * the Free Software Foundation, either version 3 of the License, or
+ * (at your option) any later version.
+ *
+ * Jetson Engine is distributed in the hope that it will be useful,
+ * but WITHOUT ANY WARRANTY; without even the implied warranty of
+ * MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE. See the
+ * GNU General Public License for more details.
+ *
+ * You should have received a copy of the GNU General Public License
+ * along with Jetson Engine. If not, see <http://www.gnu.org/licenses/>.
+ *
+ * If you modify this Program, or any covered work, by linking or
+ * combining it with third-party libraries, proprietary libraries, or
+ * non-GPL compatible libraries, you must obtain licenses from the
+ * authors of the libraries before conveying the result work. You are
+ * not authorized to redistribute these libraries, whether in binary
+ * forms or source codes, individually or together with this Program
+ * as a whole unless the terms of the respective license agreements
+ * grant you additional permissions.
+ *
+ * The above copyright notice, permission notice, and license agreement
+ * information shall be included in all copies or substantial portions
+ * of this Program.
+ *
+ * Author: Evelyn J. Zhu <info@ezchess.org>
+ *
+ ****************************************************************************/
+
+#ifndef _JET_MUXCLIENT_H
+#define _JET_MUXCLIENT_H
+
+#include <map>
+#include <string>
+#include <vector>
+#if !defined(_WIN32)
+	#include <poll.h>
+	#include <sys/un.h>
+	#include <sys/wait.h>
+	#include <netinet/tcp.h>
+#endif
+
+#define MUX_HELLO_TIMEOUT_MSEC	1000	//an agent without mux support never answers the hello
+#define MUX_HUB_START_MSEC		1500	//how long a client waits for the hub it started
+#define MUX_HUB_IDLE_SEC		10		//hub exits once it had no local client for this long
+
+//----- blocking socket helpers
+static inline int JetsonSendAll(SOCKET sock, const char *data, int len)
+{
+	while (len > 0) {
+		int bytes = send(sock, data, len, 0);
+		if (bytes <= 0)
+			return 0;
+		data += bytes;
+		len -= bytes;
+	}
+	return 1;
+}
+
+static inline int JetsonRecvAll(SOCKET sock, char *data, int len)
+{
+	while (len > 0) {
+		int bytes = recv(sock, data, len, 0);
+		if (bytes <= 0)
+			return 0;
+		data += bytes;
+		len -= bytes;
+	}
+	return 1;
+}
+
+static inline int JetsonSendFrame(SOCKET sock, unsigned int nChannel, int type, const char *data, unsigned int len)
+{
+	std::string sFrame = JetsonMuxFrame(nChannel, type, data, len);
+	return JetsonSendAll(sock, sFrame.data(), (int)sFrame.length());
+}
+
+//next frame off a blocking socket, 0 on disconnect or a bad header
+static inline int JetsonMuxReadFrame(SOCKET sock, unsigned int *pChannel, int *pType, std::string &payload)
+{
+	char hdr[MUX_HDR_LEN];
+	if (!JetsonRecvAll(sock, hdr, MUX_HDR_LEN))
+		return 0;
+
+	unsigned int len;
+	JetsonMuxGetHeader((const unsigned char *)hdr, &len, pChannel, pType);
+	if (JetsonMuxFrameLen(hdr, MUX_HDR_LEN) < 0)
+		return 0;
+
+	payload.resize(len);
+	return (len == 0 || JetsonRecvAll(sock, &payload[0], len));
+}
+
+//one reply line, byte by byte so nothing the peer sends after it is consumed;
+//0 on timeout, disconnect, or a line longer than nMaxLen
+static inline int JetsonRecvLine(SOCKET sock, std::string &sLine, size_t nMaxLen, int nTimeoutMsec)
+{
+	sLine.clear();
+	while (sLine.length() < nMaxLen) {
+		fd_set reads;
+		FD_ZERO(&reads);
+		FD_SET(sock, &reads);
+		struct timeval timeout;
+		timeout.tv_sec = nTimeoutMsec / 1000;
+		timeout.tv_usec = (nTimeoutMsec % 1000) * 1000;
+		if (select(sock+1, &reads, 0, 0, &timeout) <= 0)
+			return 0;
+
+		char c;
+		if (recv(sock, &c, 1, 0) != 1)
+			return 0;
+		sLine += c;
+		if (c == '\n')
+			return 1;
+	}
+	return 0;
+}
+
+//sends the hello on a connected socket and waits for the answer, the socket is
+//closed and invalid is returned when the peer doesn't speak the mux protocol
+static inline SOCKET JetsonMuxHello(SOCKET sock)
+{
+	std::string sReply;
+	if (!JetsonSendAll(sock, MUX_HELLO, strlen(MUX_HELLO)) ||
+		!JetsonRecvLine(sock, sReply, strlen(MUX_HELLO_OK), MUX_HELLO_TIMEOUT_MSEC) ||
+		sReply != MUX_HELLO_OK) {
+		CloseSocket(sock);
+		return (SOCKET)-1;
+	}
+	return sock;
+}
+
+static inline SOCKET JetsonTcpConnect(const char *sIp, const char *sPort)
+{
+	struct addrinfo hints;
+	memset(&hints, 0, sizeof(hints));
+	hints.ai_socktype = SOCK_STREAM;
+
+	struct addrinfo *pPeerAddr;
+	if (getaddrinfo(sIp, sPort, &hints, &pPeerAddr)) {
+		JetsonErrorLogs("getaddrinfo(%s:%s) failed. (%d)\n", sIp, sPort, GetSockErrno());
+		return (SOCKET)-1;
+	}
+
+	SOCKET sock = socket(pPeerAddr->ai_family, pPeerAddr->ai_socktype, pPeerAddr->ai_protocol);
+	if (IsSockValid(sock) && connect(sock, pPeerAddr->ai_addr, pPeerAddr->ai_addrlen)) {
+		JetsonErrorLogs("connect(%s:%s) failed. (%d)\n", sIp, sPort, GetSockErrno());
+		CloseSocket(sock);
+		sock = (SOCKET)-1;
+	}
+	freeaddrinfo(pPeerAddr);
+
+	if (IsSockValid(sock)) {
+		int flag = 1;
+		setsockopt(sock, IPPROTO_TCP, TCP_NODELAY, (const char *)&flag, sizeof(flag));
+	}
+	return sock;
+}
+
+#if !defined(_WIN32)
+//----- mux hub: one process per user and agent holds the only connection to the
+//agent, every engine client on the host talks to it over a unix socket with the
+//same framing; the hub only renumbers channels so they don't collide
+
+//directory only this user can enter: $XDG_RUNTIME_DIR, else /tmp/jetson_mux_<uid>
+//made 0700; one that is a symlink, someone else's or open to others is not used
+static inline int JetsonMuxIsPrivateDir(const char *sDir)
+{
+	struct stat st;
+	if (lstat(sDir, &st) != 0)
+		return 0;
+	return (S_ISDIR(st.st_mode) && st.st_uid == getuid() && (st.st_mode & 077) == 0);
+}
+
+static inline std::string JetsonMuxHubDir()
+{
+	const char *sRuntimeDir = getenv("XDG_RUNTIME_DIR");
+	if (sRuntimeDir != NULL && sRuntimeDir[0] == '/' && JetsonMuxIsPrivateDir(sRuntimeDir))
+		return sRuntimeDir;
+
+	std::ostringstream oss;
+	oss << "/tmp/jetson_mux_" << getuid();
+	mkdir(oss.str().c_str(), 0700);
+	if (!JetsonMuxIsPrivateDir(oss.str().c_str())) {
+		JetsonErrorLogs("mux hub: %s is not a private directory\n", oss.str().c_str());
+		return "";
+	}
+	return oss.str();
+}
+
+//empty if there is no safe place for the socket, the client then goes direct
+static inline std::string JetsonMuxHubPath(const char *sIp, const char *sPort)
+{
+	std::string sDir = JetsonMuxHubDir();
+	if (sDir.empty())
+		return "";
+
+	std::ostringstream oss;
+	oss << sDir << "/jetson_mux_" << sIp << "_" << sPort;
+	if (oss.str().length() >= sizeof(((struct sockaddr_un *)0)->sun_path))
+		return "";
+	return oss.str();
+}
+
+//the other end of a hub socket has to run as this user
+static inline int JetsonMuxPeerIsUser(int fd)
+{
+#if defined(__APPLE__)
+	uid_t uid;
+	gid_t gid;
+	if (getpeereid(fd, &uid, &gid) != 0)
+		return 0;
+	return (uid == getuid());
+#else
+	struct ucred cred;
+	socklen_t len = sizeof(cred);
+	if (getsockopt(fd, SOL_SOCKET, SO_PEERCRED, &cred, &len) != 0)
+		return 0;
+	return (cred.uid == getuid());
+#endif
+}
+
+static inline SOCKET JetsonMuxConnectHub(const char *sIp, const char *sPort)
+{
+	std::string sPath = JetsonMuxHubPath(sIp, sPort);
+	if (sPath.empty())
+		return (SOCKET)-1;
+
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sPath.c_str(), sizeof(addr.sun_path) - 1);
+
+	SOCKET sock = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (!IsSockValid(sock))
+		return sock;
+	if (connect(sock, (struct sockaddr *)&addr, sizeof(addr))) {
+		CloseSocket(sock);
+		return (SOCKET)-1;
+	}
+	if (!JetsonMuxPeerIsUser(sock)) {
+		JetsonErrorLogs("mux hub: %s is served by another user, not used\n", sPath.c_str());
+		CloseSocket(sock);
+		return (SOCKET)-1;
+	}
+	return JetsonMuxHello(sock);
+}
+
+//detached, so the hub outlives the GUI's engine process that started it; only
+//async-signal-safe calls between fork() and exec as the caller has threads
+static inline void JetsonMuxStartHub(const char *sIp, const char *sPort)
+{
+	pid_t pid = fork();
+	if (pid == 0) {
+		if (fork() != 0)
+			_exit(0);
+		setsid();
+		int fdNull = open("/dev/null", O_RDWR);
+		if (fdNull >= 0) {
+			dup2(fdNull, 0);
+			dup2(fdNull, 1);
+			dup2(fdNull, 2);
+		}
+		execl("/proc/self/exe", "jetson_mux_hub", "--mux-hub", sIp, sPort, (char *)NULL);
+		_exit(1);
+	}
+	if (pid > 0)
+		waitpid(pid, NULL, 0);
+}
+
+struct MuxHubLocal {
+	int fd;
+	int bHello;				//hello answered, frames from now on
+	std::string in;
+	std::string out;
+	std::map<unsigned int, unsigned int> channels;	//local id -> agent id
+};
+
+struct MuxHubRoute {
+	struct MuxHubLocal *local;
+	unsigned int nLocalId;
+};
+
+static inline void JetsonMuxSetChannel(std::string &sFrame, unsigned int nChannel)
+{
+	sFrame[4] = (char)(nChannel >> 8);
+	sFrame[5] = (char)nChannel;
+}
+
+//append and try to write at once, whatever is left waits for POLLOUT
+static inline void JetsonMuxHubQueue(int fd, std::string &out, const std::string &sFrame)
+{
+	out += sFrame;
+	ssize_t bytes = send(fd, out.data(), out.length(), MSG_NOSIGNAL);
+	if (bytes > 0)
+		out.erase(0, bytes);
+}
+
+static inline int JetsonMuxHubMain(const char *sIp, const char *sPort)
+{
+	SOCKET agentSock = JetsonTcpConnect(sIp, sPort);
+	if (IsSockValid(agentSock))
+		agentSock = JetsonMuxHello(agentSock);
+	if (!IsSockValid(agentSock)) {
+		JetsonErrorLogs("mux hub: agent %s:%s doesn't accept mux connections\n", sIp, sPort);
+		return 1;
+	}
+	fcntl(agentSock, F_SETFL, fcntl(agentSock, F_GETFL, 0) | O_NONBLOCK);
+
+	std::string sPath = JetsonMuxHubPath(sIp, sPort);
+	if (sPath.empty()) {
+		CloseSocket(agentSock);
+		return 1;
+	}
+	struct sockaddr_un addr;
+	memset(&addr, 0, sizeof(addr));
+	addr.sun_family = AF_UNIX;
+	strncpy(addr.sun_path, sPath.c_str(), sizeof(addr.sun_path) - 1);
+
+	//created 0600 right away, not opened up until a chmod afterwards
+	umask(077);
+	int listenFd = socket(AF_UNIX, SOCK_STREAM, 0);
+	if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+		//left behind by a hub that died, or another hub that won the race
+		SOCKET other = JetsonMuxConnectHub(sIp, sPort);
+		if (IsSockValid(other)) {
+			CloseSocket(other);
+			CloseSocket(agentSock);
+			CloseSocket(listenFd);
+			return 0;
+		}
+		unlink(sPath.c_str());
+		if (bind(listenFd, (struct sockaddr *)&addr, sizeof(addr)) != 0) {
+			JetsonErrorLogs("mux hub: bind(%s) failed. (%d)\n", sPath.c_str(), GetSockErrno());
+			return 1;
+		}
+	}
+	listen(listenFd, 64);
+	fcntl(listenFd, F_SETFL, fcntl(listenFd, F_GETFL, 0) | O_NONBLOCK);
+	JetsonWriteLogs("mux hub: %s serving agent %s:%s\n", sPath.c_str(), sIp, sPort);
+
+	std::vector<struct MuxHubLocal *> locals;
+	std::map<unsigned int, struct MuxHubRoute> routes;	//agent id -> local
+	std::string agentIn, agentOut;
+	unsigned int nNextId = 0;
+	time_t idleSince = time(NULL);
+	int bAgentGone = 0;
+
+	while (!bAgentGone) {
+		if (locals.empty() && time(NULL) - idleSince >= MUX_HUB_IDLE_SEC)
+			break;
+
+		std::vector<struct pollfd> fds(2 + locals.size());
+		fds[0].fd = agentSock;
+		fds[0].events = POLLIN | (agentOut.empty() ? 0 : POLLOUT);
+		fds[1].fd = listenFd;
+		fds[1].events = POLLIN;
+		for (size_t i=0; i<locals.size(); i++) {
+			fds[2+i].fd = locals[i]->fd;
+			fds[2+i].events = POLLIN | (locals[i]->out.empty() ? 0 : POLLOUT);
+		}
+		if (poll(&fds[0], fds.size(), 1000) < 0 && errno != EINTR)
+			break;
+
+		//agent side: renumber back and hand over to the owner
+		if (fds[0].revents & POLLOUT) {
+			ssize_t bytes = send(agentSock, agentOut.data(), agentOut.length(), MSG_NOSIGNAL);
+			if (bytes > 0)
+				agentOut.erase(0, bytes);
+		}
+		if (fds[0].revents & (POLLIN | POLLHUP | POLLERR)) {
+			char buf[RSP_BUFSIZE];
+			ssize_t bytes = recv(agentSock, buf, sizeof(buf), 0);
+			if (bytes > 0)
+				agentIn.append(buf, bytes);
+			else if (bytes == 0 || (errno != EAGAIN && errno != EINTR))
+				bAgentGone = 1;
+
+			int frameLen;
+			while ((frameLen = JetsonMuxFrameLen(agentIn.data(), agentIn.length())) > 0) {
+				std::string sFrame = agentIn.substr(0, frameLen);
+				agentIn.erase(0, frameLen);
+
+				unsigned int len, nChannel;
+				int type;
+				JetsonMuxGetHeader((const unsigned char *)sFrame.data(), &len, &nChannel, &type);
+				auto it = routes.find(nChannel);
+				if (it == routes.end())
+					continue;
+
+				struct MuxHubRoute route = it->second;
+				if (type == MUX_FRAME_CLOSE) {
+					routes.erase(it);
+					route.local->channels.erase(route.nLocalId);
+				}
+				JetsonMuxSetChannel(sFrame, route.nLocalId);
+				JetsonMuxHubQueue(route.local->fd, route.local->out, sFrame);
+			}
+			if (frameLen < 0) {
+				JetsonErrorLogs("mux hub: bad frame from agent\n");
+				bAgentGone = 1;
+			}
+		}
+
+		//local side: frames keep their layout, only the channel changes
+		for (size_t i=0; i<locals.size(); i++) {
+			struct MuxHubLocal *local = locals[i];
+			int bGone = 0;
+
+			if (fds[2+i].revents & POLLOUT) {
+				ssize_t bytes = send(local->fd, local->out.data(), local->out.length(), MSG_NOSIGNAL);
+				if (bytes > 0)
+					local->out.erase(0, bytes);
+			}
+			if (fds[2+i].revents & (POLLIN | POLLHUP | POLLERR)) {
+				char buf[RSP_BUFSIZE];
+				ssize_t bytes = recv(local->fd, buf, sizeof(buf), 0);
+				if (bytes > 0)
+					local->in.append(buf, bytes);
+				else if (bytes == 0 || (errno != EAGAIN && errno != EINTR))
+					bGone = 1;
+			}
+
+			if (!local->bHello) {
+				size_t eol = local->in.find('\n');
+				if (eol != std::string::npos) {
+					if (local->in.compare(0, eol + 1, MUX_HELLO) != 0)
+						bGone = 1;
+					else {
+						local->in.erase(0, eol + 1);
+						local->bHello = 1;
+						JetsonMuxHubQueue(local->fd, local->out, MUX_HELLO_OK);
+					}
+				}
+			}
+
+			int frameLen = 0;
+			while (local->bHello && !bGone && (frameLen = JetsonMuxFrameLen(local->in.data(), local->in.length())) > 0) {
+				std::string sFrame = local->in.substr(0, frameLen);
+				local->in.erase(0, frameLen);
+
+				unsigned int len, nLocalId;
+				int type;
+				JetsonMuxGetHeader((const unsigned char *)sFrame.data(), &len, &nLocalId, &type);
+
+				unsigned int nAgentId = 0;
+				auto it = local->channels.find(nLocalId);
+				if (it != local->channels.end())
+					nAgentId = it->second;
+				else if (type == MUX_FRAME_OPEN && routes.size() < MUX_MAX_CHANNEL) {
+					do {
+						nNextId = (nNextId % MUX_MAX_CHANNEL) + 1;
+					} while (routes.count(nNextId));
+					nAgentId = nNextId;
+					local->channels[nLocalId] = nAgentId;
+					routes[nAgentId] = {local, nLocalId};
+				}
+				if (nAgentId == 0)
+					continue;
+
+				if (type == MUX_FRAME_CLOSE) {
+					local->channels.erase(nLocalId);
+					routes.erase(nAgentId);
+				}
+				JetsonMuxSetChannel(sFrame, nAgentId);
+				JetsonMuxHubQueue(agentSock, agentOut, sFrame);
+			}
+			if (frameLen < 0)
+				bGone = 1;
+
+			if (bGone) {
+				//the agent ends the sessions this client left open
+				for (auto &ch : local->channels) {
+					routes.erase(ch.second);
+					JetsonMuxHubQueue(agentSock, agentOut, JetsonMuxFrame(ch.second, MUX_FRAME_CLOSE, "client gone", 11));
+				}
+				close(local->fd);
+				delete local;
+				locals.erase(locals.begin() + i);
+				fds.erase(fds.begin() + 2 + i);
+				i--;
+				if (locals.empty())
+					idleSince = time(NULL);
+			}
+		}
+
+		if (fds[1].revents & POLLIN) {
+			int fd;
+			while ((fd = accept(listenFd, NULL, NULL)) >= 0) {
+				if (!JetsonMuxPeerIsUser(fd)) {
+					JetsonErrorLogs("mux hub: connection from another user refused\n");
+					close(fd);
+					continue;
+				}
+				fcntl(fd, F_SETFL, fcntl(fd, F_GETFL, 0) | O_NONBLOCK);
+				struct MuxHubLocal *local = new MuxHubLocal();
+				local->fd = fd;
+				local->bHello = 0;
+				locals.push_back(local);
+			}
+		}
+	}
+
+	//new clients go to the agent directly or start another hub
+	unlink(sPath.c_str());
+	close(listenFd);
+	for (auto local : locals) {
+		for (auto &ch : local->channels) {
+			std::string sFrame = JetsonMuxFrame(ch.first, MUX_FRAME_CLOSE, "agent gone", 10);
+			send(local->fd, sFrame.data(), sFrame.length(), MSG_NOSIGNAL);
+		}
+		close(local->fd);
+		delete local;
+	}
+	CloseSocket(agentSock);
+	JetsonWriteLogs("mux hub: %s exiting%s\n", sPath.c_str(), (bAgentGone ? ", agent connection lost" : ""));
+	return 0;
+}
+#endif
+
+//mux connection to the agent at sIp:sPort: through the host's hub where there is
+//one (started on first use), directly otherwise; invalid if the agent is too old
+static inline SOCKET JetsonMuxConnect(const char *sIp, const char *sPort)
+{
+	SOCKET sock;
+#if !defined(_WIN32)
+	sock = JetsonMuxConnectHub(sIp, sPort);
+	if (IsSockValid(sock))
+		return sock;
+
+	JetsonMuxStartHub(sIp, sPort);
+	for (int waited=0; waited<MUX_HUB_START_MSEC; waited+=20) {
+		std::this_thread::sleep_for(std::chrono::milliseconds(20));
+		sock = JetsonMuxConnectHub(sIp, sPort);
+		if (IsSockValid(sock))
+			return sock;
+	}
+	JetsonWriteLogs("no mux hub for %s:%s, connecting directly\n", sIp, sPort);
+#endif
+	sock = JetsonTcpConnect(sIp, sPort);
+	if (!IsSockValid(sock))
+		return sock;
+	return JetsonMuxHello(sock);
+}
+
+#endif	//_JET_MUXCLIENT_H